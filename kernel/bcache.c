@@ -0,0 +1,478 @@
+/*
+ * KikiOS Block Buffer Cache
+ *
+ * Every buffer is always on the LRU list (invalid ones too, so they are
+ * reused first once they drift to the tail) and, while valid, in one hash
+ * chain. A run of blocks is one device request, scattered over the
+ * blocks' own buffers, so nothing is copied on the way to or from the disk.
+ * A sync keeps several write-back runs in flight at once for devices that
+ * queue them. Large requests move whole blocks straight between the device
+ * and the caller's buffer.
+ */
+
+#include "bcache.h"
+#include "hal/hal.h"
+#include "ktimer.h"
+#include "memory.h"
+#include "mmu.h"
+#include "printf.h"
+#include "string.h"
+#include "smp.h"
+
+#define BLOCK_SECTORS   (BCACHE_BLOCK_SIZE / 512)
+#define NUM_BUFFERS     512                 // 2MB of cache
+#define HASH_SIZE       256
+#define MAX_RUN         16                  // Blocks per device request (64KB)
+#define DIRTY_LIMIT     (NUM_BUFFERS / 4)   // Write back early past this
+#define DIRECT_MAX      256                 // Blocks per request straight to/from the caller (1MB)
+#define DIRECT_ALIGN    64                  // Cache line: DMA straight into the caller's buffer
+#define FLUSH_DEPTH     8                   // Write-back runs in flight during a sync
+
+typedef struct buf {
+    uint32_t block;             // Absolute sector / BLOCK_SECTORS
+    int valid;
+    int dirty;
+    int writing;                // Part of a write-back run in flight
+    uint8_t *data;
+    struct buf *hash_next;
+    struct buf *lru_prev;       // Towards the most recently used
+    struct buf *lru_next;       // Towards the next to be evicted
+} buf_t;
+
+static buf_t buffers[NUM_BUFFERS];
+static buf_t *hash_table[HASH_SIZE];
+static buf_t *lru_head = NULL;
+static buf_t *lru_tail = NULL;
+static int initialized = 0;
+
+// A write-back run: the request and the blocks it covers
+typedef struct {
+    hal_blk_req_t req;
+    uint32_t first;
+    uint32_t count;
+} flush_t;
+
+static flush_t flushing[FLUSH_DEPTH];
+
+static uint32_t dirty_count = 0;
+static uint64_t dirty_since = 0;    // ktimer_now() when the oldest dirty block was dirtied
+static uint32_t next_block = 0;     // Block after the last read, for spotting sequential reads
+static ktimer_t flush_timer = { 0 };
+static bcache_stats_t stats;
+
+// The buffers are shared, so one caller at a time. Held until the requests
+// a caller made complete, since those use the buffers.
+static mutex_t bcache_lock = MUTEX_INIT;
+
+static inline uint32_t hash(uint32_t block) {
+    return (block * 2654435761u) >> 24;
+}
+
+static buf_t *lookup(uint32_t block) {
+    buf_t *b = hash_table[hash(block)];
+    while (b && b->block != block) b = b->hash_next;
+    return b;
+}
+
+static void hash_insert(buf_t *b) {
+    uint32_t h = hash(b->block);
+    b->hash_next = hash_table[h];
+    hash_table[h] = b;
+}
+
+static void hash_remove(buf_t *b) {
+    buf_t **pp = &hash_table[hash(b->block)];
+    while (*pp && *pp != b) pp = &(*pp)->hash_next;
+    if (*pp) *pp = b->hash_next;
+    b->hash_next = NULL;
+}
+
+static void lru_unlink(buf_t *b) {
+    if (b->lru_prev) b->lru_prev->lru_next = b->lru_next;
+    else lru_head = b->lru_next;
+    if (b->lru_next) b->lru_next->lru_prev = b->lru_prev;
+    else lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = NULL;
+}
+
+// Move to the most recently used end
+static void touch(buf_t *b) {
+    if (b == lru_head) return;
+    lru_unlink(b);
+    b->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = b;
+    lru_head = b;
+    if (!lru_tail) lru_tail = b;
+}
+
+static void mark_clean(buf_t *b) {
+    b->dirty = 0;
+    if (--dirty_count == 0) dirty_since = 0;
+}
+
+static void mark_dirty(buf_t *b) {
+    if (b->dirty) return;
+    b->dirty = 1;
+    dirty_count++;
+    if (!dirty_since) {
+        // Wake an idle core (bcache_idle) when this is due
+        dirty_since = ktimer_now();
+        ktimer_add(&flush_timer, dirty_since + ktimer_us_to_count(BCACHE_FLUSH_MS * 1000ULL));
+    }
+}
+
+// Dirty and not already being written back
+static int is_dirty(uint32_t block) {
+    buf_t *b = lookup(block);
+    return b && b->dirty && !b->writing;
+}
+
+// Start writing back b together with the dirty blocks on either side of it
+static void start_flush(buf_t *b, flush_t *f) {
+    uint32_t first = b->block;
+    uint32_t last = b->block;
+    while (first > 0 && last - first + 1 < MAX_RUN && is_dirty(first - 1)) first--;
+    while (last - first + 1 < MAX_RUN && is_dirty(last + 1)) last++;
+
+    f->first = first;
+    f->count = last - first + 1;
+    f->req.sector = first * BLOCK_SECTORS;
+    f->req.write = 1;
+    f->req.nsegs = f->count;
+    for (uint32_t i = 0; i < f->count; i++) {
+        buf_t *run = lookup(first + i);
+        run->writing = 1;
+        f->req.buf[i] = run->data;
+        f->req.len[i] = BCACHE_BLOCK_SIZE;
+    }
+
+    stats.disk_writes++;
+    if (hal_blk_submit(&f->req) < 0) {
+        f->req.status = -1;
+        f->req.done = 1;
+    }
+}
+
+// Wait for a write-back run to complete
+static int finish_flush(flush_t *f) {
+    int ret = hal_blk_wait(&f->req);
+    if (ret < 0) {
+        // Nothing better to do with it - keeping it dirty would retry forever
+        printf("[BCACHE] Write error at sector %u, %u blocks lost\n",
+               f->first * BLOCK_SECTORS, f->count);
+    }
+    for (uint32_t i = 0; i < f->count; i++) {
+        buf_t *b = lookup(f->first + i);
+        b->writing = 0;
+        mark_clean(b);
+    }
+    return ret < 0 ? -1 : 0;
+}
+
+static int flush_run(buf_t *b) {
+    flush_t f;
+    start_flush(b, &f);
+    return finish_flush(&f);
+}
+
+// Write back everything, up to FLUSH_DEPTH runs at a time
+static int sync_locked(void) {
+    int ret = 0;
+    int started = 0;
+    int finished = 0;
+    for (int i = 0; i < NUM_BUFFERS && dirty_count; i++) {
+        buf_t *b = &buffers[i];
+        if (!b->dirty || b->writing) continue;
+
+        if (started - finished == FLUSH_DEPTH) {
+            if (finish_flush(&flushing[finished++ % FLUSH_DEPTH]) < 0) ret = -1;
+        }
+        start_flush(b, &flushing[started++ % FLUSH_DEPTH]);
+    }
+    while (finished < started) {
+        if (finish_flush(&flushing[finished++ % FLUSH_DEPTH]) < 0) ret = -1;
+    }
+    return ret;
+}
+
+// Take the least recently used buffer for block (written back first if
+// dirty). It is valid and hashed, but its contents are up to the caller.
+static buf_t *claim(uint32_t block) {
+    buf_t *b = lru_tail;
+    if (b->dirty) flush_run(b);
+    if (b->valid) hash_remove(b);
+
+    b->block = block;
+    b->valid = 1;
+    hash_insert(b);
+    touch(b);
+    return b;
+}
+
+static void discard(buf_t *b) {
+    hash_remove(b);
+    b->valid = 0;
+}
+
+// Read count blocks starting at first, none of them cached, into the cache:
+// claim a buffer for each and read the run straight into them
+static int fill(uint32_t first, uint32_t count) {
+    buf_t *run[MAX_RUN];
+    hal_blk_req_t req;
+    req.sector = first * BLOCK_SECTORS;
+    req.write = 0;
+    req.nsegs = count;
+    for (uint32_t i = 0; i < count; i++) {
+        run[i] = claim(first + i);
+        req.buf[i] = run[i]->data;
+        req.len[i] = BCACHE_BLOCK_SIZE;
+    }
+
+    stats.disk_reads++;
+    int ret = hal_blk_submit(&req) < 0 ? -1 : hal_blk_wait(&req);
+    if (ret < 0) {
+        for (uint32_t i = 0; i < count; i++) discard(run[i]);
+        return -1;
+    }
+    return 0;
+}
+
+// Number of whole blocks from block on, at most max, that are in [pos, end)
+// and pass test
+static uint32_t whole_blocks(uint32_t block, uint64_t end, uint32_t max, int (*test)(uint32_t)) {
+    uint32_t n = 0;
+    while (n < max && (uint64_t)(block + n + 1) * BCACHE_BLOCK_SIZE <= end && test(block + n)) n++;
+    return n;
+}
+
+static int not_cached(uint32_t block) {
+    return !lookup(block);
+}
+
+static int any_block(uint32_t block) {
+    (void)block;
+    return 1;
+}
+
+// A stretch of uncached blocks the caller wants all of: read it straight
+// into their buffer, then keep copies
+static int read_direct(uint32_t block, uint32_t count, uint8_t *out) {
+    stats.disk_reads++;
+    if (hal_blk_read(block * BLOCK_SECTORS, out, count * BLOCK_SECTORS) < 0) return -1;
+    stats.misses += count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        buf_t *b = claim(block + i);
+        memcpy(b->data, out + i * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+    }
+    return 0;
+}
+
+// A long stretch of whole blocks being overwritten: straight to disk from
+// the caller's buffer. Copies already cached are brought up to date (and
+// are no longer dirty); the rest aren't cached - big writes would only
+// push out more useful blocks.
+static int write_direct(uint32_t block, uint32_t count, const uint8_t *in) {
+    stats.disk_writes++;
+    if (hal_blk_write(block * BLOCK_SECTORS, in, count * BLOCK_SECTORS) < 0) return -1;
+
+    for (uint32_t i = 0; i < count; i++) {
+        buf_t *b = lookup(block + i);
+        if (!b) continue;
+        memcpy(b->data, in + i * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+        if (b->dirty) mark_clean(b);
+    }
+    return 0;
+}
+
+// Make sure block is cached. want is how many blocks from it on the caller
+// needs; on a sequential read the run is stretched to read ahead.
+static buf_t *get_block(uint32_t block, uint32_t want, int sequential) {
+    buf_t *b = lookup(block);
+    if (b) {
+        stats.hits++;
+        return b;
+    }
+
+    uint32_t need = 1;
+    while (need < want && need < MAX_RUN && !lookup(block + need)) need++;
+    uint32_t run = need;
+    if (sequential) {
+        while (run < MAX_RUN && !lookup(block + run)) run++;
+    }
+
+    // Read-ahead can run off the end of the device - then just read what's needed
+    if (fill(block, run) < 0) {
+        if (run == need || fill(block, need) < 0) return NULL;
+        run = need;
+    }
+    stats.misses += need;
+    stats.readahead += run - need;
+    return lookup(block);
+}
+
+int bcache_init(void) {
+    if (initialized) return 0;
+
+    uint8_t *mem = malloc(NUM_BUFFERS * BCACHE_BLOCK_SIZE + BCACHE_BLOCK_SIZE);
+    if (!mem) {
+        printf("[BCACHE] Out of memory\n");
+        return -1;
+    }
+
+    // Page aligned, so DMA cache maintenance never touches a neighbour
+    uint8_t *data = (uint8_t *)(((uint64_t)mem + BCACHE_BLOCK_SIZE - 1) & ~(uint64_t)(BCACHE_BLOCK_SIZE - 1));
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+        buf_t *b = &buffers[i];
+        memset(b, 0, sizeof(buf_t));
+        b->data = data + i * BCACHE_BLOCK_SIZE;
+        b->lru_prev = i > 0 ? &buffers[i - 1] : NULL;
+        b->lru_next = i < NUM_BUFFERS - 1 ? &buffers[i + 1] : NULL;
+    }
+    lru_head = &buffers[0];
+    lru_tail = &buffers[NUM_BUFFERS - 1];
+    initialized = 1;
+
+    printf("[BCACHE] %d KB in %d byte blocks\n",
+           NUM_BUFFERS * BCACHE_BLOCK_SIZE / 1024, BCACHE_BLOCK_SIZE);
+    return 0;
+}
+
+int bcache_read(uint32_t sector, uint32_t offset, void *buf, size_t len) {
+    if (len == 0) return 0;
+    if (!initialized) return -1;
+
+    uint64_t pos = (uint64_t)sector * 512 + offset;
+    uint64_t end = pos + len;
+    uint32_t first = pos / BCACHE_BLOCK_SIZE;
+    uint32_t last = (end - 1) / BCACHE_BLOCK_SIZE;
+    uint8_t *out = buf;
+
+    mutex_lock(&bcache_lock);
+
+    // Carrying on from the last read (or re-reading its last block, when
+    // requests don't end on block boundaries)
+    int sequential = first == next_block || first + 1 == next_block;
+
+    for (uint32_t block = first; block <= last; block++) {
+        uint64_t start = (uint64_t)block * BCACHE_BLOCK_SIZE;
+
+        if (start >= pos && ((uint64_t)out & (DIRECT_ALIGN - 1)) == 0) {
+            uint32_t n = whole_blocks(block, end, DIRECT_MAX, not_cached);
+            if (n > 1 && mmu_dma_ok(out, n * BCACHE_BLOCK_SIZE)) {
+                if (read_direct(block, n, out) < 0) {
+                    mutex_unlock(&bcache_lock);
+                    return -1;
+                }
+                out += n * BCACHE_BLOCK_SIZE;
+                block += n - 1;
+                continue;
+            }
+        }
+
+        buf_t *b = get_block(block, last - block + 1, sequential);
+        if (!b) {
+            mutex_unlock(&bcache_lock);
+            return -1;
+        }
+        touch(b);
+
+        uint64_t from = pos > start ? pos - start : 0;
+        uint64_t to = end < start + BCACHE_BLOCK_SIZE ? end - start : BCACHE_BLOCK_SIZE;
+        memcpy(out, b->data + from, to - from);
+        out += to - from;
+    }
+    // Small reads are FAT entries looked up in between a file's clusters -
+    // they mustn't break up its sequential run
+    if (len >= 512) next_block = last + 1;
+
+    mutex_unlock(&bcache_lock);
+    return 0;
+}
+
+int bcache_write(uint32_t sector, uint32_t offset, const void *buf, size_t len) {
+    if (len == 0) return 0;
+    if (!initialized) return -1;
+
+    uint64_t pos = (uint64_t)sector * 512 + offset;
+    uint64_t end = pos + len;
+    uint32_t first = pos / BCACHE_BLOCK_SIZE;
+    uint32_t last = (end - 1) / BCACHE_BLOCK_SIZE;
+    const uint8_t *in = buf;
+
+    mutex_lock(&bcache_lock);
+
+    for (uint32_t block = first; block <= last; block++) {
+        uint64_t start = (uint64_t)block * BCACHE_BLOCK_SIZE;
+        uint64_t from = pos > start ? pos - start : 0;
+        uint64_t to = end < start + BCACHE_BLOCK_SIZE ? end - start : BCACHE_BLOCK_SIZE;
+
+        if (start >= pos) {
+            uint32_t n = whole_blocks(block, end, DIRECT_MAX, any_block);
+            if (n >= MAX_RUN && mmu_dma_ok(in, n * BCACHE_BLOCK_SIZE)) {
+                if (write_direct(block, n, in) < 0) {
+                    mutex_unlock(&bcache_lock);
+                    return -1;
+                }
+                in += n * BCACHE_BLOCK_SIZE;
+                block += n - 1;
+                continue;
+            }
+        }
+
+        // Overwriting all of it - no need to read the old contents
+        buf_t *b = lookup(block);
+        if (!b && from == 0 && to == BCACHE_BLOCK_SIZE) {
+            b = claim(block);
+        } else if (!b) {
+            b = get_block(block, 1, 0);
+        }
+        if (!b) {
+            mutex_unlock(&bcache_lock);
+            return -1;
+        }
+        touch(b);
+
+        memcpy(b->data + from, in, to - from);
+        in += to - from;
+        mark_dirty(b);
+    }
+
+    int ret = dirty_count > DIRTY_LIMIT ? sync_locked() : 0;
+    mutex_unlock(&bcache_lock);
+    return ret;
+}
+
+int bcache_sync(void) {
+    mutex_lock(&bcache_lock);
+    int ret = sync_locked();
+    mutex_unlock(&bcache_lock);
+    return ret;
+}
+
+void bcache_drop(void) {
+    mutex_lock(&bcache_lock);
+    sync_locked();
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+        if (buffers[i].valid) discard(&buffers[i]);
+    }
+    next_block = 0;
+    mutex_unlock(&bcache_lock);
+}
+
+void bcache_idle(void) {
+    uint64_t since = dirty_since;
+    if (!since || ktimer_now() - since < ktimer_us_to_count(BCACHE_FLUSH_MS * 1000ULL)) return;
+
+    // Somebody is using the cache - they'll get to it, or we will next time
+    if (!mutex_trylock(&bcache_lock)) return;
+    sync_locked();
+    mutex_unlock(&bcache_lock);
+}
+
+void bcache_get_stats(bcache_stats_t *out) {
+    mutex_lock(&bcache_lock);
+    *out = stats;
+    out->dirty = dirty_count;
+    mutex_unlock(&bcache_lock);
+}
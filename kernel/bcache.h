@@ -0,0 +1,50 @@
+/*
+ * KikiOS Block Buffer Cache
+ *
+ * Sits between the filesystem and hal_blk_read/hal_blk_write. The disk is
+ * cached in 4KB blocks (8 sectors) found through a hash table and evicted
+ * least recently used first. Misses are read in runs, and a run of
+ * sequential reads also reads ahead. Writes only dirty the cache; dirty
+ * blocks go to disk together, neighbours merged into one request, once
+ * the oldest has waited BCACHE_FLUSH_MS, when too many pile up, or on
+ * bcache_sync.
+ */
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BCACHE_BLOCK_SIZE   4096
+#define BCACHE_FLUSH_MS     2000
+
+typedef struct {
+    uint64_t hits;          // Blocks found in the cache
+    uint64_t misses;        // Blocks that had to be read
+    uint64_t readahead;     // Blocks read before anyone asked for them
+    uint64_t disk_reads;    // Requests sent to the device
+    uint64_t disk_writes;
+    uint32_t dirty;         // Blocks waiting to be written
+} bcache_stats_t;
+
+// Allocate the buffers (before the first read)
+int bcache_init(void);
+
+// Read/write len bytes starting offset bytes into sector (absolute device
+// sector numbers). Any length and alignment; returns 0 or -1.
+int bcache_read(uint32_t sector, uint32_t offset, void *buf, size_t len);
+int bcache_write(uint32_t sector, uint32_t offset, const void *buf, size_t len);
+
+// Write every dirty block now
+int bcache_sync(void);
+
+// Sync, then forget everything cached (cold-cache benchmarks)
+void bcache_drop(void);
+
+// Kernel threads call this when idle: writes dirty blocks once they're due
+void bcache_idle(void);
+
+void bcache_get_stats(bcache_stats_t *stats);
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ * KikiOS Directory Entry Cache
+ *
+ * A fixed pool of entries, each always on the LRU list and, while in use,
+ * in one hash chain. The hash covers the lowercased name so lookups that
+ * differ only in case land in the same chain.
+ */
+
+#include "dcache.h"
+#include "printf.h"
+#include "string.h"
+
+#define NUM_ENTRIES     512
+#define HASH_SIZE       256
+#define REPORT_EVERY    1024        // Lookups between hit rate lines in the log
+
+typedef struct dentry {
+    uint32_t dir_cluster;
+    char name[DCACHE_NAME_MAX];
+    int used;
+    int present;                    // 0: a negative entry, the name isn't there
+    fat32_dirent_t entry;
+    uint32_t entry_cluster;         // Where the entry is stored
+    uint32_t entry_index;
+    struct dentry *hash_next;
+    struct dentry *lru_prev;        // Towards the most recently used
+    struct dentry *lru_next;        // Towards the next to be reused
+} dentry_t;
+
+static dentry_t entries[NUM_ENTRIES];
+static dentry_t *hash_table[HASH_SIZE];
+static dentry_t *lru_head = NULL;
+static dentry_t *lru_tail = NULL;
+static int initialized = 0;
+
+static uint32_t lookups = 0;
+static uint32_t hits = 0;
+static uint32_t negative_hits = 0;
+
+static char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
+
+static uint32_t hash(uint32_t dir_cluster, const char *name) {
+    uint32_t h = dir_cluster * 2654435761u;
+    while (*name) h = (h ^ (uint8_t)lower(*name++)) * 16777619u;
+    return h % HASH_SIZE;
+}
+
+static int same_name(const char *a, const char *b) {
+    while (*a && *b) {
+        if (lower(*a++) != lower(*b++)) return 0;
+    }
+    return *a == *b;
+}
+
+static void init(void) {
+    for (int i = 0; i < NUM_ENTRIES; i++) {
+        entries[i].lru_prev = i > 0 ? &entries[i - 1] : NULL;
+        entries[i].lru_next = i < NUM_ENTRIES - 1 ? &entries[i + 1] : NULL;
+    }
+    lru_head = &entries[0];
+    lru_tail = &entries[NUM_ENTRIES - 1];
+    initialized = 1;
+}
+
+static dentry_t *find(uint32_t dir_cluster, const char *name) {
+    dentry_t *d = hash_table[hash(dir_cluster, name)];
+    while (d && (d->dir_cluster != dir_cluster || !same_name(d->name, name))) d = d->hash_next;
+    return d;
+}
+
+static void lru_unlink(dentry_t *d) {
+    if (d->lru_prev) d->lru_prev->lru_next = d->lru_next;
+    else lru_head = d->lru_next;
+    if (d->lru_next) d->lru_next->lru_prev = d->lru_prev;
+    else lru_tail = d->lru_prev;
+    d->lru_prev = d->lru_next = NULL;
+}
+
+static void lru_push_head(dentry_t *d) {
+    d->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = d;
+    lru_head = d;
+    if (!lru_tail) lru_tail = d;
+}
+
+static void lru_push_tail(dentry_t *d) {
+    d->lru_prev = lru_tail;
+    if (lru_tail) lru_tail->lru_next = d;
+    lru_tail = d;
+    if (!lru_head) lru_head = d;
+}
+
+// Take an entry out of its hash chain and let it be reused first
+static void drop(dentry_t *d) {
+    dentry_t **pp = &hash_table[hash(d->dir_cluster, d->name)];
+    while (*pp && *pp != d) pp = &(*pp)->hash_next;
+    if (*pp) *pp = d->hash_next;
+    d->hash_next = NULL;
+    d->used = 0;
+
+    lru_unlink(d);
+    lru_push_tail(d);
+}
+
+int dcache_lookup(uint32_t dir_cluster, const char *name, fat32_dirent_t *entry,
+                  uint32_t *entry_cluster, uint32_t *entry_index) {
+    if (!initialized) init();
+
+    if (++lookups % REPORT_EVERY == 0) {
+        printf("[DCACHE] %u lookups, %u%% hits (%u of them negative)\n",
+               lookups, (uint32_t)((uint64_t)hits * 100 / lookups), negative_hits);
+    }
+
+    dentry_t *d = find(dir_cluster, name);
+    if (!d) return -1;
+
+    hits++;
+    lru_unlink(d);
+    lru_push_head(d);
+    if (!d->present) {
+        negative_hits++;
+        return 0;
+    }
+    *entry = d->entry;
+    *entry_cluster = d->entry_cluster;
+    *entry_index = d->entry_index;
+    return 1;
+}
+
+void dcache_insert(uint32_t dir_cluster, const char *name, const fat32_dirent_t *entry,
+                   uint32_t entry_cluster, uint32_t entry_index) {
+    if (!initialized) init();
+    if (strlen(name) >= DCACHE_NAME_MAX) return;
+
+    dentry_t *d = find(dir_cluster, name);
+    if (d) drop(d);
+
+    // Reuse the least recently used entry
+    d = lru_tail;
+    if (d->used) drop(d);
+    lru_unlink(d);
+    lru_push_head(d);
+
+    d->dir_cluster = dir_cluster;
+    strcpy(d->name, name);
+    d->used = 1;
+    d->present = entry != NULL;
+    if (entry) {
+        d->entry = *entry;
+        d->entry_cluster = entry_cluster;
+        d->entry_index = entry_index;
+    }
+
+    uint32_t h = hash(dir_cluster, name);
+    d->hash_next = hash_table[h];
+    hash_table[h] = d;
+}
+
+void dcache_forget(uint32_t dir_cluster, const char *name) {
+    if (!initialized) return;
+    dentry_t *d = find(dir_cluster, name);
+    if (d) drop(d);
+}
+
+void dcache_forget_entry(uint32_t entry_cluster, uint32_t entry_index) {
+    if (!initialized) return;
+    for (int i = 0; i < NUM_ENTRIES; i++) {
+        dentry_t *d = &entries[i];
+        if (d->used && d->present && d->entry_cluster == entry_cluster &&
+            d->entry_index == entry_index) {
+            drop(d);
+        }
+    }
+}
+
+void dcache_forget_dir(uint32_t dir_cluster) {
+    if (!initialized) return;
+    for (int i = 0; i < NUM_ENTRIES; i++) {
+        if (entries[i].used && entries[i].dir_cluster == dir_cluster) drop(&entries[i]);
+    }
+}
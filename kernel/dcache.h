@@ -0,0 +1,42 @@
+/*
+ * KikiOS Directory Entry Cache
+ *
+ * Remembers what looking a name up in a FAT32 directory found: the
+ * directory entry and where it sits, or that the name isn't there.
+ * Entries are keyed by the directory's first cluster and the name
+ * (case-insensitive, like FAT), so resolving a path costs no directory
+ * reads once its components have been seen, and probing for missing files
+ * (the shell searching PATH, tab completion) doesn't rescan directories.
+ *
+ * fat32.c is the only user and calls in with fs_lock held. It forgets a
+ * name whenever it creates, deletes, renames or rewrites that entry.
+ */
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stdint.h>
+#include "fat32.h"
+
+#define DCACHE_NAME_MAX     64      // Longer names aren't cached
+
+// Look up name in the directory starting at dir_cluster. Returns 1 and
+// fills in entry/location if it is cached as present, 0 if cached as
+// missing, -1 if not cached.
+int dcache_lookup(uint32_t dir_cluster, const char *name, fat32_dirent_t *entry,
+                  uint32_t *entry_cluster, uint32_t *entry_index);
+
+// Remember a lookup: entry NULL means the name isn't there
+void dcache_insert(uint32_t dir_cluster, const char *name, const fat32_dirent_t *entry,
+                   uint32_t entry_cluster, uint32_t entry_index);
+
+// The entry for name has changed or gone
+void dcache_forget(uint32_t dir_cluster, const char *name);
+
+// The entry stored at this slot (entry_index in entry_cluster) has changed
+void dcache_forget_entry(uint32_t entry_cluster, uint32_t entry_index);
+
+// The directory starting at dir_cluster is gone (its clusters were freed)
+void dcache_forget_dir(uint32_t dir_cluster);
+
+#endif
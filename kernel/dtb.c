@@ -50,6 +50,13 @@ static int str_starts_with(const char *str, const char *prefix) {
     return 1;
 }
 
+// cpu@N nodes under /cpus seen by the last dtb_parse
+static int dtb_cpus = 0;
+
+int dtb_cpu_count(void) {
+    return dtb_cpus;
+}
+
 const char *dtb_get_error(void) {
     return dtb_error;
 }
@@ -86,6 +93,7 @@ int dtb_parse(void *dtb_addr, struct dtb_memory_info *mem_info) {
     uint32_t offset = 0;
     int depth = 0;
     int in_memory_node = 0;
+    int in_cpus_node = 0;
     int in_root = 0;
     uint32_t root_addr_cells = 2;  // Default for 64-bit
     uint32_t root_size_cells = 1;  // Default
@@ -117,12 +125,22 @@ int dtb_parse(void *dtb_addr, struct dtb_memory_info *mem_info) {
                     in_memory_node = 1;
                     printf("[DTB] Found memory node: %s\n", name[0] ? name : "(root)");
                 }
+
+                // Count cores: /cpus/cpu@N
+                if (depth == 2 && str_eq(name, "cpus")) {
+                    in_cpus_node = 1;
+                    dtb_cpus = 0;
+                }
+                if (depth == 3 && in_cpus_node && str_starts_with(name, "cpu@")) {
+                    dtb_cpus++;
+                }
                 break;
             }
 
             case FDT_END_NODE: {
                 if (depth == 2) {
                     in_memory_node = 0;
+                    in_cpus_node = 0;
                 }
                 if (depth == 1) {
                     in_root = 0;
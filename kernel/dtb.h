@@ -48,6 +48,9 @@ struct dtb_memory_info {
 // Returns 0 on success, -1 on failure
 int dtb_parse(void *dtb_addr, struct dtb_memory_info *mem_info);
 
+// Number of CPU cores listed in the DTB (0 if dtb_parse didn't find any)
+int dtb_cpu_count(void);
+
 // Get a human-readable description of parsing result
 const char *dtb_get_error(void);
 
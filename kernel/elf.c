@@ -3,6 +3,7 @@
  */
 
 #include "elf.h"
+#include "mmu.h"
 #include "string.h"
 #include "printf.h"
 #include <stddef.h>
@@ -101,32 +102,38 @@ uint64_t elf_load(const void *data, size_t size) {
     return ehdr->e_entry;
 }
 
-// Calculate total memory size needed for all LOAD segments
-uint64_t elf_calc_size(const void *data, size_t size) {
-    int valid = elf_validate(data, size);
-    if (valid != 0) return 0;
+// Read the ELF and program headers, and work out how much memory the
+// LOAD segments need
+int elf_read_headers(vfs_node_t *file, elf_image_t *img) {
+    memset(&img->ehdr, 0, sizeof(Elf64_Ehdr));
+    int n = vfs_read(file, (char *)&img->ehdr, sizeof(Elf64_Ehdr), 0);
+    if (n < 0) return -1;
 
-    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)data;
-    const uint8_t *base = (const uint8_t *)data;
+    int valid = elf_validate(&img->ehdr, (size_t)n);
+    if (valid != 0) return valid;
+
+    const Elf64_Ehdr *ehdr = &img->ehdr;
+    if (ehdr->e_phnum == 0 || ehdr->e_phnum > ELF_MAX_PHDRS ||
+        ehdr->e_phentsize != sizeof(Elf64_Phdr)) {
+        return -7;
+    }
 
-    uint64_t min_addr = (uint64_t)-1;
-    uint64_t max_addr = 0;
+    size_t ph_bytes = ehdr->e_phnum * sizeof(Elf64_Phdr);
+    if (vfs_read(file, (char *)img->phdr, ph_bytes, ehdr->e_phoff) != (int)ph_bytes) {
+        return -7;
+    }
 
+    img->span = 0;
     for (int i = 0; i < ehdr->e_phnum; i++) {
-        const Elf64_Phdr *phdr = (const Elf64_Phdr *)(base + ehdr->e_phoff + i * ehdr->e_phentsize);
+        const Elf64_Phdr *phdr = &img->phdr[i];
         if (phdr->p_type != PT_LOAD) continue;
+        if (phdr->p_filesz > phdr->p_memsz) return -7;
 
-        if (phdr->p_vaddr < min_addr) {
-            min_addr = phdr->p_vaddr;
-        }
         uint64_t end = phdr->p_vaddr + phdr->p_memsz;
-        if (end > max_addr) {
-            max_addr = end;
-        }
+        if (end > img->span) img->span = end;
     }
 
-    if (max_addr <= min_addr) return 0;
-    return max_addr - min_addr;
+    return img->span ? 0 : -7;
 }
 
 // Process dynamic relocations for PIE binaries
@@ -179,80 +186,71 @@ static void elf_process_relocations(uint64_t load_base, const Elf64_Dyn *dynamic
     // printf("[ELF] Applied %d relocations successfully\n", applied);
 }
 
-// Load ELF at a specific base address
-int elf_load_at(const void *data, size_t size, uint64_t load_base, elf_load_info_t *info) {
-    int valid = elf_validate(data, size);
-    if (valid != 0) {
-        printf("[ELF] Invalid ELF: error %d\n", valid);
-        return -1;
+void elf_relocate(const elf_image_t *img, uint64_t load_base) {
+    if (img->ehdr.e_type != ET_DYN) return;
+
+    // The dynamic section is part of a loaded segment by now
+    for (int i = 0; i < img->ehdr.e_phnum; i++) {
+        if (img->phdr[i].p_type == PT_DYNAMIC) {
+            elf_process_relocations(load_base, (const Elf64_Dyn *)(load_base + img->phdr[i].p_vaddr));
+            return;
+        }
     }
+}
 
-    const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)data;
-    const uint8_t *base = (const uint8_t *)data;
+// Load ELF at a specific base address
+int elf_load_file(vfs_node_t *file, const elf_image_t *img, uint64_t load_base, elf_load_info_t *info) {
+    const Elf64_Ehdr *ehdr = &img->ehdr;
     int is_pie = (ehdr->e_type == ET_DYN);
 
-    // printf("[ELF] Loading %s at 0x%lx (%d program headers)\n",
-    //        is_pie ? "PIE" : "EXEC", load_base, ehdr->e_phnum);
-
-    uint64_t total_size = 0;
-    const Elf64_Dyn *dynamic = NULL;
-
-    // Process program headers
     for (int i = 0; i < ehdr->e_phnum; i++) {
-        const Elf64_Phdr *phdr = (const Elf64_Phdr *)(base + ehdr->e_phoff + i * ehdr->e_phentsize);
-
-        // Remember DYNAMIC segment for relocations
-        if (phdr->p_type == PT_DYNAMIC) {
-            // Dynamic section will be loaded, remember its runtime address
-            dynamic = (const Elf64_Dyn *)(load_base + phdr->p_vaddr);
-            continue;
-        }
-
+        const Elf64_Phdr *phdr = &img->phdr[i];
         if (phdr->p_type != PT_LOAD) continue;
 
         // For PIE, add load_base to vaddr
         // For EXEC, use vaddr as-is
         uint64_t dest_addr = is_pie ? (load_base + phdr->p_vaddr) : phdr->p_vaddr;
+        uint8_t *dest = (uint8_t *)dest_addr;
 
-        // printf("[ELF] LOAD: vaddr=0x%lx -> 0x%lx filesz=0x%lx memsz=0x%lx\n",
-        //        phdr->p_vaddr, dest_addr, phdr->p_filesz, phdr->p_memsz);
-
-        void *dest = (void *)dest_addr;
-        const void *src = base + phdr->p_offset;
-
-        // Copy file contents
-        if (phdr->p_filesz > 0) {
-            memcpy(dest, src, phdr->p_filesz);
+        // File contents go straight to their final address
+        if (phdr->p_filesz > 0 &&
+            vfs_read(file, (char *)dest, phdr->p_filesz, phdr->p_offset) != (int)phdr->p_filesz) {
+            printf("[ELF] Short read of segment at offset 0x%lx\n", phdr->p_offset);
+            return -1;
         }
 
-        // Zero BSS
+        // BSS: the rest of the last file page is ours to clear (a page may
+        // be shared with data). Whole pages after it are still untouched
+        // demand-paged memory, which reads as zeros anyway.
         if (phdr->p_memsz > phdr->p_filesz) {
-            // uint64_t bss_start = dest_addr + phdr->p_filesz;
+            uint8_t *bss = dest + phdr->p_filesz;
             uint64_t bss_size = phdr->p_memsz - phdr->p_filesz;
-            // printf("[ELF] Zeroing BSS: 0x%lx - 0x%lx (size 0x%lx)\n",
-            //        bss_start, bss_start + bss_size, bss_size);
-            memset((uint8_t *)dest + phdr->p_filesz, 0, bss_size);
+            if (is_pie && mmu_demand_paging()) {
+                uint64_t to_page = (0x1000 - ((uint64_t)bss & 0xFFF)) & 0xFFF;
+                if (bss_size > to_page) bss_size = to_page;
+            }
+            memset(bss, 0, bss_size);
         }
-
-        uint64_t seg_end = phdr->p_vaddr + phdr->p_memsz;
-        if (seg_end > total_size) total_size = seg_end;
     }
 
-    // Process relocations for PIE binaries
-    if (is_pie && dynamic) {
-        elf_process_relocations(load_base, dynamic);
+    elf_relocate(img, load_base);
+
+    // The region may have held another program's code a moment ago
+    for (int i = 0; i < ehdr->e_phnum; i++) {
+        const Elf64_Phdr *phdr = &img->phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X)) continue;
+        uint64_t dest_addr = is_pie ? (load_base + phdr->p_vaddr) : phdr->p_vaddr;
+        icache_sync_range((const void *)dest_addr, phdr->p_filesz);
     }
 
     // Calculate entry point
     uint64_t entry = is_pie ? (load_base + ehdr->e_entry) : ehdr->e_entry;
 
-    // printf("[ELF] Entry point: 0x%lx\n", entry);
-
     // Fill info struct
     if (info) {
         info->entry = entry;
         info->load_base = load_base;
-        info->load_size = total_size;
+        info->load_size = img->span;
     }
 
     return 0;
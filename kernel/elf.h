@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "vfs.h"
 
 // ELF Magic
 #define ELF_MAGIC 0x464C457F  // "\x7FELF" as little-endian uint32
@@ -47,6 +48,11 @@ typedef struct {
 #define PT_DYNAMIC 2
 #define PT_INTERP  3
 
+// Program header flags
+#define PF_X       0x1
+#define PF_W       0x2
+#define PF_R       0x4
+
 // Dynamic section entry
 typedef struct {
     int64_t  d_tag;
@@ -97,6 +103,16 @@ typedef struct {
     uint64_t load_size;   // Total size in memory
 } elf_load_info_t;
 
+// Most program headers we accept (our binaries have 3-5)
+#define ELF_MAX_PHDRS 16
+
+// Headers of an ELF file, read without loading anything
+typedef struct {
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdr[ELF_MAX_PHDRS];
+    uint64_t span;        // Memory from vaddr 0 to the end of the last LOAD segment
+} elf_image_t;
+
 // Validate ELF header, returns 0 if valid
 int elf_validate(const void *data, size_t size);
 
@@ -107,11 +123,17 @@ uint64_t elf_entry(const void *data);
 // DEPRECATED: use elf_load_at instead
 uint64_t elf_load(const void *data, size_t size);
 
-// Load ELF at a specific base address (for PIE binaries)
+// Read and check the headers of an ELF file.
+// Returns 0 on success, an elf_validate error, or -7 for bad program headers.
+int elf_read_headers(vfs_node_t *file, elf_image_t *img);
+
+// Load an ELF at a specific base address (for PIE binaries), reading each
+// LOAD segment from the file straight into place - no copy of the file.
+// [base, base + img->span) must be zeroed or demand-paged (mmu.h).
 // Returns 0 on success, fills info struct
-int elf_load_at(const void *data, size_t size, uint64_t base, elf_load_info_t *info);
+int elf_load_file(vfs_node_t *file, const elf_image_t *img, uint64_t base, elf_load_info_t *info);
 
-// Calculate total memory size needed for ELF
-uint64_t elf_calc_size(const void *data, size_t size);
+// Apply a loaded PIE's dynamic relocations for the given base
+void elf_relocate(const elf_image_t *img, uint64_t base);
 
 #endif
@@ -6,10 +6,14 @@
  */
 
 #include "fat32.h"
-#include "hal/hal.h"
 #include "printf.h"
 #include "string.h"
 #include "memory.h"
+#include "smp.h"
+#include "imgcache.h"
+#include "pagecache.h"
+#include "dcache.h"
+#include "bcache.h"
 
 // Boot sector (BIOS Parameter Block)
 typedef struct __attribute__((packed)) {
@@ -57,80 +61,77 @@ static uint8_t sector_buf[512] __attribute__((aligned(16)));
 static uint8_t *cluster_buf = NULL;
 static uint32_t cluster_buf_size = 0;
 
-// FAT sector cache - avoids repeated disk reads when traversing cluster chains
-// Larger cache = fewer disk reads when scanning FAT (df, free space checks)
-#define FAT_CACHE_SIZE 64
-static struct {
-    uint32_t sector;      // Which FAT sector is cached (0 = invalid)
-    uint8_t data[512];    // Cached sector data
-    uint32_t lru_counter; // For LRU eviction
-} fat_cache[FAT_CACHE_SIZE];
-static uint32_t fat_cache_counter = 0;
+// Bumped by every write. Open files check it to find out whether their
+// file may have moved or changed size since they last looked.
+static uint32_t fs_generation = 0;
+
+// Bumped whenever clusters are freed. Until then, any chain an open file
+// has mapped can only have grown.
+static uint32_t chain_generation = 0;
+
+// Free-cluster bitmap, built from the FAT at mount (bit set = in use).
+// Clusters 0-1 and the tail of the last word are marked in use, so a
+// search never returns them.
+static uint32_t *free_map = NULL;
+static uint32_t free_count = 0;
+static uint32_t next_free = 2;          // Where the next search starts
+
+// FSInfo sector: free count and next-free hint for other systems (and
+// fsck), rewritten when a call that changed them returns
+#define FSINFO_LEAD_SIG     0x41615252
+#define FSINFO_STRUCT_SIG   0x61417272
+static uint32_t fsinfo_sector = 0;      // 0 if the volume has none
+static int fsinfo_dirty = 0;
+
+// The buffers above are shared by every caller, so the public
+// functions below run one at a time. The lock is recursive, so they can
+// call each other (and list_dir callbacks can call back in).
+static mutex_t fs_lock = MUTEX_INIT;
+static int fs_depth = 0;                // Nesting of FS_LOCKED calls
+
+static void fsinfo_store(void);
+
+static void fs_unlock(mutex_t **lock) {
+    // Leaving the outermost call: bring FSInfo up to date once
+    if (fs_depth == 1 && fsinfo_dirty) fsinfo_store();
+    fs_depth--;
+    mutex_unlock(*lock);
+}
+
+// Hold fs_lock until the enclosing function returns
+#define FS_LOCKED() \
+    mutex_t *fs_held __attribute__((cleanup(fs_unlock), unused)) = &fs_lock; \
+    mutex_lock(fs_held); \
+    fs_depth++
+
+// All disk access goes through the block cache, which takes absolute
+// sector numbers
 
 // Read a sector from disk (adds partition offset)
 static int read_sector(uint32_t sector, void *buf) {
-    return hal_blk_read(partition_offset + sector, buf, 1);
-}
-
-// Write a sector to disk (adds partition offset)
-static int write_sector(uint32_t sector, const void *buf) {
-    return hal_blk_write(partition_offset + sector, buf, 1);
+    return bcache_read(partition_offset + sector, 0, buf, 512);
 }
 
 // Write multiple sectors (adds partition offset)
 static int write_sectors(uint32_t sector, uint32_t count, const void *buf) {
-    return hal_blk_write(partition_offset + sector, buf, count);
+    fs_generation++;
+    return bcache_write(partition_offset + sector, 0, buf, count * 512);
 }
 
 // Read multiple sectors (adds partition offset)
 static int read_sectors(uint32_t sector, uint32_t count, void *buf) {
-    return hal_blk_read(partition_offset + sector, buf, count);
+    return bcache_read(partition_offset + sector, 0, buf, count * 512);
 }
 
-// Read a FAT sector with caching
-// Returns pointer to cached data, or NULL on error
-static uint8_t *fat_read_sector_cached(uint32_t sector) {
-    // Check if already cached
-    for (int i = 0; i < FAT_CACHE_SIZE; i++) {
-        if (fat_cache[i].sector == sector && fat_cache[i].sector != 0) {
-            fat_cache[i].lru_counter = ++fat_cache_counter;
-            return fat_cache[i].data;
-        }
-    }
-
-    // Not cached - find LRU entry to evict
-    int lru_idx = 0;
-    uint32_t min_counter = fat_cache[0].lru_counter;
-    for (int i = 1; i < FAT_CACHE_SIZE; i++) {
-        if (fat_cache[i].sector == 0) {
-            // Found empty slot, use it
-            lru_idx = i;
-            break;
-        }
-        if (fat_cache[i].lru_counter < min_counter) {
-            min_counter = fat_cache[i].lru_counter;
-            lru_idx = i;
-        }
-    }
-
-    // Read sector into cache
-    if (read_sector(sector, fat_cache[lru_idx].data) < 0) {
-        return NULL;
-    }
-
-    fat_cache[lru_idx].sector = sector;
-    fat_cache[lru_idx].lru_counter = ++fat_cache_counter;
-    return fat_cache[lru_idx].data;
+// Read/write len bytes starting offset bytes into a sector (adds partition
+// offset). Any length: runs of clusters go to the cache as one request.
+static int read_at(uint32_t sector, uint32_t offset, void *buf, size_t len) {
+    return bcache_read(partition_offset + sector, offset, buf, len);
 }
 
-// Invalidate a FAT sector in the cache (call after writes)
-static void fat_cache_invalidate(uint32_t sector) {
-    for (int i = 0; i < FAT_CACHE_SIZE; i++) {
-        if (fat_cache[i].sector == sector) {
-            fat_cache[i].sector = 0;
-            return;
-        }
-    }
+static int write_at(uint32_t sector, uint32_t offset, const void *buf, size_t len) {
+    fs_generation++;
+    return bcache_write(partition_offset + sector, offset, buf, len);
 }
 
 // MBR partition entry structure
@@ -147,7 +148,7 @@ typedef struct __attribute__((packed)) {
 // Returns the starting sector of the partition, or 0 for raw disk
 static uint32_t find_fat32_partition(void) {
     // Read MBR (sector 0, bypassing partition_offset)
-    if (hal_blk_read(0, sector_buf, 1) < 0) {
+    if (bcache_read(0, 0, sector_buf, 512) < 0) {
         printf("[FAT32] Failed to read MBR\n");
         return 0;
     }
@@ -209,6 +210,11 @@ static uint32_t cluster_to_sector(uint32_t cluster) {
     return fs.data_start + (cluster - 2) * fs.sectors_per_cluster;
 }
 
+// Read one 32-bit FAT entry
+static int read_entry(uint32_t fat_sector, uint32_t entry_offset, uint32_t *entry) {
+    return read_at(fat_sector, entry_offset, entry, 4);
+}
+
 // Read the FAT entry for a cluster (returns next cluster or EOC marker)
 static uint32_t fat_next_cluster(uint32_t cluster) {
     // Calculate which sector of the FAT contains this entry
@@ -216,13 +222,13 @@ static uint32_t fat_next_cluster(uint32_t cluster) {
     uint32_t fat_sector = fs.reserved_sectors + (fat_offset / fs.bytes_per_sector);
     uint32_t entry_offset = fat_offset % fs.bytes_per_sector;
 
-    // Use cached FAT read
-    uint8_t *data = fat_read_sector_cached(fat_sector);
-    if (!data) {
+    // FAT sectors are read over and over while walking chains - the
+    // block cache keeps them
+    uint32_t next;
+    if (read_entry(fat_sector, entry_offset, &next) < 0) {
         return FAT32_EOC;
     }
 
-    uint32_t next = *(uint32_t *)(data + entry_offset);
     return next & 0x0FFFFFFF;  // FAT32 uses only 28 bits
 }
 
@@ -232,27 +238,39 @@ static int fat_set_cluster(uint32_t cluster, uint32_t value) {
     uint32_t fat_sector = fs.reserved_sectors + (fat_offset / fs.bytes_per_sector);
     uint32_t entry_offset = fat_offset % fs.bytes_per_sector;
 
-    // Read current sector
-    if (read_sector(fat_sector, sector_buf) < 0) {
+    uint32_t entry;
+    if (read_entry(fat_sector, entry_offset, &entry) < 0) {
         return -1;
     }
 
     // Modify entry (preserve high 4 bits)
-    uint32_t *entry = (uint32_t *)(sector_buf + entry_offset);
-    *entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF);
+    entry = (entry & 0xF0000000) | (value & 0x0FFFFFFF);
 
     // Write to FAT1
-    if (write_sector(fat_sector, sector_buf) < 0) {
+    if (write_at(fat_sector, entry_offset, &entry, 4) < 0) {
         return -1;
     }
 
-    // Invalidate cache for this sector (it's now stale)
-    fat_cache_invalidate(fat_sector);
+    // Keep the bitmap in step
+    if (free_map && cluster < fs.total_clusters + 2) {
+        uint32_t bit = 1u << (cluster % 32);
+        uint32_t *word = &free_map[cluster / 32];
+        if (value == FAT32_FREE && (*word & bit)) {
+            *word &= ~bit;
+            free_count++;
+            if (cluster < next_free) next_free = cluster;
+            fsinfo_dirty = 1;
+        } else if (value != FAT32_FREE && !(*word & bit)) {
+            *word |= bit;
+            free_count--;
+            fsinfo_dirty = 1;
+        }
+    }
 
     // Write to FAT2 (if exists)
     if (fs.num_fats > 1) {
         uint32_t fat2_sector = fat_sector + fs.fat_size;
-        if (write_sector(fat2_sector, sector_buf) < 0) {
+        if (write_at(fat2_sector, entry_offset, &entry, 4) < 0) {
             return -1;
         }
     }
@@ -260,24 +278,177 @@ static int fat_set_cluster(uint32_t cluster, uint32_t value) {
     return 0;
 }
 
-// Find a free cluster and mark it as end-of-chain
-static uint32_t fat_alloc_cluster(void) {
-    // Start searching from cluster 2 (first data cluster)
-    for (uint32_t cluster = 2; cluster < fs.total_clusters + 2; cluster++) {
-        uint32_t entry = fat_next_cluster(cluster);
-        if (entry == FAT32_FREE) {
-            // Mark as end of chain
-            if (fat_set_cluster(cluster, FAT32_EOC) < 0) {
-                return 0;
+static int cluster_is_free(uint32_t cluster) {
+    return cluster >= 2 && cluster < fs.total_clusters + 2 &&
+           !(free_map[cluster / 32] & (1u << (cluster % 32)));
+}
+
+// First free cluster in [start, limit), 0 if none. Whole words of used
+// clusters are skipped at once.
+static uint32_t find_free_in(uint32_t start, uint32_t limit) {
+    while (start < limit) {
+        uint32_t bits = ~free_map[start / 32] & (0xFFFFFFFFu << (start % 32));
+        if (bits) {
+            uint32_t cluster = (start & ~31u) + __builtin_ctz(bits);
+            return cluster < limit ? cluster : 0;
+        }
+        start = (start & ~31u) + 32;
+    }
+    return 0;
+}
+
+// First free cluster from start, wrapping around (0 if the disk is full)
+static uint32_t find_free(uint32_t start) {
+    uint32_t cluster = find_free_in(start, fs.total_clusters + 2);
+    return cluster ? cluster : find_free_in(2, start);
+}
+
+// Longest run of free clusters worth looking for
+#define ALLOC_RUN_MAX 1024
+
+// Start of the first free run of want clusters (at most ALLOC_RUN_MAX)
+// from next_free, else of the longest run there is (0 if the disk is full)
+static uint32_t find_free_run(uint32_t want) {
+    if (want > ALLOC_RUN_MAX) want = ALLOC_RUN_MAX;
+
+    uint32_t best = 0, best_len = 0;
+    uint32_t ranges[2][2] = {
+        { next_free, fs.total_clusters + 2 },
+        { 2, next_free },
+    };
+    for (int r = 0; r < 2; r++) {
+        uint32_t cluster = find_free_in(ranges[r][0], ranges[r][1]);
+        while (cluster) {
+            uint32_t len = 1;
+            while (len < want && cluster_is_free(cluster + len)) len++;
+            if (len >= want) return cluster;
+            if (len > best_len) {
+                best = cluster;
+                best_len = len;
             }
-            return cluster;
+            cluster = find_free_in(cluster + len, ranges[r][1]);
         }
     }
-    return 0;  // No free clusters
+    return best;
 }
 
-// Free a cluster chain starting at given cluster
+// Allocate a cluster and mark it as end-of-chain. prev is the cluster it
+// will follow (0 for a new chain) and want how many more the caller still
+// needs: the cluster right after prev is taken if free, so files stay in
+// one run, and a new chain starts where want clusters fit in a row.
+static uint32_t fat_alloc_cluster(uint32_t prev, uint32_t want) {
+    if (free_count == 0) return 0;
+
+    uint32_t cluster = 0;
+    if (prev && cluster_is_free(prev + 1)) {
+        cluster = prev + 1;
+    } else if (want > 1) {
+        cluster = find_free_run(want);
+    } else {
+        cluster = find_free(next_free);
+    }
+    if (cluster == 0) return 0;
+
+    // Mark as end of chain
+    if (fat_set_cluster(cluster, FAT32_EOC) < 0) {
+        return 0;
+    }
+    next_free = cluster + 1 < fs.total_clusters + 2 ? cluster + 1 : 2;
+    return cluster;
+}
+
+// FAT entries read per request while building the bitmap
+#define FREE_MAP_CHUNK (64 * 1024)
+
+// Read the whole FAT once and note which clusters are in use
+static int free_map_build(void) {
+    uint32_t end = fs.total_clusters + 2;
+    uint32_t words = (end + 31) / 32;
+    free_map = malloc(words * sizeof(uint32_t));
+    uint32_t *chunk = malloc(FREE_MAP_CHUNK);
+    if (!free_map || !chunk) {
+        free(free_map);
+        free(chunk);
+        free_map = NULL;
+        return -1;
+    }
+
+    // Everything past the last cluster counts as used
+    memset(free_map, 0xFF, words * sizeof(uint32_t));
+    free_count = 0;
+
+    uint32_t per_chunk = FREE_MAP_CHUNK / 4;
+    for (uint32_t first = 0; first < end; first += per_chunk) {
+        uint32_t n = end - first < per_chunk ? end - first : per_chunk;
+        if (read_at(fs.reserved_sectors, first * 4, chunk, n * 4) < 0) {
+            free(chunk);
+            free(free_map);
+            free_map = NULL;
+            return -1;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            uint32_t cluster = first + i;
+            if (cluster >= 2 && (chunk[i] & 0x0FFFFFFF) == FAT32_FREE) {
+                free_map[cluster / 32] &= ~(1u << (cluster % 32));
+                free_count++;
+            }
+        }
+    }
+    free(chunk);
+
+    next_free = find_free(2);
+    if (!next_free) next_free = 2;
+    return 0;
+}
+
+// Check the FSInfo sector against the bitmap; its hint is used if it
+// points at a free cluster. Marked dirty (rewritten by the next call that
+// takes fs_lock) if its count is stale.
+static void fsinfo_load(void) {
+    if (!fsinfo_sector) return;
+    if (read_sector(fsinfo_sector, sector_buf) < 0) {
+        fsinfo_sector = 0;
+        return;
+    }
+
+    uint32_t lead = sector_buf[0] | (sector_buf[1] << 8) |
+                    (sector_buf[2] << 16) | (sector_buf[3] << 24);
+    uint32_t strc = sector_buf[484] | (sector_buf[485] << 8) |
+                    (sector_buf[486] << 16) | (sector_buf[487] << 24);
+    if (lead != FSINFO_LEAD_SIG || strc != FSINFO_STRUCT_SIG) {
+        printf("[FAT32] No valid FSInfo sector\n");
+        fsinfo_sector = 0;
+        return;
+    }
+
+    uint32_t saved_free = sector_buf[488] | (sector_buf[489] << 8) |
+                          (sector_buf[490] << 16) | (sector_buf[491] << 24);
+    uint32_t saved_next = sector_buf[492] | (sector_buf[493] << 8) |
+                          (sector_buf[494] << 16) | (sector_buf[495] << 24);
+    if (cluster_is_free(saved_next)) next_free = saved_next;
+
+    printf("[FAT32] Free clusters: %u (FSInfo says %u)\n", free_count, saved_free);
+    if (saved_free != free_count) fsinfo_dirty = 1;
+}
+
+// Write the free count and next-free hint back to FSInfo
+static void fsinfo_store(void) {
+    fsinfo_dirty = 0;
+    if (!fsinfo_sector) return;
+
+    uint32_t info[2] = { free_count, next_free };
+    write_at(fsinfo_sector, 488, info, sizeof(info));
+}
+
+// Free a cluster chain starting at given cluster. Files rewritten whole or
+// deleted drop their chain, so this is also where a cached program image
+// or cached pages of the old contents stop being valid (in-place writes
+// invalidate them themselves).
 static int fat_free_chain(uint32_t cluster) {
+    imgcache_invalidate(cluster);
+    pagecache_invalidate(cluster);
+    dcache_forget_dir(cluster);
+    chain_generation++;
     while (cluster >= 2 && cluster < FAT32_EOC) {
         uint32_t next = fat_next_cluster(cluster);
         if (fat_set_cluster(cluster, FAT32_FREE) < 0) {
@@ -306,6 +477,59 @@ static int read_cluster(uint32_t cluster, void *buf) {
     return read_sectors(sector, fs.sectors_per_cluster, buf);
 }
 
+// Read size bytes from offset into the chain starting at cluster. Each run
+// of consecutive clusters is one request, straight into buf.
+// Returns bytes read (short at the end of the chain), or -1 on error.
+static int read_chain(uint32_t cluster, size_t offset, void *buf, size_t size) {
+    uint8_t *dst = (uint8_t *)buf;
+    size_t bytes_read = 0;
+
+    // Skip clusters until we reach the offset
+    while (cluster >= 2 && cluster < FAT32_EOC && offset >= cluster_buf_size) {
+        offset -= cluster_buf_size;
+        cluster = fat_next_cluster(cluster);
+    }
+
+    while (cluster >= 2 && cluster < FAT32_EOC && bytes_read < size) {
+        uint32_t start = cluster;
+        size_t run = cluster_buf_size - offset;
+        uint32_t next = fat_next_cluster(cluster);
+        while (run < size - bytes_read && next == cluster + 1) {
+            cluster = next;
+            run += cluster_buf_size;
+            next = fat_next_cluster(cluster);
+        }
+        if (run > size - bytes_read) run = size - bytes_read;
+
+        if (read_at(cluster_to_sector(start), offset, dst + bytes_read, run) < 0) {
+            return -1;
+        }
+        bytes_read += run;
+        offset = 0;
+        cluster = next;
+    }
+
+    return (int)bytes_read;
+}
+
+// Write len bytes over count consecutive clusters starting at cluster, in
+// one request, and zero the rest of the last one
+static int write_run(uint32_t cluster, uint32_t count, const void *buf, size_t len) {
+    uint32_t sector = cluster_to_sector(cluster);
+    if (write_at(sector, 0, buf, len) < 0) {
+        return -1;
+    }
+
+    size_t total = (size_t)count * cluster_buf_size;
+    if (len < total) {
+        memset(cluster_buf, 0, cluster_buf_size);
+        if (write_at(sector, len, cluster_buf, total - len) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 // Convert 8.3 name to normal string
 static void fat_name_to_str(const char *fat_name, char *out) {
     int i, j = 0;
@@ -347,8 +571,13 @@ static int name_match(const char *name1, const char *name2) {
 }
 
 int fat32_init(void) {
+    FS_LOCKED();
     printf("[FAT32] Initializing...\n");
 
+    if (bcache_init() < 0) {
+        return -1;
+    }
+
     // Find FAT32 partition (handles MBR parsing)
     partition_offset = find_fat32_partition();
     printf("[FAT32] Partition offset: %u sectors\n", partition_offset);
@@ -410,6 +639,7 @@ int fat32_init(void) {
                             (sector_buf[46] << 16) | (sector_buf[47] << 24);
     uint32_t total_sectors_32 = sector_buf[32] | (sector_buf[33] << 8) |
                                 (sector_buf[34] << 16) | (sector_buf[35] << 24);
+    uint16_t fsinfo = sector_buf[48] | (sector_buf[49] << 8);
     printf("[FAT32] fat_size_32=%d root_cluster=%d total_sectors=%d\n",
            fat_size_32, root_cluster, total_sectors_32);
 
@@ -431,6 +661,7 @@ int fat32_init(void) {
     fs.num_fats = num_fats;
     fs.fat_size = fat_size_32;
     fs.root_cluster = root_cluster;
+    fsinfo_sector = (fsinfo != 0 && fsinfo != 0xFFFF && fsinfo < reserved_sectors) ? fsinfo : 0;
 
     // Calculate data region start
     fs.data_start = fs.reserved_sectors + (fs.num_fats * fs.fat_size);
@@ -454,6 +685,12 @@ int fat32_init(void) {
         return -1;
     }
 
+    if (free_map_build() < 0) {
+        printf("[FAT32] Failed to build free-cluster bitmap\n");
+        return -1;
+    }
+    fsinfo_load();
+
     fs_initialized = 1;
     printf("[FAT32] Filesystem ready!\n");
     return 0;
@@ -469,10 +706,23 @@ static uint32_t read32(uint8_t *p) {
     return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
 }
 
-// Find a directory entry by path component in a directory cluster chain
-// Returns the directory entry or NULL if not found
-static fat32_dirent_t *find_entry_in_dir(uint32_t dir_cluster, const char *name,
-                                          uint32_t *out_cluster, uint32_t *out_offset) {
+// Copy the characters of one LFN entry (sequence number seq) into place
+// in lfn_name. They're UTF-16LE; we just take the low byte.
+static void lfn_chars(const uint8_t *e, int seq, char *lfn_name) {
+    static const uint8_t offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+    int base = (seq - 1) * 13;
+    for (int j = 0; j < 13; j++) {
+        uint16_t c = e[offsets[j]] | (e[offsets[j] + 1] << 8);
+        if (c == 0 || c == 0xFFFF) break;
+        if (base + j < 255) lfn_name[base + j] = (char)c;
+    }
+}
+
+// Search a directory cluster chain for a name. Returns the directory
+// entry, or NULL with *missing set if the directory doesn't have it (and
+// clear on read errors).
+static fat32_dirent_t *scan_dir(uint32_t dir_cluster, const char *name,
+                                uint32_t *out_cluster, uint32_t *out_offset, int *missing) {
     static fat32_dirent_t found_entry;
     char entry_name[256];
     char lfn_name[256];
@@ -502,6 +752,7 @@ static fat32_dirent_t *find_entry_in_dir(uint32_t dir_cluster, const char *name,
 
             // End of directory
             if (first_byte == 0x00) {
+                *missing = 1;
                 return NULL;
             }
 
@@ -522,26 +773,7 @@ static fat32_dirent_t *find_entry_in_dir(uint32_t dir_cluster, const char *name,
                     memset(lfn_name, 0, sizeof(lfn_name));
                 }
 
-                // Extract characters from LFN entry (stored as UTF-16LE, we just take low byte)
-                int base = (seq - 1) * 13;
-                // name1: bytes 1-10 (5 UTF-16 chars)
-                for (int j = 0; j < 5; j++) {
-                    uint16_t c = e[1 + j*2] | (e[2 + j*2] << 8);
-                    if (c == 0 || c == 0xFFFF) break;
-                    if (base + j < 255) lfn_name[base + j] = (char)c;
-                }
-                // name2: bytes 14-25 (6 UTF-16 chars)
-                for (int j = 0; j < 6; j++) {
-                    uint16_t c = e[14 + j*2] | (e[15 + j*2] << 8);
-                    if (c == 0 || c == 0xFFFF) break;
-                    if (base + 5 + j < 255) lfn_name[base + 5 + j] = (char)c;
-                }
-                // name3: bytes 28-31 (2 UTF-16 chars)
-                for (int j = 0; j < 2; j++) {
-                    uint16_t c = e[28 + j*2] | (e[29 + j*2] << 8);
-                    if (c == 0 || c == 0xFFFF) break;
-                    if (base + 11 + j < 255) lfn_name[base + 11 + j] = (char)c;
-                }
+                lfn_chars(e, seq, lfn_name);
                 continue;
             }
 
@@ -584,9 +816,36 @@ static fat32_dirent_t *find_entry_in_dir(uint32_t dir_cluster, const char *name,
         cluster = fat_next_cluster(cluster);
     }
 
+    *missing = 1;
     return NULL;
 }
 
+// Find a directory entry by path component in a directory cluster chain,
+// asking the dentry cache first. Returns the directory entry or NULL if
+// not found.
+static fat32_dirent_t *find_entry_in_dir(uint32_t dir_cluster, const char *name,
+                                          uint32_t *out_cluster, uint32_t *out_offset) {
+    static fat32_dirent_t found_entry;
+    uint32_t entry_cluster, entry_index;
+
+    int cached = dcache_lookup(dir_cluster, name, &found_entry, &entry_cluster, &entry_index);
+    if (cached == 0) return NULL;
+    if (cached < 0) {
+        int missing = 0;
+        fat32_dirent_t *entry = scan_dir(dir_cluster, name, &entry_cluster, &entry_index, &missing);
+        if (!entry) {
+            if (missing) dcache_insert(dir_cluster, name, NULL, 0, 0);
+            return NULL;
+        }
+        found_entry = *entry;
+        dcache_insert(dir_cluster, name, &found_entry, entry_cluster, entry_index);
+    }
+
+    if (out_cluster) *out_cluster = entry_cluster;
+    if (out_offset) *out_offset = entry_index;
+    return &found_entry;
+}
+
 // Resolve a path to a directory entry
 // Returns the entry or NULL if not found
 static fat32_dirent_t *resolve_path(const char *path, uint32_t *out_cluster) {
@@ -647,6 +906,7 @@ static fat32_dirent_t *resolve_path(const char *path, uint32_t *out_cluster) {
 }
 
 int fat32_read_file(const char *path, void *buf, size_t size) {
+    FS_LOCKED();
     if (!fs_initialized) return -1;
 
     uint32_t cluster;
@@ -663,27 +923,7 @@ int fat32_read_file(const char *path, void *buf, size_t size) {
     uint32_t file_size = entry->size;
     if (size > file_size) size = file_size;
 
-    // Read cluster chain
-    uint8_t *dst = (uint8_t *)buf;
-    size_t bytes_read = 0;
-
-    while (cluster < FAT32_EOC && bytes_read < size) {
-        if (read_cluster(cluster, cluster_buf) < 0) {
-            return -1;
-        }
-
-        size_t to_copy = cluster_buf_size;
-        if (bytes_read + to_copy > size) {
-            to_copy = size - bytes_read;
-        }
-
-        memcpy(dst + bytes_read, cluster_buf, to_copy);
-        bytes_read += to_copy;
-
-        cluster = fat_next_cluster(cluster);
-    }
-
-    return (int)bytes_read;
+    return read_chain(cluster, 0, buf, size);
 }
 
 /*
@@ -691,6 +931,7 @@ int fat32_read_file(const char *path, void *buf, size_t size) {
  * Returns bytes read, or -1 on error
  */
 int fat32_read_file_offset(const char *path, void *buf, size_t size, size_t offset) {
+    FS_LOCKED();
     if (!fs_initialized) return -1;
 
     uint32_t cluster;
@@ -715,43 +956,11 @@ int fat32_read_file_offset(const char *path, void *buf, size_t size, size_t offs
     }
     if (size == 0) return 0;
 
-    uint8_t *dst = (uint8_t *)buf;
-    size_t bytes_read = 0;
-    size_t file_pos = 0;  // Current position in file
-
-    // Skip clusters until we reach the offset
-    while (cluster < FAT32_EOC && file_pos + cluster_buf_size <= offset) {
-        file_pos += cluster_buf_size;
-        cluster = fat_next_cluster(cluster);
-    }
-
-    // Now read clusters starting from the one containing offset
-    while (cluster < FAT32_EOC && bytes_read < size) {
-        if (read_cluster(cluster, cluster_buf) < 0) {
-            return -1;
-        }
-
-        // Calculate how much of this cluster to use
-        size_t cluster_offset = 0;
-        if (file_pos < offset) {
-            cluster_offset = offset - file_pos;
-        }
-
-        size_t available = cluster_buf_size - cluster_offset;
-        size_t to_copy = size - bytes_read;
-        if (to_copy > available) to_copy = available;
-
-        memcpy(dst + bytes_read, cluster_buf + cluster_offset, to_copy);
-        bytes_read += to_copy;
-        file_pos += cluster_buf_size;
-
-        cluster = fat_next_cluster(cluster);
-    }
-
-    return (int)bytes_read;
+    return read_chain(cluster, offset, buf, size);
 }
 
 int fat32_file_size(const char *path) {
+    FS_LOCKED();
     if (!fs_initialized) return -1;
 
     fat32_dirent_t *entry = resolve_path(path, NULL);
@@ -761,7 +970,18 @@ int fat32_file_size(const char *path) {
     return (int)entry->size;
 }
 
+uint32_t fat32_file_cluster(const char *path) {
+    FS_LOCKED();
+    if (!fs_initialized) return 0;
+
+    fat32_dirent_t *entry = resolve_path(path, NULL);
+    if (!entry || (entry->attr & FAT_ATTR_DIRECTORY)) return 0;
+
+    return ((uint32_t)entry->cluster_hi << 16) | entry->cluster_lo;
+}
+
 int fat32_is_dir(const char *path) {
+    FS_LOCKED();
     if (!fs_initialized) {
         printf("[FAT32] is_dir(%s): not initialized\n", path);
         return -1;
@@ -779,6 +999,7 @@ int fat32_is_dir(const char *path) {
 }
 
 int fat32_list_dir(const char *path, fat32_dir_callback callback, void *user_data) {
+    FS_LOCKED();
     if (!fs_initialized || !callback) return -1;
 
     uint32_t dir_cluster;
@@ -827,22 +1048,7 @@ int fat32_list_dir(const char *path, fat32_dir_callback callback, void *user_dat
                     memset(lfn_name, 0, sizeof(lfn_name));
                 }
 
-                int base = (seq - 1) * 13;
-                for (int j = 0; j < 5; j++) {
-                    uint16_t c = e[1 + j*2] | (e[2 + j*2] << 8);
-                    if (c == 0 || c == 0xFFFF) break;
-                    if (base + j < 255) lfn_name[base + j] = (char)c;
-                }
-                for (int j = 0; j < 6; j++) {
-                    uint16_t c = e[14 + j*2] | (e[15 + j*2] << 8);
-                    if (c == 0 || c == 0xFFFF) break;
-                    if (base + 5 + j < 255) lfn_name[base + 5 + j] = (char)c;
-                }
-                for (int j = 0; j < 2; j++) {
-                    uint16_t c = e[28 + j*2] | (e[29 + j*2] << 8);
-                    if (c == 0 || c == 0xFFFF) break;
-                    if (base + 11 + j < 255) lfn_name[base + 11 + j] = (char)c;
-                }
+                lfn_chars(e, seq, lfn_name);
                 continue;
             }
 
@@ -880,6 +1086,128 @@ int fat32_list_dir(const char *path, fat32_dir_callback callback, void *user_dat
     return 0;
 }
 
+// FAT date and time (as in directory entries) to seconds since 1970
+static uint32_t fat_time_to_unix(uint16_t date, uint16_t time) {
+    if (date == 0) return 0;
+
+    int year = 1980 + (date >> 9);
+    int month = (date >> 5) & 0x0F;
+    int day = date & 0x1F;
+    if (month < 1 || month > 12 || day < 1) return 0;
+
+    // Days since 1970-01-01 (civil calendar, years starting in March)
+    int y = year - (month <= 2);
+    int yoe = y % 400;
+    int doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    uint32_t days = (uint32_t)((y / 400) * 146097 + doe - 719468);
+
+    return days * 86400 + (time >> 11) * 3600 + ((time >> 5) & 0x3F) * 60 + (time & 0x1F) * 2;
+}
+
+fat32_dir_t *fat32_opendir(const char *path) {
+    FS_LOCKED();
+    if (!fs_initialized) return NULL;
+
+    uint32_t dir_cluster;
+    fat32_dirent_t *entry = resolve_path(path, &dir_cluster);
+    if (!entry || !(entry->attr & FAT_ATTR_DIRECTORY)) return NULL;
+
+    fat32_dir_t *dir = malloc(sizeof(fat32_dir_t));
+    if (!dir) return NULL;
+    dir->first_cluster = dir_cluster;
+    dir->cluster = dir_cluster;
+    dir->cluster_index = 0;
+    dir->entry = 0;
+    dir->chain_generation = chain_generation;
+    return dir;
+}
+
+int fat32_readdir(fat32_dir_t *dir, fat32_dir_entry_t *ents, int max) {
+    FS_LOCKED();
+    if (!fs_initialized || !dir) return -1;
+
+    // Clusters were freed since the cursor was placed - it may have been
+    // one of them, so find it again by position
+    if (dir->chain_generation != chain_generation) {
+        uint32_t cluster = dir->first_cluster;
+        for (uint32_t i = 0; i < dir->cluster_index && cluster >= 2 && cluster < FAT32_EOC; i++) {
+            cluster = fat_next_cluster(cluster);
+        }
+        dir->cluster = (cluster >= 2) ? cluster : FAT32_EOC;
+        dir->chain_generation = chain_generation;
+    }
+
+    char lfn_name[256];
+    int has_lfn = 0;
+    int count = 0;
+    uint32_t entries_per_cluster = cluster_buf_size / 32;
+
+    // A batch only ends after a short entry, so no LFN run is split
+    // between calls
+    while (count < max && dir->cluster < FAT32_EOC) {
+        if (read_cluster(dir->cluster, cluster_buf) < 0) {
+            return count ? count : -1;
+        }
+
+        while (count < max && dir->entry < entries_per_cluster) {
+            uint8_t *e = cluster_buf + (dir->entry++ * 32);
+            uint8_t first_byte = e[0];
+            uint8_t attr = e[11];
+
+            // End of directory
+            if (first_byte == 0x00) {
+                dir->cluster = FAT32_EOC;
+                return count;
+            }
+
+            // Deleted entry
+            if (first_byte == 0xE5) {
+                has_lfn = 0;
+                continue;
+            }
+
+            // Long filename entry
+            if (attr == FAT_ATTR_LFN) {
+                if (e[0] & 0x40) {
+                    has_lfn = 1;
+                    memset(lfn_name, 0, sizeof(lfn_name));
+                }
+                lfn_chars(e, e[0] & 0x1F, lfn_name);
+                continue;
+            }
+
+            // Skip volume label and . and ..
+            if ((attr & FAT_ATTR_VOLUME_ID) || first_byte == '.') {
+                has_lfn = 0;
+                continue;
+            }
+
+            fat32_dir_entry_t *out = &ents[count++];
+            if (has_lfn) {
+                strcpy(out->name, lfn_name);
+            } else {
+                fat_name_to_str((char *)e, out->name);
+            }
+            out->attr = attr;
+            out->size = read32(e + 28);
+            out->mtime = fat_time_to_unix(read16(e + 24), read16(e + 22));
+            has_lfn = 0;
+        }
+
+        if (dir->entry >= entries_per_cluster) {
+            dir->cluster = fat_next_cluster(dir->cluster);
+            dir->cluster_index++;
+            dir->entry = 0;
+        }
+    }
+    return count;
+}
+
+void fat32_closedir(fat32_dir_t *dir) {
+    free(dir);
+}
+
 fat32_fs_t *fat32_get_fs_info(void) {
     return fs_initialized ? &fs : NULL;
 }
@@ -1221,7 +1549,7 @@ static int find_free_dir_entries(uint32_t dir_cluster, int count,
 need_more:
     // We need to allocate new cluster(s) to complete the run
     while (run_len < count) {
-        uint32_t new_cluster = fat_alloc_cluster();
+        uint32_t new_cluster = fat_alloc_cluster(last_cluster, 1);
         if (new_cluster == 0) return -1;
 
         // Link to chain
@@ -1331,6 +1659,9 @@ static uint32_t create_dir_entry(uint32_t parent_cluster, const char *name, uint
     int name_len = strlen(name);
     int use_lfn = needs_lfn(name);
 
+    // It was missing until now
+    dcache_forget(parent_cluster, name);
+
     // Calculate how many entries we need
     int lfn_entries = 0;
     if (use_lfn) {
@@ -1434,12 +1765,14 @@ static int update_dir_entry(uint32_t dir_cluster, const char *name, uint32_t fir
     write16(e + 20, (first_cluster >> 16) & 0xFFFF);  // cluster_hi
     write16(e + 26, first_cluster & 0xFFFF);          // cluster_lo
     write32(e + 28, size);
+    dcache_forget(dir_cluster, name);
 
     // Write back
     return write_cluster(entry_cluster, cluster_buf);
 }
 
 int fat32_create_file(const char *path) {
+    FS_LOCKED();
     if (!fs_initialized) return -1;
 
     char filename[256];
@@ -1464,6 +1797,7 @@ int fat32_create_file(const char *path) {
 }
 
 int fat32_mkdir(const char *path) {
+    FS_LOCKED();
     if (!fs_initialized) return -1;
 
     char dirname[256];
@@ -1480,7 +1814,7 @@ int fat32_mkdir(const char *path) {
     }
 
     // Allocate cluster for directory contents
-    uint32_t dir_cluster = fat_alloc_cluster();
+    uint32_t dir_cluster = fat_alloc_cluster(0, 1);
     if (dir_cluster == 0) {
         return -1;
     }
@@ -1529,6 +1863,7 @@ int fat32_mkdir(const char *path) {
 }
 
 int fat32_write_file(const char *path, const void *buf, size_t size) {
+    FS_LOCKED();
     if (!fs_initialized) return -1;
 
     char filename[256];
@@ -1560,14 +1895,18 @@ int fat32_write_file(const char *path, const void *buf, size_t size) {
     uint32_t clusters_needed = (size + cluster_size - 1) / cluster_size;
     if (clusters_needed == 0 && size > 0) clusters_needed = 1;
 
-    // Allocate cluster chain for new data
+    // Allocate cluster chain for new data. The allocator looks for a free
+    // run of the whole size, so the chain is usually one run - written with
+    // one request per run, straight from buf.
     uint32_t first_cluster = 0;
     uint32_t prev_cluster = 0;
+    uint32_t run_start = 0;
+    uint32_t run_count = 0;
     const uint8_t *src = (const uint8_t *)buf;
     size_t remaining = size;
 
     for (uint32_t i = 0; i < clusters_needed; i++) {
-        uint32_t cluster = fat_alloc_cluster();
+        uint32_t cluster = fat_alloc_cluster(prev_cluster, clusters_needed - i);
         if (cluster == 0) {
             // Out of space - free what we allocated
             if (first_cluster) fat_free_chain(first_cluster);
@@ -1583,21 +1922,27 @@ int fat32_write_file(const char *path, const void *buf, size_t size) {
             fat_set_cluster(prev_cluster, cluster);
         }
 
-        // Write data to this cluster
-        size_t to_write = remaining > cluster_size ? cluster_size : remaining;
-        memset(cluster_buf, 0, cluster_size);
-        memcpy(cluster_buf, src, to_write);
-
-        if (write_cluster(cluster, cluster_buf) < 0) {
-            fat_free_chain(first_cluster);
-            return -1;
+        // Not next to the run so far - write that out first
+        if (run_count && cluster != run_start + run_count) {
+            size_t len = (size_t)run_count * cluster_size;
+            if (write_run(run_start, run_count, src, len) < 0) {
+                fat_free_chain(first_cluster);
+                return -1;
+            }
+            src += len;
+            remaining -= len;
+            run_count = 0;
         }
-
-        src += to_write;
-        remaining -= to_write;
+        if (run_count == 0) run_start = cluster;
+        run_count++;
         prev_cluster = cluster;
     }
 
+    if (run_count && write_run(run_start, run_count, src, remaining) < 0) {
+        fat_free_chain(first_cluster);
+        return -1;
+    }
+
     // Update directory entry with new cluster and size
     if (update_dir_entry(parent_cluster, filename, first_cluster, size) < 0) {
         if (first_cluster) fat_free_chain(first_cluster);
@@ -1612,10 +1957,389 @@ int fat32_write_file(const char *path, const void *buf, size_t size) {
     return (int)size;
 }
 
+// Find the file's directory entry and load what the handle keeps from it
+static int file_locate(fat32_file_t *file) {
+    char filename[256];
+    uint32_t parent_cluster;
+    if (parse_parent_path(file->path, &parent_cluster, filename) < 0) {
+        return -1;
+    }
+
+    uint32_t entry_cluster, entry_index;
+    fat32_dirent_t *entry = find_entry_in_dir(parent_cluster, filename, &entry_cluster, &entry_index);
+    if (!entry || (entry->attr & FAT_ATTR_DIRECTORY)) return -1;
+
+    file->entry_cluster = entry_cluster;
+    file->entry_index = entry_index;
+    file->first_cluster = ((uint32_t)entry->cluster_hi << 16) | entry->cluster_lo;
+    file->size = entry->size;
+    file->generation = fs_generation;
+    file->chain_generation = chain_generation;
+    return 0;
+}
+
+fat32_file_t *fat32_open(const char *path) {
+    FS_LOCKED();
+    if (!fs_initialized) return NULL;
+
+    fat32_file_t *file = malloc(sizeof(fat32_file_t));
+    if (!file) return NULL;
+    memset(file, 0, sizeof(fat32_file_t));
+
+    strncpy(file->path, path, sizeof(file->path) - 1);
+    if (file_locate(file) < 0) {
+        free(file);
+        return NULL;
+    }
+    return file;
+}
+
+void fat32_close(fat32_file_t *file) {
+    if (!file) return;
+    free(file->extents);
+    free(file);
+}
+
+// Forget the cursor and extents (the chain they describe may be gone)
+static void file_forget_chain(fat32_file_t *file) {
+    file->cur_index = 0;
+    file->cur_cluster = 0;
+    free(file->extents);
+    file->extents = NULL;
+    file->extent_count = 0;
+}
+
+// Something was written since we last looked - make sure it wasn't this
+// file. Chains only ever lose clusters by being freed, so if nothing was
+// freed and the file is where and as long as it was, the cursor and
+// extents still hold.
+static int file_revalidate(fat32_file_t *file) {
+    if (file->generation == fs_generation) return 0;
+
+    uint32_t first = file->first_cluster;
+    uint32_t size = file->size;
+    uint32_t chain = file->chain_generation;
+    if (file_locate(file) < 0) return -1;
+
+    if (file->first_cluster != first || file->size != size || chain != chain_generation) {
+        file_forget_chain(file);
+    }
+    return 0;
+}
+
+// Walk the whole chain once and record it as runs of consecutive clusters
+static int file_map_extents(fat32_file_t *file) {
+    uint32_t capacity = 8;
+    fat32_extent_t *extents = malloc(capacity * sizeof(fat32_extent_t));
+    if (!extents) return -1;
+
+    uint32_t count = 0;
+    uint32_t index = 0;
+    uint32_t cluster = file->first_cluster;
+    while (cluster >= 2 && cluster < FAT32_EOC) {
+        fat32_extent_t *last = count ? &extents[count - 1] : NULL;
+        if (last && last->cluster + last->count == cluster) {
+            last->count++;
+        } else {
+            if (count == capacity) {
+                fat32_extent_t *bigger = realloc(extents, capacity * 2 * sizeof(fat32_extent_t));
+                if (!bigger) {
+                    free(extents);
+                    return -1;
+                }
+                extents = bigger;
+                capacity *= 2;
+            }
+            extents[count].index = index;
+            extents[count].cluster = cluster;
+            extents[count].count = 1;
+            count++;
+        }
+        index++;
+        cluster = fat_next_cluster(cluster);
+    }
+
+    file->extents = extents;
+    file->extent_count = count;
+    return 0;
+}
+
+// Cluster number of the index'th cluster of an open file (FAT32_EOC past
+// the end of the chain)
+static uint32_t file_cluster_at(fat32_file_t *file, uint32_t index) {
+    if (!file->extents && file->cur_cluster && index < file->cur_index) {
+        file_map_extents(file);
+    }
+
+    if (file->extents) {
+        uint32_t lo = 0, hi = file->extent_count;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            fat32_extent_t *e = &file->extents[mid];
+            if (index < e->index) hi = mid;
+            else if (index >= e->index + e->count) lo = mid + 1;
+            else return e->cluster + (index - e->index);
+        }
+        return FAT32_EOC;
+    }
+
+    // Carry on from the cursor if we can, else from the start
+    uint32_t i = 0;
+    uint32_t cluster = file->first_cluster;
+    if (file->cur_cluster && index >= file->cur_index) {
+        i = file->cur_index;
+        cluster = file->cur_cluster;
+    }
+    while (i < index && cluster >= 2 && cluster < FAT32_EOC) {
+        cluster = fat_next_cluster(cluster);
+        i++;
+    }
+    if (cluster < 2 || cluster >= FAT32_EOC) return FAT32_EOC;
+
+    file->cur_index = index;
+    file->cur_cluster = cluster;
+    return cluster;
+}
+
+int fat32_read_at(fat32_file_t *file, void *buf, size_t size, size_t offset) {
+    FS_LOCKED();
+    if (!fs_initialized || !file) return -1;
+    if (file_revalidate(file) < 0) return -1;
+
+    if (offset >= file->size) return 0;
+    if (offset + size > file->size) {
+        size = file->size - offset;
+    }
+
+    uint8_t *dst = (uint8_t *)buf;
+    size_t bytes_read = 0;
+    uint32_t index = offset / cluster_buf_size;
+    size_t cluster_offset = offset % cluster_buf_size;
+
+    while (bytes_read < size) {
+        uint32_t cluster = file_cluster_at(file, index);
+        if (cluster >= FAT32_EOC) break;
+
+        // One request for the whole run of consecutive clusters
+        size_t run = cluster_buf_size - cluster_offset;
+        uint32_t count = 1;
+        while (run < size - bytes_read && file_cluster_at(file, index + count) == cluster + count) {
+            run += cluster_buf_size;
+            count++;
+        }
+        if (run > size - bytes_read) run = size - bytes_read;
+
+        if (read_at(cluster_to_sector(cluster), cluster_offset, dst + bytes_read, run) < 0) {
+            return -1;
+        }
+
+        bytes_read += run;
+        cluster_offset = 0;
+        index += count;
+    }
+
+    return (int)bytes_read;
+}
+
+// Rewrite the handle's first cluster and size into its directory entry
+static int file_store_entry(fat32_file_t *file) {
+    // Bytes 20-31 of the entry: cluster_hi, modify time/date, cluster_lo, size
+    uint8_t e[12];
+    uint32_t sector = cluster_to_sector(file->entry_cluster);
+    uint32_t offset = file->entry_index * 32 + 20;
+    if (read_at(sector, offset, e, sizeof(e)) < 0) {
+        return -1;
+    }
+
+    write16(e, (file->first_cluster >> 16) & 0xFFFF);
+    write16(e + 6, file->first_cluster & 0xFFFF);
+    write32(e + 8, file->size);
+    dcache_forget_entry(file->entry_cluster, file->entry_index);
+    return write_at(sector, offset, e, sizeof(e));
+}
+
+// Grow the chain to count clusters
+static int file_extend_chain(fat32_file_t *file, uint32_t count) {
+    uint32_t have = (file->size + cluster_buf_size - 1) / cluster_buf_size;
+    if (count <= have) return 0;
+
+    uint32_t last = have ? file_cluster_at(file, have - 1) : 0;
+    if (have && last >= FAT32_EOC) return -1;
+
+    // The map no longer covers the whole chain; the cursor still holds
+    free(file->extents);
+    file->extents = NULL;
+    file->extent_count = 0;
+
+    for (uint32_t i = have; i < count; i++) {
+        uint32_t cluster = fat_alloc_cluster(last, count - i);
+        if (cluster == 0) return -1;
+
+        if (last) {
+            fat_set_cluster(last, cluster);
+        } else {
+            file->first_cluster = cluster;
+        }
+        last = cluster;
+    }
+    return 0;
+}
+
+static int file_write(fat32_file_t *file, const void *buf, size_t size, size_t offset);
+
+// Write len zero bytes at offset (cluster_buf is the zero source - nothing
+// under file_write uses it)
+static int file_write_zeros(fat32_file_t *file, size_t offset, size_t len) {
+    memset(cluster_buf, 0, cluster_buf_size);
+    while (len > 0) {
+        size_t n = len > cluster_buf_size ? cluster_buf_size : len;
+        if (file_write(file, cluster_buf, n, offset) < 0) {
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write into an open file in place, growing it as needed (fs_lock held,
+// handle revalidated)
+static int file_write(fat32_file_t *file, const void *buf, size_t size, size_t offset) {
+    if (size == 0) return 0;
+    if ((uint64_t)offset + size > 0xFFFFFFFFULL) return -1;  // FAT32 file size limit
+
+    // Writing past the end leaves a hole - it reads as zeros
+    if (offset > file->size && file_write_zeros(file, file->size, offset - file->size) < 0) {
+        return -1;
+    }
+
+    uint32_t end = offset + size;
+    uint32_t old_first = file->first_cluster;
+    uint32_t old_size = file->size;
+    uint32_t clusters = (end + cluster_buf_size - 1) / cluster_buf_size;
+    int ret = file_extend_chain(file, clusters);
+
+    // Even a failed extend may have linked clusters on - keep what we have
+    const uint8_t *src = (const uint8_t *)buf;
+    size_t written = 0;
+    uint32_t index = offset / cluster_buf_size;
+    size_t cluster_offset = offset % cluster_buf_size;
+
+    while (ret == 0 && written < size) {
+        uint32_t cluster = file_cluster_at(file, index);
+        if (cluster >= FAT32_EOC) {
+            ret = -1;
+            break;
+        }
+
+        // One request for the whole run of consecutive clusters
+        size_t run = cluster_buf_size - cluster_offset;
+        uint32_t count = 1;
+        while (run < size - written && file_cluster_at(file, index + count) == cluster + count) {
+            run += cluster_buf_size;
+            count++;
+        }
+        if (run > size - written) run = size - written;
+
+        if (write_at(cluster_to_sector(cluster), cluster_offset, src + written, run) < 0) {
+            ret = -1;
+            break;
+        }
+
+        written += run;
+        cluster_offset = 0;
+        index += count;
+    }
+
+    if (offset + written > file->size) file->size = offset + written;
+    if ((file->size != old_size || file->first_cluster != old_first) && file_store_entry(file) < 0) {
+        ret = -1;
+    }
+    file->generation = fs_generation;
+
+    return ret < 0 && written == 0 ? -1 : (int)written;
+}
+
+int fat32_size_of(fat32_file_t *file) {
+    FS_LOCKED();
+    if (!fs_initialized || !file) return -1;
+    if (file_revalidate(file) < 0) return -1;
+    return (int)file->size;
+}
+
+int fat32_write_at(fat32_file_t *file, const void *buf, size_t size, size_t offset) {
+    FS_LOCKED();
+    if (!fs_initialized || !file) return -1;
+    if (file_revalidate(file) < 0) return -1;
+
+    // Programs and file pages are cached by first cluster - this one's
+    // contents are changing
+    if (file->first_cluster) {
+        imgcache_invalidate(file->first_cluster);
+        pagecache_invalidate(file->first_cluster);
+    }
+
+    return file_write(file, buf, size, offset);
+}
+
+int fat32_append(fat32_file_t *file, const void *buf, size_t size) {
+    FS_LOCKED();
+    if (!fs_initialized || !file) return -1;
+    if (file_revalidate(file) < 0) return -1;
+
+    if (file->first_cluster) {
+        imgcache_invalidate(file->first_cluster);
+        pagecache_invalidate(file->first_cluster);
+    }
+
+    return file_write(file, buf, size, file->size);
+}
+
+int fat32_truncate(fat32_file_t *file, size_t size) {
+    FS_LOCKED();
+    if (!fs_initialized || !file) return -1;
+    if (file_revalidate(file) < 0) return -1;
+
+    if (file->first_cluster) {
+        imgcache_invalidate(file->first_cluster);
+        pagecache_invalidate(file->first_cluster);
+    }
+
+    if (size > file->size) {
+        return file_write_zeros(file, file->size, size - file->size);
+    }
+    if (size == file->size) return 0;
+
+    uint32_t keep = (size + cluster_buf_size - 1) / cluster_buf_size;
+    uint32_t tail;
+    if (keep == 0) {
+        tail = file->first_cluster;
+        file->first_cluster = 0;
+    } else {
+        uint32_t last = file_cluster_at(file, keep - 1);
+        if (last >= FAT32_EOC) return -1;
+        tail = fat_next_cluster(last);
+        if (fat_set_cluster(last, FAT32_EOC) < 0) return -1;
+    }
+
+    // Shrink the entry first: a crash in between leaks clusters rather
+    // than leaving the file pointing at free ones
+    file->size = size;
+    int ret = file_store_entry(file);
+
+    file_forget_chain(file);
+    if (tail >= 2 && tail < FAT32_EOC && fat_free_chain(tail) < 0) ret = -1;
+
+    file->generation = fs_generation;
+    file->chain_generation = chain_generation;
+    return ret;
+}
+
 // Delete a directory entry including its LFN entries
 // This finds all LFN entries associated with the 8.3 entry and marks them all as deleted
 static int delete_dir_entry_with_lfn(uint32_t dir_cluster, const char *name) {
     uint32_t cluster = dir_cluster;
+    dcache_forget(dir_cluster, name);
 
     // We need to track LFN entries that might precede the 8.3 entry
     // Store positions of LFN entries in the current "run"
@@ -1670,23 +2394,7 @@ static int delete_dir_entry_with_lfn(uint32_t dir_cluster, const char *name) {
                     lfn_count++;
                 }
 
-                // Extract characters from LFN entry
-                int base = (seq - 1) * 13;
-                for (int j = 0; j < 5; j++) {
-                    uint16_t c = e[1 + j*2] | (e[2 + j*2] << 8);
-                    if (c == 0 || c == 0xFFFF) break;
-                    if (base + j < 255) lfn_name[base + j] = (char)c;
-                }
-                for (int j = 0; j < 6; j++) {
-                    uint16_t c = e[14 + j*2] | (e[15 + j*2] << 8);
-                    if (c == 0 || c == 0xFFFF) break;
-                    if (base + 5 + j < 255) lfn_name[base + 5 + j] = (char)c;
-                }
-                for (int j = 0; j < 2; j++) {
-                    uint16_t c = e[28 + j*2] | (e[29 + j*2] << 8);
-                    if (c == 0 || c == 0xFFFF) break;
-                    if (base + 11 + j < 255) lfn_name[base + 11 + j] = (char)c;
-                }
+                lfn_chars(e, seq, lfn_name);
                 continue;
             }
 
@@ -1747,6 +2455,7 @@ static int delete_dir_entry_with_lfn(uint32_t dir_cluster, const char *name) {
 }
 
 int fat32_delete(const char *path) {
+    FS_LOCKED();
     if (!fs_initialized) return -1;
 
     char filename[256];
@@ -1777,6 +2486,7 @@ int fat32_delete(const char *path) {
 }
 
 int fat32_rename(const char *oldpath, const char *newname) {
+    FS_LOCKED();
     if (!fs_initialized) return -1;
 
     char filename[256];
@@ -1861,6 +2571,7 @@ static int is_dir_empty(uint32_t dir_cluster) {
 }
 
 int fat32_delete_dir(const char *path) {
+    FS_LOCKED();
     if (!fs_initialized) return -1;
 
     char dirname[256];
@@ -1982,6 +2693,7 @@ static int delete_dir_contents(const char *dir_path) {
 }
 
 int fat32_delete_recursive(const char *path) {
+    FS_LOCKED();
     if (!fs_initialized) return -1;
 
     char name[256];
@@ -2017,24 +2729,18 @@ int fat32_delete_recursive(const char *path) {
 
 // Get total disk space in KB
 int fat32_get_total_kb(void) {
+    FS_LOCKED();
     if (!fs_initialized) return 0;
     // total_clusters * sectors_per_cluster * bytes_per_sector / 1024
     uint64_t total_bytes = (uint64_t)fs.total_clusters * fs.sectors_per_cluster * fs.bytes_per_sector;
     return (int)(total_bytes / 1024);
 }
 
-// Get free disk space in KB (counts free clusters in FAT)
+// Get free disk space in KB (kept by the free-cluster bitmap)
 int fat32_get_free_kb(void) {
+    FS_LOCKED();
     if (!fs_initialized) return 0;
 
-    uint32_t free_clusters = 0;
-    for (uint32_t cluster = 2; cluster < fs.total_clusters + 2; cluster++) {
-        uint32_t entry = fat_next_cluster(cluster);
-        if (entry == FAT32_FREE) {
-            free_clusters++;
-        }
-    }
-
-    uint64_t free_bytes = (uint64_t)free_clusters * fs.sectors_per_cluster * fs.bytes_per_sector;
+    uint64_t free_bytes = (uint64_t)free_count * fs.sectors_per_cluster * fs.bytes_per_sector;
     return (int)(free_bytes / 1024);
 }
@@ -64,6 +64,50 @@ typedef struct {
     uint32_t total_clusters;
 } fat32_fs_t;
 
+// Run of consecutive clusters in a file's chain
+typedef struct {
+    uint32_t index;             // Position of the first one in the file (in clusters)
+    uint32_t cluster;           // Its cluster number
+    uint32_t count;
+} fat32_extent_t;
+
+// Open file. Remembers where the data is, so reads don't resolve the path
+// again, and where the last read ended, so sequential reads pick the chain
+// up from there instead of walking it from the start. The first backwards
+// seek maps the whole chain into extents, after which any position is a
+// binary search.
+typedef struct fat32_file {
+    char path[256];
+    uint32_t first_cluster;
+    uint32_t size;
+    uint32_t entry_cluster;     // Where its directory entry is:
+    uint32_t entry_index;       // cluster, and entry number within it
+    uint32_t generation;        // Filesystem generation the above are valid for
+    uint32_t chain_generation;  // Frees seen when the cursor and extents were made
+    uint32_t cur_index;         // Cursor: cluster cur_index of the file
+    uint32_t cur_cluster;       // is cur_cluster (0 = no cursor yet)
+    fat32_extent_t *extents;    // NULL until mapped
+    uint32_t extent_count;
+} fat32_file_t;
+
+// Open directory. Reading it resumes where the last batch stopped, so a
+// listing reads each directory cluster once.
+typedef struct fat32_dir {
+    uint32_t first_cluster;
+    uint32_t cluster;           // Cluster the cursor is in (>= FAT32_EOC at the end)
+    uint32_t cluster_index;     // Its position in the chain
+    uint32_t entry;             // Next entry within it
+    uint32_t chain_generation;  // Frees seen when cluster was found
+} fat32_dir_t;
+
+// One directory entry as fat32_readdir returns it
+typedef struct {
+    char name[256];
+    uint8_t attr;               // FAT_ATTR_*
+    uint32_t size;
+    uint32_t mtime;             // Last write, seconds since 1970 (0 if never set)
+} fat32_dir_entry_t;
+
 // Initialize FAT32 filesystem (reads from virtio-blk)
 int fat32_init(void);
 
@@ -79,10 +123,43 @@ int fat32_read_file(const char *path, void *buf, size_t size);
 // Returns: bytes read, or -1 on error
 int fat32_read_file_offset(const char *path, void *buf, size_t size, size_t offset);
 
+// Open a file for repeated reads and in-place writes
+// Returns: handle (free with fat32_close), or NULL if not found or a directory
+fat32_file_t *fat32_open(const char *path);
+
+// Read from an open file at offset
+// Returns: bytes read, or -1 on error (e.g. the file has been deleted)
+int fat32_read_at(fat32_file_t *file, void *buf, size_t size, size_t offset);
+
+// Current size of an open file
+// Returns: size in bytes, or -1 if it's gone
+int fat32_size_of(fat32_file_t *file);
+
+// Write to an open file at offset, in place. Writing at the end appends
+// (extending the last cluster, then the chain); writing past it leaves a
+// zero-filled gap.
+// Returns: bytes written, or -1 on error
+int fat32_write_at(fat32_file_t *file, const void *buf, size_t size, size_t offset);
+
+// Write at the end of an open file
+// Returns: bytes written, or -1 on error
+int fat32_append(fat32_file_t *file, const void *buf, size_t size);
+
+// Cut an open file to size (freeing the clusters past it), or grow it
+// with zeros
+// Returns: 0 on success, -1 on error
+int fat32_truncate(fat32_file_t *file, size_t size);
+
+void fat32_close(fat32_file_t *file);
+
 // Get file size
 // Returns: file size in bytes, or -1 on error
 int fat32_file_size(const char *path);
 
+// Get a file's first cluster - it changes whenever the file is rewritten
+// Returns: cluster number, or 0 if not found or empty
+uint32_t fat32_file_cluster(const char *path);
+
 // Check if path is a directory
 // Returns: 1 if directory, 0 if file, -1 if not found
 int fat32_is_dir(const char *path);
@@ -94,6 +171,17 @@ int fat32_is_dir(const char *path);
 typedef void (*fat32_dir_callback)(const char *name, int is_dir, uint32_t size, void *user_data);
 int fat32_list_dir(const char *path, fat32_dir_callback callback, void *user_data);
 
+// Open a directory for fat32_readdir
+// Returns: handle (free with fat32_closedir), or NULL if not a directory
+fat32_dir_t *fat32_opendir(const char *path);
+
+// Read up to max entries (skipping . and ..) from where the last call
+// stopped
+// Returns: entries read, 0 at the end, -1 on error
+int fat32_readdir(fat32_dir_t *dir, fat32_dir_entry_t *ents, int max);
+
+void fat32_closedir(fat32_dir_t *dir);
+
 // Get filesystem info
 fat32_fs_t *fat32_get_fs_info(void);
 
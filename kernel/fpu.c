@@ -0,0 +1,105 @@
+/*
+ * KikiOS Lazy FPU/SIMD Switching
+ *
+ * Invariant: FP access is enabled on a core exactly when the code running
+ * there is its fp_owner (outside of an IRQ handler). A process switched away
+ * from always has its registers saved, since it may resume on another core.
+ */
+
+#include "fpu.h"
+#include "smp.h"
+
+#define CPACR_FPEN  (3UL << 20)
+
+static inline void fpu_enable(void) {
+    uint64_t v;
+    asm volatile("mrs %0, cpacr_el1" : "=r"(v));
+    asm volatile("msr cpacr_el1, %0\n isb" :: "r"(v | CPACR_FPEN) : "memory");
+}
+
+static inline void fpu_disable(void) {
+    uint64_t v;
+    asm volatile("mrs %0, cpacr_el1" : "=r"(v));
+    asm volatile("msr cpacr_el1, %0\n isb" :: "r"(v & ~CPACR_FPEN) : "memory");
+}
+
+// Context whose code runs on this core when no IRQ handler is active
+static inline cpu_context_t *running_context(cpu_t *cpu) {
+    return cpu->current ? &cpu->current->context : cpu->kernel_context;
+}
+
+// Write the live registers back to their owner (FP must be enabled)
+static void save_owner(cpu_t *cpu) {
+    if (cpu->fp_owner) {
+        fpu_save_state(cpu->fp_owner);
+        cpu->fp_owner = NULL;
+    }
+}
+
+void fpu_init_cpu(void) {
+    // Boot code enabled FP and C code has been using it since
+    cpu_t *cpu = this_cpu();
+    cpu->fp_owner = cpu->kernel_context;
+    cpu->in_irq = 0;
+    fpu_enable();
+}
+
+void fpu_trap(void) {
+    cpu_t *cpu = this_cpu();
+    fpu_enable();
+    save_owner(cpu);
+    cpu->fp_traps++;
+
+    // An IRQ handler just gets scratch registers - nobody owns them, and
+    // fpu_irq_exit decides what the interrupted code resumes with
+    if (cpu->in_irq) return;
+
+    cpu_context_t *ctx = running_context(cpu);
+    fpu_load_state(ctx);
+    cpu->fp_owner = ctx;
+}
+
+void fpu_irq_enter(void) {
+    cpu_t *cpu = this_cpu();
+    cpu->in_irq = 1;
+    fpu_disable();
+}
+
+void fpu_irq_exit(void) {
+    cpu_t *cpu = this_cpu();
+    cpu->in_irq = 0;
+    fpu_switch(running_context(cpu));
+}
+
+void fpu_switch(cpu_context_t *next) {
+    cpu_t *cpu = this_cpu();
+    if (cpu->fp_owner && cpu->fp_owner != next) {
+        fpu_enable();
+        save_owner(cpu);
+    }
+
+    if (cpu->fp_owner == next) {
+        fpu_enable();
+    } else {
+        fpu_disable();
+    }
+}
+
+void fpu_save(cpu_context_t *ctx) {
+    cpu_t *cpu = this_cpu();
+    if (cpu->fp_owner != ctx) return;
+    fpu_enable();
+    save_owner(cpu);
+    fpu_disable();
+}
+
+void fpu_release(cpu_context_t *ctx) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif\n msr daifset, #2" : "=r"(flags) :: "memory");
+    cpu_t *cpu = this_cpu();
+    if (cpu->fp_owner == ctx) {
+        cpu->fp_owner = NULL;
+        fpu_disable();
+    }
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
@@ -0,0 +1,47 @@
+/*
+ * KikiOS Lazy FPU/SIMD Switching
+ *
+ * The 32 Q registers belong to one context per core at a time (a process,
+ * or the core's kernel thread) - its fp_owner. Switching to anything else
+ * turns FP access off in CPACR_EL1, and the new context only gets its
+ * registers back if it actually touches them: the first FP instruction
+ * traps, and fpu_trap loads them. Programs that never use FP never pay for
+ * the 512-byte save/restore.
+ *
+ * fpu.c is built with -mgeneral-regs-only: it runs while somebody else's
+ * registers are still live.
+ */
+
+#ifndef FPU_H
+#define FPU_H
+
+#include "process.h"
+
+// Boot: this core's kernel thread owns the (enabled) FP registers
+void fpu_init_cpu(void);
+
+// Trap handler for EC 0x07 (vectors.S), IRQs masked
+void fpu_trap(void);
+
+// Around handle_irq (vectors.S): IRQ code that uses FP gets scratch
+// registers, and the owner's state is saved first
+void fpu_irq_enter(void);
+void fpu_irq_exit(void);
+
+// Before switching this core to next (IRQs masked, just before
+// context_switch): save the owner if it is something else
+void fpu_switch(cpu_context_t *next);
+
+// ctx is being switched away from in an IRQ and may resume on another core
+// as soon as sched_lock drops: save its live registers now, not in
+// fpu_irq_exit (sched_lock held, IRQs masked)
+void fpu_save(cpu_context_t *ctx);
+
+// ctx is going away (process exit/kill) - forget its live registers
+void fpu_release(cpu_context_t *ctx);
+
+// Register file save/restore (context.S)
+void fpu_save_state(cpu_context_t *ctx);
+void fpu_load_state(cpu_context_t *ctx);
+
+#endif
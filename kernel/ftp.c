@@ -12,6 +12,7 @@
 #include "printf.h"
 #include "string.h"
 #include "memory.h"
+#include "irq.h"
 #include <stddef.h>
 #include <stdarg.h>
 
@@ -38,6 +39,11 @@ static char *strncpy_safe(char *dest, const char *src, size_t n) {
 #define FTP_STATE_WAIT_PASS 2
 #define FTP_STATE_LOGGED_IN 3
 
+// Data transfer in progress on a connection
+#define FTP_XFER_NONE       0
+#define FTP_XFER_SEND       1   // LIST/NLST/RETR: to the client
+#define FTP_XFER_RECV       2   // STOR/APPE: from the client
+
 // FTP connection structure
 #define FTP_MAX_CONNECTIONS 4
 typedef struct {
@@ -51,9 +57,23 @@ typedef struct {
     int pasv_mode;              // 1 = PASV mode, 0 = PORT mode
     uint32_t pasv_ip;
     uint16_t pasv_port;
+
+    // Transfer state, advanced a chunk at a time by ftp_poll
+    int xfer;                   // FTP_XFER_*
+    vfs_node_t *xfer_file;      // RETR/STOR: open handle
+    char *xfer_buf;             // LIST: the listing, sent instead of a file
+    uint32_t xfer_offset;       // Bytes moved so far
+    uint32_t xfer_size;         // SEND: bytes to move in all
+    uint64_t xfer_active_us;    // Uptime when it last moved data
 } ftp_connection_t;
 
 static ftp_connection_t ftp_connections[FTP_MAX_CONNECTIONS];
+
+// How long ftp_poll sleeps when nobody has anything to say, how long a
+// transfer may stall before it is abandoned, and how much moves per step
+#define FTP_POLL_MS          500
+#define FTP_DATA_TIMEOUT_MS  30000
+#define FTP_CHUNK            4096
 static int ftp_listening = 0;
 static uint16_t ftp_port = 21;
 static tcp_socket_t ftp_listen_sock = -1;
@@ -133,6 +153,129 @@ static int format_listing(char *buf, const char *name, int is_dir, int size) {
     }
 }
 
+// Open the data connection for a transfer (replies 425 if it can't)
+static int ftp_open_data(ftp_connection_t *conn) {
+    if (conn->pasv_mode) {
+        // Wait for client to connect to pasv_port
+        // For now, use control socket (simplified)
+        conn->data_sock = conn->control_sock;  // Temporary
+        return 0;
+    }
+    
+    // Connect to client
+    conn->data_sock = tcp_connect(conn->client_ip, conn->client_port);
+    if (conn->data_sock < 0) {
+        ftp_send_response(conn->control_sock, 425, "Cannot open data connection");
+        return -1;
+    }
+    return 0;
+}
+
+// Close the data connection (unless it is borrowing the control socket)
+static void ftp_close_data(ftp_connection_t *conn) {
+    if (conn->data_sock >= 0 && conn->data_sock != conn->control_sock) {
+        tcp_close(conn->data_sock);
+    }
+    conn->data_sock = -1;
+}
+
+// Start a transfer on the open data connection. ftp_poll moves it along
+// as the socket becomes ready, so one slow client doesn't hold up the rest.
+static void ftp_xfer_start(ftp_connection_t *conn, int dir, vfs_node_t *f,
+                           char *buf, uint32_t offset, uint32_t size) {
+    conn->xfer = dir;
+    conn->xfer_file = f;
+    conn->xfer_buf = buf;
+    conn->xfer_offset = offset;
+    conn->xfer_size = size;
+    conn->xfer_active_us = timer_get_uptime_us();
+}
+
+// Finish the transfer, if any, and tell the client how it went (code 0:
+// say nothing, the control connection is going away)
+static void ftp_xfer_end(ftp_connection_t *conn, int code, const char *msg) {
+    ftp_close_data(conn);
+    if (conn->xfer_file) {
+        vfs_close_handle(conn->xfer_file);
+        conn->xfer_file = NULL;
+    }
+    if (conn->xfer_buf) {
+        free(conn->xfer_buf);
+        conn->xfer_buf = NULL;
+    }
+    conn->xfer = FTP_XFER_NONE;
+    if (code) ftp_send_response(conn->control_sock, code, msg);
+}
+
+// Drop a connection and anything it was transferring
+static void ftp_close_conn(ftp_connection_t *conn) {
+    ftp_xfer_end(conn, 0, NULL);
+    if (conn->control_sock >= 0) {
+        tcp_close(conn->control_sock);
+        conn->control_sock = -1;
+    }
+    conn->active = 0;
+}
+
+// Move one chunk of conn's transfer. Only called once tcp_poll says the
+// data socket is ready (revents), so it never waits for the client.
+static void ftp_xfer_step(ftp_connection_t *conn, uint16_t revents) {
+    char buf[FTP_CHUNK];
+    
+    if (conn->xfer == FTP_XFER_SEND) {
+        if (conn->xfer_offset < conn->xfer_size) {
+            // A client that hangs up mid-download isn't coming back
+            if (!(revents & TCP_POLLOUT)) {
+                ftp_xfer_end(conn, 426, "Connection closed; transfer aborted");
+                return;
+            }
+            
+            uint32_t n = conn->xfer_size - conn->xfer_offset;
+            if (n > sizeof(buf)) n = sizeof(buf);
+            const char *src = buf;
+            if (conn->xfer_buf) {
+                src = conn->xfer_buf + conn->xfer_offset;
+            } else {
+                int read = vfs_read(conn->xfer_file, buf, n, conn->xfer_offset);
+                if (read <= 0) {
+                    ftp_xfer_end(conn, 451, "Read error");
+                    return;
+                }
+                n = read;
+            }
+            
+            // Queue what fits now; whatever doesn't goes next time
+            int sent = tcp_send_timeout(conn->data_sock, src, n, 0);
+            if (sent < 0) {
+                ftp_xfer_end(conn, 426, "Connection closed; transfer aborted");
+                return;
+            }
+            if (sent > 0) {
+                conn->xfer_offset += sent;
+                conn->xfer_active_us = timer_get_uptime_us();
+            }
+        }
+        if (conn->xfer_offset >= conn->xfer_size) {
+            ftp_xfer_end(conn, 226, "Transfer complete");
+        }
+    } else if (conn->xfer == FTP_XFER_RECV) {
+        int len = tcp_recv(conn->data_sock, buf, sizeof(buf));
+        if (len < 0) {
+            // Client done (closed)
+            ftp_xfer_end(conn, 226, "Transfer complete");
+            return;
+        }
+        if (len > 0) {
+            if (vfs_pwrite(conn->xfer_file, buf, len, conn->xfer_offset) != len) {
+                ftp_xfer_end(conn, 452, "Write error");
+                return;
+            }
+            conn->xfer_offset += len;
+            conn->xfer_active_us = timer_get_uptime_us();
+        }
+    }
+}
+
 // Handle FTP command
 static void handle_ftp_command(ftp_connection_t *conn) {
     char recv_buf[512];
@@ -140,15 +283,7 @@ static void handle_ftp_command(ftp_connection_t *conn) {
     
     if (len <= 0) {
         // Connection closed or error
-        conn->active = 0;
-        if (conn->control_sock >= 0) {
-            tcp_close(conn->control_sock);
-            conn->control_sock = -1;
-        }
-        if (conn->data_sock >= 0) {
-            tcp_close(conn->data_sock);
-            conn->data_sock = -1;
-        }
+        ftp_close_conn(conn);
         return;
     }
     
@@ -308,27 +443,25 @@ static void handle_ftp_command(ftp_connection_t *conn) {
             return;
         }
         
+        // The listing is built up front and sent like a file
+        char *listing = malloc(FTP_CHUNK);
+        if (!listing) {
+            ftp_send_response(conn->control_sock, 451, "Out of memory");
+            return;
+        }
+        
         // Open data connection
-        if (conn->pasv_mode) {
-            // Wait for client to connect to pasv_port
-            // For now, use control socket (simplified)
-            conn->data_sock = conn->control_sock;  // Temporary
-        } else {
-            // Connect to client
-            conn->data_sock = tcp_connect(conn->client_ip, conn->client_port);
-            if (conn->data_sock < 0) {
-                ftp_send_response(conn->control_sock, 425, "Cannot open data connection");
-                return;
-            }
+        if (ftp_open_data(conn) < 0) {
+            free(listing);
+            return;
         }
         
         ftp_send_response(conn->control_sock, 150, "Opening ASCII mode data connection");
         
         // List directory
+        int listing_len = 0;
         vfs_node_t *dir = vfs_lookup(conn->current_dir);
         if (dir && vfs_is_dir(dir)) {
-            char listing[4096];
-            int listing_len = 0;
             char name[64];
             uint8_t type;
             int idx = 0;
@@ -352,22 +485,14 @@ static void handle_ftp_command(ftp_connection_t *conn) {
                     line_len = format_listing(line, name, 1, 4096);
                 }
                 
-                if ((size_t)(listing_len + line_len) < sizeof(listing) - 1) {
+                if (listing_len + line_len < FTP_CHUNK) {
                     memcpy(listing + listing_len, line, line_len);
                     listing_len += line_len;
                 }
             }
-            
-            listing[listing_len] = '\0';
-            tcp_send(conn->data_sock, listing, listing_len);
         }
         
-        if (conn->data_sock != conn->control_sock) {
-            tcp_close(conn->data_sock);
-            conn->data_sock = -1;
-        }
-        
-        ftp_send_response(conn->control_sock, 226, "Transfer complete");
+        ftp_xfer_start(conn, FTP_XFER_SEND, NULL, listing, 0, listing_len);
     }
     else if (strcmp(cmd, "RETR") == 0) {
         // Download file
@@ -383,46 +508,23 @@ static void handle_ftp_command(ftp_connection_t *conn) {
             sprintf(file_path, "%s/%s", conn->current_dir, arg);
         }
         
-        vfs_node_t *f = vfs_lookup(file_path);
+        // A handle, so each chunk carries on from the last instead of
+        // finding its place in the file from the start
+        vfs_node_t *f = vfs_open_handle(file_path);
         if (!f || vfs_is_dir(f)) {
+            vfs_close_handle(f);
             ftp_send_response(conn->control_sock, 550, "File not found");
             return;
         }
         
         // Open data connection
-        if (conn->pasv_mode) {
-            conn->data_sock = conn->control_sock;  // Temporary
-        } else {
-            conn->data_sock = tcp_connect(conn->client_ip, conn->client_port);
-            if (conn->data_sock < 0) {
-                ftp_send_response(conn->control_sock, 425, "Cannot open data connection");
-                return;
-            }
+        if (ftp_open_data(conn) < 0) {
+            vfs_close_handle(f);
+            return;
         }
         
-        int file_size = f->size;
         ftp_send_response(conn->control_sock, 150, "Opening BINARY mode data connection");
-        
-        // Read and send file in chunks
-        char buf[4096];
-        int offset = 0;
-        while (offset < file_size) {
-            int chunk = file_size - offset;
-            if ((size_t)chunk > sizeof(buf)) chunk = (int)sizeof(buf);
-            
-            int read = vfs_read(f, buf, chunk, offset);
-            if (read <= 0) break;
-            
-            tcp_send(conn->data_sock, buf, read);
-            offset += read;
-        }
-        
-        if (conn->data_sock != conn->control_sock) {
-            tcp_close(conn->data_sock);
-            conn->data_sock = -1;
-        }
-        
-        ftp_send_response(conn->control_sock, 226, "Transfer complete");
+        ftp_xfer_start(conn, FTP_XFER_SEND, f, NULL, 0, f->size);
     }
     else if (strcmp(cmd, "STOR") == 0 || strcmp(cmd, "APPE") == 0) {
         // Upload file
@@ -439,45 +541,25 @@ static void handle_ftp_command(ftp_connection_t *conn) {
         }
         
         // Open data connection
-        if (conn->pasv_mode) {
-            conn->data_sock = conn->control_sock;  // Temporary
-        } else {
-            conn->data_sock = tcp_connect(conn->client_ip, conn->client_port);
-            if (conn->data_sock < 0) {
-                ftp_send_response(conn->control_sock, 425, "Cannot open data connection");
-                return;
-            }
+        if (ftp_open_data(conn) < 0) {
+            return;
         }
         
-        vfs_node_t *f = vfs_create(file_path);
-        if (!f) {
+        // STOR replaces the file, APPE adds to its end. Chunks are written
+        // in place through a handle as they arrive.
+        vfs_node_t *f = NULL;
+        if (vfs_lookup(file_path) || vfs_create(file_path)) {
+            f = vfs_open_handle(file_path);
+        }
+        if (!f || vfs_is_dir(f) || (cmd[0] == 'S' && vfs_truncate(f, 0) < 0)) {
+            vfs_close_handle(f);
             ftp_send_response(conn->control_sock, 550, "Cannot create file");
-            if (conn->data_sock != conn->control_sock) {
-                tcp_close(conn->data_sock);
-                conn->data_sock = -1;
-            }
+            ftp_close_data(conn);
             return;
         }
         
         ftp_send_response(conn->control_sock, 150, "Opening BINARY mode data connection");
-        
-        // Receive and write file
-        char buf[4096];
-        int total = 0;
-        while (1) {
-            int len = tcp_recv(conn->data_sock, buf, sizeof(buf));
-            if (len <= 0) break;
-            
-            vfs_write(f, buf, len);
-            total += len;
-        }
-        
-        if (conn->data_sock != conn->control_sock) {
-            tcp_close(conn->data_sock);
-            conn->data_sock = -1;
-        }
-        
-        ftp_send_response(conn->control_sock, 226, "Transfer complete");
+        ftp_xfer_start(conn, FTP_XFER_RECV, f, NULL, f->size, 0);
     }
     else if (strcmp(cmd, "DELE") == 0) {
         if (conn->state != FTP_STATE_LOGGED_IN) {
@@ -562,7 +644,7 @@ static void handle_ftp_command(ftp_connection_t *conn) {
     }
     else if (strcmp(cmd, "QUIT") == 0) {
         ftp_send_response(conn->control_sock, 221, "Goodbye");
-        conn->active = 0;
+        ftp_close_conn(conn);
     }
     else if (strcmp(cmd, "NOOP") == 0) {
         ftp_send_response(conn->control_sock, 200, "NOOP command successful");
@@ -654,13 +736,7 @@ void ftp_stop(void) {
     // Close all connections
     for (int i = 0; i < FTP_MAX_CONNECTIONS; i++) {
         if (ftp_connections[i].active) {
-            if (ftp_connections[i].control_sock >= 0) {
-                tcp_close(ftp_connections[i].control_sock);
-            }
-            if (ftp_connections[i].data_sock >= 0) {
-                tcp_close(ftp_connections[i].data_sock);
-            }
-            ftp_connections[i].active = 0;
+            ftp_close_conn(&ftp_connections[i]);
         }
     }
     
@@ -678,17 +754,54 @@ int ftp_is_running(void) {
     return ftp_listening;
 }
 
-// Poll FTP server (call from main loop)
+// Poll FTP server (call from main loop). Sleeps until a client connects,
+// sends a command or is ready for more of a transfer (or FTP_POLL_MS
+// passes), then serves whoever is ready: a command each, a chunk each.
 void ftp_poll(void) {
     if (!ftp_listening) return;
     
+    // Slot 0 is the listener; connection i has its control socket in slot
+    // 1 + 2i and, during a transfer, its data socket in slot 2 + 2i.
+    // Commands wait while a transfer runs, but a hangup still shows.
+    tcp_pollfd_t fds[1 + 2 * FTP_MAX_CONNECTIONS];
+    fds[0].sock = ftp_listen_sock;
+    fds[0].events = TCP_POLLIN;
+    for (int i = 0; i < FTP_MAX_CONNECTIONS; i++) {
+        ftp_connection_t *conn = &ftp_connections[i];
+        tcp_pollfd_t *ctl = &fds[1 + 2 * i];
+        tcp_pollfd_t *data = &fds[2 + 2 * i];
+        ctl->sock = conn->active ? conn->control_sock : -1;
+        ctl->events = conn->xfer ? 0 : TCP_POLLIN;
+        data->sock = conn->active && conn->xfer ? conn->data_sock : -1;
+        data->events = conn->xfer == FTP_XFER_SEND ? TCP_POLLOUT : TCP_POLLIN;
+        if (data->sock == ctl->sock) ctl->sock = -1;
+    }
+    
+    int ready = tcp_poll(fds, 1 + 2 * FTP_MAX_CONNECTIONS, FTP_POLL_MS);
+    
     // Check for new connections
-    ftp_check_new_connections();
+    if (ready > 0 && (fds[0].revents & TCP_POLLIN)) {
+        ftp_check_new_connections();
+    }
     
-    // Process existing connections
+    uint64_t now = timer_get_uptime_us();
     for (int i = 0; i < FTP_MAX_CONNECTIONS; i++) {
-        if (ftp_connections[i].active) {
-            handle_ftp_command(&ftp_connections[i]);
+        ftp_connection_t *conn = &ftp_connections[i];
+        if (!conn->active) continue;
+        uint16_t ctl = ready > 0 ? fds[1 + 2 * i].revents : 0;
+        uint16_t data = ready > 0 ? fds[2 + 2 * i].revents : 0;
+        
+        if (conn->xfer) {
+            if (ctl & TCP_POLLHUP) {
+                ftp_close_conn(conn);
+            } else if (data) {
+                ftp_xfer_step(conn, data);
+            } else if (now - conn->xfer_active_us > FTP_DATA_TIMEOUT_MS * 1000ULL) {
+                ftp_xfer_end(conn, 426, "Data connection timed out");
+            }
+        } else if (ctl) {
+            // A command (or a hangup) waiting
+            handle_ftp_command(conn);
         }
     }
 }
@@ -15,6 +15,6 @@ void ftp_init(void);
 void ftp_start(uint16_t port);
 void ftp_stop(void);
 int ftp_is_running(void);
-void ftp_poll(void);  // Call from main loop to process connections
+void ftp_poll(void);  // Call from main loop: waits for and serves clients
 
 #endif // _FTP_H
@@ -44,6 +44,7 @@ void hal_irq_disable(void);
 void hal_irq_enable_irq(uint32_t irq);
 void hal_irq_disable_irq(uint32_t irq);
 void hal_irq_register_handler(uint32_t irq, void (*handler)(void));
+void hal_irq_init_cpu(void);    // Per-core interrupt setup on a secondary core
 
 /*
  * Timer
@@ -52,6 +53,8 @@ void hal_irq_register_handler(uint32_t irq, void (*handler)(void));
 void hal_timer_init(uint32_t interval_ms);
 uint64_t hal_timer_get_ticks(void);
 void hal_timer_set_interval(uint32_t interval_ms);
+void hal_timer_init_cpu(void);  // Enable a secondary core's timer (tickless until it runs something)
+int hal_timer_wants_tick(void); // Boot core needs its periodic tick to poll devices
 
 /*
  * Block Device (Storage)
@@ -61,6 +64,25 @@ int hal_blk_init(void);
 int hal_blk_read(uint32_t sector, void *buf, uint32_t count);
 int hal_blk_write(uint32_t sector, const void *buf, uint32_t count);
 
+// Asynchronous requests: submit, carry on, then wait. A request moves the
+// sectors starting at sector to or from its segments in order (each a
+// multiple of 512 bytes), so a run of blocks can be scattered over separate
+// buffers. Several may be in flight at once where the device queues them.
+#define HAL_BLK_MAX_SEGS 16
+
+typedef struct hal_blk_req {
+    uint32_t sector;
+    int write;                              // 0 = read
+    int nsegs;
+    void *buf[HAL_BLK_MAX_SEGS];
+    uint32_t len[HAL_BLK_MAX_SEGS];         // Bytes
+    volatile int done;                      // Set on completion
+    int status;                             // 0 or -1, valid once done
+} hal_blk_req_t;
+
+int hal_blk_submit(hal_blk_req_t *req);    // 0 if queued, -1 if invalid
+int hal_blk_wait(hal_blk_req_t *req);      // Result of the request
+
 /*
  * Input Devices
  * Keyboard and mouse/touch
@@ -167,6 +189,13 @@ const char *hal_get_cpu_name(void);     // e.g., "Cortex-A72"
 uint32_t hal_get_cpu_freq_mhz(void);    // e.g., 1500 for 1.5GHz
 int hal_get_cpu_cores(void);            // e.g., 4
 
+/*
+ * Secondary Cores
+ * Release a parked core at entry (physical address, MMU off).
+ * QEMU: our own spin table in boot.S. Pi: the firmware's spin table.
+ */
+int hal_cpu_start(int cpu, void (*entry)(void));
+
 /*
  * USB Device Info
  * List of enumerated USB devices (Pi only, QEMU returns 0)
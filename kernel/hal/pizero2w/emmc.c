@@ -4,12 +4,21 @@
  * - BCM2835 ARM Peripherals (publicly available from Broadcom)
  * - SD Physical Layer Simplified Specification v3.00
  * - SDHCI Specification v3.00
+ *
+ * Multi-block transfers are moved by the system DMA engine, paced by the
+ * EMMC DREQ: the Arasan controller's own DMA (SDMA/ADMA2) isn't usable on
+ * this SoC. A request's segments become a chain of DMA control blocks
+ * feeding one CMD18/CMD25, so a scattered run is still one command. The
+ * controller raises its IRQ when the data is done and the waiting process
+ * sleeps until then.
  */
 
 #include "../hal.h"
+#include "emmc_dma.h"
 #include "../../printf.h"
 #include "../../string.h"
 #include "../../memory.h"
+#include "../../process.h"
 
 /* LED for disk activity indicator - rate limited to ~20Hz */
 extern void led_toggle(void);
@@ -120,6 +129,7 @@ static struct {
     int is_sdhc;           /* 1 = SDHC/SDXC (block addressing), 0 = SDSC (byte addressing) */
     uint32_t rca;          /* Relative Card Address */
     uint32_t clk_base;     /* Base clock frequency in Hz */
+    int cmd23;             /* Card takes SET_BLOCK_COUNT (from SCR) */
 } card;
 
 /*
@@ -128,60 +138,24 @@ static struct {
  */
 #define DMA_BASE            0x3F007000
 #define EMMC_DMA_CHANNEL    4   /* Use channel 4 for EMMC (0 is used for FB) */
-#define EMMC_DREQ           11  /* EMMC peripheral DREQ number */
 
 /* DMA register offsets */
 #define DMA_CS              0x00
 #define DMA_CONBLK_AD       0x04
 #define DMA_ENABLE          0xFF0
 
-/* DMA CS bits */
-#define DMA_CS_ACTIVE       (1 << 0)
-#define DMA_CS_END          (1 << 1)
-#define DMA_CS_INT          (1 << 2)
-#define DMA_CS_ERROR        (1 << 8)
-#define DMA_CS_PRIORITY(x)  (((x) & 0xF) << 16)
-#define DMA_CS_PANIC_PRI(x) (((x) & 0xF) << 20)
-#define DMA_CS_WAIT_WRITES  (1 << 28)
-#define DMA_CS_RESET        (1 << 31)
-
-/* DMA Transfer Info bits */
-#define DMA_TI_INTEN        (1 << 0)
-#define DMA_TI_WAIT_RESP    (1 << 3)
-#define DMA_TI_DEST_INC     (1 << 4)
-#define DMA_TI_DEST_DREQ    (1 << 6)
-#define DMA_TI_SRC_INC      (1 << 8)
-#define DMA_TI_SRC_DREQ     (1 << 10)
-#define DMA_TI_PERMAP(x)    (((x) & 0x1F) << 16)
-
-/* SDHCI interrupt bits (needed by DMA functions) */
-#define INTR_CMD_DONE       (1 << 0)
-#define INTR_DATA_DONE      (1 << 1)
-#define INTR_WRITE_READY    (1 << 4)
-#define INTR_READ_READY     (1 << 5)
-#define INTR_ERR            0xFFFF0000
-
-/* DMA Control Block (must be 32-byte aligned) */
-typedef struct __attribute__((aligned(32))) {
-    uint32_t ti;
-    uint32_t source_ad;
-    uint32_t dest_ad;
-    uint32_t txfr_len;
-    uint32_t stride;
-    uint32_t nextconbk;
-    uint32_t reserved[2];
-} emmc_dma_cb_t;
-
-static emmc_dma_cb_t __attribute__((aligned(32))) emmc_dma_cb;
-static int emmc_dma_enabled = 0;
+/* CS/TI bits, SDHCI interrupt bits and command flags: emmc_dma.h */
 
-/* Convert ARM physical address to bus address for DMA */
-static inline uint32_t arm_to_bus(void *ptr) {
-    return ((uint32_t)(uint64_t)ptr) | 0xC0000000;
-}
+/* CTRL1 reset bits */
+#define CTRL1_SRST_CMD      (1 << 25)
+#define CTRL1_SRST_DATA     (1 << 26)
 
-/* EMMC DATA register bus address */
-#define EMMC_DATA_BUS       (0x7E300000 + REG_DATA)  /* VideoCore bus address */
+/* EMMC interrupt: VideoCore IRQ 62, bank2 IRQ 30 in irq.c's numbering */
+#define IRQ_VC_EMMC         (40 + 30)
+
+/* One control block per segment of the request in flight */
+static emmc_dma_cb_t __attribute__((aligned(32))) emmc_dma_cbs[HAL_BLK_MAX_SEGS];
+static int emmc_dma_enabled = 0;
 
 static inline uint32_t emmc_dma_read(int reg) {
     return *(volatile uint32_t *)(DMA_BASE + EMMC_DMA_CHANNEL * 0x100 + reg);
@@ -223,79 +197,6 @@ static void emmc_dma_init(void) {
     printf("[SD] DMA enabled on channel %d\n", EMMC_DMA_CHANNEL);
 }
 
-static int emmc_dma_wait(void) {
-    /* Tight poll - DMA is fast, no need for delays */
-    for (int i = 0; i < 10000000; i++) {
-        uint32_t cs = emmc_dma_read(DMA_CS);
-        if (!(cs & DMA_CS_ACTIVE)) {
-            emmc_dma_write(DMA_CS, DMA_CS_END | DMA_CS_INT);
-            mem_barrier();
-            return (cs & DMA_CS_ERROR) ? -1 : 0;
-        }
-    }
-    printf("[SD] DMA timeout\n");
-    emmc_dma_write(DMA_CS, DMA_CS_END | DMA_CS_INT);
-    return -1;
-}
-
-/*
- * DMA-based block read from EMMC
- * Uses DREQ pacing - DMA waits for EMMC to signal data ready
- */
-static int read_data_blocks_dma(uint8_t *buf, uint32_t count) {
-    uint32_t bytes = count * 512;
-
-    /* Invalidate cache for destination buffer before DMA */
-    cache_invalidate(buf, bytes);
-
-    /* Set up DMA control block:
-     * - Read from EMMC DATA register (fixed address)
-     * - Write to buffer (incrementing address)
-     * - Use DREQ pacing from EMMC peripheral
-     */
-    emmc_dma_cb.ti = DMA_TI_DEST_INC | DMA_TI_WAIT_RESP |
-                     DMA_TI_SRC_DREQ | DMA_TI_PERMAP(EMMC_DREQ);
-    emmc_dma_cb.source_ad = EMMC_DATA_BUS;
-    emmc_dma_cb.dest_ad = arm_to_bus(buf);
-    emmc_dma_cb.txfr_len = bytes;
-    emmc_dma_cb.stride = 0;
-    emmc_dma_cb.nextconbk = 0;
-
-    /* Clean cache for control block */
-    cache_clean(&emmc_dma_cb, sizeof(emmc_dma_cb));
-    mem_barrier();
-
-    /* Point DMA to control block and start */
-    emmc_dma_write(DMA_CONBLK_AD, arm_to_bus(&emmc_dma_cb));
-    mem_barrier();
-    emmc_dma_write(DMA_CS, DMA_CS_ACTIVE | DMA_CS_PRIORITY(8) | DMA_CS_PANIC_PRI(15) | DMA_CS_WAIT_WRITES);
-
-    /* Wait for DMA to complete */
-    if (emmc_dma_wait() < 0) {
-        printf("[SD] DMA read failed\n");
-        return -1;
-    }
-
-    /* Wait for EMMC transfer complete - tight poll */
-    uint32_t intr;
-    for (int i = 0; i < 10000000; i++) {
-        intr = sdhci_read(REG_INTR);
-        if (intr & (INTR_DATA_DONE | INTR_ERR)) break;
-    }
-
-    sdhci_write(REG_INTR, INTR_DATA_DONE | INTR_ERR);
-
-    if (intr & INTR_ERR) {
-        printf("[SD] DMA transfer complete error: 0x%x\n", intr);
-        return -1;
-    }
-
-    /* Invalidate cache so CPU sees DMA-written data */
-    cache_invalidate(buf, bytes);
-
-    return 0;
-}
-
 /* Mailbox property buffer - must be 16-byte aligned for GPU */
 static uint32_t __attribute__((aligned(16))) prop_buf[32];
 
@@ -415,18 +316,7 @@ static void setup_sd_gpio(void) {
     gpio_set_pull_mask(0x3F0000, 1, GPIO_PULL_UP);
 }
 
-/* Command flags for CMDTM register */
-#define TM_CMD_INDEX(n)     ((n) << 24)
-#define TM_RSP_NONE         (0 << 16)
-#define TM_RSP_136          (1 << 16)  /* R2 response */
-#define TM_RSP_48           (2 << 16)  /* R1, R3, R6, R7 */
-#define TM_RSP_48_BUSY      (3 << 16)  /* R1b */
-#define TM_CRC_EN           (1 << 19)
-#define TM_DATA             (1 << 21)
-#define TM_DATA_READ        (1 << 4)
-#define TM_MULTI_BLK        (1 << 5)
-#define TM_BLK_CNT_EN       (1 << 1)
-#define TM_AUTO_CMD12       (1 << 2)  /* Auto CMD12 after multi-block transfer */
+/* Command flags for CMDTM register: emmc_dma.h */
 
 /*
  * Send a command to the SD card
@@ -730,6 +620,228 @@ static int write_data_blocks(const uint8_t *buf, uint32_t count) {
     return 0;
 }
 
+/*
+ * DMA transfers
+ *
+ * The descriptor chain, command word and final status are worked out by
+ * the pure functions in emmc_dma.c (tested on the host); everything
+ * touching the hardware goes through sdhci_read/write and
+ * emmc_dma_read/write.
+ */
+#define TRANSFER_TIMEOUT_US 2000000     /* Writes can keep the card busy for a while */
+#define WAIT_SLICE_US       10000       /* Re-check the controller this often */
+
+static spinlock_t emmc_lock = SPINLOCK_INIT;
+static wait_queue_t emmc_wq = WAIT_QUEUE_INIT;
+static hal_blk_req_t *active = NULL;    /* DMA transfer in flight */
+static volatile int idle = 1;           /* Controller free (waiters sleep on it) */
+static volatile int irq_ready = 0;      /* Completions raise the EMMC IRQ */
+
+/* Stop the DMA channel and reset the controller's data side after a
+ * failed or abandoned transfer */
+static void reset_transfer(void) {
+    emmc_dma_write(DMA_CS, DMA_CS_ABORT);
+    mem_barrier();
+    emmc_dma_write(DMA_CS, DMA_CS_RESET);
+    mem_barrier();
+
+    sdhci_write(REG_CTRL1, sdhci_read(REG_CTRL1) | CTRL1_SRST_CMD | CTRL1_SRST_DATA);
+    int timeout = 10000;
+    while ((sdhci_read(REG_CTRL1) & (CTRL1_SRST_CMD | CTRL1_SRST_DATA)) && --timeout > 0) {
+        delay_us(1);
+    }
+    emmc_dma_write(DMA_CS, DMA_CS_END | DMA_CS_INT);
+}
+
+/* Hand the active request back to its owner and free the controller.
+ * Caller holds emmc_lock. */
+static void complete_locked(hal_blk_req_t *req, int status) {
+    sdhci_write(REG_INTR_EN, 0);
+    req->status = status;
+    mem_barrier();
+    req->done = 1;
+    active = NULL;
+    idle = 1;
+}
+
+/*
+ * Check the controller for the end of the active transfer and complete it.
+ * Called from the EMMC IRQ and by waiters polling. Returns 1 if something
+ * completed.
+ */
+static int emmc_poll(void) {
+    uint64_t flags = spin_lock_irqsave(&emmc_lock);
+    hal_blk_req_t *req = active;
+    uint32_t intr = sdhci_read(REG_INTR);
+
+    if (!req) {
+        /* Nothing of ours - keep a stray flag from holding the line up */
+        sdhci_write(REG_INTR_EN, 0);
+        spin_unlock_irqrestore(&emmc_lock, flags);
+        return 0;
+    }
+    if (!(intr & (INTR_DATA_DONE | INTR_ERR))) {
+        spin_unlock_irqrestore(&emmc_lock, flags);
+        return 0;
+    }
+    sdhci_write(REG_INTR, INTR_DATA_DONE | INTR_ERR);
+
+    /* The card is done; the DMA engine drains the last of the FIFO */
+    uint32_t cs = emmc_dma_read(DMA_CS);
+    for (int i = 0; i < 100000 && (cs & DMA_CS_ACTIVE) && !(intr & INTR_ERR); i++) {
+        cs = emmc_dma_read(DMA_CS);
+    }
+
+    int status = emmc_transfer_status(intr, cs);
+    if (status < 0) {
+        printf("[SD] %s error at sector %u: intr 0x%x, dma 0x%x\n",
+               req->write ? "Write" : "Read", req->sector, intr, cs);
+        reset_transfer();
+    } else {
+        emmc_dma_write(DMA_CS, DMA_CS_END | DMA_CS_INT);
+    }
+
+    /* Drop whatever the CPU fetched while the DMA was writing */
+    if (!req->write) {
+        for (int i = 0; i < req->nsegs; i++) cache_invalidate(req->buf[i], req->len[i]);
+    }
+
+    complete_locked(req, status);
+    spin_unlock_irqrestore(&emmc_lock, flags);
+    process_wake_all(&emmc_wq);
+    return 1;
+}
+
+static void emmc_irq_handler(void) {
+    irq_ready = 1;
+    emmc_poll();
+}
+
+/* Let time pass: sleep if the IRQ will wake us, else (kernel thread) spin */
+static void wait_for(volatile int *cond) {
+    if (irq_ready && process_current()) {
+        process_wait_event(&emmc_wq, cond, ktimer_now() + ktimer_us_to_count(WAIT_SLICE_US));
+    } else {
+        delay_us(1);
+    }
+}
+
+/* Take the controller (one transfer at a time) */
+static void claim_controller(void) {
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&emmc_lock);
+        if (idle) {
+            idle = 0;
+            spin_unlock_irqrestore(&emmc_lock, flags);
+            return;
+        }
+        spin_unlock_irqrestore(&emmc_lock, flags);
+        if (!emmc_poll()) wait_for(&idle);
+    }
+}
+
+static void release_controller(void) {
+    uint64_t flags = spin_lock_irqsave(&emmc_lock);
+    idle = 1;
+    spin_unlock_irqrestore(&emmc_lock, flags);
+    process_wake_all(&emmc_wq);
+}
+
+/*
+ * Start a DMA transfer for req on the claimed controller. On failure the
+ * controller is released and the request completed with an error.
+ */
+static void start_transfer(hal_blk_req_t *req) {
+    disk_activity_led();
+
+    uint32_t bytes = emmc_dma_chain(emmc_dma_cbs, req);
+    uint32_t count = bytes / 512;
+
+    /* Written data must be in memory; read buffers must have no dirty
+     * lines that could be evicted on top of what the DMA writes */
+    for (int i = 0; i < req->nsegs; i++) {
+        if (req->write) cache_clean(req->buf[i], req->len[i]);
+        else cache_invalidate(req->buf[i], req->len[i]);
+    }
+    cache_clean(emmc_dma_cbs, req->nsegs * sizeof(emmc_dma_cb_t));
+
+    /* SDHC uses block addresses, SDSC uses byte addresses */
+    uint32_t addr = card.is_sdhc ? req->sector : (req->sector * 512);
+    sdhci_write(REG_BLKSIZECNT, (count << 16) | 512);
+    if (card.cmd23) sdhci_write(REG_ARG2, count);
+
+    if (sd_command(emmc_transfer_cmd(req->write, card.cmd23), addr, NULL) < 0) {
+        printf("[SD] Multi-%s command failed at sector %u\n",
+               req->write ? "write" : "read", req->sector);
+        uint64_t flags = spin_lock_irqsave(&emmc_lock);
+        complete_locked(req, -1);
+        spin_unlock_irqrestore(&emmc_lock, flags);
+        process_wake_all(&emmc_wq);
+        return;
+    }
+
+    /* Point DMA at the chain and start */
+    emmc_dma_write(DMA_CONBLK_AD, arm_to_bus(&emmc_dma_cbs[0]));
+    mem_barrier();
+    emmc_dma_write(DMA_CS, DMA_CS_ACTIVE | DMA_CS_PRIORITY(8) | DMA_CS_PANIC_PRI(15) | DMA_CS_WAIT_WRITES);
+
+    /* Only now may the IRQ complete it */
+    uint64_t flags = spin_lock_irqsave(&emmc_lock);
+    active = req;
+    sdhci_write(REG_INTR_EN, INTR_DATA_DONE | INTR_ERR);
+    spin_unlock_irqrestore(&emmc_lock, flags);
+}
+
+/* Give up on a transfer that never finished */
+static void abandon_transfer(hal_blk_req_t *req) {
+    uint64_t flags = spin_lock_irqsave(&emmc_lock);
+    if (active == req && !req->done) {
+        printf("[SD] Transfer timeout at sector %u\n", req->sector);
+        reset_transfer();
+        complete_locked(req, -1);
+    }
+    spin_unlock_irqrestore(&emmc_lock, flags);
+    process_wake_all(&emmc_wq);
+}
+
+/*
+ * Read the SCR (ACMD51, 8 bytes) to find out whether the card takes
+ * SET_BLOCK_COUNT (CMD_SUPPORT bit 33)
+ */
+static void read_scr(void) {
+    uint32_t resp[4];
+    uint32_t scr[2];
+
+    sdhci_write(REG_BLKSIZECNT, (1 << 16) | 8);
+    if (sd_app_command(TM_CMD_INDEX(51) | TM_RSP_48 | TM_CRC_EN | TM_DATA | TM_DATA_READ,
+                       0, resp) < 0) {
+        return;
+    }
+
+    uint32_t intr = 0;
+    int timeout = 100000;
+    while (--timeout > 0) {
+        intr = sdhci_read(REG_INTR);
+        if (intr & (INTR_READ_READY | INTR_ERR)) break;
+    }
+    if (timeout == 0 || (intr & INTR_ERR)) {
+        sdhci_write(REG_INTR, INTR_READ_READY | INTR_ERR);
+        return;
+    }
+    sdhci_write(REG_INTR, INTR_READ_READY);
+    scr[0] = sdhci_read(REG_DATA);
+    scr[1] = sdhci_read(REG_DATA);     /* Nothing we need in the rest */
+
+    timeout = 10000;
+    while (--timeout > 0) {
+        if (sdhci_read(REG_INTR) & INTR_DATA_DONE) break;
+    }
+    sdhci_write(REG_INTR, INTR_DATA_DONE);
+
+    /* The SCR arrives most significant byte first: bits 39-32 are byte 3 */
+    card.cmd23 = (scr[0] >> 24) & 0x2 ? 1 : 0;
+}
+
 /*
  * Initialize the SD card and controller
  * Implements the SD card initialization sequence from the SD spec
@@ -909,6 +1021,10 @@ int hal_blk_init(void) {
         printf("[SD] 4-bit mode enabled\n");
     }
 
+    /* Can multi-block transfers announce their length (auto CMD23)? */
+    read_scr();
+    printf("[SD] Multi-block transfers end with %s\n", card.cmd23 ? "CMD23" : "CMD12");
+
     /*
      * Try to enable High Speed mode (CMD6)
      * Arg: 0x80FFFFF1 = Switch, Access Mode = High Speed (function 1)
@@ -956,23 +1072,19 @@ int hal_blk_init(void) {
     /* Initialize DMA for faster block transfers */
     emmc_dma_init();
 
+    /* Transfers complete from the EMMC interrupt */
+    sdhci_write(REG_INTR_EN, 0);
+    hal_irq_register_handler(IRQ_VC_EMMC, emmc_irq_handler);
+    hal_irq_enable_irq(IRQ_VC_EMMC);
+
     return 0;
 }
 
 /*
- * Read sectors from the SD card
- * sector: starting sector number (512 bytes each)
- * buf: destination buffer
- * count: number of sectors to read
+ * Read sectors through the data FIFO (single blocks, or no DMA channel).
+ * Caller has claimed the controller.
  */
-int hal_blk_read(uint32_t sector, void *buf, uint32_t count) {
-    if (!card.ready) {
-        printf("[SD] Not initialized\n");
-        return -1;
-    }
-
-    if (count == 0) return 0;
-
+static int pio_read(uint32_t sector, void *buf, uint32_t count) {
     /* Disk activity LED */
     disk_activity_led();
 
@@ -1004,15 +1116,8 @@ int hal_blk_read(uint32_t sector, void *buf, uint32_t count) {
             return -1;
         }
 
-        /* Use DMA if available, fall back to FIFO */
-        if (emmc_dma_enabled) {
-            if (read_data_blocks_dma(buf, count) < 0) {
-                return -1;
-            }
-        } else {
-            if (read_data_blocks(buf, count) < 0) {
-                return -1;
-            }
+        if (read_data_blocks(buf, count) < 0) {
+            return -1;
         }
     }
 
@@ -1020,19 +1125,10 @@ int hal_blk_read(uint32_t sector, void *buf, uint32_t count) {
 }
 
 /*
- * Write sectors to the SD card
- * sector: starting sector number
- * buf: source buffer
- * count: number of sectors to write
+ * Write sectors through the data FIFO (single blocks, or no DMA channel).
+ * Caller has claimed the controller.
  */
-int hal_blk_write(uint32_t sector, const void *buf, uint32_t count) {
-    if (!card.ready) {
-        printf("[SD] Not initialized\n");
-        return -1;
-    }
-
-    if (count == 0) return 0;
-
+static int pio_write(uint32_t sector, const void *buf, uint32_t count) {
     /* Disk activity LED */
     disk_activity_led();
 
@@ -1070,3 +1166,133 @@ int hal_blk_write(uint32_t sector, const void *buf, uint32_t count) {
 
     return 0;
 }
+
+/*
+ * Asynchronous interface - one transfer runs at a time, so submitting
+ * waits for the controller, then starts the DMA and returns while the
+ * data moves. Without a DMA channel the request is carried out in full,
+ * one segment after another, before submit returns.
+ */
+int hal_blk_submit(hal_blk_req_t *req) {
+    if (!card.ready) {
+        printf("[SD] Not initialized\n");
+        return -1;
+    }
+    if (emmc_req_blocks(req) < 0) return -1;
+
+    req->done = 0;
+    req->status = 0;
+    claim_controller();
+
+    if (emmc_dma_enabled) {
+        start_transfer(req);
+        return 0;
+    }
+
+    uint32_t sector = req->sector;
+    for (int i = 0; i < req->nsegs; i++) {
+        uint32_t count = req->len[i] / 512;
+        int r = req->write ? pio_write(sector, req->buf[i], count)
+                           : pio_read(sector, req->buf[i], count);
+        if (r < 0) {
+            req->status = -1;
+            break;
+        }
+        sector += count;
+    }
+    req->done = 1;
+    release_controller();
+    return 0;
+}
+
+int hal_blk_wait(hal_blk_req_t *req) {
+    uint64_t deadline = ktimer_now() + ktimer_us_to_count(TRANSFER_TIMEOUT_US);
+
+    while (!req->done) {
+        if (emmc_poll()) continue;
+        if (ktimer_now() >= deadline) {
+            abandon_transfer(req);
+            break;
+        }
+        wait_for(&req->done);
+    }
+
+    mem_barrier();
+    return req->status;
+}
+
+/*
+ * Read sectors from the SD card
+ * sector: starting sector number (512 bytes each)
+ * buf: destination buffer
+ * count: number of sectors to read
+ */
+int hal_blk_read(uint32_t sector, void *buf, uint32_t count) {
+    if (!card.ready) {
+        printf("[SD] Not initialized\n");
+        return -1;
+    }
+
+    if (count == 0) return 0;
+
+    /* One command moves at most EMMC_MAX_BLOCKS: split longer runs */
+    if (count > EMMC_MAX_BLOCKS) {
+        uint32_t n = emmc_chunk_blocks(count);
+        if (hal_blk_read(sector, buf, n) < 0) return -1;
+        return hal_blk_read(sector + n, (uint8_t *)buf + n * 512, count - n);
+    }
+
+    /* Note: DMA overhead too high for single 512-byte blocks, use FIFO */
+    if (count > 1 && emmc_dma_enabled) {
+        hal_blk_req_t req;
+        req.sector = sector;
+        req.write = 0;
+        req.nsegs = 1;
+        req.buf[0] = buf;
+        req.len[0] = count * 512;
+        if (hal_blk_submit(&req) < 0) return -1;
+        return hal_blk_wait(&req);
+    }
+
+    claim_controller();
+    int ret = pio_read(sector, buf, count);
+    release_controller();
+    return ret;
+}
+
+/*
+ * Write sectors to the SD card
+ * sector: starting sector number
+ * buf: source buffer
+ * count: number of sectors to write
+ */
+int hal_blk_write(uint32_t sector, const void *buf, uint32_t count) {
+    if (!card.ready) {
+        printf("[SD] Not initialized\n");
+        return -1;
+    }
+
+    if (count == 0) return 0;
+
+    if (count > EMMC_MAX_BLOCKS) {
+        uint32_t n = emmc_chunk_blocks(count);
+        if (hal_blk_write(sector, buf, n) < 0) return -1;
+        return hal_blk_write(sector + n, (const uint8_t *)buf + n * 512, count - n);
+    }
+
+    if (count > 1 && emmc_dma_enabled) {
+        hal_blk_req_t req;
+        req.sector = sector;
+        req.write = 1;
+        req.nsegs = 1;
+        req.buf[0] = (void *)buf;
+        req.len[0] = count * 512;
+        if (hal_blk_submit(&req) < 0) return -1;
+        return hal_blk_wait(&req);
+    }
+
+    claim_controller();
+    int ret = pio_write(sector, buf, count);
+    release_controller();
+    return ret;
+}
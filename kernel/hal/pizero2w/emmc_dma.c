@@ -0,0 +1,60 @@
+/*
+ * KikiOS SD Card DMA Transfers - the pure part (see emmc_dma.h)
+ */
+
+#include "emmc_dma.h"
+
+int emmc_req_blocks(const hal_blk_req_t *req) {
+    if (req->nsegs < 1 || req->nsegs > HAL_BLK_MAX_SEGS) return -1;
+
+    uint32_t blocks = 0;
+    for (int i = 0; i < req->nsegs; i++) {
+        if (req->len[i] == 0 || req->len[i] % 512) return -1;
+        /* Checked per segment too, so the sum can't wrap */
+        if (req->len[i] / 512 > EMMC_MAX_BLOCKS - blocks) return -1;
+        blocks += req->len[i] / 512;
+    }
+    return (int)blocks;
+}
+
+uint32_t emmc_chunk_blocks(uint32_t count) {
+    return count > EMMC_MAX_BLOCKS ? EMMC_CHUNK_BLOCKS : count;
+}
+
+uint32_t emmc_dma_chain(emmc_dma_cb_t *cbs, const hal_blk_req_t *req) {
+    uint32_t bytes = 0;
+    for (int i = 0; i < req->nsegs; i++) {
+        emmc_dma_cb_t *cb = &cbs[i];
+        if (req->write) {
+            cb->ti = DMA_TI_SRC_INC | DMA_TI_WAIT_RESP |
+                     DMA_TI_DEST_DREQ | DMA_TI_PERMAP(EMMC_DREQ);
+            cb->source_ad = arm_to_bus(req->buf[i]);
+            cb->dest_ad = EMMC_DATA_BUS;
+        } else {
+            cb->ti = DMA_TI_DEST_INC | DMA_TI_WAIT_RESP |
+                     DMA_TI_SRC_DREQ | DMA_TI_PERMAP(EMMC_DREQ);
+            cb->source_ad = EMMC_DATA_BUS;
+            cb->dest_ad = arm_to_bus(req->buf[i]);
+        }
+        cb->txfr_len = req->len[i];
+        cb->stride = 0;
+        cb->nextconbk = i + 1 < req->nsegs ? arm_to_bus(&cbs[i + 1]) : 0;
+        cb->reserved[0] = cb->reserved[1] = 0;
+        bytes += req->len[i];
+    }
+    return bytes;
+}
+
+uint32_t emmc_transfer_cmd(int write, int cmd23) {
+    uint32_t cmd = TM_RSP_48 | TM_CRC_EN | TM_DATA | TM_MULTI_BLK | TM_BLK_CNT_EN;
+    cmd |= write ? TM_CMD_INDEX(25) : (TM_CMD_INDEX(18) | TM_DATA_READ);
+    cmd |= cmd23 ? TM_AUTO_CMD23 : TM_AUTO_CMD12;
+    return cmd;
+}
+
+int emmc_transfer_status(uint32_t intr, uint32_t dma_cs) {
+    if (intr & INTR_ERR) return -1;
+    if (!(intr & INTR_DATA_DONE)) return -1;
+    if (dma_cs & (DMA_CS_ACTIVE | DMA_CS_ERROR)) return -1;
+    return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * KikiOS SD Card DMA Transfers - the pure part
+ *
+ * Everything emmc.c works out before and after a DMA transfer without
+ * touching the hardware: whether a request fits one command, the chain
+ * of DMA control blocks that moves it, the command word that goes with
+ * it, and what the controller's status registers say once it stops.
+ * Kept apart so it can be built and tested on the host (tests/host).
+ */
+
+#ifndef EMMC_DMA_H
+#define EMMC_DMA_H
+
+#include <stdint.h>
+#include "../hal.h"
+
+/* DMA CS bits */
+#define DMA_CS_ACTIVE       (1 << 0)
+#define DMA_CS_END          (1 << 1)
+#define DMA_CS_INT          (1 << 2)
+#define DMA_CS_ERROR        (1 << 8)
+#define DMA_CS_PRIORITY(x)  (((x) & 0xF) << 16)
+#define DMA_CS_PANIC_PRI(x) (((x) & 0xF) << 20)
+#define DMA_CS_WAIT_WRITES  (1 << 28)
+#define DMA_CS_ABORT        (1 << 30)
+#define DMA_CS_RESET        (1u << 31)
+
+/* DMA Transfer Info bits */
+#define DMA_TI_INTEN        (1 << 0)
+#define DMA_TI_WAIT_RESP    (1 << 3)
+#define DMA_TI_DEST_INC     (1 << 4)
+#define DMA_TI_DEST_DREQ    (1 << 6)
+#define DMA_TI_SRC_INC      (1 << 8)
+#define DMA_TI_SRC_DREQ     (1 << 10)
+#define DMA_TI_PERMAP(x)    (((x) & 0x1F) << 16)
+
+#define EMMC_DREQ           11  /* EMMC peripheral DREQ number */
+
+/* SDHCI interrupt bits */
+#define INTR_CMD_DONE       (1 << 0)
+#define INTR_DATA_DONE      (1 << 1)
+#define INTR_WRITE_READY    (1 << 4)
+#define INTR_READ_READY     (1 << 5)
+#define INTR_ERR            0xFFFF0000
+
+/* Command flags for CMDTM register */
+#define TM_CMD_INDEX(n)     ((n) << 24)
+#define TM_RSP_NONE         (0 << 16)
+#define TM_RSP_136          (1 << 16)  /* R2 response */
+#define TM_RSP_48           (2 << 16)  /* R1, R3, R6, R7 */
+#define TM_RSP_48_BUSY      (3 << 16)  /* R1b */
+#define TM_CRC_EN           (1 << 19)
+#define TM_DATA             (1 << 21)
+#define TM_DATA_READ        (1 << 4)
+#define TM_MULTI_BLK        (1 << 5)
+#define TM_BLK_CNT_EN       (1 << 1)
+#define TM_AUTO_CMD12       (1 << 2)  /* Auto CMD12 after multi-block transfer */
+#define TM_AUTO_CMD23       (2 << 2)  /* Auto CMD23 (block count in ARG2) before it */
+
+/* EMMC DATA register bus address */
+#define EMMC_DATA_BUS       (0x7E300000 + 0x20)  /* VideoCore bus address */
+
+/* One command moves at most this many blocks: BLKSIZECNT's count field
+ * is 16 bits. Longer runs are split into chunks of EMMC_CHUNK_BLOCKS,
+ * which keeps every chunk after the first starting on a 4KB boundary. */
+#define EMMC_MAX_BLOCKS     0xFFFF
+#define EMMC_CHUNK_BLOCKS   (EMMC_MAX_BLOCKS & ~7u)
+
+/* DMA Control Block (must be 32-byte aligned) */
+typedef struct __attribute__((aligned(32))) {
+    uint32_t ti;
+    uint32_t source_ad;
+    uint32_t dest_ad;
+    uint32_t txfr_len;
+    uint32_t stride;
+    uint32_t nextconbk;
+    uint32_t reserved[2];
+} emmc_dma_cb_t;
+
+/* Convert ARM physical address to bus address for DMA */
+static inline uint32_t arm_to_bus(const void *ptr) {
+    return ((uint32_t)(uint64_t)ptr) | 0xC0000000;
+}
+
+/* Blocks req moves, or -1 if it isn't something one command can do:
+ * 1..HAL_BLK_MAX_SEGS segments, each a non-zero multiple of 512 bytes,
+ * EMMC_MAX_BLOCKS in all */
+int emmc_req_blocks(const hal_blk_req_t *req);
+
+/* Blocks the next command of a count-block run should move */
+uint32_t emmc_chunk_blocks(uint32_t count);
+
+/* Fill in one control block per segment of a checked request, chained,
+ * moving the data between the segments and the EMMC data register.
+ * Returns the bytes covered. */
+uint32_t emmc_dma_chain(emmc_dma_cb_t *cbs, const hal_blk_req_t *req);
+
+/* CMDTM for a multi-block transfer: CMD18 read or CMD25 write, ended by
+ * a block count sent ahead (CMD23) where the card takes it, else CMD12 */
+uint32_t emmc_transfer_cmd(int write, int cmd23);
+
+/* How a transfer went, from the controller's interrupt flags and the DMA
+ * channel's CS once the card says it is done: 0 if every byte arrived,
+ * -1 on an error interrupt, a DMA error or a channel that never drained */
+int emmc_transfer_status(uint32_t intr, uint32_t dma_cs);
+
+#endif
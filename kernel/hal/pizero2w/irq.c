@@ -7,12 +7,17 @@
  *
  * When a peripheral fires, it signals the VideoCore IC, which then signals
  * the ARM Local controller on bit 8, which finally raises the CPU IRQ line.
+ *
+ * Peripheral interrupts are routed to core 0. Every core has its own timer.
  */
 
 #include "../hal.h"
 #include "../../printf.h"
 #include "../../string.h"
 #include "../../process.h"
+#include "../../smp.h"
+#include "../../ktimer.h"
+#include "../../softirq.h"
 
 void led_init(void);
 void led_toggle(void);
@@ -28,10 +33,12 @@ static void on_timer_tick(void);
 static volatile uint32_t *const core_timer_cfg     = (uint32_t *)(CORE_CTRL_BASE + 0x00);
 static volatile uint32_t *const core_timer_scale   = (uint32_t *)(CORE_CTRL_BASE + 0x08);
 static volatile uint32_t *const core_gpu_route     = (uint32_t *)(CORE_CTRL_BASE + 0x0C);
-static volatile uint32_t *const core0_timer_ctl    = (uint32_t *)(CORE_CTRL_BASE + 0x40);
-static volatile uint32_t *const core0_irq_src      = (uint32_t *)(CORE_CTRL_BASE + 0x60);
 
-/* Bits in core0_irq_src */
+/* One word per core */
+#define CORE_TIMER_CTL(core)  ((volatile uint32_t *)(CORE_CTRL_BASE + 0x40UL + 4 * (core)))
+#define CORE_IRQ_SRC(core)    ((volatile uint32_t *)(CORE_CTRL_BASE + 0x60UL + 4 * (core)))
+
+/* Bits in CORE_IRQ_SRC */
 #define CORE_IRQ_PHYS_SECURE    0x01
 #define CORE_IRQ_PHYS_NONSEC    0x02
 #define CORE_IRQ_HYP_TIMER      0x04
@@ -87,7 +94,6 @@ static const uint8_t bank2_fast_irqs[] = { 21, 22, 23, 24, 25, 30 };
 #define IRQ_VC_USB          (8 + 9) /* USB is bank1 IRQ 9 */
 
 static void (*dispatch_table[TOTAL_IRQS])(void);
-static uint32_t tick_period_ms = 1;  // 1ms = 1000Hz polling (USB spec max)
 static uint64_t tick_count = 0;
 
 /* Count trailing zeros - returns bit position of lowest set bit, or 32 if zero */
@@ -124,7 +130,7 @@ static void setup_core_timer_block(void) {
     mem_barrier();
 
     /* Enable the non-secure physical timer interrupt */
-    *core0_timer_ctl = CORE_IRQ_PHYS_NONSEC;
+    *CORE_TIMER_CTL(0) = CORE_IRQ_PHYS_NONSEC;
     mem_barrier();
 
     printf("[IRQ] Core timer block configured\n");
@@ -211,7 +217,7 @@ static void service_peripheral_irqs(void) {
  * Top-level IRQ handler, called from exception vectors
  */
 void handle_irq(void) {
-    uint32_t src = *core0_irq_src;
+    uint32_t src = *CORE_IRQ_SRC(smp_cpu_id());
 
     /* Physical timer fired? */
     if (src & CORE_IRQ_PHYS_NONSEC) {
@@ -226,6 +232,9 @@ void handle_irq(void) {
     }
 
     /* PMU could be handled here if needed */
+
+    // Deferred work the handlers raised (still with IRQs masked)
+    softirq_run();
 }
 
 // DWC2 registers for debug
@@ -237,15 +246,25 @@ void handle_irq(void) {
 #define DWC2_HFNUM      (*(volatile uint32_t *)(USB_BASE_ADDR + 0x408))
 
 /*
- * Timer tick handler - reschedules itself for the next interval
+ * Timer interrupt - the timer is one-shot, programmed for this core's next
+ * tick or kernel timer deadline, whichever comes first
  */
 static void on_timer_tick(void) {
-    tick_count++;
+    cpu_t *cpu = this_cpu();
+    int tick = ktimer_expire();
 
-    /* Reload for next tick */
-    uint64_t freq;
-    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
-    asm volatile("msr cntp_tval_el0, %0" :: "r"((freq * tick_period_ms) / 1000));
+    // Preemptive scheduling - switches on expired timeslices, or when a
+    // kernel timer woke something more important
+    process_schedule_from_irq(tick);
+
+    // Re-arm (this also clears the interrupt)
+    ktimer_reprogram();
+
+    // System time, LED and USB belong to the boot core
+    if (!tick || cpu->id != 0) {
+        return;
+    }
+    tick_count++;
 
     // Heartbeat LED - toggle every 500ms (50 ticks) = 1Hz
     // (Disk activity will override with faster blinks during I/O)
@@ -257,11 +276,6 @@ static void on_timer_tick(void) {
     // This is much more efficient than SOF-based polling (1000 IRQs/sec)
     hal_usb_keyboard_tick();
 
-    // Preemptive scheduling - switch every 20 ticks (200ms timeslice)
-    if ((tick_count % 20) == 0) {
-        process_schedule_from_irq();
-    }
-
     // NOTE: Cursor blink disabled on Pi - was interfering with USB keyboard
     // TODO: Investigate why console_blink_cursor() breaks USB on real hardware
 
@@ -291,6 +305,12 @@ void hal_irq_init(void) {
     printf("[IRQ] Pi interrupt system ready\n");
 }
 
+// Secondary core: only its timer. Peripherals stay on core 0.
+void hal_irq_init_cpu(void) {
+    *CORE_TIMER_CTL(smp_cpu_id()) = CORE_IRQ_PHYS_NONSEC;
+    mem_barrier();
+}
+
 void hal_irq_enable(void) {
     asm volatile("msr daifclr, #2" ::: "memory");
 }
@@ -303,7 +323,7 @@ void hal_irq_enable_irq(uint32_t irq) {
     if (irq < 8) {
         /* Core-local: only timer supported currently */
         if (irq == IRQ_TIMER_NS) {
-            *core0_timer_ctl |= CORE_IRQ_PHYS_NONSEC;
+            *CORE_TIMER_CTL(smp_cpu_id()) |= CORE_IRQ_PHYS_NONSEC;
             mem_barrier();
         }
     } else if (irq < 40) {
@@ -318,7 +338,7 @@ void hal_irq_enable_irq(uint32_t irq) {
 void hal_irq_disable_irq(uint32_t irq) {
     if (irq < 8) {
         if (irq == IRQ_TIMER_NS) {
-            *core0_timer_ctl &= ~CORE_IRQ_PHYS_NONSEC;
+            *CORE_TIMER_CTL(smp_cpu_id()) &= ~CORE_IRQ_PHYS_NONSEC;
             mem_barrier();
         }
     } else if (irq < 40) {
@@ -339,16 +359,15 @@ void hal_irq_register_handler(uint32_t irq, void (*handler)(void)) {
 /* ========== Timer HAL ========== */
 
 void hal_timer_init(uint32_t interval_ms) {
-    tick_period_ms = interval_ms;
     tick_count = 0;
 
     uint64_t freq;
     asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
 
-    printf("[TIMER] Clock: %llu Hz, period: %u ms\n", freq, interval_ms);
+    printf("[TIMER] Clock: %llu Hz, period: %u ms, one-shot\n", freq, interval_ms);
 
-    /* Program countdown value */
-    asm volatile("msr cntp_tval_el0, %0" :: "r"((freq * interval_ms) / 1000));
+    /* Program the first deadline (absolute compare value) */
+    ktimer_init(interval_ms);
 
     /* Enable timer, don't mask output */
     asm volatile("msr cntp_ctl_el0, %0" :: "r"(1UL));
@@ -356,10 +375,21 @@ void hal_timer_init(uint32_t interval_ms) {
     printf("[TIMER] Generic timer running\n");
 }
 
+// Secondary core: enable its timer, idle (no deadline) until it gets work
+void hal_timer_init_cpu(void) {
+    ktimer_reprogram();
+    asm volatile("msr cntp_ctl_el0, %0" :: "r"(1UL));
+}
+
+// The USB keyboard has no usable interrupt and is polled from the tick
+int hal_timer_wants_tick(void) {
+    return 1;
+}
+
 uint64_t hal_timer_get_ticks(void) {
     return tick_count;
 }
 
 void hal_timer_set_interval(uint32_t interval_ms) {
-    tick_period_ms = interval_ms;
+    ktimer_init(interval_ms);
 }
@@ -183,6 +183,19 @@ int hal_get_cpu_cores(void) {
     return 4;  // Pi Zero 2W has 4 cores
 }
 
+// armstub8 parks cores 1-3 in wfe, each polling its slot of the spin table
+// at 0xD8 (0xE0, 0xE8, 0xF0) and jumping to it at EL2 with the MMU off
+#define SPIN_TABLE_BASE 0xD8
+
+int hal_cpu_start(int cpu, void (*entry)(void)) {
+    if (cpu <= 0 || cpu >= 4) return -1;
+    volatile uint64_t *slot = (volatile uint64_t *)(uintptr_t)(SPIN_TABLE_BASE + cpu * 8);
+    *slot = (uint64_t)entry;
+    cache_clean_range((const void *)slot, sizeof(uint64_t));
+    asm volatile("sev" ::: "memory");
+    return 0;
+}
+
 // USB Device List
 int hal_usb_get_device_count(void) {
     return usb_state.num_devices;
@@ -3,14 +3,17 @@
  *
  * GIC-400 (GICv2) driver for QEMU virt machine.
  * Distributor at 0x08000000, CPU Interface at 0x08010000.
+ * SPIs all go to CPU 0; each core has its own banked timer PPI.
  */
 
 #include "../hal.h"
 #include "../../printf.h"
 #include "../../irq.h"
-#include "../../virtio_sound.h"
 #include "../../console.h"
 #include "../../process.h"
+#include "../../smp.h"
+#include "../../ktimer.h"
+#include "../../softirq.h"
 
 // QEMU virt machine GIC addresses
 #define GICD_BASE   0x08000000UL  // Distributor
@@ -43,11 +46,6 @@
 // IRQ handlers
 static void (*irq_handlers[MAX_IRQS])(void);
 
-// Timer state
-static uint64_t timer_ticks = 0;
-static uint32_t timer_interval_ticks = 0;
-static uint32_t timer_freq = 0;
-
 // Memory barriers
 static inline void dsb(void) {
     asm volatile("dsb sy" ::: "memory");
@@ -57,21 +55,17 @@ static inline void isb(void) {
     asm volatile("isb" ::: "memory");
 }
 
-// Timer IRQ handler
+// Timer IRQ handler (every core has its own timer, programmed one-shot
+// for its next tick or kernel timer deadline)
 static void timer_handler(void) {
-    timer_ticks++;
-
-    // Pump audio if playing
-    virtio_sound_pump();
+    int tick = ktimer_expire();
 
-    // Preemptive scheduling - switch every 20 ticks (200ms timeslice)
-    if ((timer_ticks % 20) == 0) {
-        process_schedule_from_irq();
-    }
+    // Preemptive scheduling - switches on expired timeslices, or when a
+    // kernel timer woke something more important
+    process_schedule_from_irq(tick);
 
-    // Reload timer
-    asm volatile("msr cntp_tval_el0, %0" :: "r"(timer_interval_ticks));
-    isb();
+    // Re-arm (this also clears the interrupt)
+    ktimer_reprogram();
 }
 
 // ============================================================================
@@ -147,6 +141,23 @@ void hal_irq_init(void) {
     printf("[IRQ] GIC initialized (Secure, Group 0)\n");
 }
 
+// Secondary core: SGIs/PPIs and the CPU interface are banked per core, so
+// they need the same setup hal_irq_init did for the boot core
+void hal_irq_init_cpu(void) {
+    GICD_ICENABLER(0) = 0xFFFFFFFF;
+    GICD_ICPENDR(0) = 0xFFFFFFFF;
+    GICD_IGROUPR(0) = 0x00000000;
+    for (uint32_t i = 0; i < 8; i++) {
+        GICD_IPRIORITYR(i) = 0xA0A0A0A0;
+    }
+    dsb();
+
+    GICC_PMR = 0xFF;
+    dsb();
+    GICC_CTLR = 0x1;
+    dsb();
+}
+
 void hal_irq_enable(void) {
     asm volatile("msr daifclr, #2" ::: "memory");
 }
@@ -184,17 +195,13 @@ void hal_irq_register_handler(uint32_t irq, void (*handler)(void)) {
 // ============================================================================
 
 void hal_timer_init(uint32_t interval_ms) {
-    // Get timer frequency
-    asm volatile("mrs %0, cntfrq_el0" : "=r"(timer_freq));
-    printf("[TIMER] Frequency: %u Hz\n", timer_freq);
-
-    // Calculate ticks per interval
-    timer_interval_ticks = (timer_freq / 1000) * interval_ms;
-    printf("[TIMER] Interval: %u ms (%u ticks)\n", interval_ms, timer_interval_ticks);
+    uint64_t freq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+    printf("[TIMER] Frequency: %llu Hz\n", freq);
 
-    // Set timer value
-    asm volatile("msr cntp_tval_el0, %0" :: "r"(timer_interval_ticks));
-    isb();
+    // Program the first deadline before enabling, so it can't fire early
+    ktimer_init(interval_ms);
+    printf("[TIMER] Tick: %u ms (%llu counts), one-shot\n", interval_ms, ktimer_tick_count());
 
     // Enable timer
     asm volatile("msr cntp_ctl_el0, %0" :: "r"((uint64_t)1));
@@ -206,12 +213,28 @@ void hal_timer_init(uint32_t interval_ms) {
     printf("[TIMER] Timer initialized\n");
 }
 
+// Secondary core: enable its timer, idle (no deadline) until it gets work
+void hal_timer_init_cpu(void) {
+    ktimer_reprogram();
+    asm volatile("msr cntp_ctl_el0, %0" :: "r"((uint64_t)1));
+    isb();
+
+    // PPI enable is banked - this only affects the calling core
+    hal_irq_enable_irq(TIMER_IRQ);
+}
+
+// Nothing here is polled (devices interrupt, audio runs off a kernel
+// timer), so the boot core goes tickless too
+int hal_timer_wants_tick(void) {
+    return 0;
+}
+
 uint64_t hal_timer_get_ticks(void) {
-    return timer_ticks;
+    return ktimer_uptime_ticks();
 }
 
 void hal_timer_set_interval(uint32_t interval_ms) {
-    timer_interval_ticks = (timer_freq / 1000) * interval_ms;
+    ktimer_init(interval_ms);
 }
 
 // ============================================================================
@@ -243,4 +266,7 @@ void handle_irq(void) {
     dsb();
     GICC_EOIR = iar;
     dsb();
+
+    // Deferred work the handler raised (still with IRQs masked)
+    softirq_run();
 }
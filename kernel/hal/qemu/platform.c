@@ -3,6 +3,8 @@
  */
 
 #include "../hal.h"
+#include "../../dtb.h"
+#include "../../mmu.h"
 
 const char *hal_platform_name(void) {
     return "QEMU virt (aarch64)";
@@ -100,7 +102,20 @@ uint32_t hal_get_cpu_freq_mhz(void) {
 }
 
 int hal_get_cpu_cores(void) {
-    return 1;  // Single core in QEMU by default
+    int n = dtb_cpu_count();  // QEMU lists one cpu@N node per -smp core
+    return n > 0 ? n : 1;
+}
+
+// We are the firmware (-bios, EL3), so there is no PSCI to ask. boot.S
+// parks the secondaries in wfe, polling this table for an entry address.
+volatile uint64_t spin_table[4];
+
+int hal_cpu_start(int cpu, void (*entry)(void)) {
+    if (cpu <= 0 || cpu >= 4) return -1;
+    spin_table[cpu] = (uint64_t)entry;
+    dcache_clean_range((const void *)&spin_table[cpu], sizeof(uint64_t));
+    asm volatile("sev" ::: "memory");
+    return 0;
 }
 
 // USB Device List - QEMU uses virtio, no USB
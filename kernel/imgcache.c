@@ -0,0 +1,287 @@
+/*
+ * KikiOS Program Image Cache
+ *
+ * Cached images sit on one list. refs counts the programs running from an
+ * image; one that has left the list (invalidated, or never fit under the
+ * cap) is freed when the last of them goes. Building an image reads the
+ * file without the lock held, so two launches of the same new program may
+ * both build one - the second just throws its copy away.
+ */
+
+#include "imgcache.h"
+#include "mmu.h"
+#include "memory.h"
+#include "string.h"
+#include "printf.h"
+#include "spinlock.h"
+
+#define PAGE_SIZE   0x1000ULL
+#define PAGE_UP(x)  (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+struct image {
+    struct image *next;
+    char name[64];              // Path it was first launched as (for the log)
+    uint32_t file_id;           // First cluster (vfs_file_id)
+    size_t file_size;
+    elf_image_t hdr;
+
+    uint8_t *text;              // Program bytes [0, text_size), page aligned
+    void *text_alloc;
+    uint64_t text_size;
+    uint8_t *data;              // [data_vaddr, data_vaddr + data_size) before relocation
+    uint64_t data_vaddr;
+    uint64_t data_size;
+
+    int refs;                   // Programs running from it
+    int cached;                 // On the list
+    uint64_t last_used;
+};
+
+static spinlock_t cache_lock = SPINLOCK_INIT;
+static image_t *cache_head = NULL;
+static uint64_t cache_bytes = 0;
+static uint64_t use_clock = 0;
+static uint32_t lookups = 0;
+static uint32_t hits = 0;
+
+static uint64_t image_bytes(image_t *img) {
+    return img->text_size + img->data_size;
+}
+
+static void image_free(image_t *img) {
+    free(img->text_alloc);
+    free(img->data);
+    free(img);
+}
+
+// Take an image off the list (caller holds cache_lock)
+static void unlink_image(image_t *img) {
+    image_t **pp = &cache_head;
+    while (*pp && *pp != img) pp = &(*pp)->next;
+    if (*pp) *pp = img->next;
+    img->next = NULL;
+    img->cached = 0;
+    cache_bytes -= image_bytes(img);
+}
+
+// [vaddr, vaddr + len) of the program within our copy, or NULL
+static void *image_at(image_t *img, uint64_t vaddr, uint64_t len) {
+    if (vaddr + len <= img->text_size) return img->text + vaddr;
+    if (vaddr >= img->data_vaddr && vaddr + len <= img->data_vaddr + img->data_size) {
+        return img->data + (vaddr - img->data_vaddr);
+    }
+    return NULL;
+}
+
+// The code is shared, so relocations may only patch the data
+static int relocs_in_data(image_t *img) {
+    const elf_image_t *hdr = &img->hdr;
+    for (int i = 0; i < hdr->ehdr.e_phnum; i++) {
+        const Elf64_Phdr *phdr = &hdr->phdr[i];
+        if (phdr->p_type != PT_DYNAMIC) continue;
+
+        const Elf64_Dyn *dyn = image_at(img, phdr->p_vaddr, phdr->p_filesz);
+        if (!dyn) return 0;
+
+        uint64_t rela_addr = 0, rela_size = 0;
+        int count = (int)(phdr->p_filesz / sizeof(Elf64_Dyn));
+        for (int d = 0; d < count && dyn[d].d_tag != DT_NULL; d++) {
+            if (dyn[d].d_tag == DT_RELA) rela_addr = dyn[d].d_val;
+            if (dyn[d].d_tag == DT_RELASZ) rela_size = dyn[d].d_val;
+        }
+        if (!rela_size) return 1;
+
+        const Elf64_Rela *rela = image_at(img, rela_addr, rela_size);
+        if (!rela) return 0;
+        for (uint64_t r = 0; r < rela_size / sizeof(Elf64_Rela); r++) {
+            if (rela[r].r_offset < img->data_vaddr) return 0;
+        }
+    }
+    return 1;
+}
+
+// Read a program into a new image. NULL if it isn't laid out as code
+// followed by data on a later page (user/linker.ld), or on I/O errors.
+static image_t *image_build(vfs_node_t *file, const char *path, uint32_t file_id) {
+    image_t *img = malloc(sizeof(image_t));
+    if (!img) return NULL;
+    memset(img, 0, sizeof(image_t));
+
+    const elf_image_t *hdr = &img->hdr;
+    if (elf_read_headers(file, &img->hdr) != 0 || hdr->ehdr.e_type != ET_DYN) goto fail;
+
+    uint64_t code_end = 0;
+    uint64_t data_start = ~0ULL;
+    uint64_t data_end = 0;
+    for (int i = 0; i < hdr->ehdr.e_phnum; i++) {
+        const Elf64_Phdr *phdr = &hdr->phdr[i];
+        if (phdr->p_type != PT_LOAD) continue;
+        if (phdr->p_flags & PF_W) {
+            if (phdr->p_vaddr < data_start) data_start = phdr->p_vaddr;
+            if (phdr->p_vaddr + phdr->p_filesz > data_end) data_end = phdr->p_vaddr + phdr->p_filesz;
+        } else if (phdr->p_vaddr + phdr->p_memsz > code_end) {
+            code_end = phdr->p_vaddr + phdr->p_memsz;
+        }
+    }
+    if (data_start == ~0ULL || PAGE_UP(code_end) > (data_start & ~(PAGE_SIZE - 1))) goto fail;
+
+    img->text_size = PAGE_UP(code_end);
+    img->data_vaddr = data_start;
+    img->data_size = data_end > data_start ? data_end - data_start : 0;
+
+    img->text_alloc = malloc(img->text_size + PAGE_SIZE);
+    img->data = malloc(img->data_size ? img->data_size : 1);
+    if (!img->text_alloc || !img->data) goto fail;
+    img->text = (uint8_t *)PAGE_UP((uint64_t)img->text_alloc);
+    memset(img->text, 0, img->text_size);
+    memset(img->data, 0, img->data_size);
+
+    for (int i = 0; i < hdr->ehdr.e_phnum; i++) {
+        const Elf64_Phdr *phdr = &hdr->phdr[i];
+        if (phdr->p_type != PT_LOAD || phdr->p_filesz == 0) continue;
+        uint8_t *dest = (phdr->p_flags & PF_W) ? img->data + (phdr->p_vaddr - data_start)
+                                               : img->text + phdr->p_vaddr;
+        if (vfs_read(file, (char *)dest, phdr->p_filesz, phdr->p_offset) != (int)phdr->p_filesz) {
+            goto fail;
+        }
+    }
+    if (!relocs_in_data(img)) goto fail;
+
+    // It will be executed at other addresses, but it's the same memory
+    icache_sync_range(img->text, img->text_size);
+
+    strncpy(img->name, path, sizeof(img->name) - 1);
+    img->file_id = file_id;
+    img->file_size = file->size;
+    return img;
+
+fail:
+    image_free(img);
+    return NULL;
+}
+
+image_t *imgcache_get(vfs_node_t *file, const char *path) {
+    // Sharing pages between programs needs the MMU
+    if (!mmu_demand_paging()) return NULL;
+    uint32_t file_id = vfs_file_id(file);
+    if (!file_id) return NULL;
+
+    uint64_t flags = spin_lock_irqsave(&cache_lock);
+    lookups++;
+    image_t *img = cache_head;
+    while (img && (img->file_id != file_id || img->file_size != file->size)) img = img->next;
+    if (img) {
+        img->refs++;
+        img->last_used = ++use_clock;
+        hits++;
+    }
+    uint32_t h = hits, n = lookups;
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    if (img) {
+        printf("[EXEC] %s: cached image (hit rate %u/%u)\n", path, h, n);
+        return img;
+    }
+
+    img = image_build(file, path, file_id);
+    if (!img) return NULL;
+
+    image_t *victims = NULL;
+    flags = spin_lock_irqsave(&cache_lock);
+
+    // Somebody else just built it - use theirs
+    image_t *dup = cache_head;
+    while (dup && (dup->file_id != file_id || dup->file_size != file->size)) dup = dup->next;
+    if (dup) {
+        dup->refs++;
+        dup->last_used = ++use_clock;
+        spin_unlock_irqrestore(&cache_lock, flags);
+        image_free(img);
+        return dup;
+    }
+
+    // Make room, least recently used first. Images in use can't go.
+    while (cache_bytes + image_bytes(img) > IMGCACHE_MAX_BYTES) {
+        image_t *lru = NULL;
+        for (image_t *i = cache_head; i; i = i->next) {
+            if (i->refs == 0 && (!lru || i->last_used < lru->last_used)) lru = i;
+        }
+        if (!lru) break;
+        unlink_image(lru);
+        lru->next = victims;
+        victims = lru;
+    }
+
+    img->refs = 1;
+    img->last_used = ++use_clock;
+    if (cache_bytes + image_bytes(img) <= IMGCACHE_MAX_BYTES) {
+        img->next = cache_head;
+        cache_head = img;
+        img->cached = 1;
+        cache_bytes += image_bytes(img);
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    while (victims) {
+        image_t *next = victims->next;
+        image_free(victims);
+        victims = next;
+    }
+
+    printf("[EXEC] %s: read into image cache, %d KB shared code (hit rate %u/%u)\n",
+           path, (int)(img->text_size / 1024), h, n);
+    return img;
+}
+
+const elf_image_t *imgcache_headers(image_t *image) {
+    return &image->hdr;
+}
+
+int imgcache_load(image_t *image, uint64_t base, elf_load_info_t *info) {
+    if (mmu_map_shared(base, image->text, image->text_size) != 0) return -1;
+
+    // Data gets a private copy; BSS and the rest of its last page are still
+    // untouched demand-paged memory, so they read as zeros
+    memcpy((void *)(base + image->data_vaddr), image->data, image->data_size);
+    elf_relocate(&image->hdr, base);
+
+    info->entry = base + image->hdr.ehdr.e_entry;
+    info->load_base = base;
+    info->load_size = image->hdr.span;
+    return 0;
+}
+
+void imgcache_put(image_t *image) {
+    uint64_t flags = spin_lock_irqsave(&cache_lock);
+    image->refs--;
+    int dead = !image->cached && image->refs == 0;
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    if (dead) image_free(image);
+}
+
+void imgcache_invalidate(uint32_t first_cluster) {
+    image_t *victims = NULL;
+
+    uint64_t flags = spin_lock_irqsave(&cache_lock);
+    image_t *img = cache_head;
+    while (img) {
+        image_t *next = img->next;
+        if (img->file_id == first_cluster) {
+            unlink_image(img);
+            // Programs still running it keep it until they exit
+            if (img->refs == 0) {
+                img->next = victims;
+                victims = img;
+            }
+        }
+        img = next;
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    while (victims) {
+        image_t *next = victims->next;
+        image_free(victims);
+        victims = next;
+    }
+}
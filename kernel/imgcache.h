@@ -0,0 +1,46 @@
+/*
+ * KikiOS Program Image Cache
+ *
+ * The shell and the dock launch the same few programs over and over. The
+ * first launch reads a binary into kernel memory once: its code segment as
+ * a page-aligned copy, and the initial contents of its writable segment.
+ * Every later launch maps the cached code read-only into its program
+ * region - all running copies share it - and only copies and relocates
+ * the data. Nothing is read from disk.
+ *
+ * An image is identified by its file's first cluster and size (FAT32 here
+ * keeps no modification times), and dropped as soon as those clusters are
+ * freed, which is how files get rewritten or deleted. Images nobody is
+ * running are evicted least recently used first to stay under
+ * IMGCACHE_MAX_BYTES.
+ */
+
+#ifndef IMGCACHE_H
+#define IMGCACHE_H
+
+#include <stdint.h>
+#include "elf.h"
+#include "vfs.h"
+
+#define IMGCACHE_MAX_BYTES  (16 * 1024 * 1024)
+
+typedef struct image image_t;
+
+// Find or build the cached image of an ELF file, with a reference held.
+// NULL if it can't be cached (not split into code and data segments, MMU
+// off, ...) - load it with elf_load_file instead.
+image_t *imgcache_get(vfs_node_t *file, const char *path);
+
+// ELF headers of a cached image
+const elf_image_t *imgcache_headers(image_t *image);
+
+// Set up a program from a cached image in a fresh region at base
+int imgcache_load(image_t *image, uint64_t base, elf_load_info_t *info);
+
+// Drop a reference taken by imgcache_get (the program is gone)
+void imgcache_put(image_t *image);
+
+// The cluster chain starting here is being freed (fat32.c)
+void imgcache_invalidate(uint32_t first_cluster);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * KikiOS Disk Benchmark
+ *
+ * Random 4KB reads straight from the block device (no cache), keeping 1,
+ * 2, 4 ... 32 requests in flight through hal_blk_submit/hal_blk_wait.
+ * IOPS should grow with the depth where the device queues requests.
+ * Read only, so safe on a live disk. Run from the kernel shell: iobench
+ */
+
+#include "iobench.h"
+#include "hal/hal.h"
+#include "ktimer.h"
+#include "memory.h"
+#include "printf.h"
+#include <stdint.h>
+
+#define IO_SIZE         4096
+#define IO_SECTORS      (IO_SIZE / 512)
+#define SPAN_SECTORS    (32 * 1024 * 1024 / 512)    // Reads land in the first 32MB
+#define IOS_PER_DEPTH   2048
+#define MAX_DEPTH       32
+
+static hal_blk_req_t reqs[MAX_DEPTH];
+
+static uint32_t rng_state = 2463534242u;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static int submit_random(hal_blk_req_t *req, uint8_t *buf) {
+    req->sector = (rng() % (SPAN_SECTORS / IO_SECTORS)) * IO_SECTORS;
+    req->write = 0;
+    req->nsegs = 1;
+    req->buf[0] = buf;
+    req->len[0] = IO_SIZE;
+    return hal_blk_submit(req);
+}
+
+// Keep depth reads in flight until IOS_PER_DEPTH have completed
+static void bench_depth(int depth, uint8_t *bufs) {
+    int started = 0;
+    int finished = 0;
+    int errors = 0;
+
+    uint64_t t0 = ktimer_uptime_us();
+    while (finished < IOS_PER_DEPTH) {
+        while (started < IOS_PER_DEPTH && started - finished < depth) {
+            int slot = started % depth;
+            if (submit_random(&reqs[slot], bufs + slot * IO_SIZE) < 0) {
+                printf("iobench: submit failed\n");
+                return;
+            }
+            started++;
+        }
+        if (hal_blk_wait(&reqs[finished % depth]) < 0) errors++;
+        finished++;
+    }
+    uint64_t us = ktimer_uptime_us() - t0;
+    if (us == 0) us = 1;
+
+    uint32_t iops = (uint32_t)((uint64_t)IOS_PER_DEPTH * 1000000 / us);
+    printf("  depth %2d: %6u IOPS  %6u KB/s  (%u ms)",
+           depth, iops, iops * (IO_SIZE / 1024), (uint32_t)(us / 1000));
+    if (errors) printf("  %d errors", errors);
+    printf("\n");
+}
+
+void iobench_run(void) {
+    uint8_t *mem = malloc(MAX_DEPTH * IO_SIZE + IO_SIZE);
+    if (!mem) {
+        printf("iobench: out of memory\n");
+        return;
+    }
+    // Page aligned, so DMA cache maintenance never touches a neighbour
+    uint8_t *bufs = (uint8_t *)(((uint64_t)mem + IO_SIZE - 1) & ~(uint64_t)(IO_SIZE - 1));
+
+    printf("Random %d KB reads, %d per depth:\n", IO_SIZE / 1024, IOS_PER_DEPTH);
+    for (int depth = 1; depth <= MAX_DEPTH; depth *= 2) {
+        bench_depth(depth, bufs);
+    }
+    free(mem);
+}
@@ -0,0 +1,11 @@
+/*
+ * KikiOS Disk Benchmark
+ */
+
+#ifndef IOBENCH_H
+#define IOBENCH_H
+
+// Print random 4KB read IOPS at increasing queue depths
+void iobench_run(void);
+
+#endif
@@ -12,6 +12,7 @@
 #include "hal/hal.h"
 #include "fb.h"
 #include "process.h"
+#include "ktimer.h"
 
 // Direct UART output (always works, even if printf goes to screen)
 extern void uart_puts(const char *s);
@@ -78,15 +79,35 @@ void wfi(void) {
     asm volatile("wfi");
 }
 
-void sleep_ms(uint32_t ms) {
-    // Timer runs at 100Hz (10ms per tick)
-    uint64_t ticks_to_wait = (ms + 9) / 10;
-    if (ticks_to_wait == 0) ticks_to_wait = 1;
+uint64_t timer_get_uptime_us(void) {
+    return ktimer_uptime_us();
+}
+
+static void sleep_for(uint64_t us) {
+    uint64_t deadline = ktimer_now() + ktimer_us_to_count(us);
+
+    // A process blocks on a kernel timer so the core can run something else
+    if (process_current()) {
+        process_sleep_until(deadline);
+        return;
+    }
 
-    uint64_t target = hal_timer_get_ticks() + ticks_to_wait;
-    while (hal_timer_get_ticks() < target) {
-        wfi();
+    // Kernel thread: a timer with no callback still makes sure some core
+    // wakes at the deadline, and ktimer_expire's sev wakes us from wfe
+    ktimer_t t = { 0 };
+    ktimer_add(&t, deadline);
+    while (ktimer_now() < deadline) {
+        asm volatile("wfe");
     }
+    ktimer_cancel(&t);
+}
+
+void sleep_us(uint32_t us) {
+    sleep_for(us);
+}
+
+void sleep_ms(uint32_t ms) {
+    sleep_for((uint64_t)ms * 1000);
 }
 
 // ============================================================================
@@ -348,9 +369,9 @@ void handle_sync_exception(uint64_t esr, uint64_t elr, uint64_t far, uint64_t *r
         uart_puts((iss & (1 << 6)) ? "Write" : "Read");
         uart_puts("\n");
     }
-    if (current_process) {
+    if (process_current()) {
         uart_puts("  Process:        ");
-        uart_puts(current_process->name);
+        uart_puts(process_current()->name);
         uart_puts("\n");
     }
     if (regs) {
@@ -380,10 +401,10 @@ void handle_sync_exception(uint64_t esr, uint64_t elr, uint64_t far, uint64_t *r
             uart_puts("    ["); uart_putc('0' + depth); uart_puts("] ");
             uart_puthex(ret_addr);
             // Show location
-            if (current_process && ret_addr >= current_process->load_base &&
-                ret_addr < current_process->load_base + current_process->load_size) {
-                uart_puts(" ("); uart_puts(current_process->name); uart_puts(" +");
-                uart_puthex(ret_addr - current_process->load_base); uart_puts(")");
+            if (process_current() && ret_addr >= process_current()->load_base &&
+                ret_addr < process_current()->load_base + process_current()->load_size) {
+                uart_puts(" ("); uart_puts(process_current()->name); uart_puts(" +");
+                uart_puthex(ret_addr - process_current()->load_base); uart_puts(")");
             } else {
                 uart_puts(" (kernel +");
                 uart_puthex(ret_addr - (uint64_t)_kernel_start);
@@ -428,9 +449,9 @@ void handle_sync_exception(uint64_t esr, uint64_t elr, uint64_t far, uint64_t *r
         // Left column - Exception info, Right column - Process/uptime
         wsod_draw_text(left_col, info_y, "Exception:");
         wsod_draw_text(left_col + 96, info_y, get_exception_name(ec));
-        if (current_process) {
+        if (process_current()) {
             wsod_draw_text(right_col, info_y, "Process:");
-            wsod_draw_text(right_col + 72, info_y, current_process->name);
+            wsod_draw_text(right_col + 72, info_y, process_current()->name);
         }
         info_y += 16;
 
@@ -522,16 +543,16 @@ void handle_sync_exception(uint64_t esr, uint64_t elr, uint64_t far, uint64_t *r
                 trace_buf[pos++] = ' '; trace_buf[pos++] = '(';
 
                 // Determine location - check process first, then assume kernel
-                if (current_process && ret_addr >= current_process->load_base &&
-                    ret_addr < current_process->load_base + current_process->load_size) {
+                if (process_current() && ret_addr >= process_current()->load_base &&
+                    ret_addr < process_current()->load_base + process_current()->load_size) {
                     // Current process
-                    const char *name = current_process->name;
+                    const char *name = process_current()->name;
                     // Just show last part of path
                     const char *slash = name;
                     for (const char *p = name; *p; p++) if (*p == '/') slash = p + 1;
                     while (*slash && pos < 60) trace_buf[pos++] = *slash++;
                     trace_buf[pos++] = ' '; trace_buf[pos++] = '+';
-                    wsod_hex(buf, ret_addr - current_process->load_base);
+                    wsod_hex(buf, ret_addr - process_current()->load_base);
                     for (int i = 0; buf[i]; i++) trace_buf[pos++] = buf[i];
                 } else {
                     // Kernel - use linker-provided base address
@@ -585,9 +606,9 @@ void handle_serror(uint64_t esr) {
     uart_puts("  KERNEL PANIC: SError (Async Abort)\n");
     uart_puts("========================================\n");
     uart_puts("  ESR: "); uart_puthex(esr); uart_puts("\n");
-    if (current_process) {
+    if (process_current()) {
         uart_puts("  Process: ");
-        uart_puts(current_process->name);
+        uart_puts(process_current()->name);
         uart_puts("\n");
     }
     uart_puts("========================================\n");
@@ -621,9 +642,9 @@ void handle_serror(uint64_t esr) {
         wsod_draw_text(left_col, info_y, "Exception:");
         wsod_draw_text(left_col + 136, info_y, "SError (Async Abort)");
 
-        if (current_process) {
+        if (process_current()) {
             wsod_draw_text(right_col, info_y, "Process:");
-            wsod_draw_text(right_col + 80, info_y, current_process->name);
+            wsod_draw_text(right_col + 80, info_y, process_current()->name);
         }
         info_y += 20;
 
@@ -35,11 +35,15 @@ void timer_set_interval(uint32_t interval_ms);
 // Get timer interrupt count (for debugging)
 uint64_t timer_get_ticks(void);
 
+// Microseconds since the timer was initialized
+uint64_t timer_get_uptime_us(void);
+
 // Wait for interrupt (low power sleep until next interrupt)
 void wfi(void);
 
-// Sleep for at least the specified number of milliseconds
-// Uses timer ticks (10ms resolution with 100Hz timer)
+// Sleep for at least the specified time (one-shot timer, microsecond
+// resolution - not rounded to ticks)
 void sleep_ms(uint32_t ms);
+void sleep_us(uint32_t us);
 
 #endif // IRQ_H
@@ -20,6 +20,9 @@
 #include "klog.h"
 #include "ftp.h"
 #include "winexec.h"
+#include "smp.h"
+#include "bcache.h"
+#include "pagecache.h"
 #include "hal/hal.h"
 
 // Global kernel API instance
@@ -120,6 +123,16 @@ static int kapi_write(void *file, const char *buf, size_t size) {
     return vfs_write((vfs_node_t *)file, buf, size);
 }
 
+// Wrapper for VFS pwrite
+static int kapi_pwrite(void *file, const char *buf, size_t size, size_t offset) {
+    return vfs_pwrite((vfs_node_t *)file, buf, size, offset);
+}
+
+// Wrapper for VFS truncate
+static int kapi_truncate(void *file, size_t size) {
+    return vfs_truncate((vfs_node_t *)file, size);
+}
+
 // Wrapper for is_dir
 static int kapi_is_dir(void *node) {
     return vfs_is_dir((vfs_node_t *)node);
@@ -167,6 +180,24 @@ static int kapi_readdir(void *dir, int index, char *name, size_t name_size, uint
     return vfs_readdir((vfs_node_t *)dir, index, name, name_size, type);
 }
 
+// Wrappers for directory iteration
+static void *kapi_opendir(const char *path) {
+    return vfs_opendir(path);
+}
+
+static int kapi_readdir_batch(void *dir, void *ents, int max) {
+    return vfs_readdir_batch((vfs_dir_t *)dir, (vfs_dirent_t *)ents, max);
+}
+
+static void kapi_closedir(void *dir) {
+    vfs_closedir((vfs_dir_t *)dir);
+}
+
+// Wrapper for tcp_poll
+static int kapi_tcp_poll(void *fds, int n, int timeout_ms) {
+    return tcp_poll((tcp_pollfd_t *)fds, n, timeout_ms);
+}
+
 // Wrapper for set_cwd
 static int kapi_set_cwd(const char *path) {
     return vfs_set_cwd(path);
@@ -191,6 +222,14 @@ static void kapi_get_datetime(int *year, int *month, int *day,
     if (weekday) *weekday = dt.weekday;
 }
 
+// Wrapper for block cache stats (flattens bcache_stats_t)
+static void kapi_blk_cache_stats(uint64_t *hits, uint64_t *misses) {
+    bcache_stats_t stats;
+    bcache_get_stats(&stats);
+    if (hits) *hits = stats.hits;
+    if (misses) *misses = stats.misses;
+}
+
 void kapi_init(void) {
     kapi.version = KAPI_VERSION;
 
@@ -213,7 +252,7 @@ void kapi_init(void) {
     kapi.has_key = keyboard_has_key;
 
     // Memory
-    kapi.malloc = malloc;
+    kapi.malloc = process_malloc;  // Caller's arena - freed when it exits
     kapi.free = free;
 
     // Filesystem
@@ -359,7 +398,7 @@ void kapi_init(void) {
     // CPU info
     kapi.get_cpu_name = hal_get_cpu_name;
     kapi.get_cpu_freq_mhz = hal_get_cpu_freq_mhz;
-    kapi.get_cpu_cores = hal_get_cpu_cores;
+    kapi.get_cpu_cores = smp_cpu_count;
 
     // USB device list
     kapi.usb_device_count = hal_usb_get_device_count;
@@ -415,4 +454,40 @@ void kapi_init(void) {
     kapi.wifi_disconnect = wifi_disconnect;
     kapi.wifi_get_connection = wifi_get_connection;
     kapi.wifi_get_mac = wifi_get_mac;
+
+    // Per-process memory
+    kapi.get_process_mem = process_get_mem;
+
+    // Scheduling
+    kapi.set_priority = process_set_priority;
+
+    // High-resolution time
+    kapi.get_uptime_us = timer_get_uptime_us;
+    kapi.sleep_us = sleep_us;
+
+    // Block cache
+    kapi.sync = bcache_sync;
+    kapi.blk_cache_stats = kapi_blk_cache_stats;
+    kapi.blk_cache_drop = bcache_drop;
+
+    // In-place file writes
+    kapi.pwrite = kapi_pwrite;
+    kapi.truncate = kapi_truncate;
+
+    // Directory iteration
+    kapi.opendir = kapi_opendir;
+    kapi.readdir_batch = kapi_readdir_batch;
+    kapi.closedir = kapi_closedir;
+
+    // File mapping
+    kapi.map_file = pagecache_map;
+    kapi.unmap_file = pagecache_unmap;
+
+    // Blocking sockets
+    kapi.tcp_recv_timeout = tcp_recv_timeout;
+    kapi.tcp_send_timeout = tcp_send_timeout;
+    kapi.tls_recv_timeout = tls_recv_timeout;
+    kapi.tcp_listen = tcp_listen;
+    kapi.tcp_accept_timeout = tcp_accept_timeout;
+    kapi.tcp_poll = kapi_tcp_poll;
 }
@@ -147,7 +147,7 @@ typedef struct {
 
     // Networking
     int (*net_ping)(uint32_t ip, uint16_t seq, uint32_t timeout_ms);  // Ping an IP, returns 0 on success
-    void (*net_poll)(void);                                           // Process incoming packets
+    void (*net_poll)(void);                                           // Process incoming packets now (optional, IRQ-driven)
     uint32_t (*net_get_ip)(void);                                     // Get our IP address
     void (*net_get_mac)(uint8_t *mac);                               // Get our MAC address (6 bytes)
     uint32_t (*dns_resolve)(const char *hostname);                   // Resolve hostname to IP, returns 0 on failure
@@ -222,7 +222,7 @@ typedef struct {
     void (*ftp_start)(uint16_t port);       // Start FTP server on port
     void (*ftp_stop)(void);                 // Stop FTP server
     int (*ftp_is_running)(void);            // Check if FTP server is running
-    void (*ftp_poll)(void);                 // Poll FTP server (call from main loop)
+    void (*ftp_poll)(void);                 // Wait for and serve FTP clients (call from main loop)
     
     // WiFi support
     int (*wifi_available)(void);            // Check if WiFi hardware is available
@@ -237,8 +237,50 @@ typedef struct {
     int (*wifi_get_connection)(void *info); // Get connection info
     void (*wifi_get_mac)(uint8_t *mac);     // Get WiFi MAC address
 
+    // Per-process memory
+    size_t (*get_process_mem)(int index);   // Heap bytes in use by process at index
+
+    // Scheduling priority of the calling process (PRIORITY_*), -1 on error
+    int (*set_priority)(int priority);
+
+    // High-resolution time
+    uint64_t (*get_uptime_us)(void);     // Microseconds since boot
+    void (*sleep_us)(uint32_t us);       // Sleep for at least us microseconds
+
+    // Block cache
+    int (*sync)(void);                                    // Write all cached disk writes now, 0 or -1
+    void (*blk_cache_stats)(uint64_t *hits, uint64_t *misses);  // Blocks found / read from disk
+    void (*blk_cache_drop)(void);                         // Sync, then empty the cache
+
+    // In-place file writes (write() replaces the whole file)
+    int (*pwrite)(void *file, const char *buf, size_t size, size_t offset);  // Returns bytes written, grows the file
+    int (*truncate)(void *file, size_t size);             // Shrink, or grow with zeros; 0 or -1
+
+    // Directory iteration (one pass over the directory, unlike readdir)
+    void *(*opendir)(const char *path);                   // NULL if not a directory
+    int (*readdir_batch)(void *dir, void *ents, int max); // Fills dirent_t[max]: count, 0 at end, -1 on error
+    void (*closedir)(void *dir);
+
+    // File mapping: a read-only view of a whole file, shared with other
+    // programs mapping it and kept cached after (no private copy to read into)
+    void *(*map_file)(const char *path, size_t *size);    // NULL if it can't be mapped - fall back to read
+    int (*unmap_file)(void *addr);                        // 0, or -1 if addr isn't a mapping
+
+    // Blocking sockets: sleep until something happens or timeout_ms passes
+    // (< 0: no limit, 0: just check), instead of looping on tcp_recv
+    int (*tcp_recv_timeout)(int sock, void *buf, uint32_t maxlen, int timeout_ms);  // Bytes, 0 on timeout, -1 closed
+    int (*tcp_send_timeout)(int sock, const void *data, uint32_t len, int timeout_ms);  // Bytes queued, -1 closed
+    int (*tls_recv_timeout)(int sock, void *buf, uint32_t maxlen, int timeout_ms);  // Bytes, 0 on timeout, -1 closed
+    int (*tcp_listen)(uint16_t port);                     // Listening socket, or -1
+    int (*tcp_accept_timeout)(int sock, int timeout_ms);  // New connection, or -1
+    int (*tcp_poll)(void *fds, int n, int timeout_ms);    // Fills revents of tcp_pollfd_t[n]: ready count, 0 on timeout
 } kapi_t;
 
+// Scheduling priorities for set_priority
+#define PRIORITY_INTERACTIVE 0  // Runs ahead of everything else
+#define PRIORITY_NORMAL      1  // Default for new processes
+#define PRIORITY_BACKGROUND  2  // Only runs when nothing else is ready
+
 // TTF font style flags (for ttf_get_glyph)
 #define TTF_STYLE_NORMAL  0
 #define TTF_STYLE_BOLD    1
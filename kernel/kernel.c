@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 #include "memory.h"
+#include "mmu.h"
 #include "string.h"
 #include "printf.h"
 #include "fb.h"
@@ -26,6 +27,7 @@
 #include "ttf.h"
 #include "klog.h"
 #include "ftp.h"
+#include "smp.h"
 #include "hal/hal.h"
 
 // UART functions now use HAL
@@ -53,6 +55,9 @@ int uart_getc_blocking(void) {
 }
 
 void kernel_main(void) {
+    // Per-core state first - IRQs, locks and the scheduler all use it
+    smp_early_init();
+
     // Raw UART test first
     uart_putc('V');
     uart_putc('I');
@@ -71,6 +76,10 @@ void kernel_main(void) {
     fb_init();
     console_init();
 
+    // Page tables + MMU + caches. Everything above ran uncached; needs the
+    // RAM size from memory_init and the framebuffer address from fb_init.
+    mmu_init();
+
     // Initialize DMA for fast memory transfers (Pi only, QEMU uses CPU fallback)
     hal_dma_init();
 
@@ -88,38 +97,6 @@ void kernel_main(void) {
     printf("[DEBUG] D-Cache (C bit): %s\n", (sctlr & 4) ? "ENABLED" : "DISABLED");
     printf("[DEBUG] I-Cache (I bit): %s\n", (sctlr & (1 << 12)) ? "ENABLED" : "DISABLED");
     printf("[DEBUG] Framebuffer at: 0x%lx\n", (uint64_t)fb_base);
-    printf("[DEBUG] FB in cached region: %s\n",
-           ((uint64_t)fb_base < 0x3E000000) ? "YES" : "NO (device memory!)");
-
-#ifdef TARGET_PI
-    // Try enabling D-cache now that everything is initialized
-    printf("[DEBUG] Attempting to enable D-cache...\n");
-    extern void enable_dcache(void);
-    enable_dcache();
-
-    // Re-check
-    asm volatile("mrs %0, sctlr_el1" : "=r"(sctlr));
-    printf("[DEBUG] After enable: D-Cache (C bit): %s\n", (sctlr & 4) ? "ENABLED" : "DISABLED");
-#endif
-
-    // Quick cache benchmark: read a variable 1 million times
-    // With cache: should be ~1-2ms (variable in L1)
-    // Without cache: should be ~100-200ms (every read hits RAM)
-    {
-        volatile uint64_t test_var = 0x12345678;
-        volatile uint64_t sink = 0;
-        uint64_t start, end;
-        asm volatile("mrs %0, cntpct_el0" : "=r"(start));
-        for (int i = 0; i < 1000000; i++) {
-            sink = test_var;  // Read from memory
-        }
-        asm volatile("mrs %0, cntpct_el0" : "=r"(end));
-        uint64_t freq;
-        asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
-        uint64_t elapsed_us = ((end - start) * 1000000) / freq;
-        printf("[BENCH] 1M reads: %lu us (expect <5000 if cached)\n", elapsed_us);
-        (void)sink;  // Prevent optimization
-    }
     printf("\n");
     printf("KikiOS v1.0 - aarch64\n");
     printf("=====================\n\n");
@@ -232,6 +209,15 @@ void kernel_main(void) {
     // Initialize block device (for persistent storage)
 #ifdef TARGET_QEMU
     virtio_blk_init();
+
+    // Register block IRQ handler (requests complete from it once IRQs are on;
+    // until then they're polled)
+    uint32_t blk_irq = virtio_blk_get_irq();
+    if (blk_irq > 0) {
+        irq_register_handler(blk_irq, virtio_blk_irq_handler);
+        irq_enable_irq(blk_irq);
+        printf("[KERNEL] Block IRQ %d registered\n", blk_irq);
+    }
 #else
     // For Pi, use HAL block device (EMMC/SD card)
     if (hal_blk_init() < 0) {
@@ -249,7 +235,7 @@ void kernel_main(void) {
     // Register network IRQ handler
     uint32_t net_irq = virtio_net_get_irq();
     if (net_irq > 0) {
-        irq_register_handler(net_irq, virtio_net_irq_handler);
+        irq_register_handler(net_irq, net_irq_handler);
         irq_enable_irq(net_irq);
         printf("[KERNEL] Network IRQ %d registered\n", net_irq);
     }
@@ -285,6 +271,9 @@ void kernel_main(void) {
 #endif
     // Pi: interrupts already enabled before USB init
 
+    // Bring up the other cores - they start picking processes right away
+    smp_init();
+
     printf("\n");
     printf("[KERNEL] Starting shell...\n");
 
@@ -0,0 +1,180 @@
+/*
+ * KikiOS Kernel Timers
+ *
+ * Pending timers are one list sorted by deadline. Exactly one core is
+ * responsible for the head at a time (head_owner): the one that queued it
+ * or last expired timers. That core keeps its compare register at or before
+ * the head's deadline, so no other core has to wake up for it and nobody
+ * needs to interrupt anybody when a timer is added.
+ */
+
+#include "ktimer.h"
+#include "hal/hal.h"
+#include "process.h"
+#include "smp.h"
+#include "spinlock.h"
+
+#define NEVER   0xFFFFFFFFFFFFFFFFULL
+
+static spinlock_t timer_lock = SPINLOCK_INIT;
+static ktimer_t *timer_head = NULL;
+static int head_owner = 0;
+
+static uint64_t counter_freq = 0;
+static uint64_t tick_length = 0;    // Counter ticks per timer tick
+static uint64_t boot_count = 0;
+
+uint64_t ktimer_now(void) {
+    uint64_t cnt;
+    asm volatile("isb; mrs %0, cntpct_el0" : "=r"(cnt) :: "memory");
+    return cnt;
+}
+
+uint64_t ktimer_us_to_count(uint64_t us) {
+    return us * counter_freq / 1000000;
+}
+
+uint64_t ktimer_tick_count(void) {
+    return tick_length;
+}
+
+uint64_t ktimer_uptime_ticks(void) {
+    if (!tick_length) return 0;
+    return (ktimer_now() - boot_count) / tick_length;
+}
+
+uint64_t ktimer_uptime_us(void) {
+    if (!counter_freq) return 0;
+    uint64_t delta = ktimer_now() - boot_count;
+    // Split so delta * 1000000 can't overflow
+    return (delta / counter_freq) * 1000000 +
+           (delta % counter_freq) * 1000000 / counter_freq;
+}
+
+void ktimer_init(uint32_t tick_ms) {
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(counter_freq));
+    if (!boot_count) boot_count = ktimer_now();
+    tick_length = counter_freq / 1000 * tick_ms;
+
+    cpu_t *cpu = this_cpu();
+    cpu->next_tick = ktimer_now() + tick_length;
+    ktimer_reprogram();
+}
+
+// Caller holds timer_lock
+static void unlink(ktimer_t *t) {
+    if (t->prev) t->prev->next = t->next;
+    else timer_head = t->next;
+    if (t->next) t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    t->queued = 0;
+}
+
+void ktimer_add(ktimer_t *t, uint64_t deadline) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif\n msr daifset, #2" : "=r"(flags) :: "memory");
+    spin_lock(&timer_lock);
+
+    if (t->queued) unlink(t);
+    t->deadline = deadline;
+
+    // Sorted insert - equal deadlines fire in the order they were added
+    ktimer_t *prev = NULL;
+    ktimer_t *cur = timer_head;
+    while (cur && cur->deadline <= deadline) {
+        prev = cur;
+        cur = cur->next;
+    }
+    t->prev = prev;
+    t->next = cur;
+    if (prev) prev->next = t;
+    else timer_head = t;
+    if (cur) cur->prev = t;
+    t->queued = 1;
+
+    // New earliest deadline: we arm for it ourselves
+    int new_head = (timer_head == t);
+    if (new_head) head_owner = this_cpu()->id;
+    spin_unlock(&timer_lock);
+
+    if (new_head) ktimer_reprogram();
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
+int ktimer_cancel(ktimer_t *t) {
+    uint64_t flags = spin_lock_irqsave(&timer_lock);
+    int was_queued = t->queued;
+    if (was_queued) unlink(t);
+    spin_unlock_irqrestore(&timer_lock, flags);
+    // If it was the head, its owner wakes early for nothing and re-arms
+    return was_queued;
+}
+
+int ktimer_expire(void) {
+    cpu_t *cpu = this_cpu();
+    uint64_t now = ktimer_now();
+    int tick = 0;
+
+    if (cpu->next_tick && now >= cpu->next_tick) {
+        tick = 1;
+        cpu->ticks++;
+        cpu->next_tick += tick_length;
+        if (cpu->next_tick <= now) {
+            // Fell behind (long IRQs-off section) - don't replay lost ticks
+            cpu->next_tick = now + tick_length;
+        }
+    }
+
+    int fired = 0;
+    spin_lock(&timer_lock);
+    while (timer_head && timer_head->deadline <= now) {
+        ktimer_t *t = timer_head;
+        void (*fn)(void *) = t->fn;
+        void *arg = t->arg;
+        unlink(t);
+
+        // Callbacks take other locks (sched_lock) and may re-add timers
+        spin_unlock(&timer_lock);
+        if (fn) fn(arg);
+        fired = 1;
+        spin_lock(&timer_lock);
+    }
+    if (fired) head_owner = cpu->id;
+    spin_unlock(&timer_lock);
+
+    // Kernel threads waiting for a timer sleep in wfe
+    if (fired) asm volatile("sev");
+    return tick;
+}
+
+void ktimer_reprogram(void) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif\n msr daifset, #2" : "=r"(flags) :: "memory");
+    cpu_t *cpu = this_cpu();
+
+    // A core ticks to preempt a process that has competition. The boot
+    // core also ticks while the platform polls devices from its tick: on
+    // the Pi that is always (USB keyboard every 10ms, heartbeat LED), which
+    // costs it 100 wakeups a second even when idle.
+    int want_tick = (cpu->id == 0 && hal_timer_wants_tick()) ||
+                    (cpu->current && process_count_ready() > 1);
+    if (!want_tick) {
+        cpu->next_tick = 0;
+    } else if (!cpu->next_tick) {
+        cpu->next_tick = ktimer_now() + tick_length;
+    }
+
+    uint64_t deadline = cpu->next_tick ? cpu->next_tick : NEVER;
+
+    spin_lock(&timer_lock);
+    if (timer_head && head_owner == cpu->id && timer_head->deadline < deadline) {
+        deadline = timer_head->deadline;
+    }
+    spin_unlock(&timer_lock);
+
+    // Absolute compare: a deadline already in the past fires immediately
+    asm volatile("msr cntp_cval_el0, %0" :: "r"(deadline));
+    asm volatile("isb" ::: "memory");
+
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
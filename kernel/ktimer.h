@@ -0,0 +1,53 @@
+/*
+ * KikiOS Kernel Timers
+ *
+ * One-shot deadlines on the ARM generic timer. Each core programs its own
+ * compare register (CNTP_CVAL_EL0) for the next thing it has to do: its
+ * periodic tick, if it needs one, or the earliest kernel timer. A core
+ * only ticks while it runs a process that has competition, or (boot core)
+ * while the platform polls devices from the tick, so idle cores sleep until
+ * there is work. System time comes from the counter, not from ticks.
+ */
+
+#ifndef KTIMER_H
+#define KTIMER_H
+
+#include <stdint.h>
+
+// Kernel timer. fn runs in IRQ context on whichever core notices the
+// deadline, with no locks held; it may be NULL (just wake the core).
+typedef struct ktimer {
+    uint64_t deadline;          // Counter value (ktimer_now) to fire at
+    void (*fn)(void *arg);
+    void *arg;
+    struct ktimer *next;
+    struct ktimer *prev;
+    int queued;
+} ktimer_t;
+
+// Set the tick length and start the calling core's tick (boot core, from
+// hal_timer_init / hal_timer_set_interval)
+void ktimer_init(uint32_t tick_ms);
+
+// Free-running counter, and conversions
+uint64_t ktimer_now(void);
+uint64_t ktimer_us_to_count(uint64_t us);
+uint64_t ktimer_tick_count(void);       // Counter ticks per timer tick
+uint64_t ktimer_uptime_ticks(void);    // Tick periods elapsed since boot
+uint64_t ktimer_uptime_us(void);
+
+// Queue t to fire at deadline (re-queues if already pending)
+void ktimer_add(ktimer_t *t, uint64_t deadline);
+
+// Remove t if still pending. Returns 1 if it was, 0 if it already fired.
+int ktimer_cancel(ktimer_t *t);
+
+// Timer IRQ: run due timers. Returns 1 if this core's tick was due.
+int ktimer_expire(void);
+
+// Program this core's compare register for its next deadline.
+// Called with IRQs masked at the end of the timer IRQ and whenever the
+// core starts or stops running a process.
+void ktimer_reprogram(void);
+
+#endif
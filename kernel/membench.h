@@ -0,0 +1,11 @@
+/*
+ * KikiOS Memory Benchmark
+ */
+
+#ifndef MEMBENCH_H
+#define MEMBENCH_H
+
+// Print memset/memcpy bandwidth and load latency with D-cache on and off
+void membench_run(void);
+
+#endif
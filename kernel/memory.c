@@ -1,15 +1,25 @@
 /*
  * KikiOS Memory Management
  *
- * Simple first-fit heap allocator. Not the fastest, but easy to understand.
- * Each allocation has a header with size and free flag.
+ * Segregated-fit heap allocator with boundary tags:
+ *   - Small requests (<= 1KB) come from exact 16-byte size-class bins, so a
+ *     malloc that hits its bin is a single list pop.
+ *   - Large requests come from power-of-two bins, with a bitmap of non-empty
+ *     bins so the search never walks empty lists.
+ *   - free() merges with both neighbours in O(1) using the size tags stored
+ *     around each chunk - no heap walk, no matter how many blocks are live.
+ *   - Programs allocate from per-process arenas (private heaps built from
+ *     regions of the kernel heap) that are torn down in one step on exit.
  *
  * RAM is detected at runtime by parsing the Device Tree Blob (DTB).
+ * One lock covers the kernel heap and every arena (they share its regions).
  */
 
 #include "memory.h"
 #include "dtb.h"
 #include "printf.h"
+#include "string.h"
+#include "smp.h"
 
 // Detected RAM info (populated by memory_init)
 uint64_t ram_base;
@@ -19,22 +29,107 @@ uint64_t ram_size;
 uint64_t heap_start;
 uint64_t heap_end;
 
-// Block header - sits before each allocation
-typedef struct block_header {
-    size_t size;                    // Size of data area (not including header)
-    uint8_t is_free;                // 1 if block is free, 0 if allocated
-    struct block_header *next;      // Next block in list
-} block_header_t;
+// Program area (process.c hands out regions of it)
+uint64_t program_start;
+uint64_t program_end;
 
-#define HEADER_SIZE sizeof(block_header_t)
+/*
+ * Chunk header - sits before each allocation
+ *
+ * Chunks are laid out back to back across the heap. `head` holds the chunk
+ * size (header included, always a multiple of 16) plus flag bits in the low
+ * nibble. When a chunk is free it also records its size in the NEXT chunk's
+ * prev_size field (a boundary tag), so free() can step to either neighbour
+ * in O(1) and merge without walking the heap.
+ *
+ * The bin links overlay the payload and are only meaningful while free.
+ */
+typedef struct chunk {
+    size_t prev_size;               // Size of previous chunk (only valid if it is free)
+    size_t head;                    // Owner | Size | flags
+    struct chunk *next_free;        // Next chunk in the same bin
+    struct chunk *prev_free;        // Previous chunk in the same bin
+} chunk_t;
+
+#define CHUNK_INUSE       0x1
+#define CHUNK_PREV_INUSE  0x2
+#define CHUNK_FIRST       0x4       // First chunk of a heap/region (nothing before it)
+#define CHUNK_FLAGS       0xFUL
+#define CHUNK_KEEP        (CHUNK_PREV_INUSE | CHUNK_FIRST)  // Flags that survive merge/split
+
+// Allocated chunks carry the id of the arena they came from in the top byte,
+// so free() can hand them back to the right heap without any lookup.
+// 0 = the global kernel heap.
+#define CHUNK_OWNER_SHIFT 56
+#define CHUNK_OWNER_MASK  (0xFFUL << CHUNK_OWNER_SHIFT)
+
+#define HEADER_SIZE 16              // prev_size + head
+#define MIN_CHUNK   32              // Header + room for the two bin links
 #define ALIGN_UP(x, align) (((x) + ((align) - 1)) & ~((align) - 1))
 
-static block_header_t *free_list = NULL;
+#define chunk_size(c)   ((c)->head & ~(CHUNK_FLAGS | CHUNK_OWNER_MASK))
+#define chunk_owner(c)  ((int)((c)->head >> CHUNK_OWNER_SHIFT))
+#define chunk_next(c)   ((chunk_t *)((uint8_t *)(c) + chunk_size(c)))
+#define chunk_prev(c)   ((chunk_t *)((uint8_t *)(c) - (c)->prev_size))
+#define chunk_to_mem(c) ((void *)((uint8_t *)(c) + HEADER_SIZE))
+#define mem_to_chunk(p) ((chunk_t *)((uint8_t *)(p) - HEADER_SIZE))
+
+// Small bins: one exact size class per 16 bytes, chunks of 32..1040 bytes
+// (payloads up to 1KB). A hit is an exact fit - no searching, no splitting.
+#define NUM_SMALL_BINS  64
+#define SMALL_MAX_CHUNK (MIN_CHUNK + (NUM_SMALL_BINS - 1) * 16)
+
+// Large bins: one per power of two above the small range. Bin k holds
+// chunks in [2^(k+10), 2^(k+11)), so anything in a higher bin always fits.
+#define NUM_LARGE_BINS  54
+#define LARGE_BIN_SHIFT 10
+
+// A set of bins plus its counters. The global kernel heap is one of these,
+// and so is every process arena.
+typedef struct heap {
+    chunk_t *small_bins[NUM_SMALL_BINS];
+    chunk_t *large_bins[NUM_LARGE_BINS];
+
+    // Bit i set = bin i is non-empty (lets malloc find the next usable bin in O(1))
+    uint64_t small_map;
+    uint64_t large_map;
+
+    // O(1) counters - updated on malloc/free instead of scanning
+    size_t used;        // Total bytes in use (including headers)
+    size_t free;        // Total bytes free (excluding free chunk headers)
+    int alloc_count;    // Number of active allocations
+} heap_t;
+
+static heap_t kernel_heap;
+static rlock_t heap_lock = RLOCK_INIT;  // Recursive: arena code calls malloc/free
 
-// O(1) counters - updated on malloc/free instead of scanning
-static size_t stat_used = 0;      // Total bytes in use (including headers)
-static size_t stat_free = 0;      // Total bytes free
-static int stat_alloc_count = 0;  // Number of active allocations
+/*
+ * Process arenas
+ *
+ * An arena is a private heap built from regions carved out of the kernel
+ * heap. Each region is laid out like a miniature heap: a link header, one
+ * big chunk flagged CHUNK_FIRST, and a zero-sized in-use fence. Destroying
+ * an arena just hands its regions back - no need to know what was in them.
+ */
+#define ARENA_MAX          128             // Arena ids 1..ARENA_MAX-1 (0 = kernel heap)
+#define ARENA_REGION_SIZE  (256 * 1024)    // Default region size
+
+typedef struct arena_region {
+    struct arena_region *next;
+    struct arena_region *prev;
+} arena_region_t;
+
+#define REGION_HEADER_SIZE sizeof(arena_region_t)  // 16 - keeps chunks aligned
+
+struct arena {
+    heap_t heap;
+    arena_region_t *regions;
+    int id;
+};
+
+static arena_t *arena_table[ARENA_MAX];
+static int arena_region_count = 0;    // Kernel heap blocks that are really arena regions
+static int arena_alloc_count = 0;     // Live allocations across all arenas
 
 // Defined in linker script - end of BSS in RAM
 // Declared as char[] so the symbol name gives the address directly
@@ -52,6 +147,74 @@ extern char _bss_end[];
 // Leave some room below stack for safety (1MB)
 #define STACK_BUFFER (1 * 1024 * 1024)
 
+// Map a chunk size to its bin
+static inline int small_index(size_t csize) {
+    return (int)(csize >> 4) - (MIN_CHUNK >> 4);
+}
+
+static inline int large_index(size_t csize) {
+    return (63 - __builtin_clzll(csize)) - LARGE_BIN_SHIFT;
+}
+
+// Push a free chunk onto the front of its bin
+static void bin_insert(heap_t *h, chunk_t *c) {
+    size_t size = chunk_size(c);
+    chunk_t **bin;
+
+    if (size <= SMALL_MAX_CHUNK) {
+        int idx = small_index(size);
+        bin = &h->small_bins[idx];
+        h->small_map |= 1ULL << idx;
+    } else {
+        int idx = large_index(size);
+        bin = &h->large_bins[idx];
+        h->large_map |= 1ULL << idx;
+    }
+
+    c->prev_free = NULL;
+    c->next_free = *bin;
+    if (*bin) (*bin)->prev_free = c;
+    *bin = c;
+}
+
+// Remove a free chunk from whichever bin it is in
+static void bin_unlink(heap_t *h, chunk_t *c) {
+    if (c->next_free) c->next_free->prev_free = c->prev_free;
+    if (c->prev_free) {
+        c->prev_free->next_free = c->next_free;
+        return;
+    }
+
+    // Chunk was the bin head - update the head and the non-empty bitmap
+    size_t size = chunk_size(c);
+    if (size <= SMALL_MAX_CHUNK) {
+        int idx = small_index(size);
+        h->small_bins[idx] = c->next_free;
+        if (!c->next_free) h->small_map &= ~(1ULL << idx);
+    } else {
+        int idx = large_index(size);
+        h->large_bins[idx] = c->next_free;
+        if (!c->next_free) h->large_map &= ~(1ULL << idx);
+    }
+}
+
+// Hand [start, start + size) to a heap as one free chunk, followed by a
+// zero-sized "in use" fence so coalescing never runs off the end
+static void heap_add_space(heap_t *h, uint64_t start, size_t size) {
+    chunk_t *first = (chunk_t *)start;
+    chunk_t *fence = (chunk_t *)(start + size - HEADER_SIZE);
+    size_t first_size = (uint64_t)fence - start;
+
+    first->prev_size = 0;
+    first->head = first_size | CHUNK_PREV_INUSE | CHUNK_FIRST;  // Nothing before us to merge with
+    fence->prev_size = first_size;
+    fence->head = 0 | CHUNK_INUSE;
+    bin_insert(h, first);
+
+    // The fence is bookkeeping, not an allocation
+    h->free += first_size - HEADER_SIZE;
+}
+
 void memory_init(void) {
     // Note: Don't use printf here - console isn't initialized yet!
 
@@ -92,105 +255,193 @@ void memory_init(void) {
         heap_max = heap_start + 64 * 1024 * 1024;
     }
 
-    heap_end = heap_max;
+    heap_end = heap_max & ~0xFULL;
+
+    // Everything between the heap and the stack buffer is for programs
+    uint64_t area_top = KERNEL_STACK_TOP < ram_end ? KERNEL_STACK_TOP : ram_end;
+    program_start = (heap_end + 0xFFFF) & ~0xFFFFULL;
+    program_end = (area_top - STACK_BUFFER) & ~0xFFFFULL;
+    if (program_end < program_start) program_end = program_start;
 
     printf("[MEM] heap: 0x%lx - 0x%lx, stack at 0x%lx\n",
            heap_start, heap_end, (uint64_t)KERNEL_STACK_TOP);
 
-    // Initialize with one giant free block
-    free_list = (block_header_t *)heap_start;
-    free_list->size = heap_end - heap_start - HEADER_SIZE;
-    free_list->is_free = 1;
-    free_list->next = NULL;
+    memset(&kernel_heap, 0, sizeof(kernel_heap));
+    heap_add_space(&kernel_heap, heap_start, heap_end - heap_start);
 
-    // Initialize O(1) counters
-    stat_used = 0;
-    stat_free = free_list->size;
-    stat_alloc_count = 0;
+    for (int i = 0; i < ARENA_MAX; i++) arena_table[i] = NULL;
+    arena_region_count = 0;
+    arena_alloc_count = 0;
 }
 
-void *malloc(size_t size) {
-    if (size == 0) return NULL;
+// Round a request up to a chunk size (header included, 16-byte aligned)
+static size_t request_to_chunk(size_t size) {
+    size_t csize = ALIGN_UP(size, 16) + HEADER_SIZE;
+    return csize < MIN_CHUNK ? MIN_CHUNK : csize;
+}
+
+// Find a free chunk of at least csize bytes, or NULL if the heap is full
+static chunk_t *bin_find(heap_t *h, size_t csize) {
+    int idx;
+
+    if (csize <= SMALL_MAX_CHUNK) {
+        // Exact size class first
+        idx = small_index(csize);
+        if (h->small_bins[idx]) return h->small_bins[idx];
 
-    // Align size to 16 bytes
-    size = ALIGN_UP(size, 16);
-
-    block_header_t *current = free_list;
-
-    // First-fit: find first block that's big enough
-    while (current != NULL) {
-        if (current->is_free && current->size >= size) {
-            // Found a suitable block
-            size_t old_size = current->size;
-
-            // Split if there's enough room for another block
-            if (current->size >= size + HEADER_SIZE + 16) {
-                // Create new block after this allocation
-                block_header_t *new_block = (block_header_t *)((uint8_t *)current + HEADER_SIZE + size);
-                new_block->size = current->size - size - HEADER_SIZE;
-                new_block->is_free = 1;
-                new_block->next = current->next;
-
-                current->size = size;
-                current->next = new_block;
-
-                // Update counters: we used size+header, free lost size+header
-                stat_used += size + HEADER_SIZE;
-                stat_free -= size + HEADER_SIZE;
-            } else {
-                // No split: entire block becomes used
-                stat_used += old_size + HEADER_SIZE;
-                stat_free -= old_size;
-            }
-
-            current->is_free = 0;
-            stat_alloc_count++;
-            return (void *)((uint8_t *)current + HEADER_SIZE);
+        // Next non-empty small bin - every chunk in it is bigger than needed
+        uint64_t above = (idx + 1 < NUM_SMALL_BINS) ? h->small_map & (~0ULL << (idx + 1)) : 0;
+        if (above) return h->small_bins[__builtin_ctzll(above)];
+
+        idx = 0;  // Fall through to the large bins from the bottom
+    } else {
+        // Chunks in our own large bin span a power of two - first fit
+        idx = large_index(csize);
+        for (chunk_t *c = h->large_bins[idx]; c; c = c->next_free) {
+            if (chunk_size(c) >= csize) return c;
         }
-        current = current->next;
+        idx++;
+    }
+
+    // Any chunk in a higher large bin is guaranteed to fit
+    if (idx >= NUM_LARGE_BINS) return NULL;
+    uint64_t above = h->large_map & (~0ULL << idx);
+    if (!above) return NULL;
+    return h->large_bins[__builtin_ctzll(above)];
+}
+
+// Take a chunk of csize bytes out of a heap, splitting off any usable tail
+static chunk_t *heap_alloc(heap_t *h, size_t csize) {
+    chunk_t *c = bin_find(h, csize);
+    if (!c) return NULL;
+
+    bin_unlink(h, c);
+
+    size_t have = chunk_size(c);
+    if (have - csize >= MIN_CHUNK) {
+        // Split: the tail goes back into a bin as its own free chunk
+        chunk_t *rest = (chunk_t *)((uint8_t *)c + csize);
+        rest->head = (have - csize) | CHUNK_PREV_INUSE;
+        chunk_next(rest)->prev_size = have - csize;
+        bin_insert(h, rest);
+
+        c->head = csize | (c->head & CHUNK_KEEP) | CHUNK_INUSE;
+
+        // Used gained csize, free lost csize (the new tail header comes out of it)
+        h->used += csize;
+        h->free -= csize;
+    } else {
+        // No split: entire chunk becomes used
+        c->head |= CHUNK_INUSE;
+        chunk_next(c)->head |= CHUNK_PREV_INUSE;
+
+        h->used += have;
+        h->free -= have - HEADER_SIZE;
+    }
+
+    h->alloc_count++;
+    return c;
+}
+
+// Return an allocated chunk to its heap, merging with free neighbours.
+// Returns the (possibly merged) free chunk.
+static chunk_t *heap_release(heap_t *h, chunk_t *c) {
+    size_t size = chunk_size(c);
+
+    // Update counters before merging
+    h->used -= size;
+    h->free += size - HEADER_SIZE;
+    h->alloc_count--;
+
+    // Merge with the following chunk - O(1) via its header
+    chunk_t *next = chunk_next(c);
+    if (!(next->head & CHUNK_INUSE)) {
+        bin_unlink(h, next);
+        size += chunk_size(next);
+        h->free += HEADER_SIZE;  // Reclaim header space
+    }
+
+    // Merge with the preceding chunk - O(1) via the boundary tag
+    if (!(c->head & CHUNK_PREV_INUSE)) {
+        chunk_t *prev = chunk_prev(c);
+        bin_unlink(h, prev);
+        size += chunk_size(prev);
+        h->free += HEADER_SIZE;
+        c = prev;
     }
 
-    // No suitable block found
-    return NULL;
+    c->head = size | (c->head & CHUNK_KEEP);
+    next = chunk_next(c);
+    next->prev_size = size;
+    next->head &= ~(size_t)CHUNK_PREV_INUSE;
+    bin_insert(h, c);
+    return c;
 }
 
+// Grow an allocated chunk into a free chunk right after it.
+// Returns 1 on success, 0 if the neighbour is in use or too small.
+static int heap_grow_in_place(heap_t *h, chunk_t *c, size_t csize) {
+    size_t have = chunk_size(c);
+    chunk_t *next = chunk_next(c);
+    if ((next->head & CHUNK_INUSE) || have + chunk_size(next) < csize) {
+        return 0;
+    }
+
+    size_t total = have + chunk_size(next);
+    bin_unlink(h, next);
+    h->free -= chunk_size(next) - HEADER_SIZE;
+
+    if (total - csize >= MIN_CHUNK) {
+        chunk_t *rest = (chunk_t *)((uint8_t *)c + csize);
+        rest->head = (total - csize) | CHUNK_PREV_INUSE;
+        chunk_next(rest)->prev_size = total - csize;
+        bin_insert(h, rest);
+        h->free += total - csize - HEADER_SIZE;
+        total = csize;
+    }
+
+    c->head = total | (c->head & (CHUNK_FLAGS | CHUNK_OWNER_MASK));
+    chunk_next(c)->head |= CHUNK_PREV_INUSE;
+    h->used += total - have;
+    return 1;
+}
+
+void *malloc(size_t size) {
+    if (size == 0) return NULL;
+    if (size > heap_end - heap_start) return NULL;
+
+    rlock_acquire(&heap_lock);
+    chunk_t *c = heap_alloc(&kernel_heap, request_to_chunk(size));
+    rlock_release(&heap_lock);
+    return c ? chunk_to_mem(c) : NULL;
+}
+
+static void arena_release(arena_t *a, chunk_t *c);
+
 void free(void *ptr) {
     if (ptr == NULL) return;
 
-    // Get header
-    block_header_t *block = (block_header_t *)((uint8_t *)ptr - HEADER_SIZE);
-
-    // Update counters before marking free
-    stat_used -= block->size + HEADER_SIZE;
-    stat_free += block->size;
-    stat_alloc_count--;
-
-    block->is_free = 1;
-
-    // Coalesce adjacent free blocks
-    block_header_t *current = free_list;
-    while (current != NULL) {
-        if (current->is_free && current->next != NULL && current->next->is_free) {
-            // Merge with next block - reclaim header space
-            stat_free += HEADER_SIZE;
-            current->size += HEADER_SIZE + current->next->size;
-            current->next = current->next->next;
-            // Don't advance - check if we can merge again
-        } else {
-            current = current->next;
-        }
+    rlock_acquire(&heap_lock);
+    chunk_t *c = mem_to_chunk(ptr);
+    int owner = chunk_owner(c);
+    if (!(c->head & CHUNK_INUSE)) {
+        printf("[MEM] free(%p): not an allocated block\n", ptr);
+    } else if (owner == 0) {
+        heap_release(&kernel_heap, c);
+    } else if (owner >= ARENA_MAX || !arena_table[owner]) {
+        printf("[MEM] free(%p): arena %d no longer exists\n", ptr, owner);
+    } else {
+        arena_release(arena_table[owner], c);
     }
+    rlock_release(&heap_lock);
 }
 
 void *calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > (size_t)-1 / size) return NULL;
     size_t total = nmemb * size;
     void *ptr = malloc(total);
     if (ptr != NULL) {
-        // Zero the memory
-        uint8_t *p = (uint8_t *)ptr;
-        for (size_t i = 0; i < total; i++) {
-            p[i] = 0;
-        }
+        memset(ptr, 0, total);
     }
     return ptr;
 }
@@ -202,32 +453,152 @@ void *realloc(void *ptr, size_t size) {
         return NULL;
     }
 
-    block_header_t *block = (block_header_t *)((uint8_t *)ptr - HEADER_SIZE);
+    chunk_t *c = mem_to_chunk(ptr);
+    size_t have = chunk_size(c);
 
     // If current block is big enough, just return it
-    if (block->size >= size) {
+    if (have - HEADER_SIZE >= size) {
         return ptr;
     }
+    if (size > heap_end - heap_start) return NULL;
+
+    rlock_acquire(&heap_lock);
+
+    // The block stays in whichever heap it came from
+    int owner = chunk_owner(c);
+    arena_t *a = NULL;
+    if (owner != 0) {
+        a = (owner < ARENA_MAX) ? arena_table[owner] : NULL;
+        if (!a) {
+            printf("[MEM] realloc(%p): arena %d no longer exists\n", ptr, owner);
+            rlock_release(&heap_lock);
+            return NULL;
+        }
+    }
 
-    // Otherwise allocate new block and copy
-    void *new_ptr = malloc(size);
-    if (new_ptr != NULL) {
-        uint8_t *src = (uint8_t *)ptr;
-        uint8_t *dst = (uint8_t *)new_ptr;
-        for (size_t i = 0; i < block->size; i++) {
-            dst[i] = src[i];
+    // Grow in place if the following chunk is free and big enough
+    void *new_ptr = ptr;
+    if (!heap_grow_in_place(a ? &a->heap : &kernel_heap, c, request_to_chunk(size))) {
+        // Otherwise allocate new block and copy
+        new_ptr = a ? arena_malloc(a, size) : malloc(size);
+        if (new_ptr != NULL) {
+            memcpy(new_ptr, ptr, have - HEADER_SIZE);
+            free(ptr);
         }
-        free(ptr);
     }
+
+    rlock_release(&heap_lock);
     return new_ptr;
 }
 
+// Add a region big enough for at least one chunk of csize bytes
+static int arena_grow(arena_t *a, size_t csize) {
+    size_t size = REGION_HEADER_SIZE + csize + HEADER_SIZE;  // Link header + chunk + fence
+    if (size < ARENA_REGION_SIZE) size = ARENA_REGION_SIZE;
+
+    arena_region_t *r = malloc(size);
+    if (!r) return -1;
+
+    r->prev = NULL;
+    r->next = a->regions;
+    if (a->regions) a->regions->prev = r;
+    a->regions = r;
+    arena_region_count++;
+
+    heap_add_space(&a->heap, (uint64_t)r + REGION_HEADER_SIZE, size - REGION_HEADER_SIZE);
+    return 0;
+}
+
+static void arena_release(arena_t *a, chunk_t *c) {
+    c = heap_release(&a->heap, c);
+    arena_alloc_count--;
+
+    // A region that is one free chunk from header to fence is empty. Give it
+    // back to the kernel heap, unless it is the last one (so a process that
+    // keeps allocating and freeing one buffer doesn't churn regions).
+    if (!(c->head & CHUNK_FIRST) || chunk_size(chunk_next(c)) != 0) return;
+
+    arena_region_t *r = (arena_region_t *)((uint8_t *)c - REGION_HEADER_SIZE);
+    if (!r->next && !r->prev) return;
+
+    bin_unlink(&a->heap, c);
+    a->heap.free -= chunk_size(c) - HEADER_SIZE;
+
+    if (r->prev) r->prev->next = r->next;
+    else a->regions = r->next;
+    if (r->next) r->next->prev = r->prev;
+
+    free(r);
+    arena_region_count--;
+}
+
+arena_t *arena_create(void) {
+    arena_t *a = NULL;
+    rlock_acquire(&heap_lock);
+    for (int id = 1; id < ARENA_MAX; id++) {
+        if (arena_table[id]) continue;
+
+        a = malloc(sizeof(arena_t));
+        if (a) {
+            memset(a, 0, sizeof(arena_t));
+            a->id = id;
+            arena_table[id] = a;
+        }
+        break;
+    }
+    rlock_release(&heap_lock);
+    return a;
+}
+
+void arena_destroy(arena_t *a) {
+    if (!a) return;
+    rlock_acquire(&heap_lock);
+
+    // Everything allocated from the arena lives in its regions - dropping
+    // the regions frees it all, however many blocks were leaked
+    arena_region_t *r = a->regions;
+    while (r) {
+        arena_region_t *next = r->next;
+        free(r);
+        arena_region_count--;
+        r = next;
+    }
+
+    arena_alloc_count -= a->heap.alloc_count;
+    arena_table[a->id] = NULL;
+    free(a);
+    rlock_release(&heap_lock);
+}
+
+void *arena_malloc(arena_t *a, size_t size) {
+    if (!a) return malloc(size);
+    if (size == 0) return NULL;
+    if (size > heap_end - heap_start) return NULL;
+
+    rlock_acquire(&heap_lock);
+    size_t csize = request_to_chunk(size);
+    chunk_t *c = heap_alloc(&a->heap, csize);
+    if (!c && arena_grow(a, csize) == 0) {
+        c = heap_alloc(&a->heap, csize);
+    }
+    if (c) {
+        c->head |= (size_t)a->id << CHUNK_OWNER_SHIFT;
+        arena_alloc_count++;
+    }
+    rlock_release(&heap_lock);
+    return c ? chunk_to_mem(c) : NULL;
+}
+
+size_t arena_used(arena_t *a) {
+    return a ? a->heap.used : 0;
+}
+
 size_t memory_used(void) {
-    return stat_used;  // O(1) - no scanning!
+    return kernel_heap.used;  // O(1) - no scanning!
 }
 
 size_t memory_free(void) {
-    return stat_free;  // O(1) - no scanning!
+    return kernel_heap.free;  // O(1) - no scanning!
 }
 
 uint64_t memory_heap_start(void) {
@@ -245,5 +616,6 @@ uint64_t memory_get_sp(void) {
 }
 
 int memory_alloc_count(void) {
-    return stat_alloc_count;  // O(1) - no scanning!
+    // Arena regions are kernel heap blocks, but not allocations anyone asked for
+    return kernel_heap.alloc_count - arena_region_count + arena_alloc_count;
 }
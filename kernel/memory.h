@@ -16,15 +16,28 @@ extern uint64_t ram_size;
 extern uint64_t heap_start;
 extern uint64_t heap_end;
 
+// Program area, 64KB aligned, between the heap and the kernel stack
+extern uint64_t program_start;
+extern uint64_t program_end;
+
 // Initialize memory management (parses DTB to detect RAM)
 void memory_init(void);
 
-// Simple heap allocator
+// Kernel heap allocator
 void *malloc(size_t size);
 void free(void *ptr);
 void *calloc(size_t nmemb, size_t size);
 void *realloc(void *ptr, size_t size);
 
+// Per-process arenas - private heaps carved from the kernel heap.
+// free()/realloc() work on arena blocks too (each block records its arena).
+typedef struct arena arena_t;
+
+arena_t *arena_create(void);
+void arena_destroy(arena_t *a);            // Frees everything allocated from it
+void *arena_malloc(arena_t *a, size_t size);  // NULL arena = kernel heap
+size_t arena_used(arena_t *a);             // Bytes in use (including headers)
+
 // Memory stats
 size_t memory_used(void);
 size_t memory_free(void);
@@ -0,0 +1,488 @@
+/*
+ * KikiOS MMU and Cache Management
+ *
+ * Builds one identity map (VA == PA) for the whole system and turns on the
+ * MMU with D-cache and I-cache. Without the MMU every data access is treated
+ * as device memory, so nothing is cached no matter what SCTLR.C says.
+ *
+ * Translation: 4KB granule, 39-bit VA (T0SZ=25), walk starts at level 1.
+ *   L1: 1GB per entry, always points to an L2 table
+ *   L2: 2MB blocks (the common case)
+ *   L3: 4KB pages, only where a range doesn't line up with 2MB
+ *
+ * Tables come from a small static pool in .bss, so this runs after the
+ * boot code has cleared BSS, before anything needs the caches.
+ *
+ * The program area is demand-paged: it gets L3 tables up front, but its
+ * pages start out invalid. The first access to one faults, and
+ * mmu_demand_fault maps it (still identity) and zero-fills it. A region
+ * handed to a new program is unmapped again, so a program only pays for
+ * the pages it touches and never sees what the last one left behind.
+ */
+
+#include "mmu.h"
+#include "memory.h"
+#include "printf.h"
+#include "string.h"
+#include "spinlock.h"
+#include "hal/hal.h"
+
+#define ENTRIES      512
+#define PAGE_SIZE    0x1000UL
+#define BLOCK_SIZE   0x200000UL           // 2MB (L2 block)
+#define ADDR_MASK    0x0000FFFFFFFFF000UL // Output address bits of a descriptor
+
+// Descriptor bits
+#define DESC_VALID     (1UL << 0)
+#define DESC_TABLE     (1UL << 1)         // Table at L1/L2, page at L3
+#define DESC_ATTR(i)   ((uint64_t)(i) << 2)
+#define DESC_SH_INNER  (3UL << 8)
+#define DESC_AP_RO     (1UL << 7)         // AP[2]: read-only
+#define DESC_AF        (1UL << 10)        // Access flag (we never take AF faults)
+#define DESC_PXN       (1UL << 53)
+#define DESC_UXN       (1UL << 54)
+
+// MAIR_EL1 - one byte per mem_type_t:
+//   0: Device-nGnRnE (0x00)  1: Normal WB RW-allocate (0xFF)
+//   2: Device-nGnRE  (0x04)  3: Normal non-cacheable (0x44)
+#define MAIR_VALUE   0x4404FF00UL
+
+// TCR_EL1: T0SZ=25, inner/outer WB walks, inner shareable, 4KB granule,
+// TTBR1 walks disabled (EPD1), 40-bit PA
+#define TCR_VALUE    0x0000000280803519UL
+
+#define SCTLR_M      (1UL << 0)
+#define SCTLR_C      (1UL << 2)
+#define SCTLR_I      (1UL << 12)
+
+// A handful for RAM, devices and unaligned edges, plus one L3 per 2MB
+// of program area (32 for the usual 64MB)
+#define MMU_MAX_TABLES 64
+
+static uint64_t mmu_tables[MMU_MAX_TABLES][ENTRIES] __attribute__((aligned(4096)));
+static int tables_used = 0;
+
+// Demand-paged program area (set once the MMU is on)
+static uint64_t demand_base = 0;
+static uint64_t demand_end = 0;
+static spinlock_t demand_lock = SPINLOCK_INIT;
+
+// ESR_EL1 fields for a data abort
+#define EC_DABT_LOWER   0x24
+#define EC_DABT_CUR     0x25
+#define ESR_FNV         (1UL << 10)     // FAR not valid
+#define FSC_TRANSLATION 0x04            // Bits [5:2] - level in [1:0]
+
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+    mem_type_t type;
+} mmu_region_t;
+
+// Fixed parts of the physical map. RAM comes from the DTB and is mapped
+// first, so these override it where they overlap.
+static const mmu_region_t platform_map[] = {
+#ifdef TARGET_PI
+    { 0x1C000000, 0x04000000, MT_DEVICE_nGnRnE },  // GPU memory: mailbox and DMA buffers
+    { 0x3F000000, 0x01000000, MT_DEVICE_nGnRnE },  // BCM2837 peripherals
+    { 0x40000000, 0x01000000, MT_DEVICE_nGnRnE },  // ARM local (core timers, mailboxes)
+#else
+    { 0x00000000, 0x08000000, MT_NORMAL },         // Flash: kernel code and rodata
+    { 0x08000000, 0x38000000, MT_DEVICE },         // GIC, UART, RTC, fw_cfg, virtio-mmio, PCIe
+#endif
+};
+
+/*
+ * Clean and/or invalidate every D-cache line by set/way, up to the Level of
+ * Coherence. Uses registers only: it runs while the cache is being switched
+ * on or off, when a stray load or store could see stale data.
+ * op is "isw" (invalidate) or "cisw" (clean + invalidate).
+ */
+#define DCACHE_ALL_SETWAY(op)                       \
+    "    mrs     x0, clidr_el1\n"                   \
+    "    and     w3, w0, #0x07000000\n"             \
+    "    lsr     w3, w3, #23\n"          /* LoC * 2 */ \
+    "    cbz     w3, 5f\n"                          \
+    "    mov     w10, #0\n"              /* Cache level * 2 */ \
+    "1:  add     w2, w10, w10, lsr #1\n"            \
+    "    lsr     w1, w0, w2\n"                      \
+    "    and     w1, w1, #7\n"                      \
+    "    cmp     w1, #2\n"               /* No D-cache at this level */ \
+    "    b.lt    4f\n"                              \
+    "    msr     csselr_el1, x10\n"                 \
+    "    isb\n"                                     \
+    "    mrs     x1, ccsidr_el1\n"                  \
+    "    and     w2, w1, #7\n"                      \
+    "    add     w2, w2, #4\n"           /* log2(line size) */ \
+    "    ubfx    w4, w1, #3, #10\n"      /* Ways - 1 */ \
+    "    clz     w5, w4\n"                          \
+    "    ubfx    w7, w1, #13, #15\n"     /* Sets - 1 */ \
+    "2:  mov     w6, w4\n"                          \
+    "3:  lsl     w11, w6, w5\n"                     \
+    "    lsl     w12, w7, w2\n"                     \
+    "    orr     w11, w11, w10\n"                   \
+    "    orr     w11, w11, w12\n"                   \
+    "    dc      " op ", x11\n"                     \
+    "    subs    w6, w6, #1\n"                      \
+    "    b.ge    3b\n"                              \
+    "    subs    w7, w7, #1\n"                      \
+    "    b.ge    2b\n"                              \
+    "4:  add     w10, w10, #2\n"                    \
+    "    cmp     w3, w10\n"                         \
+    "    b.gt    1b\n"                              \
+    "5:  dsb     sy\n"                              \
+    "    isb\n"
+
+#define SETWAY_CLOBBERS "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7", \
+                        "x10", "x11", "x12", "cc", "memory"
+
+static uint64_t type_attrs(mem_type_t type) {
+    switch (type) {
+        case MT_NORMAL:
+            return DESC_ATTR(MT_NORMAL) | DESC_AF | DESC_SH_INNER;
+        case MT_WRITE_COMBINE:
+            return DESC_ATTR(MT_WRITE_COMBINE) | DESC_AF | DESC_SH_INNER | DESC_PXN | DESC_UXN;
+        default:
+            // Never execute from (or speculatively fetch) device memory
+            return DESC_ATTR(type) | DESC_AF | DESC_PXN | DESC_UXN;
+    }
+}
+
+// Get the next-level table behind an entry, creating it if needed.
+// A block entry is split into a table that maps the same range the same way.
+static uint64_t *next_level(uint64_t *entry, uint64_t child_size) {
+    if ((*entry & (DESC_VALID | DESC_TABLE)) == (DESC_VALID | DESC_TABLE)) {
+        return (uint64_t *)(*entry & ADDR_MASK);
+    }
+
+    if (tables_used >= MMU_MAX_TABLES) return NULL;
+    uint64_t *table = mmu_tables[tables_used++];
+
+    if (*entry & DESC_VALID) {
+        uint64_t base = *entry & ADDR_MASK;
+        uint64_t attrs = *entry & ~(ADDR_MASK | DESC_VALID | DESC_TABLE);
+        uint64_t kind = (child_size == PAGE_SIZE) ? (DESC_VALID | DESC_TABLE) : DESC_VALID;
+        for (int i = 0; i < ENTRIES; i++) {
+            table[i] = (base + i * child_size) | attrs | kind;
+        }
+    } else {
+        memset(table, 0, sizeof(mmu_tables[0]));
+    }
+
+    *entry = (uint64_t)table | DESC_VALID | DESC_TABLE;
+    return table;
+}
+
+// Identity-map [base, base + size) as the given type, using 2MB blocks
+// where possible and 4KB pages at unaligned edges
+static int map_range(uint64_t base, uint64_t size, mem_type_t type) {
+    uint64_t *l1 = mmu_tables[0];
+    uint64_t attrs = type_attrs(type);
+    uint64_t addr = base & ~(PAGE_SIZE - 1);
+    uint64_t end = (base + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    while (addr < end) {
+        uint64_t *l2 = next_level(&l1[(addr >> 30) & (ENTRIES - 1)], BLOCK_SIZE);
+        if (!l2) return -1;
+
+        uint64_t *entry = &l2[(addr >> 21) & (ENTRIES - 1)];
+        if ((addr & (BLOCK_SIZE - 1)) == 0 && end - addr >= BLOCK_SIZE) {
+            *entry = addr | attrs | DESC_VALID;
+            addr += BLOCK_SIZE;
+        } else {
+            uint64_t *l3 = next_level(entry, PAGE_SIZE);
+            if (!l3) return -1;
+            l3[(addr >> 12) & (ENTRIES - 1)] = addr | attrs | DESC_VALID | DESC_TABLE;
+            addr += PAGE_SIZE;
+        }
+    }
+    return 0;
+}
+
+// Give [base, base + size) L3 tables with every page invalid
+static int unmap_range(uint64_t base, uint64_t size) {
+    uint64_t *l1 = mmu_tables[0];
+    uint64_t addr = base & ~(PAGE_SIZE - 1);
+    uint64_t end = (base + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    while (addr < end) {
+        uint64_t *l2 = next_level(&l1[(addr >> 30) & (ENTRIES - 1)], BLOCK_SIZE);
+        if (!l2) return -1;
+        uint64_t *l3 = next_level(&l2[(addr >> 21) & (ENTRIES - 1)], PAGE_SIZE);
+        if (!l3) return -1;
+        l3[(addr >> 12) & (ENTRIES - 1)] = 0;
+        addr += PAGE_SIZE;
+    }
+    return 0;
+}
+
+// L3 entry for a demand-paged address, or NULL if something else (a
+// 2MB block) ended up mapping it
+static uint64_t *demand_pte(uint64_t addr) {
+    uint64_t l1e = mmu_tables[0][(addr >> 30) & (ENTRIES - 1)];
+    if ((l1e & (DESC_VALID | DESC_TABLE)) != (DESC_VALID | DESC_TABLE)) return NULL;
+    uint64_t l2e = ((uint64_t *)(l1e & ADDR_MASK))[(addr >> 21) & (ENTRIES - 1)];
+    if ((l2e & (DESC_VALID | DESC_TABLE)) != (DESC_VALID | DESC_TABLE)) return NULL;
+    return &((uint64_t *)(l2e & ADDR_MASK))[(addr >> 12) & (ENTRIES - 1)];
+}
+
+void mmu_init(void) {
+    tables_used = 1;  // Table 0 is L1
+    memset(mmu_tables[0], 0, sizeof(mmu_tables[0]));
+
+    int err = map_range(ram_base, ram_size, MT_NORMAL);
+
+    for (size_t i = 0; i < sizeof(platform_map) / sizeof(platform_map[0]); i++) {
+        err |= map_range(platform_map[i].base, platform_map[i].size, platform_map[i].type);
+    }
+
+    // Program area: pages get mapped as programs touch them
+    uint64_t demand_size = program_end - program_start;
+    if (demand_size) err |= unmap_range(program_start, demand_size);
+
+    // Framebuffer: uncached so the display sees every write, but writes can
+    // still be merged and buffered - far faster than device memory
+    hal_fb_info_t *fb = hal_fb_get_info();
+    if (fb && fb->base) {
+        uint64_t fb_size = (uint64_t)fb->pitch * hal_fb_get_virtual_height();
+        err |= map_range((uint64_t)fb->base, fb_size, MT_WRITE_COMBINE);
+    }
+
+    if (err) {
+        printf("[MMU] Out of page tables - running with MMU off\n");
+        return;
+    }
+
+    // Caches are still off, so anything in them is left over from firmware:
+    // invalidate (not clean - that would write stale lines over our data),
+    // then install the tables and switch everything on
+    asm volatile(
+        DCACHE_ALL_SETWAY("isw")
+        "    msr     mair_el1, %0\n"
+        "    msr     tcr_el1, %1\n"
+        "    msr     ttbr0_el1, %2\n"
+        "    isb\n"
+        "    tlbi    vmalle1\n"
+        "    ic      iallu\n"
+        "    dsb     sy\n"
+        "    isb\n"
+        "    mrs     x0, sctlr_el1\n"
+        "    orr     x0, x0, %3\n"
+        "    msr     sctlr_el1, x0\n"
+        "    isb\n"
+        :: "r"(MAIR_VALUE), "r"(TCR_VALUE), "r"((uint64_t)mmu_tables[0]),
+           "r"(SCTLR_M | SCTLR_C | SCTLR_I)
+        : SETWAY_CLOBBERS);
+
+    if (demand_size) {
+        demand_base = program_start;
+        demand_end = program_end;
+    }
+
+    printf("[MMU] Enabled: %d page tables, D-cache and I-cache on\n", tables_used);
+}
+
+void mmu_init_secondary(void) {
+    // Caches are still off on this core, and its L1 comes out of reset
+    // invalid - no set/way work here (that would reach the shared L2 and
+    // throw away the boot core's dirty lines). The tables live in RAM the
+    // boot core may still have cached, but table walks are cacheable and
+    // inner shareable, so they snoop it.
+    asm volatile(
+        "    msr     mair_el1, %0\n"
+        "    msr     tcr_el1, %1\n"
+        "    msr     ttbr0_el1, %2\n"
+        "    isb\n"
+        "    tlbi    vmalle1\n"
+        "    ic      iallu\n"
+        "    dsb     sy\n"
+        "    isb\n"
+        "    mrs     x0, sctlr_el1\n"
+        "    orr     x0, x0, %3\n"
+        "    msr     sctlr_el1, x0\n"
+        "    isb\n"
+        :: "r"(MAIR_VALUE), "r"(TCR_VALUE), "r"((uint64_t)mmu_tables[0]),
+           "r"(SCTLR_M | SCTLR_C | SCTLR_I)
+        : "x0", "memory");
+}
+
+int mmu_dcache_enabled(void) {
+    uint64_t sctlr;
+    asm volatile("mrs %0, sctlr_el1" : "=r"(sctlr));
+    return (sctlr & SCTLR_C) != 0;
+}
+
+void mmu_dcache_disable(void) {
+    if (!mmu_dcache_enabled()) return;
+
+    // Stop allocating first, then push every dirty line out to RAM
+    asm volatile(
+        "    mrs     x0, sctlr_el1\n"
+        "    bic     x0, x0, #(1 << 2)\n"
+        "    msr     sctlr_el1, x0\n"
+        "    isb\n"
+        DCACHE_ALL_SETWAY("cisw")
+        ::: SETWAY_CLOBBERS);
+}
+
+void mmu_dcache_enable(void) {
+    if (mmu_dcache_enabled()) return;
+
+    // RAM is up to date (nothing was cached while off); drop any stale lines
+    asm volatile(
+        DCACHE_ALL_SETWAY("isw")
+        "    mrs     x0, sctlr_el1\n"
+        "    orr     x0, x0, #(1 << 2)\n"
+        "    msr     sctlr_el1, x0\n"
+        "    isb\n"
+        ::: SETWAY_CLOBBERS);
+}
+
+static inline uint64_t dcache_line_size(void) {
+    uint64_t ctr;
+    asm volatile("mrs %0, ctr_el0" : "=r"(ctr));
+    return 4UL << ((ctr >> 16) & 0xF);  // DminLine is log2(words)
+}
+
+void dcache_clean_range(const void *start, size_t len) {
+    uint64_t line = dcache_line_size();
+    uint64_t addr = (uint64_t)start & ~(line - 1);
+    uint64_t end = (uint64_t)start + len;
+
+    for (; addr < end; addr += line) {
+        asm volatile("dc cvac, %0" : : "r"(addr) : "memory");
+    }
+    asm volatile("dsb sy" ::: "memory");
+}
+
+void dcache_invalidate_range(void *start, size_t len) {
+    uint64_t line = dcache_line_size();
+    uint64_t addr = (uint64_t)start & ~(line - 1);
+    uint64_t end = (uint64_t)start + len;
+
+    // Clean + invalidate rather than plain invalidate: buffers rarely fill
+    // whole cache lines, and dc ivac would throw away our neighbours' writes
+    for (; addr < end; addr += line) {
+        asm volatile("dc civac, %0" : : "r"(addr) : "memory");
+    }
+    asm volatile("dsb sy" ::: "memory");
+}
+
+void icache_sync_range(const void *start, size_t len) {
+    uint64_t ctr;
+    asm volatile("mrs %0, ctr_el0" : "=r"(ctr));
+    uint64_t dline = 4UL << ((ctr >> 16) & 0xF);
+    uint64_t iline = 4UL << (ctr & 0xF);    // IminLine
+    uint64_t end = (uint64_t)start + len;
+
+    // Push the new instructions out to where instruction fetch sees them,
+    // then drop whatever the I-cache still holds for those addresses
+    for (uint64_t addr = (uint64_t)start & ~(dline - 1); addr < end; addr += dline) {
+        asm volatile("dc cvau, %0" : : "r"(addr) : "memory");
+    }
+    asm volatile("dsb ish" ::: "memory");
+    for (uint64_t addr = (uint64_t)start & ~(iline - 1); addr < end; addr += iline) {
+        asm volatile("ic ivau, %0" : : "r"(addr) : "memory");
+    }
+    asm volatile("dsb ish\n isb" ::: "memory");
+}
+
+int mmu_demand_paging(void) {
+    return demand_end != 0;
+}
+
+void mmu_demand_reset(uint64_t base, uint64_t size) {
+    if (!demand_end) return;
+    uint64_t addr = base & ~(PAGE_SIZE - 1);
+    uint64_t end = base + size;
+    if (addr < demand_base) addr = demand_base;
+    if (end > demand_end) end = demand_end;
+
+    uint64_t flags = spin_lock_irqsave(&demand_lock);
+    for (; addr < end; addr += PAGE_SIZE) {
+        uint64_t *pte = demand_pte(addr);
+        if (pte) *pte = 0;
+    }
+    // One broadcast flush is cheaper than a tlbi per page for any region
+    // worth loading a program into
+    asm volatile(
+        "dsb ishst\n"
+        "tlbi vmalle1is\n"
+        "dsb ish\n"
+        "isb\n" ::: "memory");
+    spin_unlock_irqrestore(&demand_lock, flags);
+}
+
+int mmu_map_shared(uint64_t base, const void *pages, uint64_t size) {
+    if (!demand_end || (base | (uint64_t)pages | size) & (PAGE_SIZE - 1)) return -1;
+    if (base < demand_base || base + size > demand_end) return -1;
+
+    uint64_t flags = spin_lock_irqsave(&demand_lock);
+    for (uint64_t off = 0; off < size; off += PAGE_SIZE) {
+        if (!demand_pte(base + off)) {
+            spin_unlock_irqrestore(&demand_lock, flags);
+            return -1;
+        }
+    }
+    // The entries were invalid (fresh region), so no TLB maintenance
+    for (uint64_t off = 0; off < size; off += PAGE_SIZE) {
+        *demand_pte(base + off) = ((uint64_t)pages + off) | type_attrs(MT_NORMAL) |
+                                  DESC_AP_RO | DESC_VALID | DESC_TABLE;
+    }
+    asm volatile("dsb ishst\n isb" ::: "memory");
+    spin_unlock_irqrestore(&demand_lock, flags);
+    return 0;
+}
+
+int mmu_dma_ok(const void *buf, size_t len) {
+    uint64_t start = (uint64_t)buf;
+    uint64_t end = start + len;
+    if (!demand_end || end <= demand_base || start >= demand_end) return 1;
+
+    for (uint64_t page = start & ~(PAGE_SIZE - 1); page < end; page += PAGE_SIZE) {
+        if (page < demand_base || page >= demand_end) continue;
+        uint64_t *pte = demand_pte(page);
+        if (pte && (*pte & DESC_VALID) && (*pte & ADDR_MASK) != page) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Runs straight from sync_handler, before anything else, with IRQs masked.
+ * The faulting code's FP registers are still live and were not saved, so
+ * this must not touch them - hence general-regs-only and a hand-written
+ * zero loop (memset could be vectorised).
+ *
+ * DMA into a program buffer stays correct: drivers invalidate a buffer by
+ * address before starting the device, and that dc civac faults the page in
+ * (zeroed) before the device writes it.
+ */
+__attribute__((target("general-regs-only")))
+int mmu_demand_fault(uint64_t esr, uint64_t far) {
+    uint64_t ec = (esr >> 26) & 0x3F;
+    if (ec != EC_DABT_CUR && ec != EC_DABT_LOWER) return 0;
+    if ((esr & ESR_FNV) || (esr & 0x3C) != FSC_TRANSLATION) return 0;
+    if (far < demand_base || far >= demand_end) return 0;
+
+    uint64_t page = far & ~(PAGE_SIZE - 1);
+    uint64_t *pte = demand_pte(page);
+    if (!pte) return 0;
+
+    // Another core may be faulting on the same page
+    spin_lock(&demand_lock);
+    if (!(*pte & DESC_VALID)) {
+        *pte = page | type_attrs(MT_NORMAL) | DESC_VALID | DESC_TABLE;
+        asm volatile("dsb ishst\n isb" ::: "memory");
+
+        uint64_t p = page;
+        uint64_t n = PAGE_SIZE;
+        asm volatile(
+            "1:  stp     xzr, xzr, [%0], #16\n"
+            "    stp     xzr, xzr, [%0], #16\n"
+            "    subs    %1, %1, #32\n"
+            "    b.ne    1b\n"
+            : "+r"(p), "+r"(n) :: "cc", "memory");
+    }
+    spin_unlock(&demand_lock);
+    return 1;
+}
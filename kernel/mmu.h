@@ -0,0 +1,67 @@
+/*
+ * KikiOS MMU and Cache Management
+ *
+ * Identity-mapped page tables shared by all targets: RAM is normal
+ * write-back memory, MMIO is device memory, and the framebuffer is
+ * write-combining. Enabling the MMU is what lets the D-cache work.
+ */
+
+#ifndef MMU_H
+#define MMU_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Memory types (index into MAIR_EL1)
+typedef enum {
+    MT_DEVICE_nGnRnE = 0,   // Strongly ordered device (Pi peripherals, GPU shared memory)
+    MT_NORMAL        = 1,   // Write-back cacheable RAM
+    MT_DEVICE        = 2,   // Device-nGnRE (MMIO that tolerates early write ack)
+    MT_WRITE_COMBINE = 3,   // Normal non-cacheable (framebuffer)
+} mem_type_t;
+
+// Build the identity map and turn on MMU, D-cache and I-cache.
+// Call once RAM is known (memory_init) and the framebuffer exists (fb_init).
+void mmu_init(void);
+
+// Turn on the MMU on a secondary core, using the tables mmu_init built
+void mmu_init_secondary(void);
+
+// Turn the D-cache off/on at runtime (for benchmarking)
+void mmu_dcache_disable(void);
+void mmu_dcache_enable(void);
+int mmu_dcache_enabled(void);
+
+// DMA cache maintenance for devices that access memory behind the cache:
+// clean before the device reads a buffer, invalidate before the CPU reads
+// what the device wrote. Cheap no-ops in effect when caches are off.
+void dcache_clean_range(const void *start, size_t len);
+void dcache_invalidate_range(void *start, size_t len);
+
+// Make instructions just written to [start, start + len) visible to
+// instruction fetch on every core (after loading code)
+void icache_sync_range(const void *start, size_t len);
+
+// Demand paging of the program area (memory.h program_start/end).
+// mmu_demand_paging() is 0 if the MMU is off: then nothing is zeroed for you.
+int mmu_demand_paging(void);
+
+// Unmap every page of a program-area range - it reads as zeros again
+void mmu_demand_reset(uint64_t base, uint64_t size);
+
+// Map size bytes of page-aligned kernel memory read-only at base, a fresh
+// region of the program area, so several programs can share one copy.
+// These are the only pages where VA != PA: never DMA from them.
+// Returns -1 if demand paging is off or the range doesn't qualify.
+int mmu_map_shared(uint64_t base, const void *pages, uint64_t size);
+
+// 1 if the device can be pointed at [buf, buf + len) directly: no part of
+// it is a shared page. Pages not yet touched are fine - drivers' cache
+// maintenance on the buffer faults them in first.
+int mmu_dma_ok(const void *buf, size_t len);
+
+// Translation fault in the program area: map and zero the page.
+// Returns 1 if handled (retry the access), 0 to treat it as a crash.
+int mmu_demand_fault(uint64_t esr, uint64_t far);
+
+#endif
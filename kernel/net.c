@@ -8,6 +8,11 @@
 #include "virtio_net.h"
 #include "printf.h"
 #include "string.h"
+#include "irq.h"
+#include "process.h"
+#include "ktimer.h"
+#include "softirq.h"
+#include "spinlock.h"
 
 // Our MAC and IP
 static uint8_t our_mac[6];
@@ -17,9 +22,6 @@ static uint32_t our_ip = NET_IP;
 #define ARP_TABLE_SIZE 16
 static arp_entry_t arp_table[ARP_TABLE_SIZE];
 
-// Packet buffer
-static uint8_t pkt_buf[1600];
-
 // Broadcast MAC
 static const uint8_t broadcast_mac[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
@@ -36,6 +38,26 @@ typedef struct {
 } udp_listener_t;
 static udp_listener_t udp_listeners[UDP_MAX_LISTENERS];
 
+// Everything above and below is only touched under net_lock: by the
+// network softirq, which drains the RX ring and runs the TCP timers, and
+// by the entry points processes call (net_poll, net_ping, dns_resolve,
+// the tcp_* API). Those drop it only to wait for the softirq in net_wait.
+static spinlock_t net_lock = SPINLOCK_INIT;
+
+// Processes in net_wait sleep on net_wq until the softirq has been. Each
+// checks its condition and clears its flag under net_lock, so a wakeup
+// can't fall in between. Flags are by pid; sharing one is just spurious.
+#define NET_WAIT_SLICE_US 10000
+static wait_queue_t net_wq = WAIT_QUEUE_INIT;
+static volatile int net_woken[MAX_PROCESSES];
+
+// TCP timers (retransmission) go off through here, which raises the softirq
+static ktimer_t net_timer;
+static volatile uint64_t net_timer_due = 0;   // Uptime us, 0 = not set
+
+static void net_timer_fire(void *arg);
+static void net_softirq(void);
+
 // Byte order helpers (network = big endian)
 static inline uint16_t htons(uint16_t x) {
     return (x >> 8) | (x << 8);
@@ -80,10 +102,66 @@ const char *ip_to_str(uint32_t ip) {
     return ip_str_buf;
 }
 
+// Packet buffers. They stay with the driver until the device has sent
+// them, so senders can't build packets on the stack.
+static pbuf_t pbuf_pool[PBUF_POOL_SIZE];
+static pbuf_t *pbuf_free_list;
+
+static void pbuf_pool_init(void) {
+    pbuf_free_list = NULL;
+    for (int i = PBUF_POOL_SIZE - 1; i >= 0; i--) {
+        pbuf_pool[i].next = pbuf_free_list;
+        pbuf_free_list = &pbuf_pool[i];
+    }
+}
+
+void pbuf_free(pbuf_t *p) {
+    p->next = pbuf_free_list;
+    pbuf_free_list = p;
+}
+
+// Driver callback: the device has sent p
+static void pbuf_tx_done(void *cookie) {
+    pbuf_t *p = (pbuf_t *)cookie;
+    if (p->nrefs && p->ref_frames) (*p->ref_frames)--;
+    pbuf_free(p);
+}
+
+pbuf_t *pbuf_alloc(void) {
+    // All in flight: reclaim what the device has finished. Callers hold
+    // net_lock with IRQs masked, so never wait for it - they treat NULL
+    // like a lost packet (TCP holds its data back and retries)
+    if (!pbuf_free_list) virtio_net_tx_reap();
+    if (!pbuf_free_list) return NULL;
+
+    pbuf_t *p = pbuf_free_list;
+    pbuf_free_list = p->next;
+    p->data = p->buf + PBUF_HEADROOM;
+    p->len = 0;
+    p->nrefs = 0;
+    p->ref_frames = NULL;
+    return p;
+}
+
+// Whether none of a sender's queued frames points into its memory any more
+static int net_tx_refs_done(const int *ref_frames) {
+    if (*ref_frames > 0) virtio_net_tx_reap();
+    return *ref_frames == 0;
+}
+
 void net_init(void) {
     // Get our MAC from the driver
     virtio_net_get_mac(our_mac);
 
+    // Transmit buffers come back through the driver once sent
+    pbuf_pool_init();
+    virtio_net_set_tx_done(pbuf_tx_done);
+
+    // Received packets and TCP timers are handled in the network softirq
+    net_timer.fn = net_timer_fire;
+    net_timer.arg = NULL;
+    softirq_register(SOFTIRQ_NET, net_softirq);
+
     // Clear ARP table
     memset(arp_table, 0, sizeof(arp_table));
 
@@ -98,21 +176,81 @@ void net_get_mac(uint8_t *mac) {
     memcpy(mac, our_mac, 6);
 }
 
+void *pbuf_put(pbuf_t *p, uint32_t len) {
+    // Copied bytes can't go after referenced ones
+    if (p->nrefs || p->data + p->len + len > p->buf + sizeof(p->buf)) {
+        return NULL;
+    }
+    void *tail = p->data + p->len;
+    p->len += len;
+    return tail;
+}
+
+int pbuf_ref(pbuf_t *p, const void *addr, uint32_t len) {
+    if (len == 0) return 0;
+    if (p->nrefs == PBUF_MAX_REFS) return -1;
+    p->ref[p->nrefs].addr = addr;
+    p->ref[p->nrefs].len = len;
+    p->nrefs++;
+    return 0;
+}
+
+void *pbuf_push(pbuf_t *p, uint32_t len) {
+    if (p->data - p->buf < (long)len) return NULL;
+    p->data -= len;
+    p->len += len;
+    return p->data;
+}
+
+uint32_t pbuf_len(const pbuf_t *p) {
+    uint32_t len = p->len;
+    for (int i = 0; i < p->nrefs; i++) {
+        len += p->ref[i].len;
+    }
+    return len;
+}
+
 // Send ethernet frame
-int eth_send(const uint8_t *dst_mac, uint16_t ethertype, const void *data, uint32_t len) {
-    if (len > NET_MTU - sizeof(eth_header_t)) {
+int eth_output(pbuf_t *p, const uint8_t *dst_mac, uint16_t ethertype) {
+    eth_header_t *eth = pbuf_push(p, sizeof(eth_header_t));
+    if (!eth || pbuf_len(p) > NET_MTU) {
+        pbuf_free(p);
         return -1;
     }
 
-    // Build frame
-    eth_header_t *eth = (eth_header_t *)pkt_buf;
     memcpy(eth->dst, dst_mac, 6);
     memcpy(eth->src, our_mac, 6);
     eth->ethertype = htons(ethertype);
 
-    memcpy(pkt_buf + sizeof(eth_header_t), data, len);
+    // Headers and copied data, then the referenced pieces where they are
+    virtio_net_sg_t sg[1 + PBUF_MAX_REFS];
+    sg[0].addr = p->data;
+    sg[0].len = p->len;
+    for (int i = 0; i < p->nrefs; i++) {
+        sg[1 + i].addr = p->ref[i].addr;
+        sg[1 + i].len = p->ref[i].len;
+    }
 
-    return virtio_net_send(pkt_buf, sizeof(eth_header_t) + len);
+    if (virtio_net_send_sg(sg, 1 + p->nrefs, p) < 0) {
+        pbuf_free(p);
+        return -1;
+    }
+    if (p->nrefs && p->ref_frames) (*p->ref_frames)++;
+    return 0;
+}
+
+int eth_send(const uint8_t *dst_mac, uint16_t ethertype, const void *data, uint32_t len) {
+    pbuf_t *p = pbuf_alloc();
+    if (!p) {
+        return -1;
+    }
+    void *payload = pbuf_put(p, len);
+    if (!payload) {
+        pbuf_free(p);
+        return -1;
+    }
+    memcpy(payload, data, len);
+    return eth_output(p, dst_mac, ethertype);
 }
 
 // ARP table lookup
@@ -223,25 +361,88 @@ static void arp_handle(const uint8_t *pkt, uint32_t len) {
     }
 }
 
-// IP checksum
-uint16_t ip_checksum(const void *data, uint32_t len) {
-    const uint16_t *ptr = (const uint16_t *)data;
-    uint32_t sum = 0;
+// Add with end-around carry, as ones' complement arithmetic wants
+static inline uint64_t csum_add(uint64_t sum, uint64_t w) {
+    sum += w;
+    return sum + (sum < w);
+}
+
+// Fold a 64-bit ones' complement sum down to 16 bits
+static uint32_t csum_fold(uint64_t sum) {
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint32_t)sum;
+}
+
+// Ones' complement sum of a buffer (RFC 1071), folded but not inverted so
+// pieces can be combined. Sums 8 bytes per add: since 2^16 = 1 mod 0xffff,
+// folding a sum of 64-bit words gives the same result as adding 16-bit ones.
+static uint32_t csum_partial(const void *data, uint32_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    int odd = (uintptr_t)p & 1;
+    uint64_t sum = 0;
+    uint64_t w = 0;
+
+    // We build with -mstrict-align, so bytes before the first 8-byte
+    // boundary go into the lanes an aligned load would have put them in
+    while (len && ((uintptr_t)p & 7)) {
+        w |= (uint64_t)*p << (((uintptr_t)p & 7) * 8);
+        p++;
+        len--;
+    }
+    sum = csum_add(sum, w);
+
+    const uint64_t *q = (const uint64_t *)p;
+    while (len >= 32) {
+        sum = csum_add(sum, q[0]);
+        sum = csum_add(sum, q[1]);
+        sum = csum_add(sum, q[2]);
+        sum = csum_add(sum, q[3]);
+        q += 4;
+        len -= 32;
+    }
+    while (len >= 8) {
+        sum = csum_add(sum, *q++);
+        len -= 8;
+    }
 
-    while (len > 1) {
-        sum += *ptr++;
-        len -= 2;
+    p = (const uint8_t *)q;
+    w = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        w |= (uint64_t)p[i] << (i * 8);
     }
+    sum = csum_add(sum, w);
 
-    if (len == 1) {
-        sum += *(const uint8_t *)ptr;
+    // Lanes follow the address, so an odd start put every byte in the
+    // wrong half of its 16-bit word
+    uint32_t folded = csum_fold(sum);
+    if (odd) {
+        folded = ((folded & 0xff) << 8) | (folded >> 8);
     }
+    return folded;
+}
 
-    while (sum >> 16) {
-        sum = (sum & 0xffff) + (sum >> 16);
+// IP checksum
+uint16_t ip_checksum(const void *data, uint32_t len) {
+    return ~csum_partial(data, len);
+}
+
+uint16_t pbuf_checksum(const pbuf_t *p, uint32_t sum) {
+    uint64_t total = (uint64_t)sum + csum_partial(p->data, p->len);
+    uint32_t offset = p->len;
+
+    for (int i = 0; i < p->nrefs; i++) {
+        uint32_t part = csum_partial(p->ref[i].addr, p->ref[i].len);
+        if (offset & 1) {
+            part = ((part & 0xff) << 8) | (part >> 8);
+        }
+        total += part;
+        offset += p->ref[i].len;
     }
 
-    return ~sum;
+    return ~csum_fold(total);
 }
 
 // Handle incoming ICMP packet
@@ -253,9 +454,16 @@ static void icmp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip) {
     if (icmp->type == ICMP_ECHO_REQUEST) {
         printf("[ICMP] Echo request from %s\n", ip_to_str(src_ip));
 
-        // Send echo reply
-        uint8_t reply_buf[1500];
-        icmp_header_t *reply = (icmp_header_t *)reply_buf;
+        // Send echo reply. The request's data is copied: the receive
+        // buffer is reused before the reply has necessarily gone out.
+        uint32_t data_len = len - sizeof(icmp_header_t);
+        if (data_len > PBUF_DATA_SIZE - sizeof(ip_header_t) - sizeof(icmp_header_t)) {
+            data_len = PBUF_DATA_SIZE - sizeof(ip_header_t) - sizeof(icmp_header_t);
+        }
+        pbuf_t *p = pbuf_alloc();
+        if (!p) return;
+        memcpy(pbuf_put(p, data_len), pkt + sizeof(icmp_header_t), data_len);
+        icmp_header_t *reply = pbuf_push(p, sizeof(icmp_header_t));
 
         reply->type = ICMP_ECHO_REPLY;
         reply->code = 0;
@@ -263,17 +471,10 @@ static void icmp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip) {
         reply->id = icmp->id;
         reply->seq = icmp->seq;
 
-        // Copy data portion
-        uint32_t data_len = len - sizeof(icmp_header_t);
-        if (data_len > sizeof(reply_buf) - sizeof(icmp_header_t)) {
-            data_len = sizeof(reply_buf) - sizeof(icmp_header_t);
-        }
-        memcpy(reply_buf + sizeof(icmp_header_t), pkt + sizeof(icmp_header_t), data_len);
-
         // Calculate checksum
-        reply->checksum = ip_checksum(reply_buf, sizeof(icmp_header_t) + data_len);
+        reply->checksum = pbuf_checksum(p, 0);
 
-        ip_send(src_ip, IP_PROTO_ICMP, reply_buf, sizeof(icmp_header_t) + data_len);
+        ip_output(p, src_ip, IP_PROTO_ICMP);
         printf("[ICMP] Sent echo reply\n");
     }
     else if (icmp->type == ICMP_ECHO_REPLY) {
@@ -312,8 +513,10 @@ static void udp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip) {
     // No listener - silently drop (don't spam debug output)
 }
 
-// Forward declaration for TCP handler
+// Forward declarations for TCP
 static void tcp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip);
+static void tcp_timers(void);
+static uint64_t tcp_next_deadline(void);
 
 // Handle incoming IP packet
 static void ip_handle(const uint8_t *pkt, uint32_t len) {
@@ -353,8 +556,10 @@ static void ip_handle(const uint8_t *pkt, uint32_t len) {
 }
 
 // Send IP packet
-int ip_send(uint32_t dst_ip, uint8_t protocol, const void *data, uint32_t len) {
+int ip_output(pbuf_t *p, uint32_t dst_ip, uint8_t protocol) {
+    uint32_t len = pbuf_len(p);
     if (len > NET_MTU - sizeof(eth_header_t) - sizeof(ip_header_t)) {
+        pbuf_free(p);
         return -1;
     }
 
@@ -371,13 +576,17 @@ int ip_send(uint32_t dst_ip, uint8_t protocol, const void *data, uint32_t len) {
     if (!dst_mac) {
         // Need to ARP first
         printf("[IP] No ARP entry for %s, sending request\n", ip_to_str(next_hop));
+        pbuf_free(p);
         arp_request(next_hop);
         return -1;  // Caller should retry
     }
 
-    // Build IP packet
-    static uint8_t ip_buf[1600];
-    ip_header_t *ip = (ip_header_t *)ip_buf;
+    // Build IP header in front of the payload
+    ip_header_t *ip = pbuf_push(p, sizeof(ip_header_t));
+    if (!ip) {
+        pbuf_free(p);
+        return -1;
+    }
 
     ip->version_ihl = 0x45;  // IPv4, 20 byte header
     ip->tos = 0;
@@ -393,41 +602,62 @@ int ip_send(uint32_t dst_ip, uint8_t protocol, const void *data, uint32_t len) {
     // Calculate header checksum
     ip->checksum = ip_checksum(ip, sizeof(ip_header_t));
 
-    // Copy payload
-    memcpy(ip_buf + sizeof(ip_header_t), data, len);
+    return eth_output(p, dst_mac, ETH_TYPE_IP);
+}
 
-    return eth_send(dst_mac, ETH_TYPE_IP, ip_buf, sizeof(ip_header_t) + len);
+int ip_send(uint32_t dst_ip, uint8_t protocol, const void *data, uint32_t len) {
+    pbuf_t *p = pbuf_alloc();
+    if (!p) {
+        return -1;
+    }
+    void *payload = pbuf_put(p, len);
+    if (!payload) {
+        pbuf_free(p);
+        return -1;
+    }
+    memcpy(payload, data, len);
+    return ip_output(p, dst_ip, protocol);
 }
 
 // Send ICMP echo request
 int icmp_send_echo_request(uint32_t dst_ip, uint16_t id, uint16_t seq, const void *data, uint32_t len) {
-    uint8_t icmp_buf[1500];
-    icmp_header_t *icmp = (icmp_header_t *)icmp_buf;
+    pbuf_t *p = pbuf_alloc();
+    if (!p) {
+        return -1;
+    }
+
+    // Copy data
+    if (len > PBUF_DATA_SIZE - sizeof(ip_header_t) - sizeof(icmp_header_t)) {
+        len = PBUF_DATA_SIZE - sizeof(ip_header_t) - sizeof(icmp_header_t);
+    }
+    uint8_t *payload = pbuf_put(p, len);
+    if (data && len > 0) {
+        memcpy(payload, data, len);
+    } else {
+        memset(payload, 0, len);
+    }
 
+    icmp_header_t *icmp = pbuf_push(p, sizeof(icmp_header_t));
     icmp->type = ICMP_ECHO_REQUEST;
     icmp->code = 0;
     icmp->checksum = 0;
     icmp->id = htons(id);
     icmp->seq = htons(seq);
 
-    // Copy data
-    if (len > sizeof(icmp_buf) - sizeof(icmp_header_t)) {
-        len = sizeof(icmp_buf) - sizeof(icmp_header_t);
-    }
-    if (data && len > 0) {
-        memcpy(icmp_buf + sizeof(icmp_header_t), data, len);
-    }
-
     // Calculate checksum
-    icmp->checksum = ip_checksum(icmp_buf, sizeof(icmp_header_t) + len);
+    icmp->checksum = pbuf_checksum(p, 0);
 
-    return ip_send(dst_ip, IP_PROTO_ICMP, icmp_buf, sizeof(icmp_header_t) + len);
+    return ip_output(p, dst_ip, IP_PROTO_ICMP);
 }
 
-// Process incoming packets
-void net_poll(void) {
+// Process incoming packets, reclaim sent ones and run the TCP timers
+// (net_lock held)
+static void net_process(void) {
     static uint8_t rx_buf[1600];
 
+    // Reclaim sent frames (their buffers go back to the pool)
+    virtio_net_tx_reap();
+
     while (virtio_net_has_packet()) {
         int len = virtio_net_recv(rx_buf, sizeof(rx_buf));
         if (len <= 0) break;
@@ -452,31 +682,126 @@ void net_poll(void) {
                 break;
         }
     }
+    tcp_timers();
 }
 
-// Blocking ping with timeout
-int net_ping(uint32_t ip, uint16_t seq, uint32_t timeout_ms) {
-    // First, make sure we have ARP entry for the target (or gateway)
+static void net_timer_fire(void *arg) {
+    (void)arg;
+    net_timer_due = 0;
+    softirq_raise(SOFTIRQ_NET);
+}
+
+// Point net_timer at the earliest TCP timer (net_lock held)
+static void net_arm_timer(void) {
+    uint64_t due = tcp_next_deadline();
+    if (!due || due == net_timer_due) return;
+
+    uint64_t now = timer_get_uptime_us();
+    net_timer_due = due;
+    ktimer_add(&net_timer, ktimer_now() + ktimer_us_to_count(due > now ? due - now + 1 : 1));
+}
+
+static uint64_t net_lock_irqsave(void) {
+    return spin_lock_irqsave(&net_lock);
+}
+
+// Anything the caller did may have started a TCP timer
+static void net_unlock(uint64_t flags) {
+    net_arm_timer();
+    spin_unlock_irqrestore(&net_lock, flags);
+}
+
+// Let everyone in net_wait re-check what they were waiting for
+static void net_wake(void) {
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        net_woken[i] = 1;
+    }
+    process_wake_all(&net_wq);
+}
+
+// Wait for the softirq to get something done: called with net_lock held
+// (flags from net_lock_irqsave), sleeps without it until the softirq has
+// run or a slice has passed, and returns with it held again. Callers loop,
+// re-checking their condition and deadline. The kernel thread can't block,
+// so it runs the stack itself and goes round.
+static uint64_t net_wait(uint64_t flags) {
+    process_t *cur = process_current();
+    if (!cur) {
+        net_process();
+        net_unlock(flags);
+        asm volatile("yield");
+        return net_lock_irqsave();
+    }
+
+    volatile int *woken = &net_woken[cur->pid % MAX_PROCESSES];
+    *woken = 0;
+    net_unlock(flags);
+    process_wait_event(&net_wq, woken, ktimer_now() + ktimer_us_to_count(NET_WAIT_SLICE_US));
+    return net_lock_irqsave();
+}
+
+// Uptime at which a wait of timeout_ms ends: never if < 0, now if 0
+static uint64_t net_deadline(int timeout_ms) {
+    if (timeout_ms < 0) return UINT64_MAX;
+    return timer_get_uptime_us() + (uint64_t)timeout_ms * 1000;
+}
+
+// Bottom half of the network IRQ. Runs on one core at a time with IRQs
+// masked, so the lock only keeps out process context on other cores.
+static void net_softirq(void) {
+    spin_lock(&net_lock);
+    net_process();
+    net_arm_timer();
+    spin_unlock(&net_lock);
+
+    net_wake();
+}
+
+void net_irq_handler(void) {
+    virtio_net_irq_handler();       // Ack the device
+    softirq_raise(SOFTIRQ_NET);
+}
+
+// Process incoming packets now. The softirq does this by itself; this is
+// for code that wants the stack caught up before it looks at something.
+void net_poll(void) {
+    uint64_t flags = net_lock_irqsave();
+    net_process();
+    net_unlock(flags);
+    net_wake();
+}
+
+// Make sure there is an ARP entry for the next hop towards ip, asking
+// and waiting up to a second if not (net_lock held, flags updated)
+static int arp_resolve(uint32_t ip, uint64_t *flags) {
     uint32_t next_hop = ip;
     if ((ip & NET_NETMASK) != (our_ip & NET_NETMASK)) {
         next_hop = NET_GATEWAY;
     }
 
-    // Try to get ARP entry, send request if needed
+    if (arp_lookup(next_hop)) return 0;
+
+    arp_request(next_hop);
+    uint64_t deadline = timer_get_uptime_us() + 1000000;
+    while (!arp_lookup(next_hop) && timer_get_uptime_us() < deadline) {
+        *flags = net_wait(*flags);
+    }
+
     if (!arp_lookup(next_hop)) {
-        arp_request(next_hop);
+        printf("[ARP] Timeout for %s\n", ip_to_str(next_hop));
+        return -1;
+    }
+    return 0;
+}
 
-        // Wait for ARP reply (up to 1 second)
-        for (int i = 0; i < 100 && !arp_lookup(next_hop); i++) {
-            net_poll();
-            // Simple delay (~10ms)
-            for (volatile int j = 0; j < 100000; j++);
-        }
+// Blocking ping with timeout
+int net_ping(uint32_t ip, uint16_t seq, uint32_t timeout_ms) {
+    uint64_t flags = net_lock_irqsave();
 
-        if (!arp_lookup(next_hop)) {
-            printf("[PING] ARP timeout for %s\n", ip_to_str(next_hop));
-            return -1;
-        }
+    // First, make sure we have ARP entry for the target (or gateway)
+    if (arp_resolve(ip, &flags) < 0) {
+        net_unlock(flags);
+        return -1;
     }
 
     // Set up ping tracking
@@ -489,17 +814,20 @@ int net_ping(uint32_t ip, uint16_t seq, uint32_t timeout_ms) {
     memset(ping_data, 0xAB, sizeof(ping_data));
 
     if (icmp_send_echo_request(ip, ping_id, seq, ping_data, sizeof(ping_data)) < 0) {
+        net_unlock(flags);
         return -1;
     }
 
     // Wait for reply
-    for (uint32_t i = 0; i < timeout_ms / 10 && !ping_received; i++) {
-        net_poll();
-        // Simple delay (~10ms)
-        for (volatile int j = 0; j < 100000; j++);
+    uint64_t deadline = timer_get_uptime_us() + (uint64_t)timeout_ms * 1000;
+    while (!ping_received && timer_get_uptime_us() < deadline) {
+        flags = net_wait(flags);
     }
 
-    if (ping_received) {
+    int received = ping_received;
+    net_unlock(flags);
+
+    if (received) {
         return 0;  // TODO: return actual RTT
     }
 
@@ -546,19 +874,20 @@ int udp_send(uint32_t dst_ip, uint16_t src_port, uint16_t dst_port, const void *
         return -1;
     }
 
-    // Build UDP packet
-    uint8_t udp_buf[1500];
-    udp_header_t *udp = (udp_header_t *)udp_buf;
+    // Build UDP packet: data, then the header in front of it
+    pbuf_t *p = pbuf_alloc();
+    if (!p) {
+        return -1;
+    }
+    memcpy(pbuf_put(p, len), data, len);
+    udp_header_t *udp = pbuf_push(p, sizeof(udp_header_t));
 
     udp->src_port = htons(src_port);
     udp->dst_port = htons(dst_port);
     udp->length = htons(sizeof(udp_header_t) + len);
     udp->checksum = 0;  // Checksum optional for IPv4
 
-    // Copy data
-    memcpy(udp_buf + sizeof(udp_header_t), data, len);
-
-    return ip_send(dst_ip, IP_PROTO_UDP, udp_buf, sizeof(udp_header_t) + len);
+    return ip_output(p, dst_ip, IP_PROTO_UDP);
 }
 
 // DNS resolver
@@ -727,6 +1056,8 @@ uint32_t dns_resolve(const char *hostname) {
 
     uint32_t query_len = ptr - query;
 
+    uint64_t flags = net_lock_irqsave();
+
     // Bind to receive DNS responses on port 53 (we're the client, but use same port for simplicity)
     // Actually, use ephemeral port
     uint16_t local_port = 10053 + (dns_query_id % 100);
@@ -737,36 +1068,27 @@ uint32_t dns_resolve(const char *hostname) {
 
     // First, make sure we can reach DNS server (ARP)
     uint32_t dns_server = NET_DNS;
-    uint32_t next_hop = dns_server;
-    if ((dns_server & NET_NETMASK) != (our_ip & NET_NETMASK)) {
-        next_hop = NET_GATEWAY;
-    }
-
-    if (!arp_lookup(next_hop)) {
-        arp_request(next_hop);
-        for (int i = 0; i < 100 && !arp_lookup(next_hop); i++) {
-            net_poll();
-            for (volatile int j = 0; j < 100000; j++);
-        }
-        if (!arp_lookup(next_hop)) {
-            udp_unbind(local_port);
-            return 0;
-        }
+    if (arp_resolve(dns_server, &flags) < 0) {
+        udp_unbind(local_port);
+        net_unlock(flags);
+        return 0;
     }
 
     // Send DNS query
     if (udp_send(dns_server, local_port, 53, query, query_len) < 0) {
         udp_unbind(local_port);
+        net_unlock(flags);
         return 0;
     }
 
     // Wait for response (up to 5 seconds)
-    for (int i = 0; i < 500 && !dns_response_received; i++) {
-        net_poll();
-        for (volatile int j = 0; j < 100000; j++);
+    uint64_t deadline = timer_get_uptime_us() + 5000000;
+    while (!dns_response_received && timer_get_uptime_us() < deadline) {
+        flags = net_wait(flags);
     }
 
     udp_unbind(local_port);
+    net_unlock(flags);
 
     if (dns_response_received) {
         printf("[DNS] Resolved %s -> %s\n", hostname, ip_to_str(dns_resolved_ip));
@@ -778,11 +1100,32 @@ uint32_t dns_resolve(const char *hostname) {
 }
 
 // ============ TCP Implementation ============
+//
+// Sending: tcp_send queues data in the socket's tx ring, which holds
+// everything from snd_una (the oldest unacknowledged byte) on, and
+// tcp_output sends from it as far as the peer's window and the congestion
+// window allow. Data is resent when the retransmission timer runs out
+// (RFC 6298, run from the network softirq) or after three duplicate ACKs
+// (fast retransmit). Congestion control is NewReno (RFC 6582).
+//
+// Receiving: a segment's data goes straight to its place in the rx ring,
+// in order or not. Ranges past a gap are remembered until the gap fills,
+// and every data segment is ACKed at once - a duplicate ACK while there is
+// a gap, which is what gets the peer to fast retransmit. We advertise the
+// ring's free space, scaled (RFC 7323) if the peer does window scaling.
 
 // TCP socket structure
 #define TCP_MAX_SOCKETS 8
-#define TCP_RX_BUF_SIZE 32768  // 32KB - TLS certs can be large
-#define TCP_TX_BUF_SIZE 4096
+#define TCP_RX_BUF_SIZE (128 * 1024)   // Our window (TLS certs can be large too)
+#define TCP_TX_BUF_SIZE (64 * 1024)    // Unacknowledged and unsent data
+#define TCP_WSCALE      2              // 128KB of window needs 2 bits of scaling
+#define TCP_MSS         1460           // Ethernet MTU - IP and TCP headers
+#define TCP_OOO_MAX     8              // Out-of-order ranges remembered
+#define TCP_DUPACKS     3              // Duplicate ACKs that trigger fast retransmit
+#define TCP_RTO_INIT    1000000        // Microseconds, before the first RTT sample
+#define TCP_RTO_MIN     200000
+#define TCP_RTO_MAX     60000000
+#define TCP_MAX_RETRIES 10             // Timeouts in a row before giving up (minutes)
 
 typedef struct {
     int state;
@@ -792,19 +1135,58 @@ typedef struct {
     uint16_t remote_port;
 
     // Sequence numbers
-    uint32_t send_seq;      // Next byte we'll send
+    uint32_t send_seq;      // Next byte we'll send (snd_nxt)
     uint32_t send_ack;      // Last ACK we sent (next byte we expect)
     uint32_t recv_seq;      // For tracking incoming data
-
-    // Receive buffer (ring buffer)
+    uint32_t snd_una;       // Oldest byte not acknowledged yet
+    uint32_t snd_max;       // Highest send_seq so far (a timeout rewinds send_seq)
+    uint32_t snd_wnd;       // Peer's window, scaled
+    uint16_t mss;           // Largest segment the peer takes
+    uint8_t snd_wscale;     // Shift for the windows the peer advertises
+    uint8_t rcv_wscale;     // Shift for the windows we advertise
+    uint32_t adv_wnd;       // Window in our last segment, bytes
+
+    // Receive buffer (ring buffer). Out-of-order data sits past rx_head.
     uint8_t rx_buf[TCP_RX_BUF_SIZE];
-    uint32_t rx_head;       // Write position
+    uint32_t rx_head;       // Write position (send_ack goes here)
     uint32_t rx_tail;       // Read position
+    struct {
+        uint32_t start;     // Sequence numbers, start < end
+        uint32_t end;
+    } ooo[TCP_OOO_MAX];
+    int ooo_count;
+
+    // Send buffer (ring buffer) from snd_una on
+    uint8_t tx_buf[TCP_TX_BUF_SIZE];
+    uint32_t tx_start;      // Position of snd_una
+    uint32_t tx_len;        // Bytes queued
+
+    // Congestion control
+    uint32_t cwnd;          // Bytes we may have in flight
+    uint32_t ssthresh;
+    uint32_t recover;       // Fast recovery lasts until this is ACKed
+    int in_recovery;
+    int dupacks;
+
+    // Retransmission timer (times in microseconds)
+    uint64_t rto_deadline;  // 0 = not running
+    uint32_t rto;
+    uint32_t srtt;          // 0 = no sample yet
+    uint32_t rttvar;
+    uint32_t rtt_seq;       // Timing the segment ending here...
+    uint64_t rtt_start;     // ...sent at this time (0 = not timing)
+    int rto_retries;        // Timeouts since the peer last ACKed anything
+
+    // Frames queued for the device that point into tx_buf. The slot can't
+    // be reused until they have gone, even once the socket is closed.
+    int tx_ref_frames;
 
     // Flags
     uint8_t fin_received;   // Remote sent FIN
-    uint8_t fin_sent;       // We sent FIN
-    
+    uint8_t fin_sent;       // We sent FIN (at fin_seq)
+    uint8_t fin_queued;     // FIN goes after the queued data
+    uint32_t fin_seq;
+
     // For listening sockets
     int is_listening;       // 1 if this is a listening socket
     int accepted;           // For new connections: 1 if already accepted
@@ -813,18 +1195,12 @@ typedef struct {
 static tcp_socket_internal_t tcp_sockets[TCP_MAX_SOCKETS];
 static uint16_t tcp_next_port = 49152;  // Ephemeral port range
 
-// TCP pseudo-header for checksum
-typedef struct __attribute__((packed)) {
-    uint32_t src_ip;
-    uint32_t dst_ip;
-    uint8_t zero;
-    uint8_t protocol;
-    uint16_t tcp_len;
-} tcp_pseudo_header_t;
-
-// Calculate TCP checksum (includes pseudo-header)
-static uint16_t tcp_checksum(uint32_t src_ip, uint32_t dst_ip,
-                              const tcp_header_t *tcp, const void *data, uint32_t data_len) {
+// Sequence number comparisons (they wrap)
+#define SEQ_LT(a, b)    ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b)   ((int32_t)((a) - (b)) <= 0)
+
+// Calculate TCP checksum over a segment (header onward) and the pseudo-header
+static uint16_t tcp_checksum(uint32_t src_ip, uint32_t dst_ip, const pbuf_t *p) {
     uint32_t sum = 0;
 
     // Pseudo-header
@@ -833,58 +1209,366 @@ static uint16_t tcp_checksum(uint32_t src_ip, uint32_t dst_ip,
     sum += (dst_ip >> 16) & 0xffff;
     sum += dst_ip & 0xffff;
     sum += htons(IP_PROTO_TCP);
-    sum += htons(sizeof(tcp_header_t) + data_len);
+    sum += htons(pbuf_len(p));
 
-    // TCP header
-    const uint16_t *ptr = (const uint16_t *)tcp;
-    for (int i = 0; i < (int)(sizeof(tcp_header_t) / 2); i++) {
-        sum += ptr[i];
-    }
+    return pbuf_checksum(p, sum);
+}
 
-    // Data
-    ptr = (const uint16_t *)data;
-    while (data_len > 1) {
-        sum += *ptr++;
-        data_len -= 2;
-    }
-    if (data_len == 1) {
-        sum += *(const uint8_t *)ptr;
-    }
+// Free space in the receive ring
+static uint32_t tcp_rx_free(tcp_socket_internal_t *sock) {
+    uint32_t used = (sock->rx_head - sock->rx_tail + TCP_RX_BUF_SIZE) % TCP_RX_BUF_SIZE;
+    return TCP_RX_BUF_SIZE - 1 - used;
+}
 
-    // Fold 32-bit sum to 16 bits
-    while (sum >> 16) {
-        sum = (sum & 0xffff) + (sum >> 16);
+// Send a TCP segment starting at seq, with the payload already in p (or
+// none if p is NULL). Takes ownership of p. SYNs carry our MSS and window scale.
+static int tcp_send_segment(tcp_socket_internal_t *sock, uint8_t flags, uint32_t seq,
+                            pbuf_t *p) {
+    if (!p) {
+        p = pbuf_alloc();
+        if (!p) return -1;
     }
 
-    return ~sum;
-}
+    // Options go in front of the payload first, then the fixed header
+    uint32_t hdr_len = sizeof(tcp_header_t);
+    if (flags & TCP_SYN) {
+        hdr_len += (!(flags & TCP_ACK) || sock->rcv_wscale) ? 8 : 4;
+    }
+    tcp_header_t *tcp = pbuf_push(p, hdr_len);
+    if (!tcp) {
+        pbuf_free(p);
+        return -1;
+    }
 
-// Send a TCP segment
-static int tcp_send_segment(tcp_socket_internal_t *sock, uint8_t flags,
-                            const void *data, uint32_t len) {
-    uint8_t pkt[1500];
-    tcp_header_t *tcp = (tcp_header_t *)pkt;
+    // Windows in SYNs are never scaled
+    uint32_t wnd = tcp_rx_free(sock);
+    uint32_t max_wnd = (flags & TCP_SYN) ? 0xffff : (0xffffu << sock->rcv_wscale);
+    if (wnd > max_wnd) wnd = max_wnd;
+    if (!(flags & TCP_SYN)) wnd &= ~((1u << sock->rcv_wscale) - 1);
+    sock->adv_wnd = wnd;
 
     tcp->src_port = htons(sock->local_port);
     tcp->dst_port = htons(sock->remote_port);
-    tcp->seq = htonl(sock->send_seq);
+    tcp->seq = htonl(seq);
     tcp->ack = htonl(sock->send_ack);
-    tcp->data_off = (5 << 4);  // 20 bytes, no options
     tcp->flags = flags;
-    tcp->window = htons(TCP_RX_BUF_SIZE);
+    tcp->window = htons((flags & TCP_SYN) ? wnd : wnd >> sock->rcv_wscale);
     tcp->checksum = 0;
     tcp->urgent = 0;
 
-    // Copy data
-    if (data && len > 0) {
-        memcpy(pkt + sizeof(tcp_header_t), data, len);
+    // A SYN+ACK only offers window scaling if the SYN did
+    if (flags & TCP_SYN) {
+        uint8_t *opt = (uint8_t *)tcp + sizeof(tcp_header_t);
+        opt[0] = 2;                 // MSS
+        opt[1] = 4;
+        opt[2] = TCP_MSS >> 8;
+        opt[3] = TCP_MSS & 0xff;
+        if (hdr_len > sizeof(tcp_header_t) + 4) {
+            opt[4] = 1;             // NOP, to align
+            opt[5] = 3;             // Window scale
+            opt[6] = 3;
+            opt[7] = TCP_WSCALE;
+        }
     }
+    tcp->data_off = (hdr_len / 4) << 4;
 
     // Calculate checksum
-    tcp->checksum = tcp_checksum(htonl(sock->local_ip), htonl(sock->remote_ip),
-                                  tcp, data, len);
+    tcp->checksum = tcp_checksum(htonl(sock->local_ip), htonl(sock->remote_ip), p);
+
+    return ip_output(p, sock->remote_ip, IP_PROTO_TCP);
+}
+
+// ACK (and advertise our window) without sending data
+static void tcp_send_ack(tcp_socket_internal_t *sock) {
+    tcp_send_segment(sock, TCP_ACK, sock->send_seq, NULL);
+}
+
+// Pick up the MSS and window scale options from a SYN
+static void tcp_parse_syn_options(tcp_socket_internal_t *sock, const uint8_t *opt, uint32_t len) {
+    sock->mss = 536;            // RFC 9293 default
+    sock->snd_wscale = 0;
+    sock->rcv_wscale = 0;
+
+    uint32_t i = 0;
+    while (i < len) {
+        uint8_t kind = opt[i];
+        if (kind == 0) break;   // End of options
+        if (kind == 1) {        // NOP
+            i++;
+            continue;
+        }
+        if (i + 1 >= len || opt[i + 1] < 2 || i + opt[i + 1] > len) break;
+        if (kind == 2 && opt[i + 1] == 4) {
+            sock->mss = (opt[i + 2] << 8) | opt[i + 3];
+        } else if (kind == 3 && opt[i + 1] == 3) {
+            // Scaling only happens if both ends offer it
+            sock->snd_wscale = opt[i + 2] > 14 ? 14 : opt[i + 2];
+            sock->rcv_wscale = TCP_WSCALE;
+        }
+        i += opt[i + 1];
+    }
+    if (sock->mss > TCP_MSS) sock->mss = TCP_MSS;
+    if (sock->mss < 64) sock->mss = 64;
+}
+
+// Connection is up: start congestion control (RFC 5681 initial window)
+static void tcp_start_sending(tcp_socket_internal_t *sock, uint32_t ack, uint16_t window) {
+    sock->snd_una = ack;
+    sock->send_seq = ack;
+    sock->snd_max = ack;
+    sock->snd_wnd = window;     // From a SYN, so not scaled
+    sock->cwnd = (sock->mss > 2190) ? 2 * sock->mss : (sock->mss > 1095 ? 3 : 4) * sock->mss;
+    sock->ssthresh = 0xffffffff;
+    sock->rto_deadline = 0;
+    sock->rtt_start = 0;
+    sock->rto_retries = 0;
+    sock->dupacks = 0;
+    sock->in_recovery = 0;
+}
+
+static void tcp_arm_rto(tcp_socket_internal_t *sock) {
+    sock->rto_deadline = timer_get_uptime_us() + sock->rto;
+}
+
+// Send one segment of queued data (and/or the FIN) starting at seq. The
+// payload is sent straight out of the send ring, which holds it until it
+// is acknowledged anyway (tcp_send waits for the device before reusing it).
+// Returns -1 if no packet buffer was free, so nothing went out.
+static int tcp_send_data(tcp_socket_internal_t *sock, uint32_t seq, uint32_t len, int fin) {
+    pbuf_t *p = pbuf_alloc();
+    if (!p) return -1;
+    p->ref_frames = &sock->tx_ref_frames;
+    uint32_t pos = (sock->tx_start + (seq - sock->snd_una)) % TCP_TX_BUF_SIZE;
+    uint32_t first = TCP_TX_BUF_SIZE - pos;
+    if (first > len) first = len;
+    pbuf_ref(p, sock->tx_buf + pos, first);
+    pbuf_ref(p, sock->tx_buf, len - first);
+
+    uint8_t flags = TCP_ACK | (len ? TCP_PSH : 0) | (fin ? TCP_FIN : 0);
+    tcp_send_segment(sock, flags, seq, p);
+    return 0;
+}
+
+// Send whatever queued data the windows allow, then the FIN if queued.
+// With probe set, send a byte even into a zero window (persist timer).
+static void tcp_output(tcp_socket_internal_t *sock, int probe) {
+    for (;;) {
+        // send_seq is past the FIN once it has gone (in_flight > tx_len)
+        uint32_t in_flight = sock->send_seq - sock->snd_una;
+        uint32_t unsent = in_flight < sock->tx_len ? sock->tx_len - in_flight : 0;
+        int fin = sock->fin_queued && in_flight <= sock->tx_len;
+        if (unsent == 0 && !fin) break;
+
+        uint32_t wnd = sock->snd_wnd < sock->cwnd ? sock->snd_wnd : sock->cwnd;
+        if (probe && in_flight == 0 && wnd == 0) wnd = 1;
+        if (in_flight >= wnd) {
+            // Shut window: the timer probes it
+            if (in_flight == 0 && !sock->rto_deadline) tcp_arm_rto(sock);
+            break;
+        }
+
+        uint32_t len = unsent;
+        if (len > sock->mss) len = sock->mss;
+        if (len > wnd - in_flight) len = wnd - in_flight;
+        // Don't send a runt while earlier data is still out (Nagle)
+        if (len < unsent && len < sock->mss && in_flight > 0) break;
+
+        fin = fin && len == unsent;
+        uint32_t seq = sock->send_seq;
+        if (tcp_send_data(sock, seq, len, fin) < 0) {
+            // Out of packet buffers: keep it queued. ACKs for what is in
+            // flight bring us back, or the timer if nothing is.
+            if (!sock->rto_deadline) tcp_arm_rto(sock);
+            break;
+        }
+        sock->send_seq += len;
+        if (fin) {
+            sock->fin_seq = sock->send_seq;
+            sock->fin_sent = 1;
+            sock->send_seq++;
+        }
+        if (SEQ_LT(sock->snd_max, sock->send_seq)) sock->snd_max = sock->send_seq;
+
+        // Time one segment at a time (never a retransmitted one - Karn)
+        if (!sock->rtt_start) {
+            sock->rtt_seq = sock->send_seq;
+            sock->rtt_start = timer_get_uptime_us();
+        }
+        if (!sock->rto_deadline) tcp_arm_rto(sock);
+        if (probe) break;
+    }
+}
+
+// Resend the first unacknowledged segment
+static void tcp_retransmit(tcp_socket_internal_t *sock) {
+    uint32_t len = sock->tx_len;
+    if (len > sock->mss) len = sock->mss;
+    int fin = sock->fin_sent && sock->snd_una + len == sock->fin_seq;
+    if (len == 0 && !fin) return;
+
+    tcp_send_data(sock, sock->snd_una, len, fin);     // No buffer looks like loss
+    sock->rtt_start = 0;
+}
+
+// RFC 6298 estimator
+static void tcp_rtt_sample(tcp_socket_internal_t *sock, uint32_t rtt) {
+    if (!sock->srtt) {
+        sock->srtt = rtt;
+        sock->rttvar = rtt / 2;
+    } else {
+        uint32_t err = rtt > sock->srtt ? rtt - sock->srtt : sock->srtt - rtt;
+        sock->rttvar = (3 * sock->rttvar + err) / 4;
+        sock->srtt = (7 * sock->srtt + rtt) / 8;
+    }
+    uint32_t rto = sock->srtt + (4 * sock->rttvar > 1000 ? 4 * sock->rttvar : 1000);
+    if (rto < TCP_RTO_MIN) rto = TCP_RTO_MIN;
+    if (rto > TCP_RTO_MAX) rto = TCP_RTO_MAX;
+    sock->rto = rto;
+}
+
+// Process the ACK field and window of a segment on a synchronized connection
+static void tcp_process_ack(tcp_socket_internal_t *sock, uint32_t ack, uint16_t window,
+                            uint32_t data_len) {
+    uint32_t wnd = (uint32_t)window << sock->snd_wscale;
+
+    if (SEQ_LT(sock->snd_max, ack)) {
+        // ACKs something we haven't sent - ignore it, but say where we are
+        tcp_send_ack(sock);
+        return;
+    }
+    sock->rto_retries = 0;      // The peer is still there
+
+    if (SEQ_LEQ(ack, sock->snd_una)) {
+        // Duplicate: no new data acknowledged, nothing else carried
+        int dup = ack == sock->snd_una && data_len == 0 && wnd == sock->snd_wnd &&
+                  sock->snd_max != sock->snd_una;
+        if (ack == sock->snd_una) sock->snd_wnd = wnd;
+        if (!dup) return;
+
+        sock->dupacks++;
+        if (sock->dupacks == TCP_DUPACKS && !sock->in_recovery) {
+            // Fast retransmit, then fast recovery
+            uint32_t flight = sock->snd_max - sock->snd_una;
+            sock->ssthresh = flight / 2 > 2 * sock->mss ? flight / 2 : 2 * sock->mss;
+            sock->recover = sock->snd_max;
+            sock->in_recovery = 1;
+            tcp_retransmit(sock);
+            sock->cwnd = sock->ssthresh + TCP_DUPACKS * sock->mss;
+        } else if (sock->in_recovery) {
+            // Each duplicate means a segment has left the network
+            sock->cwnd += sock->mss;
+        }
+        return;
+    }
+
+    // New data acknowledged
+    uint32_t acked = ack - sock->snd_una;
+    uint32_t data_acked = acked > sock->tx_len ? sock->tx_len : acked;
+    sock->tx_start = (sock->tx_start + data_acked) % TCP_TX_BUF_SIZE;
+    sock->tx_len -= data_acked;
+    sock->snd_una = ack;
+    sock->snd_wnd = wnd;
+    sock->dupacks = 0;
+    // Segments sent before a timeout can still be ACKed after it
+    if (SEQ_LT(sock->send_seq, ack)) sock->send_seq = ack;
+
+    if (sock->rtt_start && SEQ_LEQ(sock->rtt_seq, ack)) {
+        tcp_rtt_sample(sock, (uint32_t)(timer_get_uptime_us() - sock->rtt_start));
+        sock->rtt_start = 0;
+    }
+
+    if (sock->in_recovery) {
+        if (SEQ_LT(ack, sock->recover)) {
+            // Partial ACK: the next hole is lost too
+            tcp_retransmit(sock);
+            sock->cwnd = sock->cwnd > acked ? sock->cwnd - acked : 0;
+            sock->cwnd += sock->mss;
+        } else {
+            sock->in_recovery = 0;
+            sock->cwnd = sock->ssthresh;
+        }
+    } else if (sock->cwnd < sock->ssthresh) {
+        // Slow start
+        sock->cwnd += acked < sock->mss ? acked : sock->mss;
+    } else {
+        // Congestion avoidance: about one MSS per round trip
+        uint32_t inc = sock->mss * sock->mss / sock->cwnd;
+        sock->cwnd += inc ? inc : 1;
+    }
 
-    return ip_send(sock->remote_ip, IP_PROTO_TCP, pkt, sizeof(tcp_header_t) + len);
+    // The timer covers the oldest outstanding segment
+    if (sock->snd_max == sock->snd_una) {
+        sock->rto_deadline = 0;
+    } else {
+        tcp_arm_rto(sock);
+    }
+}
+
+// Store a data segment in the receive ring, in order or not, and ACK it
+static void tcp_receive(tcp_socket_internal_t *sock, uint32_t seq, const uint8_t *data, uint32_t len) {
+    // Drop what we already have
+    if (SEQ_LT(seq, sock->send_ack)) {
+        uint32_t skip = sock->send_ack - seq;
+        if (skip >= len) {
+            tcp_send_ack(sock);
+            return;
+        }
+        seq += skip;
+        data += skip;
+        len -= skip;
+    }
+
+    // ...and what doesn't fit
+    uint32_t off = seq - sock->send_ack;
+    uint32_t space = tcp_rx_free(sock);
+    if (off >= space) {
+        tcp_send_ack(sock);
+        return;
+    }
+    if (len > space - off) len = space - off;
+
+    uint32_t pos = (sock->rx_head + off) % TCP_RX_BUF_SIZE;
+    uint32_t first = TCP_RX_BUF_SIZE - pos;
+    if (first > len) first = len;
+    memcpy(sock->rx_buf + pos, data, first);
+    memcpy(sock->rx_buf, data + first, len - first);
+
+    uint32_t end = seq + len;
+    if (off == 0) {
+        // In order: take it and any ranges it now joins up with
+        int merged = 1;
+        while (merged) {
+            merged = 0;
+            for (int i = 0; i < sock->ooo_count; i++) {
+                if (SEQ_LEQ(sock->ooo[i].start, end)) {
+                    if (SEQ_LT(end, sock->ooo[i].end)) end = sock->ooo[i].end;
+                    sock->ooo[i] = sock->ooo[--sock->ooo_count];
+                    merged = 1;
+                    break;
+                }
+            }
+        }
+        sock->rx_head = (sock->rx_head + (end - sock->send_ack)) % TCP_RX_BUF_SIZE;
+        sock->send_ack = end;
+    } else {
+        // Past a gap: remember the range, merged with any it touches
+        for (int i = 0; i < sock->ooo_count; i++) {
+            if (SEQ_LEQ(sock->ooo[i].start, end) && SEQ_LEQ(seq, sock->ooo[i].end)) {
+                if (SEQ_LT(sock->ooo[i].start, seq)) seq = sock->ooo[i].start;
+                if (SEQ_LT(end, sock->ooo[i].end)) end = sock->ooo[i].end;
+                sock->ooo[i--] = sock->ooo[--sock->ooo_count];
+            }
+        }
+        // No room to remember it: the peer will send it again
+        if (sock->ooo_count < TCP_OOO_MAX) {
+            sock->ooo[sock->ooo_count].start = seq;
+            sock->ooo[sock->ooo_count].end = end;
+            sock->ooo_count++;
+        }
+    }
+
+    // A duplicate ACK while there is a gap
+    tcp_send_ack(sock);
 }
 
 // Find socket by connection tuple
@@ -918,6 +1602,74 @@ static int tcp_socket_index(tcp_socket_internal_t *sock) {
     return sock - tcp_sockets;
 }
 
+// Whether a slot can take a new connection: closed, and nothing the device
+// has yet to send still points into its send ring
+static int tcp_slot_free(tcp_socket_internal_t *sock) {
+    if (sock->state != TCP_STATE_CLOSED) return 0;
+    return net_tx_refs_done(&sock->tx_ref_frames);
+}
+
+// Retransmission timer, run from the network softirq
+static void tcp_timers(void) {
+    uint64_t now = timer_get_uptime_us();
+
+    for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
+        tcp_socket_internal_t *sock = &tcp_sockets[i];
+        if (sock->state == TCP_STATE_CLOSED || sock->state == TCP_STATE_LISTEN) continue;
+        if (!sock->rto_deadline || now < sock->rto_deadline) continue;
+
+        // The peer has gone quiet for good: drop the connection (RFC 1122
+        // 4.2.3.5) so it doesn't hold its slot forever
+        if (++sock->rto_retries > TCP_MAX_RETRIES) {
+            printf("[TCP] %s:%d not responding, connection dropped\n",
+                   ip_to_str(sock->remote_ip), sock->remote_port);
+            sock->state = TCP_STATE_CLOSED;
+            sock->rto_deadline = 0;
+            continue;
+        }
+
+        // Back off, and start again from the oldest unacknowledged byte
+        sock->rto = sock->rto * 2 > TCP_RTO_MAX ? TCP_RTO_MAX : sock->rto * 2;
+        sock->rtt_start = 0;
+        tcp_arm_rto(sock);
+
+        if (sock->state == TCP_STATE_SYN_SENT) {
+            tcp_send_segment(sock, TCP_SYN, sock->snd_una, NULL);
+            continue;
+        }
+        if (sock->state == TCP_STATE_SYN_RCVD) {
+            tcp_send_segment(sock, TCP_SYN | TCP_ACK, sock->snd_una, NULL);
+            continue;
+        }
+
+        uint32_t flight = sock->snd_max - sock->snd_una;
+        if (flight == 0) {
+            // Nothing outstanding: the peer's window is shut, probe it
+            tcp_output(sock, 1);
+            continue;
+        }
+        sock->ssthresh = flight / 2 > 2 * sock->mss ? flight / 2 : 2 * sock->mss;
+        sock->cwnd = sock->mss;
+        sock->in_recovery = 0;
+        sock->dupacks = 0;
+        sock->send_seq = sock->snd_una;
+        tcp_output(sock, 1);
+    }
+}
+
+// Earliest retransmission timer, 0 if none is running
+static uint64_t tcp_next_deadline(void) {
+    uint64_t due = 0;
+    for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
+        tcp_socket_internal_t *sock = &tcp_sockets[i];
+        if (sock->state == TCP_STATE_CLOSED || sock->state == TCP_STATE_LISTEN) continue;
+        if (sock->rto_deadline && (!due || sock->rto_deadline < due)) {
+            due = sock->rto_deadline;
+        }
+    }
+    return due;
+}
+
 // Handle incoming TCP packet
 static void tcp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip) {
     if (len < sizeof(tcp_header_t)) return;
@@ -928,17 +1680,20 @@ static void tcp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip) {
     uint32_t seq = ntohl(tcp->seq);
     uint32_t ack = ntohl(tcp->ack);
     uint8_t flags = tcp->flags;
+    uint16_t window = ntohs(tcp->window);
 
     // Calculate data offset and length
     uint32_t data_off = (tcp->data_off >> 4) * 4;
     if (data_off < sizeof(tcp_header_t) || data_off > len) return;
 
+    const uint8_t *opts = pkt + sizeof(tcp_header_t);
+    uint32_t opts_len = data_off - sizeof(tcp_header_t);
     const uint8_t *data = pkt + data_off;
     uint32_t data_len = len - data_off;
 
     // Find matching socket
     tcp_socket_internal_t *sock = tcp_find_socket(src_ip, src_port, dst_port);
-    
+
     // If no socket found, check for listening socket
     if (!sock) {
         tcp_socket_internal_t *listener = tcp_find_listener(dst_port);
@@ -947,35 +1702,40 @@ static void tcp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip) {
             // Find free socket for new connection
             int new_idx = -1;
             for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
-                if (tcp_sockets[i].state == TCP_STATE_CLOSED) {
+                if (tcp_slot_free(&tcp_sockets[i])) {
                     new_idx = i;
                     break;
                 }
             }
-            
+
             if (new_idx >= 0) {
                 sock = &tcp_sockets[new_idx];
                 memset(sock, 0, sizeof(*sock));
-                
+
                 sock->local_ip = our_ip;
                 sock->remote_ip = src_ip;
                 sock->local_port = dst_port;
                 sock->remote_port = src_port;
                 sock->send_seq = 1000 + (new_idx * 1234);
+                sock->snd_una = sock->send_seq;
                 sock->send_ack = seq + 1;
                 sock->recv_seq = seq + 1;
+                sock->snd_wnd = window;
+                sock->rto = TCP_RTO_INIT;
+                tcp_parse_syn_options(sock, opts, opts_len);
                 sock->state = TCP_STATE_SYN_RCVD;
                 sock->accepted = 0;  // Not yet accepted by application
-                
+
                 // Send SYN+ACK
-                tcp_send_segment(sock, TCP_SYN | TCP_ACK, NULL, 0);
+                tcp_send_segment(sock, TCP_SYN | TCP_ACK, sock->snd_una, NULL);
                 sock->send_seq++;
-                
+                tcp_arm_rto(sock);
+
                 printf("[TCP] Received SYN from %s:%d, sent SYN+ACK\n", ip_to_str(src_ip), src_port);
                 return;
             }
         }
-        
+
         // No socket - send RST if not a RST
         if (!(flags & TCP_RST)) {
             // TODO: send RST
@@ -995,129 +1755,133 @@ static void tcp_handle(const uint8_t *pkt, uint32_t len, uint32_t src_ip) {
         case TCP_STATE_SYN_SENT:
             // Expecting SYN+ACK
             if ((flags & (TCP_SYN | TCP_ACK)) == (TCP_SYN | TCP_ACK)) {
-                if (ack == sock->send_seq + 1) {
-                    sock->send_seq = ack;
+                if (ack == sock->send_seq) {
                     sock->send_ack = seq + 1;
                     sock->recv_seq = seq + 1;
+                    tcp_parse_syn_options(sock, opts, opts_len);
+                    tcp_start_sending(sock, ack, window);
 
                     // Send ACK
-                    tcp_send_segment(sock, TCP_ACK, NULL, 0);
+                    tcp_send_ack(sock);
                     sock->state = TCP_STATE_ESTABLISHED;
-                    printf("[TCP] Connection established\n");
+                    printf("[TCP] Connection established (mss %d, wscale %d/%d)\n",
+                           sock->mss, sock->snd_wscale, sock->rcv_wscale);
                 }
             }
-            break;
-            
+            return;
+
         case TCP_STATE_SYN_RCVD:
-            // Waiting for ACK to complete three-way handshake
-            if ((flags & TCP_ACK) && !(flags & TCP_SYN)) {
-                if (ack == sock->send_seq) {
-                    sock->state = TCP_STATE_ESTABLISHED;
-                    printf("[TCP] Connection established (server)\n");
-                }
+            // Our SYN+ACK was lost: the peer sends its SYN again
+            if ((flags & TCP_SYN) && !(flags & TCP_ACK)) {
+                tcp_send_segment(sock, TCP_SYN | TCP_ACK, sock->snd_una, NULL);
+                return;
             }
+            // Waiting for ACK to complete three-way handshake. It may carry
+            // data already.
+            if (!(flags & TCP_ACK) || ack != sock->send_seq) return;
+            tcp_start_sending(sock, ack, window);
+            sock->snd_wnd = (uint32_t)window << sock->snd_wscale;
+            sock->state = TCP_STATE_ESTABLISHED;
+            printf("[TCP] Connection established (server)\n");
             break;
 
-        case TCP_STATE_ESTABLISHED:
-            // Check if ACK is valid
-            if (flags & TCP_ACK) {
-                // Update send_seq if this ACKs new data
-                if (ack > sock->send_seq - 1000 && ack <= sock->send_seq + 10000) {
-                    // Valid ACK range (rough check)
-                }
-            }
-
-            // Handle incoming data
-            if (data_len > 0) {
-                // Check if this is the next expected segment
-                if (seq == sock->send_ack) {
-                    // Copy data to receive buffer, track how many bytes actually stored
-                    uint32_t bytes_stored = 0;
-                    for (uint32_t i = 0; i < data_len; i++) {
-                        uint32_t next_head = (sock->rx_head + 1) % TCP_RX_BUF_SIZE;
-                        if (next_head == sock->rx_tail) {
-                            // Buffer full - stop here
-                            break;
-                        }
-                        sock->rx_buf[sock->rx_head] = data[i];
-                        sock->rx_head = next_head;
-                        bytes_stored++;
-                    }
-
-                    // CRITICAL: Only ACK bytes we actually stored!
-                    // Otherwise we tell sender we got data that was dropped.
-                    sock->send_ack = seq + bytes_stored;
+        case TCP_STATE_TIME_WAIT:
+            // Should wait 2*MSL, but we just close immediately
+            sock->state = TCP_STATE_CLOSED;
+            return;
 
-                    // Send ACK
-                    tcp_send_segment(sock, TCP_ACK, NULL, 0);
-                }
-            }
+        case TCP_STATE_CLOSED:
+        case TCP_STATE_LISTEN:
+            return;
 
-            // Handle FIN
-            if (flags & TCP_FIN) {
-                sock->fin_received = 1;
-                sock->send_ack = seq + data_len + 1;
-                tcp_send_segment(sock, TCP_ACK, NULL, 0);
-                sock->state = TCP_STATE_CLOSE_WAIT;
-                printf("[TCP] Received FIN, connection closing\n");
-            }
+        default:
             break;
+    }
 
-        case TCP_STATE_FIN_WAIT_1:
-            if (flags & TCP_ACK) {
-                if (flags & TCP_FIN) {
-                    // Simultaneous close
-                    sock->send_ack = seq + 1;
-                    tcp_send_segment(sock, TCP_ACK, NULL, 0);
-                    sock->state = TCP_STATE_TIME_WAIT;
-                } else {
-                    sock->state = TCP_STATE_FIN_WAIT_2;
-                }
-            }
-            break;
+    // Synchronized states
+    if (flags & TCP_ACK) {
+        tcp_process_ack(sock, ack, window, data_len);
 
-        case TCP_STATE_FIN_WAIT_2:
-            if (flags & TCP_FIN) {
-                sock->send_ack = seq + 1;
-                tcp_send_segment(sock, TCP_ACK, NULL, 0);
+        int fin_acked = sock->fin_sent && SEQ_LT(sock->fin_seq, sock->snd_una);
+        if (fin_acked && sock->state == TCP_STATE_FIN_WAIT_1) {
+            sock->state = TCP_STATE_FIN_WAIT_2;
+        } else if (fin_acked && sock->state == TCP_STATE_LAST_ACK) {
+            sock->state = TCP_STATE_CLOSED;
+            printf("[TCP] Connection closed\n");
+            return;
+        }
+    }
+
+    // Data and FIN count until we have sent our own FIN... or got theirs
+    int receiving = sock->state == TCP_STATE_ESTABLISHED ||
+                    sock->state == TCP_STATE_FIN_WAIT_1 ||
+                    sock->state == TCP_STATE_FIN_WAIT_2;
+    if (receiving && data_len > 0) {
+        tcp_receive(sock, seq, data, data_len);
+    }
+
+    if (flags & TCP_FIN) {
+        if (receiving && seq + data_len == sock->send_ack) {
+            // Everything before the FIN is in
+            sock->fin_received = 1;
+            sock->send_ack++;
+            tcp_send_ack(sock);
+            if (sock->state == TCP_STATE_ESTABLISHED) {
+                sock->state = TCP_STATE_CLOSE_WAIT;
+                printf("[TCP] Received FIN, connection closing\n");
+            } else {
+                // Our FIN is out too (simultaneous close, or FIN_WAIT_2)
                 sock->state = TCP_STATE_TIME_WAIT;
             }
-            break;
+        } else if (!receiving) {
+            // Our ACK of their FIN was lost
+            tcp_send_ack(sock);
+        }
+    }
 
-        case TCP_STATE_CLOSE_WAIT:
-            // Waiting for application to close
-            break;
+    // The ACK may have opened the windows
+    if (sock->state != TCP_STATE_CLOSED) tcp_output(sock, 0);
+}
 
-        case TCP_STATE_LAST_ACK:
-            if (flags & TCP_ACK) {
-                sock->state = TCP_STATE_CLOSED;
-                printf("[TCP] Connection closed\n");
-            }
-            break;
+// Bytes waiting to be read
+static uint32_t tcp_rx_avail(tcp_socket_internal_t *sock) {
+    return (sock->rx_head - sock->rx_tail + TCP_RX_BUF_SIZE) % TCP_RX_BUF_SIZE;
+}
 
-        case TCP_STATE_TIME_WAIT:
-            // Should wait 2*MSL, but we just close immediately
-            sock->state = TCP_STATE_CLOSED;
-            break;
+// Nothing more will arrive: the peer sent FIN or the connection is gone
+static int tcp_rx_done(tcp_socket_internal_t *sock) {
+    return sock->fin_received || sock->state == TCP_STATE_CLOSED;
+}
 
-        default:
-            break;
+// A connection on the listener's port that is ready to be accepted, or -1
+static int tcp_find_pending(int listen_sock) {
+    tcp_socket_internal_t *listener = &tcp_sockets[listen_sock];
+    for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
+        tcp_socket_internal_t *sock = &tcp_sockets[i];
+        if (i != listen_sock && sock->state == TCP_STATE_ESTABLISHED &&
+            sock->local_port == listener->local_port && !sock->accepted) {
+            return i;
+        }
     }
+    return -1;
 }
 
 // Public API
 
 tcp_socket_t tcp_connect(uint32_t ip, uint16_t port) {
+    uint64_t flags = net_lock_irqsave();
+
     // Find free socket
     int idx = -1;
     for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
-        if (tcp_sockets[i].state == TCP_STATE_CLOSED) {
+        if (tcp_slot_free(&tcp_sockets[i])) {
             idx = i;
             break;
         }
     }
     if (idx < 0) {
         printf("[TCP] No free sockets\n");
+        net_unlock(flags);
         return -1;
     }
 
@@ -1129,139 +1893,167 @@ tcp_socket_t tcp_connect(uint32_t ip, uint16_t port) {
     sock->local_port = tcp_next_port++;
     sock->remote_port = port;
     sock->send_seq = 1000 + (tcp_next_port * 1234);  // Simple ISN
+    sock->snd_una = sock->send_seq;
     sock->send_ack = 0;
+    sock->rto = TCP_RTO_INIT;
     sock->state = TCP_STATE_SYN_SENT;
 
     // ARP resolve first
-    uint32_t next_hop = ip;
-    if ((ip & NET_NETMASK) != (our_ip & NET_NETMASK)) {
-        next_hop = NET_GATEWAY;
-    }
-
-    if (!arp_lookup(next_hop)) {
-        arp_request(next_hop);
-        for (int i = 0; i < 100 && !arp_lookup(next_hop); i++) {
-            net_poll();
-            for (volatile int j = 0; j < 100000; j++);
-        }
-        if (!arp_lookup(next_hop)) {
-            printf("[TCP] ARP failed for %s\n", ip_to_str(next_hop));
-            sock->state = TCP_STATE_CLOSED;
-            return -1;
-        }
+    if (arp_resolve(ip, &flags) < 0) {
+        printf("[TCP] ARP failed for %s\n", ip_to_str(ip));
+        sock->state = TCP_STATE_CLOSED;
+        net_unlock(flags);
+        return -1;
     }
 
-    // Send SYN
+    // Send SYN (tcp_timers resends it)
     printf("[TCP] Connecting to %s:%d\n", ip_to_str(ip), port);
-    if (tcp_send_segment(sock, TCP_SYN, NULL, 0) < 0) {
+    if (tcp_send_segment(sock, TCP_SYN, sock->snd_una, NULL) < 0) {
         sock->state = TCP_STATE_CLOSED;
+        net_unlock(flags);
         return -1;
     }
+    sock->send_seq++;
+    tcp_arm_rto(sock);
 
     // Wait for SYN+ACK (up to 10 seconds)
-    for (int i = 0; i < 1000 && sock->state == TCP_STATE_SYN_SENT; i++) {
-        net_poll();
-        for (volatile int j = 0; j < 100000; j++);
+    uint64_t deadline = timer_get_uptime_us() + 10000000;
+    while (sock->state == TCP_STATE_SYN_SENT && timer_get_uptime_us() < deadline) {
+        flags = net_wait(flags);
     }
 
     if (sock->state != TCP_STATE_ESTABLISHED) {
         printf("[TCP] Connection timeout\n");
         sock->state = TCP_STATE_CLOSED;
+        net_unlock(flags);
         return -1;
     }
 
+    net_unlock(flags);
     return idx;
 }
 
-int tcp_send(tcp_socket_t sock_id, const void *data, uint32_t len) {
+int tcp_send_timeout(tcp_socket_t sock_id, const void *data, uint32_t len, int timeout_ms) {
     if (sock_id < 0 || sock_id >= TCP_MAX_SOCKETS) return -1;
 
+    uint64_t flags = net_lock_irqsave();
     tcp_socket_internal_t *sock = &tcp_sockets[sock_id];
-    if (sock->state != TCP_STATE_ESTABLISHED) return -1;
+    if (sock->state != TCP_STATE_ESTABLISHED &&
+        sock->state != TCP_STATE_CLOSE_WAIT) {
+        net_unlock(flags);
+        return -1;
+    }
 
-    // Send data in chunks (MSS ~1460, use 1400 to be safe)
+    // Queue as much as fits, send what the windows allow, and wait for
+    // ACKs to make room for the rest (giving up if nothing moves in time)
     const uint8_t *ptr = (const uint8_t *)data;
     uint32_t sent = 0;
+    uint64_t deadline = net_deadline(timeout_ms);
 
     while (sent < len) {
-        uint32_t chunk = len - sent;
-        if (chunk > 1400) chunk = 1400;
+        uint32_t room = TCP_TX_BUF_SIZE - sock->tx_len;
+        uint32_t chunk = len - sent < room ? len - sent : room;
+        // The free space may have been acked while a retransmission of it
+        // was still queued for the device: if so, wait for the device below
+        if (chunk > 0 && net_tx_refs_done(&sock->tx_ref_frames)) {
+            uint32_t pos = (sock->tx_start + sock->tx_len) % TCP_TX_BUF_SIZE;
+            uint32_t first = TCP_TX_BUF_SIZE - pos;
+            if (first > chunk) first = chunk;
+            memcpy(sock->tx_buf + pos, ptr + sent, first);
+            memcpy(sock->tx_buf, ptr + sent + first, chunk - first);
+            sock->tx_len += chunk;
+            sent += chunk;
+            tcp_output(sock, 0);
+            deadline = net_deadline(timeout_ms);
+            continue;
+        }
 
-        if (tcp_send_segment(sock, TCP_ACK | TCP_PSH, ptr + sent, chunk) < 0) {
+        if (timer_get_uptime_us() >= deadline) break;
+        flags = net_wait(flags);
+        if (sock->state != TCP_STATE_ESTABLISHED && sock->state != TCP_STATE_CLOSE_WAIT) {
+            net_unlock(flags);
             return sent > 0 ? (int)sent : -1;
         }
-
-        sock->send_seq += chunk;
-        sent += chunk;
-
-        // Small delay between segments
-        for (volatile int j = 0; j < 10000; j++);
     }
 
+    net_unlock(flags);
     return (int)sent;
 }
 
-int tcp_recv(tcp_socket_t sock_id, void *buf, uint32_t maxlen) {
+int tcp_send(tcp_socket_t sock_id, const void *data, uint32_t len) {
+    int sent = tcp_send_timeout(sock_id, data, len, 30000);
+    return sent > 0 ? sent : -1;
+}
+
+int tcp_recv_timeout(tcp_socket_t sock_id, void *buf, uint32_t maxlen, int timeout_ms) {
     if (sock_id < 0 || sock_id >= TCP_MAX_SOCKETS) return -1;
 
+    // Incoming data lands in the ring from the softirq, which wakes us
+    uint64_t deadline = net_deadline(timeout_ms);
+    uint64_t flags = net_lock_irqsave();
     tcp_socket_internal_t *sock = &tcp_sockets[sock_id];
-
-    // Poll for incoming data
-    net_poll();
+    while (tcp_rx_avail(sock) == 0 && !tcp_rx_done(sock) &&
+           timer_get_uptime_us() < deadline) {
+        flags = net_wait(flags);
+    }
 
     // Check for data in receive buffer
     uint8_t *dst = (uint8_t *)buf;
-    uint32_t received = 0;
-
-    while (received < maxlen && sock->rx_tail != sock->rx_head) {
-        dst[received++] = sock->rx_buf[sock->rx_tail];
-        sock->rx_tail = (sock->rx_tail + 1) % TCP_RX_BUF_SIZE;
-    }
+    uint32_t avail = tcp_rx_avail(sock);
+    uint32_t received = avail < maxlen ? avail : maxlen;
+    uint32_t first = TCP_RX_BUF_SIZE - sock->rx_tail;
+    if (first > received) first = received;
+    memcpy(dst, sock->rx_buf + sock->rx_tail, first);
+    memcpy(dst + first, sock->rx_buf, received - first);
+    sock->rx_tail = (sock->rx_tail + received) % TCP_RX_BUF_SIZE;
 
     // If no data and connection closed, return -1
     if (received == 0) {
-        if (sock->state == TCP_STATE_CLOSE_WAIT ||
-            sock->state == TCP_STATE_CLOSED) {
-            return -1;
-        }
-        return 0;  // No data yet
+        int closed = tcp_rx_done(sock);
+        net_unlock(flags);
+        return closed ? -1 : 0;  // Else no data yet
+    }
+
+    // Tell the peer once there's room again after a (nearly) shut window
+    if (sock->adv_wnd < 2 * TCP_MSS && tcp_rx_free(sock) >= TCP_RX_BUF_SIZE / 4 &&
+        (sock->state == TCP_STATE_ESTABLISHED || sock->state == TCP_STATE_FIN_WAIT_1 ||
+         sock->state == TCP_STATE_FIN_WAIT_2)) {
+        tcp_send_ack(sock);
     }
 
+    net_unlock(flags);
     return (int)received;
 }
 
+int tcp_recv(tcp_socket_t sock_id, void *buf, uint32_t maxlen) {
+    return tcp_recv_timeout(sock_id, buf, maxlen, 0);
+}
+
 void tcp_close(tcp_socket_t sock_id) {
     if (sock_id < 0 || sock_id >= TCP_MAX_SOCKETS) return;
 
+    uint64_t flags = net_lock_irqsave();
     tcp_socket_internal_t *sock = &tcp_sockets[sock_id];
 
-    if (sock->state == TCP_STATE_ESTABLISHED) {
-        // Send FIN
-        tcp_send_segment(sock, TCP_FIN | TCP_ACK, NULL, 0);
-        sock->send_seq++;
-        sock->fin_sent = 1;
-        sock->state = TCP_STATE_FIN_WAIT_1;
+    if (sock->state == TCP_STATE_ESTABLISHED || sock->state == TCP_STATE_CLOSE_WAIT) {
+        // FIN goes out after whatever is still queued
+        sock->state = sock->state == TCP_STATE_ESTABLISHED ? TCP_STATE_FIN_WAIT_1
+                                                           : TCP_STATE_LAST_ACK;
+        sock->fin_queued = 1;
+        tcp_output(sock, 0);
 
         // Wait for close to complete (up to 5 seconds)
-        for (int i = 0; i < 500 && sock->state != TCP_STATE_CLOSED &&
-                                   sock->state != TCP_STATE_TIME_WAIT; i++) {
-            net_poll();
-            for (volatile int j = 0; j < 100000; j++);
-        }
-    } else if (sock->state == TCP_STATE_CLOSE_WAIT) {
-        // Send FIN
-        tcp_send_segment(sock, TCP_FIN | TCP_ACK, NULL, 0);
-        sock->send_seq++;
-        sock->state = TCP_STATE_LAST_ACK;
-
-        // Wait for ACK
-        for (int i = 0; i < 500 && sock->state != TCP_STATE_CLOSED; i++) {
-            net_poll();
-            for (volatile int j = 0; j < 100000; j++);
+        uint64_t deadline = timer_get_uptime_us() + 5000000;
+        while (sock->state != TCP_STATE_CLOSED && sock->state != TCP_STATE_TIME_WAIT &&
+               timer_get_uptime_us() < deadline) {
+            flags = net_wait(flags);
         }
     }
 
+    // Frames still queued may point into tx_buf: tcp_slot_free keeps the
+    // slot until the device has sent them
     sock->state = TCP_STATE_CLOSED;
+    net_unlock(flags);
 }
 
 int tcp_is_connected(tcp_socket_t sock_id) {
@@ -1277,16 +2069,19 @@ int tcp_get_state(tcp_socket_t sock_id) {
 // TCP server functions
 
 tcp_socket_t tcp_listen(uint16_t port) {
+    uint64_t flags = net_lock_irqsave();
+
     // Find free socket
     int idx = -1;
     for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
-        if (tcp_sockets[i].state == TCP_STATE_CLOSED) {
+        if (tcp_slot_free(&tcp_sockets[i])) {
             idx = i;
             break;
         }
     }
     if (idx < 0) {
         printf("[TCP] No free sockets for listen\n");
+        net_unlock(flags);
         return -1;
     }
     
@@ -1299,44 +2094,74 @@ tcp_socket_t tcp_listen(uint16_t port) {
     sock->is_listening = 1;
     
     printf("[TCP] Listening on port %d\n", port);
+    net_unlock(flags);
     return idx;
 }
 
-tcp_socket_t tcp_accept(tcp_socket_t listen_sock) {
+tcp_socket_t tcp_accept_timeout(tcp_socket_t listen_sock, int timeout_ms) {
     if (listen_sock < 0 || listen_sock >= TCP_MAX_SOCKETS) return -1;
-    
+
+    uint64_t deadline = net_deadline(timeout_ms);
+    uint64_t flags = net_lock_irqsave();
     tcp_socket_internal_t *listener = &tcp_sockets[listen_sock];
-    if (listener->state != TCP_STATE_LISTEN) return -1;
-    
-    // Poll for incoming connections
-    net_poll();
-    
+
     // Look for newly established connections on this port that haven't been accepted yet
-    for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
-        tcp_socket_internal_t *sock = &tcp_sockets[i];
-        if (i != listen_sock &&
-            (sock->state == TCP_STATE_ESTABLISHED || sock->state == TCP_STATE_SYN_RCVD) &&
-            sock->local_port == listener->local_port &&
-            !sock->accepted) {
-            // Found a new connection
-            if (sock->state == TCP_STATE_SYN_RCVD) {
-                // Still waiting for ACK, poll more
-                for (int j = 0; j < 100 && sock->state == TCP_STATE_SYN_RCVD; j++) {
-                    net_poll();
-                    for (volatile int k = 0; k < 10000; k++);
-                }
-                if (sock->state == TCP_STATE_ESTABLISHED) {
-                    sock->accepted = 1;
-                    return i;
-                }
-            } else if (sock->state == TCP_STATE_ESTABLISHED) {
-                sock->accepted = 1;
-                return i;
-            }
+    int idx = -1;
+    while (listener->state == TCP_STATE_LISTEN &&
+           (idx = tcp_find_pending(listen_sock)) < 0 &&
+           timer_get_uptime_us() < deadline) {
+        flags = net_wait(flags);
+    }
+
+    if (idx >= 0) tcp_sockets[idx].accepted = 1;
+    net_unlock(flags);
+    return idx;
+}
+
+tcp_socket_t tcp_accept(tcp_socket_t listen_sock) {
+    return tcp_accept_timeout(listen_sock, 0);
+}
+
+// What a poll entry is waiting for that has happened (net_lock held)
+static uint16_t tcp_poll_events(const tcp_pollfd_t *fd) {
+    if (fd->sock >= TCP_MAX_SOCKETS) return TCP_POLLERR;
+
+    tcp_socket_internal_t *sock = &tcp_sockets[fd->sock];
+    uint16_t ev = 0;
+    if (sock->state == TCP_STATE_LISTEN) {
+        if (tcp_find_pending(fd->sock) >= 0) ev |= TCP_POLLIN;
+    } else {
+        if (tcp_rx_avail(sock) > 0) ev |= TCP_POLLIN;
+        if (tcp_rx_done(sock)) ev |= TCP_POLLIN | TCP_POLLHUP;
+        if ((sock->state == TCP_STATE_ESTABLISHED || sock->state == TCP_STATE_CLOSE_WAIT) &&
+            sock->tx_len < TCP_TX_BUF_SIZE) {
+            ev |= TCP_POLLOUT;
         }
     }
-    
-    return -1;  // No connection available
+
+    // Hangups are reported whether asked for or not
+    return ev & (fd->events | TCP_POLLHUP);
+}
+
+int tcp_poll(tcp_pollfd_t *fds, int nfds, int timeout_ms) {
+    if (nfds < 0 || (nfds > 0 && !fds)) return -1;
+
+    uint64_t deadline = net_deadline(timeout_ms);
+    uint64_t flags = net_lock_irqsave();
+    int ready;
+
+    while (1) {
+        ready = 0;
+        for (int i = 0; i < nfds; i++) {
+            fds[i].revents = fds[i].sock >= 0 ? tcp_poll_events(&fds[i]) : 0;
+            if (fds[i].revents) ready++;
+        }
+        if (ready || timer_get_uptime_us() >= deadline) break;
+        flags = net_wait(flags);
+    }
+
+    net_unlock(flags);
+    return ready;
 }
 
 int tcp_get_peer_info(tcp_socket_t sock_id, uint32_t *ip, uint16_t *port) {
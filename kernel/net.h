@@ -91,14 +91,70 @@ typedef struct {
 #define NET_DNS         0x0a000203  // 10.0.2.3
 #define NET_NETMASK     0xffffff00  // 255.255.255.0
 
+// Packet buffer for transmit. A packet is built back to front: the payload
+// goes in first (copied with pbuf_put, or referenced in place with pbuf_ref)
+// and each layer then pushes its header into the headroom in front of it.
+// The driver sends the header area and the references as one gather list
+// and hands the pbuf back to the pool once the device is done with it.
+#define PBUF_HEADROOM   96      // Ethernet + IP + TCP with options
+#define PBUF_DATA_SIZE  1500    // IP MTU
+#define PBUF_MAX_REFS   2       // A TCP segment can wrap around the send ring
+#define PBUF_POOL_SIZE  16      // Frames in flight at once
+
+typedef struct pbuf {
+    uint8_t *data;              // First byte of the packet, moves back on push
+    uint32_t len;               // Bytes in buf from data on
+    struct {
+        const void *addr;       // Kernel memory, left alone until sent
+        uint32_t len;
+    } ref[PBUF_MAX_REFS];       // Sent after the bytes in buf
+    int nrefs;
+    int *ref_frames;            // Sender's count of its frames in flight, or NULL
+    struct pbuf *next;          // Free list
+    uint8_t buf[PBUF_HEADROOM + PBUF_DATA_SIZE] __attribute__((aligned(8)));
+} pbuf_t;
+
+// Get an empty packet with all of the headroom free. Reclaims the ones the
+// device has sent if all are in flight, NULL at once if none has been.
+pbuf_t *pbuf_alloc(void);
+
+// Give back a packet that won't be sent after all
+void pbuf_free(pbuf_t *p);
+
+// Append len bytes after the data, returns where to write them or NULL
+void *pbuf_put(pbuf_t *p, uint32_t len);
+
+// Append len bytes at addr without copying them. Returns 0 or -1 if full.
+int pbuf_ref(pbuf_t *p, const void *addr, uint32_t len);
+
+// Prepend a len byte header, returns where to write it or NULL
+void *pbuf_push(pbuf_t *p, uint32_t len);
+
+// Total packet length, headers and references included
+uint32_t pbuf_len(const pbuf_t *p);
+
+// Internet checksum of the whole packet on top of sum (e.g. a pseudo-header)
+uint16_t pbuf_checksum(const pbuf_t *p, uint32_t sum);
+
 // Initialize network stack
 void net_init(void);
 
-// Process incoming packets (call from main loop or IRQ)
+// Network IRQ: acks the device and leaves the work to the network
+// softirq, which processes received packets and runs the TCP timers
+void net_irq_handler(void);
+
+// Process incoming packets now. Not needed to keep the stack going (the
+// softirq does that); only to catch up before looking at its state.
 void net_poll(void);
 
-// Send raw ethernet frame
+// The eth_, arp_, ip_, icmp_ and udp_ functions are the stack's internals
+// and expect its lock held (call them from within net.c). net_ping,
+// dns_resolve and the TCP API take it themselves.
+
+// Send raw ethernet frame. The _output variants take ownership of p and
+// return once it is queued; it goes back to the pool when sent or on error.
 int eth_send(const uint8_t *dst_mac, uint16_t ethertype, const void *data, uint32_t len);
+int eth_output(pbuf_t *p, const uint8_t *dst_mac, uint16_t ethertype);
 
 // ARP functions
 void arp_request(uint32_t ip);
@@ -106,6 +162,7 @@ const uint8_t *arp_lookup(uint32_t ip);
 
 // IP functions
 int ip_send(uint32_t dst_ip, uint8_t protocol, const void *data, uint32_t len);
+int ip_output(pbuf_t *p, uint32_t dst_ip, uint8_t protocol);
 uint16_t ip_checksum(const void *data, uint32_t len);
 
 // ICMP functions
@@ -180,17 +237,28 @@ typedef struct __attribute__((packed)) {
 typedef int tcp_socket_t;
 
 // TCP API
+// The _timeout calls sleep until they can go on: timeout_ms < 0 waits as
+// long as it takes, 0 doesn't wait at all.
+
 // Returns socket handle (>=0) or -1 on error
 tcp_socket_t tcp_connect(uint32_t ip, uint16_t port);
 
-// Send data on connected socket
+// Send data on connected socket, waiting up to 30s at a time for room
 // Returns bytes sent or -1 on error
 int tcp_send(tcp_socket_t sock, const void *data, uint32_t len);
 
+// Send data, waiting up to timeout_ms at a time for room in the buffer
+// Returns bytes queued (0 if none fit in time) or -1 on error/closed
+int tcp_send_timeout(tcp_socket_t sock, const void *data, uint32_t len, int timeout_ms);
+
 // Receive data from connected socket
 // Returns bytes received, 0 if no data, -1 on error/closed
 int tcp_recv(tcp_socket_t sock, void *buf, uint32_t maxlen);
 
+// Receive data, waiting up to timeout_ms for some to arrive
+// Returns bytes received, 0 on timeout, -1 on error/closed
+int tcp_recv_timeout(tcp_socket_t sock, void *buf, uint32_t maxlen, int timeout_ms);
+
 // Close socket
 void tcp_close(tcp_socket_t sock);
 
@@ -205,9 +273,29 @@ int tcp_get_state(tcp_socket_t sock);
 tcp_socket_t tcp_listen(uint16_t port);
 
 // Accept a connection on a listening socket
-// Returns new socket handle or -1
+// Returns new socket handle or -1 if none is waiting
 tcp_socket_t tcp_accept(tcp_socket_t listen_sock);
 
+// Accept a connection, waiting up to timeout_ms for one
+// Returns new socket handle or -1
+tcp_socket_t tcp_accept_timeout(tcp_socket_t listen_sock, int timeout_ms);
+
+// Waiting on several sockets at once
+typedef struct {
+    tcp_socket_t sock;   // Entries with sock < 0 are skipped
+    uint16_t events;     // TCP_POLL* to wait for
+    uint16_t revents;    // TCP_POLL* that happened (set by tcp_poll)
+} tcp_pollfd_t;
+
+#define TCP_POLLIN   0x01  // recv won't return 0, or (listening) accept has a connection
+#define TCP_POLLOUT  0x04  // send has room
+#define TCP_POLLERR  0x08  // Not a socket (always reported)
+#define TCP_POLLHUP  0x10  // Peer closed, nothing more to receive (always reported)
+
+// Sleep until one of the sockets is ready or timeout_ms passes
+// Returns how many entries have revents set, 0 on timeout, -1 on error
+int tcp_poll(tcp_pollfd_t *fds, int nfds, int timeout_ms);
+
 // Get client IP and port from an accepted socket
 // Returns 0 on success, -1 on error
 int tcp_get_peer_info(tcp_socket_t sock, uint32_t *ip, uint16_t *port);
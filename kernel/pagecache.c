@@ -0,0 +1,465 @@
+/*
+ * KikiOS File Page Cache
+ *
+ * Pages come from slabs: 64KB chunks of heap, page aligned, carved into
+ * sixteen pages with a descriptor each. A slab goes back to the heap as
+ * soon as its last page is released, so the cache shrinks when it gives
+ * pages up.
+ *
+ * A cached file has a table of its pages by index. While some process maps
+ * it, its pages are pinned; once the last mapping goes they join the LRU
+ * list and can be evicted one at a time. A file that is invalidated leaves
+ * the list at once but keeps its pages until nobody maps it any more.
+ *
+ * Filling a page reads the file without the lock held, so two programs
+ * mapping the same new file may both read a page - the second just throws
+ * its copy away. Nothing is freed under the lock either: what the locked
+ * code lets go of is collected in a graveyard_t and freed after unlocking.
+ */
+
+#include "pagecache.h"
+#include "process.h"
+#include "vfs.h"
+#include "mmu.h"
+#include "memory.h"
+#include "string.h"
+#include "printf.h"
+#include "spinlock.h"
+
+#define PAGE_SIZE   0x1000ULL
+#define PAGE_UP(x)  (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+#define SLAB_PAGES  16
+#define MAX_PAGES   (PAGECACHE_MAX_BYTES / PAGE_SIZE)
+
+struct cfile;
+struct slab;
+
+typedef struct page {
+    struct slab *slab;
+    struct cfile *file;         // NULL while being filled or free
+    uint32_t index;             // Page of the file it holds
+    int used;
+    uint8_t *data;
+    struct page *lru_prev;      // Towards the most recently used
+    struct page *lru_next;      // Towards the next to be evicted
+} page_t;
+
+typedef struct slab {
+    struct slab *next;
+    void *alloc;                // What malloc returned
+    int used;                   // Pages handed out
+    page_t pages[SLAB_PAGES];
+} slab_t;
+
+typedef struct cfile {
+    struct cfile *next;
+    uint32_t file_id;           // First cluster (vfs_file_id)
+    size_t size;
+    uint32_t npages;
+    page_t **pages;             // By index, NULL if not cached
+    uint32_t cached;            // Non-NULL entries in pages
+    int maps;                   // Mappings of it, in any process
+    int stale;                  // Invalidated: off the list
+} cfile_t;
+
+typedef struct mapping {
+    struct mapping *next;
+    uint64_t base;
+    uint64_t size;              // Whole pages
+    cfile_t *file;
+} mapping_t;
+
+// Released under the lock, freed after it
+typedef struct {
+    cfile_t *files;
+    slab_t *slabs;
+} graveyard_t;
+
+static spinlock_t cache_lock = SPINLOCK_INIT;
+static cfile_t *file_head = NULL;
+static slab_t *slab_head = NULL;
+static page_t *lru_head = NULL;
+static page_t *lru_tail = NULL;
+static uint32_t page_count = 0;     // Pages in use, pinned or not
+
+static void lru_unlink(page_t *p) {
+    if (p->lru_prev) p->lru_prev->lru_next = p->lru_next;
+    else lru_head = p->lru_next;
+    if (p->lru_next) p->lru_next->lru_prev = p->lru_prev;
+    else lru_tail = p->lru_prev;
+    p->lru_prev = p->lru_next = NULL;
+}
+
+static void lru_push_head(page_t *p) {
+    p->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = p;
+    lru_head = p;
+    if (!lru_tail) lru_tail = p;
+}
+
+static void bury(graveyard_t *g) {
+    while (g->files) {
+        cfile_t *f = g->files;
+        g->files = f->next;
+        free(f->pages);
+        free(f);
+    }
+    while (g->slabs) {
+        slab_t *s = g->slabs;
+        g->slabs = s->next;
+        free(s->alloc);
+        free(s);
+    }
+}
+
+// Take a file off the list (caller holds cache_lock)
+static void unlink_file(cfile_t *f) {
+    cfile_t **pp = &file_head;
+    while (*pp && *pp != f) pp = &(*pp)->next;
+    if (*pp) *pp = f->next;
+    f->next = NULL;
+}
+
+// A file nothing maps and with no pages left goes (caller holds cache_lock)
+static void file_done(cfile_t *f, graveyard_t *g) {
+    if (f->maps || f->cached) return;
+    if (!f->stale) unlink_file(f);
+    f->next = g->files;
+    g->files = f;
+}
+
+// Give a page back to its slab, and an empty slab back to the heap
+// (caller holds cache_lock, the page is off the LRU)
+static void release_page(page_t *p, graveyard_t *g) {
+    if (p->file) {
+        p->file->pages[p->index] = NULL;
+        p->file->cached--;
+        p->file = NULL;
+    }
+    p->used = 0;
+    page_count--;
+
+    slab_t *s = p->slab;
+    if (--s->used > 0) return;
+    slab_t **pp = &slab_head;
+    while (*pp && *pp != s) pp = &(*pp)->next;
+    if (*pp) *pp = s->next;
+    s->next = g->slabs;
+    g->slabs = s;
+}
+
+// Drop the least recently used unmapped page. 0 if there is none.
+static int evict_one(graveyard_t *g) {
+    page_t *p = lru_tail;
+    if (!p) return 0;
+    cfile_t *f = p->file;
+    lru_unlink(p);
+    release_page(p, g);
+    file_done(f, g);
+    return 1;
+}
+
+// Drop all of an unmapped file's pages (caller holds cache_lock)
+static void drop_pages(cfile_t *f, graveyard_t *g) {
+    for (uint32_t i = 0; i < f->npages && f->cached; i++) {
+        page_t *p = f->pages[i];
+        if (!p) continue;
+        lru_unlink(p);
+        release_page(p, g);
+    }
+    file_done(f, g);
+}
+
+// A free page from an existing slab (caller holds cache_lock)
+static page_t *take_page(void) {
+    for (slab_t *s = slab_head; s; s = s->next) {
+        if (s->used == SLAB_PAGES) continue;
+        for (int i = 0; i < SLAB_PAGES; i++) {
+            page_t *p = &s->pages[i];
+            if (p->used) continue;
+            p->used = 1;
+            s->used++;
+            page_count++;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static slab_t *slab_create(void) {
+    slab_t *s = malloc(sizeof(slab_t));
+    if (!s) return NULL;
+    memset(s, 0, sizeof(slab_t));
+    s->alloc = malloc(SLAB_PAGES * PAGE_SIZE + PAGE_SIZE);
+    if (!s->alloc) {
+        free(s);
+        return NULL;
+    }
+    uint8_t *data = (uint8_t *)PAGE_UP((uint64_t)s->alloc);
+    for (int i = 0; i < SLAB_PAGES; i++) {
+        s->pages[i].slab = s;
+        s->pages[i].data = data + i * PAGE_SIZE;
+    }
+    return s;
+}
+
+// A page to fill, evicting to stay under the cap or to make room in the
+// heap. NULL if nothing is left to evict.
+static page_t *new_page(void) {
+    for (;;) {
+        graveyard_t g = { NULL, NULL };
+        uint64_t flags = spin_lock_irqsave(&cache_lock);
+        if (page_count >= MAX_PAGES) evict_one(&g);
+        page_t *p = take_page();
+        spin_unlock_irqrestore(&cache_lock, flags);
+        bury(&g);
+        if (p) return p;
+
+        slab_t *s = slab_create();
+        flags = spin_lock_irqsave(&cache_lock);
+        int progress = 1;
+        if (s) {
+            s->next = slab_head;
+            slab_head = s;
+        } else {
+            progress = evict_one(&g);
+        }
+        spin_unlock_irqrestore(&cache_lock, flags);
+        bury(&g);
+        if (!progress) return NULL;
+    }
+}
+
+// Return a page that was never added to a file
+static void put_page(page_t *p) {
+    graveyard_t g = { NULL, NULL };
+    uint64_t flags = spin_lock_irqsave(&cache_lock);
+    release_page(p, &g);
+    spin_unlock_irqrestore(&cache_lock, flags);
+    bury(&g);
+}
+
+static cfile_t *find_file(uint32_t file_id, size_t size) {
+    cfile_t *f = file_head;
+    while (f && (f->file_id != file_id || f->size != size)) f = f->next;
+    return f;
+}
+
+// Count a new mapping of f, pinning its pages (caller holds cache_lock)
+static void hold_file(cfile_t *f) {
+    if (f->maps++ > 0) return;
+    for (uint32_t i = 0; i < f->npages; i++) {
+        if (f->pages[i]) lru_unlink(f->pages[i]);
+    }
+}
+
+// Undo hold_file: the last mapping gone unpins the pages, or frees them if
+// the file is stale (caller holds cache_lock)
+static void release_file(cfile_t *f, graveyard_t *g) {
+    if (--f->maps > 0) return;
+    if (f->stale || !f->cached) {
+        // Pinned pages aren't on the LRU
+        for (uint32_t i = 0; i < f->npages && f->cached; i++) {
+            if (f->pages[i]) release_page(f->pages[i], g);
+        }
+        file_done(f, g);
+        return;
+    }
+    // Later pages are evicted first: a reader that comes back usually
+    // starts at the beginning
+    for (uint32_t i = 0; i < f->npages; i++) {
+        if (f->pages[i]) lru_push_head(f->pages[i]);
+    }
+    // Evicting its last page lets the file go too
+    while (page_count > MAX_PAGES && evict_one(g)) { }
+}
+
+// The cached file for (file_id, size), created if needed, with a mapping
+// counted. NULL if out of memory.
+static cfile_t *get_file(uint32_t file_id, size_t size) {
+    uint64_t flags = spin_lock_irqsave(&cache_lock);
+    cfile_t *f = find_file(file_id, size);
+    if (f) hold_file(f);
+    spin_unlock_irqrestore(&cache_lock, flags);
+    if (f) return f;
+
+    cfile_t *nf = malloc(sizeof(cfile_t));
+    if (!nf) return NULL;
+    memset(nf, 0, sizeof(cfile_t));
+    nf->file_id = file_id;
+    nf->size = size;
+    nf->npages = (uint32_t)(PAGE_UP(size) / PAGE_SIZE);
+    nf->pages = malloc(nf->npages * sizeof(page_t *));
+    if (!nf->pages) {
+        free(nf);
+        return NULL;
+    }
+    memset(nf->pages, 0, nf->npages * sizeof(page_t *));
+
+    // Somebody else may have added it meanwhile - use theirs
+    flags = spin_lock_irqsave(&cache_lock);
+    f = find_file(file_id, size);
+    if (f) {
+        hold_file(f);
+    } else {
+        f = nf;
+        f->maps = 1;
+        f->next = file_head;
+        file_head = f;
+        nf = NULL;
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    if (nf) {
+        free(nf->pages);
+        free(nf);
+    }
+    return f;
+}
+
+static void put_file(cfile_t *f) {
+    graveyard_t g = { NULL, NULL };
+    uint64_t flags = spin_lock_irqsave(&cache_lock);
+    release_file(f, &g);
+    spin_unlock_irqrestore(&cache_lock, flags);
+    bury(&g);
+}
+
+// Read the pages of f that aren't cached. Returns how many were, or -1.
+static int fill(cfile_t *f, vfs_node_t *node) {
+    int hits = 0;
+    for (uint32_t i = 0; i < f->npages; i++) {
+        // Pinned, so a page once there stays there
+        if (f->pages[i]) {
+            hits++;
+            continue;
+        }
+
+        page_t *p = new_page();
+        if (!p) return -1;
+        size_t off = (size_t)i * PAGE_SIZE;
+        size_t len = f->size - off < PAGE_SIZE ? f->size - off : PAGE_SIZE;
+        if (vfs_read(node, (char *)p->data, len, off) != (int)len) {
+            put_page(p);
+            return -1;
+        }
+        if (len < PAGE_SIZE) memset(p->data + len, 0, PAGE_SIZE - len);
+
+        uint64_t flags = spin_lock_irqsave(&cache_lock);
+        if (!f->pages[i]) {
+            p->file = f;
+            p->index = i;
+            f->pages[i] = p;
+            f->cached++;
+            p = NULL;
+        }
+        spin_unlock_irqrestore(&cache_lock, flags);
+        if (p) put_page(p);
+    }
+    return hits;
+}
+
+void *pagecache_map(const char *path, size_t *size) {
+    process_t *proc = process_current();
+    if (!proc || !mmu_demand_paging()) return NULL;
+
+    vfs_node_t *node = vfs_open_handle(path);
+    if (!node) return NULL;
+    uint32_t file_id = vfs_is_dir(node) ? 0 : vfs_file_id(node);
+    size_t file_size = node->size;
+    if (!file_id || file_size == 0) {
+        vfs_close_handle(node);
+        return NULL;
+    }
+
+    uint64_t map_size = PAGE_UP(file_size);
+    mapping_t *m = malloc(sizeof(mapping_t));
+    uint64_t base = m ? process_region_alloc(map_size) : 0;
+    cfile_t *f = base ? get_file(file_id, file_size) : NULL;
+    int hits = f ? fill(f, node) : -1;
+    vfs_close_handle(node);
+    if (hits < 0) goto fail;
+
+    // Pages of a file aren't contiguous, so one at a time
+    for (uint32_t i = 0; i < f->npages; i++) {
+        if (mmu_map_shared(base + i * PAGE_SIZE, f->pages[i]->data, PAGE_SIZE) != 0) goto fail;
+    }
+
+    m->base = base;
+    m->size = map_size;
+    m->file = f;
+    uint64_t flags = spin_lock_irqsave(&cache_lock);
+    m->next = proc->mappings;
+    proc->mappings = m;
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    printf("[PCACHE] %s: %u KB mapped, %u of %u pages were cached\n",
+           path, (uint32_t)(map_size / 1024), (uint32_t)hits, f->npages);
+    *size = file_size;
+    return (void *)base;
+
+fail:
+    if (base) {
+        mmu_demand_reset(base, map_size);
+        process_region_free(base, map_size);
+    }
+    if (f) put_file(f);
+    free(m);
+    return NULL;
+}
+
+static void unmap(mapping_t *m) {
+    // Nothing may read the pages through the mapping once they can go
+    mmu_demand_reset(m->base, m->size);
+    process_region_free(m->base, m->size);
+    put_file(m->file);
+    free(m);
+}
+
+int pagecache_unmap(void *addr) {
+    process_t *proc = process_current();
+    if (!proc) return -1;
+
+    uint64_t flags = spin_lock_irqsave(&cache_lock);
+    mapping_t **pp = &proc->mappings;
+    while (*pp && (*pp)->base != (uint64_t)addr) pp = &(*pp)->next;
+    mapping_t *m = *pp;
+    if (m) *pp = m->next;
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    if (!m) return -1;
+    unmap(m);
+    return 0;
+}
+
+void pagecache_unmap_all(struct process *proc) {
+    uint64_t flags = spin_lock_irqsave(&cache_lock);
+    mapping_t *m = proc->mappings;
+    proc->mappings = NULL;
+    spin_unlock_irqrestore(&cache_lock, flags);
+
+    while (m) {
+        mapping_t *next = m->next;
+        unmap(m);
+        m = next;
+    }
+}
+
+void pagecache_invalidate(uint32_t first_cluster) {
+    if (first_cluster == 0) return;
+    graveyard_t g = { NULL, NULL };
+
+    uint64_t flags = spin_lock_irqsave(&cache_lock);
+    cfile_t *f = file_head;
+    while (f) {
+        cfile_t *next = f->next;
+        if (f->file_id == first_cluster) {
+            unlink_file(f);
+            f->stale = 1;
+            if (f->maps == 0) drop_pages(f, &g);
+        }
+        f = next;
+    }
+    spin_unlock_irqrestore(&cache_lock, flags);
+    bury(&g);
+}
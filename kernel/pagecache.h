@@ -0,0 +1,43 @@
+/*
+ * KikiOS File Page Cache
+ *
+ * Keeps files' contents in memory a page at a time, keyed by the file and
+ * the page's index in it, for map_file: a program gets a read-only view of
+ * a whole file, made by mapping the cached pages into a fresh region of
+ * the program area, instead of malloc'ing a private copy and reading into
+ * it. Decoders (images, MP3s, WADs) can work on the file in place, and the
+ * next program mapping the same file finds its pages already there.
+ *
+ * Files are identified like imgcache does it, by first cluster and size,
+ * and dropped when those clusters are freed or written. Mappings belong to
+ * a process and go when it exits. Pages no mapping uses stay cached,
+ * least recently used first out once the cache passes PAGECACHE_MAX_BYTES
+ * or the heap runs short.
+ */
+
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PAGECACHE_MAX_BYTES  (16 * 1024 * 1024)
+
+struct process;
+
+// Map the file at path read-only into the current process. Returns the
+// address and sets *size, or NULL if it can't be mapped (no such file,
+// empty, not on disk, MMU off, out of memory).
+void *pagecache_map(const char *path, size_t *size);
+
+// Undo a pagecache_map of the current process. Returns 0, or -1 if addr
+// isn't one of its mappings.
+int pagecache_unmap(void *addr);
+
+// Undo all of a process's mappings (it is exiting)
+void pagecache_unmap_all(struct process *proc);
+
+// The cluster chain starting here is being freed or written (fat32.c)
+void pagecache_invalidate(uint32_t first_cluster);
+
+#endif
@@ -7,6 +7,7 @@
 
 #include "printf.h"
 #include "klog.h"
+#include "smp.h"
 #include <stdint.h>
 #include <stddef.h>
 
@@ -16,6 +17,9 @@
 extern void uart_putc(char c);
 extern void console_putc(char c);
 
+// Keeps lines from different cores from interleaving
+static rlock_t print_lock = RLOCK_INIT;
+
 // Local strlen to avoid circular deps
 static int local_strlen(const char *s) {
     int len = 0;
@@ -224,6 +228,8 @@ int printf(const char *fmt, ...) {
     va_start(args, fmt);
     int count = 0;
 
+    rlock_acquire(&print_lock);
+
     while (*fmt) {
         if (*fmt != '%') {
             printf_putchar(*fmt++, NULL);
@@ -314,6 +320,7 @@ int printf(const char *fmt, ...) {
         fmt++;
     }
 
+    rlock_release(&print_lock);
     va_end(args);
     return count;
 }
@@ -4,38 +4,58 @@
  * Preemptive multitasking - timer IRQ forces context switches.
  * Programs run in kernel space and call kernel functions directly.
  * No memory protection, but full preemption via timer interrupt.
+ *
+ * SMP: proc_table is shared by all cores and guarded by sched_lock. Each
+ * core has its own current process and kernel context (cpu_t). The lock is
+ * always taken with IRQs masked, and a voluntary switch hands it to
+ * context_switch, which drops it only once the old context is saved.
+ *
+ * Scheduling is O(1) in the number of processes: READY processes sit in one
+ * FIFO per priority with a bitmap of non-empty queues, BLOCKED ones on a
+ * sleep queue sorted by wake-up tick (or on nothing, if they wait for a
+ * child). A process that uses a whole time slice drops a priority level;
+ * blocking or yielding puts it back at its base priority.
  */
 
 #include "process.h"
 #include "elf.h"
+#include "imgcache.h"
+#include "pagecache.h"
+#include "bcache.h"
 #include "vfs.h"
 #include "memory.h"
+#include "mmu.h"
 #include "string.h"
 #include "printf.h"
 #include "kapi.h"
+#include "smp.h"
+#include "fpu.h"
 #include <stddef.h>
 
 // Process table
 static process_t proc_table[MAX_PROCESSES];
-static int current_pid = -1;  // -1 means kernel/shell is running
 static int next_pid = 1;
-
-// Current process pointer - used by IRQ handler for preemption
-// NULL means kernel is running (no process to save to)
-process_t *current_process = NULL;
-
-// Kernel context - saved when switching from kernel to a process
-// This allows us to return to kernel (e.g., desktop running via process_exec)
-// Global (not static) so vectors.S can access it for kernel->process IRQ switches
-cpu_context_t kernel_context;
-
-// Program load address - grows upward as we load programs
-// Set dynamically based on heap_end
-static uint64_t program_base = 0;
-static uint64_t next_load_addr = 0;
-
-// Align to 64KB boundary for cleaner loading
-#define ALIGN_64K(x) (((x) + 0xFFFF) & ~0xFFFFULL)
+static spinlock_t sched_lock = SPINLOCK_INIT;
+
+// Run queues and sleep queue (under sched_lock)
+static process_t *ready_head[PROC_PRIORITIES];
+static process_t *ready_tail[PROC_PRIORITIES];
+static uint32_t ready_mask = 0;     // Bit n set: ready_head[n] non-empty
+static int ready_count = 0;
+
+// Killed processes the timer IRQ took off a core, still to be freed from
+// process context (reap_zombies). Under sched_lock; read unlocked as a hint.
+static volatile int unreaped = 0;
+
+// Program regions: the program area (memory.h) in 64KB granules, one bit
+// each, handed out first fit. A region is free again as soon as its
+// program is gone, and comes back unmapped (mmu_demand_reset), so the next
+// program only pays for the pages it touches.
+#define REGION_GRANULE  0x10000ULL
+#define REGION_MAX      2048            // Up to 128MB of program area
+static uint64_t region_map[REGION_MAX / 64];
+static int region_count = 0;            // Granules in the program area
+static spinlock_t region_lock = SPINLOCK_INIT;
 
 // Program entry point signature
 typedef int (*program_entry_t)(kapi_t *api, int argc, char **argv);
@@ -52,20 +72,86 @@ void process_init(void) {
         // Also clear context to prevent garbage
         memset(&proc_table[i].context, 0, sizeof(cpu_context_t));
     }
-    current_pid = -1;
-    current_process = NULL;
     next_pid = 1;
 
-    // Programs load right after the heap
-    program_base = ALIGN_64K(heap_end);
-    next_load_addr = program_base;
+    // Programs load between the heap and the kernel stack
+    region_count = (int)((program_end - program_start) / REGION_GRANULE);
+    if (region_count > REGION_MAX) region_count = REGION_MAX;
+    memset(region_map, 0, sizeof(region_map));
 
     printf("[PROC] Process subsystem initialized (max %d processes)\n", MAX_PROCESSES);
-    printf("[PROC] Program load area: 0x%lx+\n", program_base);
-    printf("[PROC] kernel_context at: 0x%lx\n", (uint64_t)&kernel_context);
+    printf("[PROC] Program load area: 0x%lx - 0x%lx\n",
+           program_start, program_start + region_count * REGION_GRANULE);
+}
+
+static void region_mark(int first, int count, int used) {
+    for (int i = first; i < first + count; i++) {
+        if (used) region_map[i / 64] |= 1ULL << (i % 64);
+        else region_map[i / 64] &= ~(1ULL << (i % 64));
+    }
 }
 
-// Find a free slot in the process table
+// Reserve a program region of at least size bytes. Returns its address,
+// or 0 if no gap is big enough.
+static uint64_t region_alloc(uint64_t size) {
+    int need = (int)((size + REGION_GRANULE - 1) / REGION_GRANULE);
+    int first = -1;
+
+    uint64_t flags = spin_lock_irqsave(&region_lock);
+    int run = 0;
+    for (int i = 0; i < region_count; i++) {
+        if ((i % 64) == 0 && region_map[i / 64] == ~0ULL) {
+            run = 0;
+            i += 63;
+            continue;
+        }
+        if (region_map[i / 64] & (1ULL << (i % 64))) {
+            run = 0;
+            continue;
+        }
+        if (++run == need) {
+            first = i - need + 1;
+            region_mark(first, need, 1);
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&region_lock, flags);
+
+    if (first < 0) return 0;
+    uint64_t base = program_start + first * REGION_GRANULE;
+
+    // Drop the last owner's pages - they come back zeroed as we load
+    mmu_demand_reset(base, need * REGION_GRANULE);
+    return base;
+}
+
+uint64_t process_region_alloc(uint64_t size) {
+    return region_alloc(size);
+}
+
+void process_region_free(uint64_t base, uint64_t size) {
+    int first = (int)((base - program_start) / REGION_GRANULE);
+    int count = (int)((size + REGION_GRANULE - 1) / REGION_GRANULE);
+
+    uint64_t flags = spin_lock_irqsave(&region_lock);
+    region_mark(first, count, 0);
+    spin_unlock_irqrestore(&region_lock, flags);
+}
+
+// Give a process's program region, cached image and file mappings back
+// (its code must not run again)
+static void region_release(process_t *proc) {
+    pagecache_unmap_all(proc);
+    if (proc->image) {
+        imgcache_put(proc->image);
+        proc->image = NULL;
+    }
+    if (!proc->region_size) return;
+    process_region_free(proc->load_base, proc->region_size);
+    proc->region_size = 0;
+}
+
+// Find a free slot in the process table (caller holds sched_lock)
 static int find_free_slot(void) {
     for (int i = 0; i < MAX_PROCESSES; i++) {
         if (proc_table[i].state == PROC_STATE_FREE) {
@@ -76,8 +162,8 @@ static int find_free_slot(void) {
 }
 
 process_t *process_current(void) {
-    if (current_pid < 0) return NULL;
-    return &proc_table[current_pid];
+    cpu_t *cpu = this_cpu();
+    return cpu ? cpu->current : NULL;
 }
 
 process_t *process_get(int pid) {
@@ -89,22 +175,123 @@ process_t *process_get(int pid) {
     return NULL;
 }
 
-// Get pointer to current_process pointer (for assembly IRQ handler)
-process_t **process_get_current_ptr(void) {
-    return &current_process;
-}
-
 int process_count_ready(void) {
-    int count = 0;
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (proc_table[i].state == PROC_STATE_READY ||
-            proc_table[i].state == PROC_STATE_RUNNING) {
-            count++;
-        }
+    // READY ones are all queued; RUNNING ones are some core's current
+    int count = ready_count;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        if (cpus[i].current) count++;
     }
     return count;
 }
 
+// ============================================================================
+// Run queues (caller holds sched_lock)
+// ============================================================================
+
+// Append to the back of its priority's queue
+static void ready_push(process_t *p) {
+    int prio = p->priority;
+    p->state = PROC_STATE_READY;
+    p->q_next = NULL;
+    p->q_prev = ready_tail[prio];
+    if (ready_tail[prio]) ready_tail[prio]->q_next = p;
+    else ready_head[prio] = p;
+    ready_tail[prio] = p;
+    ready_mask |= 1u << prio;
+    ready_count++;
+
+    // Wake idle cores (they wait in wfe, with no tick programmed)
+    asm volatile("sev");
+}
+
+static void ready_remove(process_t *p) {
+    int prio = p->priority;
+    if (p->q_prev) p->q_prev->q_next = p->q_next;
+    else ready_head[prio] = p->q_next;
+    if (p->q_next) p->q_next->q_prev = p->q_prev;
+    else ready_tail[prio] = p->q_prev;
+    if (!ready_head[prio]) ready_mask &= ~(1u << prio);
+    p->q_next = p->q_prev = NULL;
+    ready_count--;
+}
+
+// Take the first process off the highest-priority non-empty queue
+static process_t *ready_pop(void) {
+    if (!ready_mask) return NULL;
+    process_t *p = ready_head[__builtin_ctz(ready_mask)];
+    ready_remove(p);
+    return p;
+}
+
+// Anything READY at priority prio or better?
+static int ready_at_or_above(int prio) {
+    return (ready_mask & ((2u << prio) - 1)) != 0;
+}
+
+// Anything READY strictly better than prio?
+static int ready_above(int prio) {
+    return (ready_mask & ((1u << prio) - 1)) != 0;
+}
+
+// Take p off the wait queue it is blocked on, if any
+static void wq_remove(process_t *p) {
+    if (!p->wq) return;
+    process_t **pp = &p->wq->head;
+    while (*pp && *pp != p) pp = &(*pp)->wq_next;
+    if (*pp) *pp = p->wq_next;
+    p->wq = NULL;
+    p->wq_next = NULL;
+}
+
+// BLOCKED -> READY, back at its base priority
+static void wake(process_t *p) {
+    wq_remove(p);
+    if (p->sleeping) {
+        ktimer_cancel(&p->sleep_timer);
+        p->sleeping = 0;
+    }
+    p->wait_pid = 0;
+    p->priority = p->base_priority;
+    ready_push(p);
+}
+
+// sleep_timer callback (timer IRQ, any core). The slot may have been killed
+// and reused since the timer fired; a sleeper woken early just re-sleeps.
+static void sleep_expired(void *arg) {
+    process_t *p = arg;
+    spin_lock(&sched_lock);
+    if (p->state == PROC_STATE_BLOCKED && p->sleeping) {
+        p->sleeping = 0;
+        wake(p);
+    }
+    spin_unlock(&sched_lock);
+}
+
+// Block until the counter reaches deadline
+static void sleep_block(process_t *p, uint64_t deadline) {
+    p->state = PROC_STATE_BLOCKED;
+    p->sleeping = 1;
+    p->sleep_timer.fn = sleep_expired;
+    p->sleep_timer.arg = p;
+    ktimer_add(&p->sleep_timer, deadline);
+}
+
+// p is exiting or being killed - hand its exit status to whoever waits in
+// exec and let them run again. The status must go now: the slot can be
+// reused as soon as it is FREE.
+static void wake_waiter(process_t *p) {
+    process_t *w = p->waiter;
+    p->waiter = NULL;
+    if (p->status_out) {
+        *p->status_out = p->exit_status;
+        p->status_out = NULL;
+    }
+    if (w && w->wait_pid == p->pid) {
+        w->child_status = p->exit_status;
+        if (w->state == PROC_STATE_BLOCKED) wake(w);
+    }
+}
+
 int process_get_info(int index, char *name, int name_size, int *state) {
     if (index < 0 || index >= MAX_PROCESSES) return 0;
     process_t *p = &proc_table[index];
@@ -124,88 +311,235 @@ int process_get_info(int index, char *name, int name_size, int *state) {
     return 1;
 }
 
+size_t process_get_mem(int index) {
+    if (index < 0 || index >= MAX_PROCESSES) return 0;
+    process_t *p = &proc_table[index];
+    if (p->state == PROC_STATE_FREE) return 0;
+    return arena_used(p->arena);
+}
+
+// Which live process's program image contains this code address?
+static process_t *process_owning_code(uint64_t addr) {
+    process_t *p = process_current();
+    if (p && addr - p->load_base < p->load_size) return p;
+
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        p = &proc_table[i];
+        if (p->state != PROC_STATE_FREE && addr - p->load_base < p->load_size) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// kapi malloc - charge the allocation to the program whose code called us.
+// Not simply current_process: the desktop's window functions run on behalf
+// of whichever app called them, but the buffers they allocate belong to the
+// desktop and must outlive that app. Code outside every program image was
+// generated at runtime (tcc output, the micropython JIT) by the process
+// running it, so that process pays; only the kernel thread gets the kernel
+// heap.
+void *process_malloc(size_t size) {
+    process_t *p = process_owning_code((uint64_t)__builtin_return_address(0));
+    if (!p) p = process_current();
+    return arena_malloc(p ? p->arena : NULL, size);
+}
+
+// Copy argv into the new process's arena, so it stays valid no matter how
+// long the caller's copy lives (spawn passes a stack array)
+static char **copy_argv(arena_t *arena, int argc, char **argv) {
+    if (argc <= 0 || !argv) return argv;
+
+    size_t size = (argc + 1) * sizeof(char *);
+    for (int i = 0; i < argc; i++) {
+        size += strlen(argv[i] ? argv[i] : "") + 1;
+    }
+
+    char **copy = arena_malloc(arena, size);
+    if (!copy) return NULL;
+
+    char *str = (char *)(copy + argc + 1);
+    for (int i = 0; i < argc; i++) {
+        const char *src = argv[i] ? argv[i] : "";
+        strcpy(str, src);
+        copy[i] = str;
+        str += strlen(src) + 1;
+    }
+    copy[argc] = NULL;
+    return copy;
+}
+
+// Release a dead process's stack, heap arena and program region (not for
+// the running process)
+static void release_process_memory(process_t *proc) {
+    if (proc->stack_base) {
+        free(proc->stack_base);
+        proc->stack_base = NULL;
+    }
+    arena_destroy(proc->arena);
+    proc->arena = NULL;
+    region_release(proc);
+}
+
+// Take a live process off the scheduler so it can be torn down. One that is
+// running on another core can't be freed under it - flag it and let that
+// core unlink it on its next tick (reap_zombies frees it later). One holding a kernel mutex may be halfway
+// through a filesystem or cache update, so it is flagged too and goes once
+// it lets go of the last one. Caller holds sched_lock.
+// Returns 1 if the caller should reap it now.
+static int claim_for_kill(process_t *proc) {
+    if (proc->state == PROC_STATE_RUNNING || proc->mutexes_held) {
+        proc->kill_pending = 1;
+        return 0;
+    }
+    if (proc->state == PROC_STATE_READY) {
+        ready_remove(proc);
+    } else if (proc->state == PROC_STATE_BLOCKED) {
+        wq_remove(proc);
+        if (proc->sleeping) {
+            ktimer_cancel(&proc->sleep_timer);
+            proc->sleeping = 0;
+        }
+    }
+    wake_waiter(proc);
+    proc->state = PROC_STATE_ZOMBIE;
+    return 1;
+}
+
+// Free a claimed process and give its slot back
+static void reap(process_t *proc) {
+    release_process_memory(proc);
+    uint64_t flags = spin_lock_irqsave(&sched_lock);
+    proc->state = PROC_STATE_FREE;
+    proc->pid = 0;
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+// Free whatever the timer IRQ left behind. It only unlinks a killed
+// process: arenas, cached pages and images take locks and time that don't
+// belong in an interrupt.
+static void reap_zombies(void) {
+    if (!unreaped) return;
+    for (int i = 0; i < MAX_PROCESSES; i++) {
+        process_t *p = &proc_table[i];
+        uint64_t flags = spin_lock_irqsave(&sched_lock);
+        int mine = p->state == PROC_STATE_ZOMBIE && p->unreaped;
+        if (mine) {
+            p->unreaped = 0;
+            unreaped--;
+        }
+        spin_unlock_irqrestore(&sched_lock, flags);
+        if (mine) reap(p);
+    }
+}
+
+// Give back a slot claimed by process_create that never got started
+static void abandon_slot(process_t *proc) {
+    uint64_t flags = spin_lock_irqsave(&sched_lock);
+    proc->state = PROC_STATE_FREE;
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
 // Create a new process (load the binary but don't start it)
 int process_create(const char *path, int argc, char **argv) {
-    (void)argc;
-    (void)argv;
+    reap_zombies();
 
-    // Find free slot
+    // Claim a free slot. BLOCKED with pid 0 keeps it from being scheduled,
+    // killed or handed out again until it is fully set up.
+    uint64_t flags = spin_lock_irqsave(&sched_lock);
     int slot = find_free_slot();
     if (slot < 0) {
+        spin_unlock_irqrestore(&sched_lock, flags);
         printf("[PROC] No free process slots\n");
         return -1;
     }
+    process_t *proc = &proc_table[slot];
+    proc->state = PROC_STATE_BLOCKED;
+    proc->pid = 0;
+    proc->kill_pending = 0;
+    proc->unreaped = 0;
+    proc->mutexes_held = 0;
+    proc->sleeping = 0;
+    proc->wait_pid = 0;
+    proc->waiter = NULL;
+    proc->status_out = NULL;
+    proc->wq = NULL;
+    proc->wq_next = NULL;
+    spin_unlock_irqrestore(&sched_lock, flags);
+
+    // A process that exited in this slot couldn't free the stack it was
+    // running on - do it now
+    if (proc->stack_base) {
+        free(proc->stack_base);
+        proc->stack_base = NULL;
+    }
 
     // Look up file
     vfs_node_t *file = vfs_lookup(path);
     if (!file) {
         printf("[PROC] File not found: %s\n", path);
+        abandon_slot(proc);
         return -1;
     }
 
     if (vfs_is_dir(file)) {
         printf("[PROC] Cannot exec directory: %s\n", path);
+        abandon_slot(proc);
         return -1;
     }
 
-    size_t size = file->size;
-    if (size == 0) {
+    if (file->size == 0) {
         printf("[PROC] File is empty: %s\n", path);
+        abandon_slot(proc);
         return -1;
     }
 
-    // Read the ELF file
-    char *data = malloc(size);
-    if (!data) {
-        printf("[PROC] Out of memory reading %s\n", path);
-        return -1;
-    }
-
-    int bytes = vfs_read(file, data, size, 0);
-    if (bytes != (int)size) {
-        printf("[PROC] Failed to read %s\n", path);
-        free(data);
-        return -1;
+    // A program launched before comes from the image cache. Otherwise the
+    // headers say how much memory it needs.
+    image_t *image = imgcache_get(file, path);
+    elf_image_t img;
+    const elf_image_t *hdr = image ? imgcache_headers(image) : &img;
+    if (!image) {
+        int err = elf_read_headers(file, &img);
+        if (err != 0) {
+            printf("[PROC] Invalid ELF: %s (err=%d, size=%d)\n", path, err, (int)file->size);
+            uint8_t *b = img.ehdr.e_ident;
+            printf("[PROC] Header: %02x %02x %02x %02x %02x %02x %02x %02x\n",
+                   b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
+            abandon_slot(proc);
+            return -1;
+        }
     }
 
-    // Calculate how much memory the program needs
-    uint64_t prog_size = elf_calc_size(data, size);
-    if (prog_size == 0) {
-        int err = elf_validate(data, size);
-        printf("[PROC] Invalid ELF: %s (err=%d, size=%d)\n", path, err, (int)size);
-        uint8_t *b = (uint8_t*)data;
-        printf("[PROC] Header: %02x %02x %02x %02x %02x %02x %02x %02x\n",
-               b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7]);
-        free(data);
+    uint64_t load_addr = region_alloc(hdr->span);
+    if (!load_addr) {
+        printf("[PROC] No room in program area for %s (%d KB)\n", path, (int)(hdr->span / 1024));
+        if (image) imgcache_put(image);
+        abandon_slot(proc);
         return -1;
     }
+    proc->load_base = load_addr;
+    proc->region_size = (hdr->span + REGION_GRANULE - 1) & ~(REGION_GRANULE - 1);
+    proc->image = image;
 
-    // Align load address
-    uint64_t load_addr = ALIGN_64K(next_load_addr);
-
-    // Load the ELF at this address
+    // Shared code and a copy of the data from the cache, or segments read
+    // from the file straight into the region
     elf_load_info_t info;
-    if (elf_load_at(data, size, load_addr, &info) != 0) {
+    int loaded = image ? imgcache_load(image, load_addr, &info)
+                       : elf_load_file(file, &img, load_addr, &info);
+    if (loaded != 0) {
         printf("[PROC] Failed to load ELF: %s\n", path);
-        free(data);
+        region_release(proc);
+        abandon_slot(proc);
         return -1;
     }
 
-    free(data);
-
-    // Update next load address for future programs
-    next_load_addr = ALIGN_64K(load_addr + info.load_size + 0x10000);
-
     // Set up process structure
-    process_t *proc = &proc_table[slot];
-    proc->pid = next_pid++;
     strncpy(proc->name, path, PROCESS_NAME_MAX - 1);
     proc->name[PROCESS_NAME_MAX - 1] = '\0';
-    proc->state = PROC_STATE_READY;
     proc->load_base = info.load_base;
     proc->load_size = info.load_size;
     proc->entry = info.entry;
-    proc->parent_pid = current_pid;
     proc->exit_status = 0;
 
     // Allocate stack
@@ -213,10 +547,22 @@ int process_create(const char *path, int argc, char **argv) {
     proc->stack_base = malloc(proc->stack_size);
     if (!proc->stack_base) {
         printf("[PROC] Failed to allocate stack\n");
-        proc->state = PROC_STATE_FREE;
+        region_release(proc);
+        abandon_slot(proc);
         return -1;
     }
 
+    // Private heap - everything the program mallocs goes away with it
+    proc->arena = arena_create();
+    char **args = proc->arena ? copy_argv(proc->arena, argc, argv) : NULL;
+    if (!proc->arena || (argc > 0 && argv && !args)) {
+        printf("[PROC] Failed to allocate heap arena\n");
+        release_process_memory(proc);
+        abandon_slot(proc);
+        return -1;
+    }
+    argv = args;
+
     // Initialize context
     // Stack grows down, SP starts at top (aligned to 16 bytes)
     uint64_t stack_top = ((uint64_t)proc->stack_base + proc->stack_size) & ~0xFULL;
@@ -232,12 +578,24 @@ int process_create(const char *path, int argc, char **argv) {
     proc->context.x[21] = (uint64_t)argc;     // x21 = argc
     proc->context.x[22] = (uint64_t)argv;     // x22 = argv
 
+    // Publish it - any core may start running it from here on
+    process_t *parent = process_current();
+    flags = spin_lock_irqsave(&sched_lock);
+    int pid = next_pid++;
+    proc->pid = pid;
+    proc->parent_pid = parent ? parent->pid : 0;
+    proc->base_priority = PRIO_NORMAL;
+    proc->priority = PRIO_NORMAL;
+    proc->slice_ticks = 0;
+    ready_push(proc);
+    spin_unlock_irqrestore(&sched_lock, flags);
+
     // printf("[PROC] Created process '%s' pid=%d at 0x%lx-0x%lx (slot %d)\n",
     //        proc->name, proc->pid, proc->load_base, proc->load_base + proc->load_size, slot);
     // printf("[PROC] Stack at 0x%lx-0x%lx\n",
     //        (uint64_t)proc->stack_base, (uint64_t)proc->stack_base + proc->stack_size);
 
-    return proc->pid;
+    return pid;
 }
 
 // Entry wrapper - called when a new process is switched to for the first time
@@ -271,7 +629,8 @@ int process_start(int pid) {
     process_t *proc = process_get(pid);
     if (!proc) return -1;
 
-    if (proc->state != PROC_STATE_READY) {
+    // Another core may already have picked it up
+    if (proc->state != PROC_STATE_READY && proc->state != PROC_STATE_RUNNING) {
         printf("[PROC] Process %d not ready (state=%d)\n", pid, proc->state);
         return -1;
     }
@@ -285,14 +644,14 @@ void process_exit(int status) {
     // Disable IRQs during exit to prevent race with preemption
     asm volatile("msr daifset, #2" ::: "memory");
 
-    if (current_pid < 0) {
+    cpu_t *cpu = this_cpu();
+    process_t *proc = cpu->current;
+    if (!proc) {
         printf("[PROC] Exit called with no current process!\n");
         asm volatile("msr daifclr, #2" ::: "memory");
         return;
     }
 
-    int slot = current_pid;
-    process_t *proc = &proc_table[slot];
     printf("[PROC] Process '%s' (pid %d) exited with status %d\n",
            proc->name, proc->pid, status);
 
@@ -300,139 +659,209 @@ void process_exit(int status) {
     kill_children(proc->pid);
 
     proc->exit_status = status;
-    proc->state = PROC_STATE_ZOMBIE;
+
+    // Everything the program allocated goes in one step, leaked or not.
+    // Its code won't run again either, so the region can be reused.
+    arena_destroy(proc->arena);
+    proc->arena = NULL;
+    region_release(proc);
 
     // Free stack - but we're still on it! Don't free yet.
     // The stack will be freed when the slot is reused.
 
-    // Mark slot as free (simple cleanup for now)
+    // Mark slot as free and switch back to this core's kernel context.
+    // context_switch drops sched_lock once we're off the books, so nobody
+    // reuses the slot before our registers are saved.
+    // This MUST not return - it resumes in process_exec_args() or
+    // process_schedule(), wherever this core's kernel was waiting.
+    spin_lock(&sched_lock);
+    wake_waiter(proc);
     proc->state = PROC_STATE_FREE;
+    cpu->current = NULL;
+    ktimer_reprogram();
+    fpu_release(&proc->context);
+    fpu_switch(cpu->kernel_context);
+    context_switch(&proc->context, cpu->kernel_context, &sched_lock);
 
-    // We're done with this process - switch back to kernel context
-    // This MUST not return - we context switch away
-    current_pid = -1;
-    current_process = NULL;
+    // Should never reach here
+    printf("[PROC] ERROR: process_exit returned!\n");
+    while(1);
+}
 
-    // Debug: verify kernel_context before switching
-    printf("[PROC] Switching to kernel_context: pc=0x%lx sp=0x%lx pstate=0x%lx\n",
-           kernel_context.pc, kernel_context.sp, kernel_context.pstate);
+// Switch this core from 'old' to the best READY process, or to its kernel
+// thread if there is none. old must already be off the CPU's books:
+// re-queued, blocked or freed (or NULL for the kernel thread itself).
+// Called with sched_lock held and IRQs masked; always releases the lock.
+// Returns 0 without switching if old is NULL and nothing is ready.
+static int switch_away(cpu_t *cpu, process_t *old) {
+    process_t *next = ready_pop();
+
+    if (next && next == old) {
+        // It was re-queued and is still the best choice - keep running
+        old->state = PROC_STATE_RUNNING;
+        spin_unlock(&sched_lock);
+        return 1;
+    }
 
-    // Sanity check kernel_context
-    // Note: kernel code is in flash at 0x0, stack is near 0x5f000000
-    if (kernel_context.pc == 0 || kernel_context.sp == 0) {
-        printf("[PROC] ERROR: kernel_context appears corrupted!\n");
-        printf("[PROC] This indicates memory corruption during process execution\n");
-        while(1);  // Hang instead of crashing
+    if (next) {
+        next->state = PROC_STATE_RUNNING;
+        next->slice_ticks = 0;
+        cpu->current = next;
+        ktimer_reprogram();     // It may have competition - needs a tick
+        fpu_switch(&next->context);
+        // IRQs stay disabled - new process will enable them (entry_wrapper or return path)
+        context_switch(old ? &old->context : cpu->kernel_context, &next->context, &sched_lock);
+        return 1;
     }
 
-    // Switch directly back to kernel context
-    // This will resume in process_exec_args() or process_schedule()
-    // wherever the kernel was waiting
-    // IRQs will be re-enabled when kernel re-enables them
-    context_switch(&proc->context, &kernel_context);
+    if (old) {
+        cpu->current = NULL;
+        ktimer_reprogram();     // Idle - no tick
+        fpu_switch(cpu->kernel_context);
+        context_switch(&old->context, cpu->kernel_context, &sched_lock);
+        return 1;
+    }
 
-    // Should never reach here
-    printf("[PROC] ERROR: process_exit returned!\n");
-    while(1);
+    spin_unlock(&sched_lock);
+    return 0;
 }
 
-// Yield - voluntarily give up CPU
-void process_yield(void) {
-    if (current_pid >= 0) {
-        // Mark current process as ready
-        process_t *proc = &proc_table[current_pid];
-        proc->state = PROC_STATE_READY;
+// Called with sched_lock held before the current process gives up the CPU:
+// if another core killed it meanwhile, finish the job instead (unless it
+// still holds a mutex - then mutex_unlock comes back here)
+static void exit_if_killed(process_t *cur) {
+    if (cur && cur->kill_pending && !cur->mutexes_held) {
+        spin_unlock(&sched_lock);
+        asm volatile("msr daifclr, #2" ::: "memory");
+        process_exit(-1);
     }
-    // Always try to schedule - even from kernel context
-    // This lets programs started via process_exec() yield to spawned children
-    process_schedule();
 }
 
-// Simple round-robin scheduler (for voluntary transitions like process_exec)
-void process_schedule(void) {
+// Voluntary reschedule (yield, process_exec from the kernel thread)
+static void schedule(void) {
     // Disable IRQs during scheduling to prevent race with preemption
     asm volatile("msr daifset, #2" ::: "memory");
+    cpu_t *cpu = this_cpu();
+    process_t *old = cpu->current;
+
+    spin_lock(&sched_lock);
+    exit_if_killed(old);
+
+    if (!old) {
+        // Kernel thread: run a process if one is ready, else sleep until
+        // an interrupt or until ready_push signals new work (sev)
+        if (!switch_away(cpu, NULL)) {
+            asm volatile("msr daifclr, #2" ::: "memory");
+            asm volatile("wfe");
+            return;
+        }
+    } else if (ready_at_or_above(old->base_priority)) {
+        // Round-robin with its peers (anything better goes first)
+        old->priority = old->base_priority;
+        ready_push(old);
+        switch_away(cpu, old);
+    } else {
+        // Only lower-priority work is waiting, or none. A loop polling with
+        // yield would starve it, so get out of its way for a tick. Alone, it
+        // mustn't just wfi either: no tick is armed for a lone process, and
+        // device IRQs only go to core 0, so nothing might ever wake it.
+        old->priority = old->base_priority;
+        sleep_block(old, ktimer_now() + ktimer_tick_count());
+        switch_away(cpu, old);
+    }
 
-    int old_pid = current_pid;
-    process_t *old_proc = (old_pid >= 0) ? &proc_table[old_pid] : NULL;
+    // We return here when someone switches back to us (lock already released)
+    asm volatile("msr daifclr, #2" ::: "memory");  // Re-enable IRQs
+}
 
-    // Find next runnable process (round-robin)
-    int start = (old_pid >= 0) ? old_pid + 1 : 0;
-    int next = -1;
+// Yield - voluntarily give up CPU
+void process_yield(void) {
+    // Always try to schedule - even from kernel context
+    // This lets programs started via process_exec() yield to spawned children
+    schedule();
+}
 
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        int idx = (start + i) % MAX_PROCESSES;
-        if (proc_table[idx].state == PROC_STATE_READY) {
-            next = idx;
-            break;
-        }
-    }
+void process_schedule(void) {
+    reap_zombies();
+    schedule();
+}
 
-    if (next < 0) {
-        // No runnable processes
-        if (old_pid >= 0 && old_proc->state == PROC_STATE_RUNNING) {
-            // Current process still running, keep it
-            asm volatile("msr daifclr, #2" ::: "memory");  // Re-enable IRQs
+void process_sleep_until(uint64_t deadline) {
+    // Loop: a wakeup meant for a previous owner of the slot can come early
+    while (ktimer_now() < deadline) {
+        asm volatile("msr daifset, #2" ::: "memory");
+        cpu_t *cpu = this_cpu();
+        process_t *cur = cpu->current;
+        if (!cur) {
+            asm volatile("msr daifclr, #2" ::: "memory");
             return;
         }
-        // Return to kernel (if we were in a process, switch back to kernel)
-        if (old_pid >= 0) {
-            current_pid = -1;
-            current_process = NULL;
-            context_switch(&old_proc->context, &kernel_context);
-            // When we return here, IRQs will be re-enabled below
-        }
-        // Already in kernel with nothing to run - sleep until next interrupt
-        asm volatile("msr daifclr, #2" ::: "memory");  // Re-enable IRQs
-        asm volatile("wfi");
-        return;
+
+        spin_lock(&sched_lock);
+        exit_if_killed(cur);
+        cur->priority = cur->base_priority;
+        sleep_block(cur, deadline);
+        switch_away(cpu, cur);
+        asm volatile("msr daifclr, #2" ::: "memory");
     }
+}
 
-    if (next == old_pid && old_proc && old_proc->state == PROC_STATE_RUNNING) {
-        // Same process and it's running - nothing to switch
-        asm volatile("msr daifclr, #2" ::: "memory");  // Re-enable IRQs
+void process_wait_event(wait_queue_t *wq, volatile int *cond, uint64_t deadline) {
+    asm volatile("msr daifset, #2" ::: "memory");
+    cpu_t *cpu = this_cpu();
+    process_t *cur = cpu->current;
+    if (!cur) {
+        asm volatile("msr daifclr, #2" ::: "memory");
         return;
     }
 
-    if (next == old_pid && old_proc && old_proc->state == PROC_STATE_READY) {
-        // Process yielded but it's the only one - sleep until interrupt
-        old_proc->state = PROC_STATE_RUNNING;
-        asm volatile("msr daifclr, #2" ::: "memory");  // Re-enable IRQs
-        asm volatile("wfi");
+    spin_lock(&sched_lock);
+    exit_if_killed(cur);
+    // Checked under the lock: process_wake_all takes it too, so a wakeup
+    // can't slip in between the check and blocking
+    if (*cond || (deadline && ktimer_now() >= deadline)) {
+        spin_unlock(&sched_lock);
+        asm volatile("msr daifclr, #2" ::: "memory");
         return;
     }
 
-    // Switch to new process
-    process_t *new_proc = &proc_table[next];
-
-    if (old_proc && old_proc->state == PROC_STATE_RUNNING) {
-        old_proc->state = PROC_STATE_READY;
+    cur->wq = wq;
+    cur->wq_next = wq->head;
+    wq->head = cur;
+    cur->priority = cur->base_priority;
+    if (deadline) {
+        sleep_block(cur, deadline);
+    } else {
+        cur->state = PROC_STATE_BLOCKED;
     }
+    switch_away(cpu, cur);
+    asm volatile("msr daifclr, #2" ::: "memory");
+}
 
-    new_proc->state = PROC_STATE_RUNNING;
-    current_pid = next;
-    current_process = new_proc;
-
-    // Context switch!
-    // If old_pid == -1, we're switching FROM kernel context
-    // IRQs stay disabled - new process will enable them (entry_wrapper or return path)
-    cpu_context_t *old_ctx = (old_pid >= 0) ? &old_proc->context : &kernel_context;
-
-    // Debug: if switching from kernel, verify kernel_context after we return
-    int was_kernel = (old_pid < 0);
-
-    context_switch(old_ctx, &new_proc->context);
-
-    // We return here when someone switches back to us
-    // Verify kernel_context wasn't corrupted during process execution
-    if (was_kernel) {
-        if (kernel_context.pc < 0x40000000 || kernel_context.sp < 0x40000000) {
-            printf("[PROC] WARNING: kernel_context corrupted after process ran!\n");
-            printf("[PROC] pc=0x%lx sp=0x%lx\n", kernel_context.pc, kernel_context.sp);
+void process_wake_all(wait_queue_t *wq) {
+    uint64_t flags = spin_lock_irqsave(&sched_lock);
+    while (wq->head) {
+        process_t *p = wq->head;
+        if (p->state == PROC_STATE_BLOCKED) {
+            wake(p);            // Unlinks it
+        } else {
+            wq_remove(p);
         }
     }
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
 
-    asm volatile("msr daifclr, #2" ::: "memory");  // Re-enable IRQs
+int process_set_priority(int priority) {
+    if (priority < 0 || priority >= PROC_PRIORITIES) return -1;
+
+    uint64_t flags = spin_lock_irqsave(&sched_lock);
+    process_t *cur = this_cpu()->current;
+    if (cur) {
+        cur->base_priority = priority;
+        cur->priority = priority;
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+    return cur ? 0 : -1;
 }
 
 // Execute and wait - creates a real process and waits for it to finish
@@ -443,9 +872,6 @@ int process_exec_args(const char *path, int argc, char **argv) {
         return pid;  // Error already printed
     }
 
-    // Start it
-    process_start(pid);
-
     // Find the slot for this process
     int slot = -1;
     for (int i = 0; i < MAX_PROCESSES; i++) {
@@ -460,14 +886,58 @@ int process_exec_args(const char *path, int argc, char **argv) {
         return -1;
     }
 
-    // Wait for it to finish by yielding until it's done
-    // The process is READY, we need to run the scheduler to let it execute
-    while (proc_table[slot].state != PROC_STATE_FREE &&
-           proc_table[slot].state != PROC_STATE_ZOMBIE) {
-        process_schedule();
+    // Sign up for its exit status before it can run: by the time we see it
+    // gone, the slot (and exit_status with it) may belong to someone else
+    process_t *proc = &proc_table[slot];
+    process_t *self = process_current();
+    volatile int status = 0;
+    uint64_t flags = spin_lock_irqsave(&sched_lock);
+    if (self) {
+        proc->waiter = self;
+        self->wait_pid = pid;
+        self->child_status = 0;
+    } else {
+        proc->status_out = &status;
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+
+    // Start it
+    process_start(pid);
+
+    // Wait for it to finish. A process blocks until the child's exit wakes
+    // it; the kernel thread has no slot to block in, so it runs the
+    // scheduler until the child is gone (writing back dirty disk blocks
+    // when it's idle). A killed child gives its pid up.
+    while (proc->pid == pid &&
+           proc->state != PROC_STATE_FREE &&
+           proc->state != PROC_STATE_ZOMBIE) {
+        if (!self) {
+            process_schedule();
+            bcache_idle();
+            continue;
+        }
+
+        asm volatile("msr daifset, #2" ::: "memory");
+        spin_lock(&sched_lock);
+        exit_if_killed(self);
+        if (proc->pid == pid &&
+            proc->state != PROC_STATE_FREE &&
+            proc->state != PROC_STATE_ZOMBIE) {
+            proc->waiter = self;
+            self->wait_pid = pid;
+            self->state = PROC_STATE_BLOCKED;
+            self->priority = self->base_priority;
+            switch_away(this_cpu(), self);
+        } else {
+            spin_unlock(&sched_lock);
+        }
+        asm volatile("msr daifclr, #2" ::: "memory");
     }
 
-    int result = proc_table[slot].exit_status;
+    flags = spin_lock_irqsave(&sched_lock);
+    int result = self ? self->child_status : status;
+    if (self) self->wait_pid = 0;
+    spin_unlock_irqrestore(&sched_lock, flags);
     printf("[PROC] Process '%s' (pid %d) finished with status %d\n", path, pid, result);
     return result;
 }
@@ -477,73 +947,90 @@ int process_exec(const char *path) {
     return process_exec_args(path, 1, argv);
 }
 
-// Called from IRQ handler for preemptive scheduling
-// Just updates current_process - IRQ handler does the actual context switch
-void process_schedule_from_irq(void) {
-    // Check how many processes are ready to run
-    int ready_count = process_count_ready();
-
-    // If kernel is running (current_pid == -1), we should switch to ANY ready process
-    // If a process is running, we only switch if there's another ready process
-    if (current_pid >= 0 && ready_count <= 1) {
-        return;  // Only one process, no point switching
-    }
-    if (current_pid < 0 && ready_count == 0) {
-        return;  // Kernel running, no processes to switch to
+// Called from the timer IRQ on every core, for preemptive scheduling: on a
+// tick (tick=1), or when a kernel timer fired and may have woken someone.
+// Just updates this core's current process - IRQ handler does the actual
+// context switch (the old context is already saved, and the handler runs on
+// the per-core IRQ stack, so the old process is free to run elsewhere)
+void process_schedule_from_irq(int tick) {
+    cpu_t *cpu = this_cpu();
+    process_t *old = cpu->current;
+
+    spin_lock(&sched_lock);
+
+    // Killed by another core while it ran here. Its registers are saved and
+    // we're off its stack, so it can go now - unless it is inside a mutex.
+    // Only take it off the books: the memory is freed from process context.
+    if (old && old->kill_pending && !old->mutexes_held) {
+        fpu_release(&old->context);
+        wake_waiter(old);
+        old->state = PROC_STATE_ZOMBIE;
+        old->unreaped = 1;
+        unreaped++;
+        cpu->current = NULL;
+        old = NULL;
     }
 
-    // Find next runnable process (round-robin)
-    int old_slot = current_pid;
-    int start = (old_slot >= 0) ? old_slot + 1 : 0;
-
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        int idx = (start + i) % MAX_PROCESSES;
-        if (proc_table[idx].state == PROC_STATE_READY) {
-            // Found a different process to switch to
-            if (idx != old_slot) {
-                // Safety check: verify process has valid context
-                process_t *new_proc = &proc_table[idx];
-                if (new_proc->context.sp == 0 || new_proc->context.pc == 0) {
-                    continue;  // Skip invalid process
-                }
-
-                // Mark old process as ready (it was running)
-                if (old_slot >= 0 && proc_table[old_slot].state == PROC_STATE_RUNNING) {
-                    proc_table[old_slot].state = PROC_STATE_READY;
-                }
-
-                // Switch to new process
-                proc_table[idx].state = PROC_STATE_RUNNING;
-                current_pid = idx;
-                current_process = new_proc;
-
-                // Memory barrier to ensure current_process is visible to IRQ handler
-                asm volatile("dsb sy" ::: "memory");
-            }
-            return;
+    process_t *next = NULL;
+    if (old) {
+        // Switch when something better woke up, or when the slice is over
+        // and anyone else is waiting. Using a whole slice marks it as a CPU
+        // hog: it drops a level until it next blocks or yields.
+        old->slice_ticks += tick;
+        int expired = old->slice_ticks >= TIME_SLICE_TICKS;
+        if (expired) {
+            old->slice_ticks = 0;
+            if (old->priority < PRIO_LOW) old->priority++;
+        }
+        if (ready_above(old->priority) || (expired && ready_mask)) {
+            ready_push(old);
+            next = ready_pop();
         }
+    } else if (!cpu->mutexes_held) {
+        // Kernel thread runs whenever there's nothing else to - but don't
+        // switch away from it in the middle of a long locked operation
+        next = ready_pop();
     }
+
+    if (next && next != old) {
+        // Another core can pick old up once the lock drops - its FP
+        // registers must be in its context by then
+        if (old) fpu_save(&old->context);
+        next->state = PROC_STATE_RUNNING;
+        next->slice_ticks = 0;
+        cpu->current = next;
+    } else if (next) {
+        old->state = PROC_STATE_RUNNING;
+    }
+
+    spin_unlock(&sched_lock);
 }
 
 // Kill all children of a process (recursive)
 static void kill_children(int parent_pid) {
+    process_t *self = process_current();
+
     for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (proc_table[i].state != PROC_STATE_FREE &&
-            proc_table[i].parent_pid == parent_pid) {
-            int child_pid = proc_table[i].pid;
-            // First kill grandchildren recursively
-            kill_children(child_pid);
-            // Then kill this child (skip if it's current process)
-            if (i != current_pid) {
-                printf("[PROC] Killing child '%s' (pid %d, parent %d)\n",
-                       proc_table[i].name, child_pid, parent_pid);
-                if (proc_table[i].stack_base) {
-                    free(proc_table[i].stack_base);
-                    proc_table[i].stack_base = NULL;
-                }
-                proc_table[i].state = PROC_STATE_FREE;
-                proc_table[i].pid = 0;
-            }
+        process_t *child = &proc_table[i];
+
+        uint64_t flags = spin_lock_irqsave(&sched_lock);
+        if (child == self || child->pid == 0 ||
+            child->state == PROC_STATE_FREE || child->state == PROC_STATE_ZOMBIE ||
+            child->parent_pid != parent_pid) {
+            spin_unlock_irqrestore(&sched_lock, flags);
+            continue;
+        }
+        int child_pid = child->pid;
+        int reap_now = claim_for_kill(child);
+        spin_unlock_irqrestore(&sched_lock, flags);
+
+        // First kill grandchildren recursively
+        kill_children(child_pid);
+
+        printf("[PROC] Killing child '%s' (pid %d, parent %d)\n",
+               child->name, child_pid, parent_pid);
+        if (reap_now) {
+            reap(child);
         }
     }
 }
@@ -557,41 +1044,44 @@ int process_kill(int pid) {
     }
 
     // Find the process
-    int slot = -1;
+    process_t *proc = NULL;
+    uint64_t flags = spin_lock_irqsave(&sched_lock);
     for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (proc_table[i].pid == pid && proc_table[i].state != PROC_STATE_FREE) {
-            slot = i;
+        if (proc_table[i].pid == pid &&
+            proc_table[i].state != PROC_STATE_FREE &&
+            proc_table[i].state != PROC_STATE_ZOMBIE) {
+            proc = &proc_table[i];
             break;
         }
     }
 
-    if (slot < 0) {
+    if (!proc) {
+        spin_unlock_irqrestore(&sched_lock, flags);
         printf("[PROC] Process %d not found\n", pid);
         return -1;
     }
 
-    process_t *proc = &proc_table[slot];
-
     // Don't allow killing the current process this way - use exit() instead
-    if (slot == current_pid) {
+    if (proc == this_cpu()->current) {
+        spin_unlock_irqrestore(&sched_lock, flags);
         printf("[PROC] Cannot kill current process (use exit)\n");
         return -1;
     }
 
+    int reap_now = claim_for_kill(proc);
+    spin_unlock_irqrestore(&sched_lock, flags);
+
     printf("[PROC] Killing process '%s' (pid %d)\n", proc->name, pid);
 
     // First kill all children of this process
     kill_children(pid);
 
-    // Free the process memory
-    if (proc->stack_base) {
-        free(proc->stack_base);
-        proc->stack_base = NULL;
+    // Free the process memory (stack and whole heap arena) and the slot.
+    // One running on another core is unlinked by that core and freed by
+    // the next reap_zombies.
+    if (reap_now) {
+        reap(proc);
     }
 
-    // Mark slot as free
-    proc->state = PROC_STATE_FREE;
-    proc->pid = 0;
-
     return 0;
 }
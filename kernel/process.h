@@ -2,7 +2,13 @@
  * KikiOS Process Management
  *
  * Preemptive multitasking - timer IRQ forces context switches.
- * Processes get 200ms time slices (100Hz timer, preempt every 20 ticks).
+ * Processes get 200ms time slices (20 ticks of 10ms). A core only ticks
+ * while its process has something to be preempted for.
+ * Every core runs the same scheduler over the one process table.
+ *
+ * Runnable processes wait in per-priority FIFO queues (a bitmap says which
+ * are non-empty), sleeping ones on a kernel timer, so picking the next
+ * process costs the same however many slots there are.
  */
 
 #ifndef PROCESS_H
@@ -10,17 +16,27 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "spinlock.h"
+#include "ktimer.h"
 
 #define PROCESS_NAME_MAX 32
 #define PROCESS_STACK_SIZE 0x100000  // 1MB per process (TLS crypto needs lots of stack)
-#define MAX_PROCESSES 16
+#define MAX_PROCESSES 64
+
+// Scheduling priorities (lower runs first)
+#define PRIO_HIGH        0   // Interactive: desktop, terminal
+#define PRIO_NORMAL      1   // Default
+#define PRIO_LOW         2   // Ran a whole time slice without giving up the CPU
+#define PROC_PRIORITIES  3
+
+#define TIME_SLICE_TICKS 20  // 200ms at 100Hz
 
 // Process states
 typedef enum {
     PROC_STATE_FREE = 0,     // Slot available
     PROC_STATE_READY,        // Ready to run
     PROC_STATE_RUNNING,      // Currently executing
-    PROC_STATE_BLOCKED,      // Waiting for something
+    PROC_STATE_BLOCKED,      // Sleeping, or waiting for a child to exit
     PROC_STATE_ZOMBIE        // Exited, waiting to be cleaned up
 } proc_state_t;
 
@@ -32,12 +48,20 @@ typedef struct {
     uint64_t sp;         // Stack pointer
     uint64_t pc;         // Program counter (elr_el1)
     uint64_t pstate;     // Processor state (spsr_el1)
-    // FPU state
+    // FPU state - only loaded once the context uses FP (fpu.c)
     uint64_t fpcr;
     uint64_t fpsr;
     uint64_t fp_regs[64];  // q0-q31 (each 128-bit = 2 x 64-bit)
 } __attribute__((aligned(16))) cpu_context_t;
 
+// Processes blocked until some event (a disk request finishing, data
+// arriving). Whoever makes the event happen calls process_wake_all.
+typedef struct wait_queue {
+    struct process *head;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { NULL }
+
 typedef struct process {
     int pid;
     char name[PROCESS_NAME_MAX];
@@ -53,9 +77,33 @@ typedef struct process {
     uint64_t entry;           // Entry point
     cpu_context_t context;    // Saved registers for context switch
 
+    // Heap (after context - vectors.S hardcodes the context offset)
+    struct arena *arena;      // Private heap for api->malloc, freed on exit
+    uint64_t region_size;     // Program region at load_base (0 = none)
+    struct image *image;      // Cached image the code is shared from (imgcache.h)
+    struct mapping *mappings; // Files it has mapped (pagecache.h)
+
     // Exit
     int exit_status;
-    int parent_pid;           // Who spawned us
+    int parent_pid;           // Who spawned us (0 = kernel)
+    volatile int kill_pending;  // Killed while running on another core
+    int unreaped;             // ZOMBIE unlinked by the timer IRQ, not yet freed
+    int mutexes_held;         // Kernel mutexes held; a kill waits for 0
+
+    // Scheduling (all under the scheduler lock)
+    int priority;             // Queue it runs from (base, or lower after using a full slice)
+    int base_priority;        // What it returns to after blocking or yielding
+    int slice_ticks;          // Ticks run since it was last picked
+    int sleeping;             // Blocked until sleep_timer fires
+    ktimer_t sleep_timer;
+    int wait_pid;             // Blocked until this child exits
+    int child_status;         // wait_pid's exit status, once it has exited
+    struct process *waiter;   // Process blocked in exec waiting for us
+    volatile int *status_out; // Where the kernel thread waiting for us wants our status
+    wait_queue_t *wq;         // Blocked on this wait queue
+    struct process *wq_next;
+    struct process *q_next;   // Ready queue links
+    struct process *q_prev;
 } process_t;
 
 // Initialize process subsystem
@@ -75,28 +123,50 @@ int process_exec_args(const char *path, int argc, char **argv);
 void process_exit(int status);
 
 // Get current/specific process
-process_t *process_current(void);
+process_t *process_current(void);  // On this core (NULL if kernel)
 process_t *process_get(int pid);
 
-// Current running process (NULL if kernel)
-extern process_t *current_process;
-
-// Get pointer to current_process pointer (for assembly IRQ handler)
-process_t **process_get_current_ptr(void);
-
 // Scheduling
 void process_yield(void);              // Give up CPU voluntarily
 void process_schedule(void);           // Pick next process to run
-void process_schedule_from_irq(void);  // Called from timer IRQ for preemption
+void process_schedule_from_irq(int tick);  // From the timer IRQ (tick: a tick elapsed)
 int process_count_ready(void);         // Count runnable processes
 
+// Block the current process until the counter reaches deadline (ktimer_now)
+// (returns at once if called from the kernel thread)
+void process_sleep_until(uint64_t deadline);
+
+// Block the current process on wq until *cond is non-zero, it is woken, or
+// the deadline passes (0 = none). Spurious returns are possible - callers
+// re-check their condition in a loop. Returns at once from the kernel thread.
+void process_wait_event(wait_queue_t *wq, volatile int *cond, uint64_t deadline);
+
+// Make every process blocked on wq runnable (safe from IRQ handlers)
+void process_wake_all(wait_queue_t *wq);
+
+// Set the current process's priority (PRIO_*). Returns 0, or -1 if invalid.
+int process_set_priority(int priority);
+
 // Context switch (implemented in assembly)
-void context_switch(cpu_context_t *old_ctx, cpu_context_t *new_ctx);
+// Releases 'unlock' (if not NULL) once old_ctx is fully saved, so another
+// core can't pick the old process up while it is still being switched out
+void context_switch(cpu_context_t *old_ctx, cpu_context_t *new_ctx, spinlock_t *unlock);
 
 // Get info about process by index (for sysmon)
 // Returns 1 if slot is active, 0 if free
 int process_get_info(int index, char *name, int name_size, int *state);
 
+// Allocate from the arena of the program that called (kapi malloc)
+void *process_malloc(size_t size);
+
+// Heap bytes in use by the process in a slot (for sysmon/ps)
+size_t process_get_mem(int index);
+
+// Reserve/free a region of the program area for something other than a
+// program (file mappings). Returns 0 if no gap is big enough.
+uint64_t process_region_alloc(uint64_t size);
+void process_region_free(uint64_t base, uint64_t size);
+
 // Kill a process by PID
 // Returns 0 on success, -1 if not found or cannot kill
 int process_kill(int pid);
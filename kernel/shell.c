@@ -15,6 +15,8 @@
 #include "process.h"
 #include "klog.h"
 #include "memory.h"
+#include "membench.h"
+#include "iobench.h"
 #include <stddef.h>
 
 #ifdef TARGET_PI
@@ -270,12 +272,16 @@ void shell_run(void) {
                     free(log_buf);
                 }
             }
+        } else if (strcmp(cmd, "membench") == 0) {
+            membench_run();
+        } else if (strcmp(cmd, "iobench") == 0) {
+            iobench_run();
 #ifdef TARGET_PI
         } else if (strcmp(cmd, "usbstats") == 0) {
             usb_hid_print_stats();
 #endif
         } else if (pos > 0) {
-            console_puts("Unknown command. Try 'gui', 'kikish', 'dmesg', or 'reboot'.\n");
+            console_puts("Unknown command. Try 'gui', 'kikish', 'dmesg', 'membench', 'iobench', or 'reboot'.\n");
         }
     }
 }
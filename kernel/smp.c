@@ -0,0 +1,230 @@
+/*
+ * KikiOS Multi-core Support
+ *
+ * Bring-up: the boot code parks every core but 0 (QEMU: in boot.S, Pi: in
+ * the firmware's spin table). smp_init hands each one a stack and tells the
+ * platform to release it at secondary_entry. The core drops to EL1, turns on
+ * its MMU with the boot core's page tables, sets up its own GIC CPU
+ * interface / local timer and then sits in an idle loop that runs whatever
+ * process the scheduler gives it. Its timer only ticks while it has a
+ * process to preempt.
+ */
+
+#include "smp.h"
+#include "bcache.h"
+#include "mmu.h"
+#include "fpu.h"
+#include "irq.h"
+#include "printf.h"
+#include "hal/hal.h"
+
+#define CPU_STACK_SIZE  0x4000   // 16KB - idle loop and IRQs, never process code
+#define BOOT_TIMEOUT_US 100000
+
+cpu_t cpus[MAX_CPUS];
+
+// Read by the boot code with the MMU off - cleaned to RAM before release
+uint64_t smp_boot_stack[MAX_CPUS];
+
+// Boot entry in boot.S / boot-pi.S
+extern void secondary_entry(void);
+
+static cpu_context_t kernel_contexts[MAX_CPUS];
+static uint8_t boot_stacks[MAX_CPUS][CPU_STACK_SIZE] __attribute__((aligned(64)));
+static uint8_t irq_stacks[MAX_CPUS][CPU_STACK_SIZE] __attribute__((aligned(64)));
+static int online_count = 1;
+static volatile int locking = 0;    // rlock_t does real locking
+
+static void cpu_setup(int id) {
+    cpu_t *cpu = &cpus[id];
+    cpu->id = id;
+    cpu->current = NULL;
+    cpu->kernel_context = &kernel_contexts[id];
+    cpu->irq_stack_top = (uint64_t)irq_stacks[id] + CPU_STACK_SIZE;
+    cpu->ticks = 0;
+    cpu->next_tick = 0;
+    cpu->mutexes_held = 0;
+    cpu->fp_owner = NULL;
+    cpu->fp_traps = 0;
+}
+
+void smp_early_init(void) {
+    cpu_setup(0);
+    cpus[0].online = 1;
+    asm volatile("msr tpidr_el1, %0" :: "r"(&cpus[0]) : "memory");
+    fpu_init_cpu();
+}
+
+int smp_cpu_count(void) {
+    return online_count;
+}
+
+// C entry for a secondary core, called from boot code on its own stack.
+// The MMU and caches are still off: nothing here may read data the boot core
+// could be holding dirty in its cache until mmu_init_secondary has run.
+void smp_secondary_main(int id) {
+    mmu_init_secondary();
+
+    cpu_t *cpu = &cpus[id];
+    asm volatile("msr tpidr_el1, %0" :: "r"(cpu) : "memory");
+    fpu_init_cpu();
+
+    hal_irq_init_cpu();
+    hal_timer_init_cpu();
+
+    asm volatile("dmb ish" ::: "memory");
+    cpu->online = 1;
+
+    // Idle loop: process_schedule runs anything READY, or sleeps until a
+    // process is queued (or an interrupt). No tick is programmed while idle.
+    // This core's kernel_context is saved here. Idle time is also when
+    // dirty disk blocks get written back.
+    while (1) {
+        process_schedule();
+        bcache_idle();
+    }
+}
+
+void smp_init(void) {
+    int want = hal_get_cpu_cores();
+    if (want > MAX_CPUS) want = MAX_CPUS;
+
+    // Spinlocks need exclusive access to cacheable memory
+    if (!mmu_dcache_enabled()) {
+        printf("[SMP] MMU off - running on one core\n");
+        return;
+    }
+
+    locking = 1;
+    asm volatile("dmb ish" ::: "memory");
+
+    for (int id = 1; id < want; id++) {
+        cpu_setup(id);
+
+        // Leave a cache line of slack at the top: the core writes its stack
+        // uncached until its MMU is on, and must not share a line with
+        // anything this core touches
+        smp_boot_stack[id] = ((uint64_t)boot_stacks[id] + CPU_STACK_SIZE - 64) & ~63ULL;
+        dcache_invalidate_range(boot_stacks[id], CPU_STACK_SIZE);
+        dcache_clean_range(&smp_boot_stack[id], sizeof(uint64_t));
+        dcache_clean_range(&cpus[id], sizeof(cpu_t));
+
+        if (hal_cpu_start(id, secondary_entry) < 0) {
+            printf("[SMP] CPU %d: no way to start it\n", id);
+            continue;
+        }
+
+        // One at a time, so their boot paths never overlap
+        uint32_t start = hal_get_time_us();
+        while (!cpus[id].online && hal_get_time_us() - start < BOOT_TIMEOUT_US) {
+            asm volatile("yield");
+        }
+
+        if (cpus[id].online) {
+            online_count++;
+        } else {
+            printf("[SMP] CPU %d did not come up\n", id);
+        }
+    }
+
+    printf("[SMP] %d of %d cores online\n", online_count, want);
+}
+
+// Mask IRQs, and take the lock once other cores could be contending
+static uint64_t guard_lock(spinlock_t *lock) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif\n msr daifset, #2" : "=r"(flags) :: "memory");
+    if (locking) spin_lock(lock);
+    return flags;
+}
+
+static void guard_unlock(spinlock_t *lock, uint64_t flags) {
+    spin_unlock(lock);
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
+void rlock_acquire(rlock_t *l) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif\n msr daifset, #2" : "=r"(flags) :: "memory");
+
+    // Only this core ever writes our id into owner, so this read is safe
+    int id = smp_cpu_id();
+    if (l->owner != id) {
+        if (locking) spin_lock(&l->lock);
+        l->owner = id;
+        l->flags = flags;
+    }
+    l->depth++;
+}
+
+void rlock_release(rlock_t *l) {
+    if (--l->depth > 0) return;
+
+    uint64_t flags = l->flags;
+    l->owner = -1;
+    spin_unlock(&l->lock);
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
+void mutex_lock(mutex_t *m) {
+    // Processes migrate between cores, so the owner is the process itself;
+    // kernel threads never migrate, so for them it's the core
+    while (1) {
+        uint64_t flags = guard_lock(&m->lock);
+        cpu_t *cpu = this_cpu();
+        process_t *proc = cpu->current;
+        void *self = proc ? (void *)proc : (void *)cpu;
+
+        if (!m->owner || m->owner == self) {
+            if (!m->owner) {
+                if (proc) proc->mutexes_held++;
+                else cpu->mutexes_held++;
+            }
+            m->owner = self;
+            m->owner_pid = proc ? proc->pid : 0;
+            m->depth++;
+            guard_unlock(&m->lock, flags);
+            return;
+        }
+        guard_unlock(&m->lock, flags);
+        process_yield();
+    }
+}
+
+int mutex_trylock(mutex_t *m) {
+    uint64_t flags = guard_lock(&m->lock);
+    cpu_t *cpu = this_cpu();
+    process_t *proc = cpu->current;
+    void *self = proc ? (void *)proc : (void *)cpu;
+
+    int taken = !m->owner || m->owner == self;
+    if (taken) {
+        if (!m->owner) {
+            if (proc) proc->mutexes_held++;
+            else cpu->mutexes_held++;
+        }
+        m->owner = self;
+        m->owner_pid = proc ? proc->pid : 0;
+        m->depth++;
+    }
+    guard_unlock(&m->lock, flags);
+    return taken;
+}
+
+void mutex_unlock(mutex_t *m) {
+    process_t *killed = NULL;
+    uint64_t flags = guard_lock(&m->lock);
+    if (--m->depth == 0) {
+        if (!m->owner_pid) {
+            this_cpu()->mutexes_held--;
+        } else {
+            process_t *proc = m->owner;
+            if (--proc->mutexes_held == 0 && proc->kill_pending) killed = proc;
+        }
+        m->owner = NULL;
+    }
+    guard_unlock(&m->lock, flags);
+
+    // A kill that waited for us to finish: the yield takes us out
+    if (killed) process_yield();
+}
@@ -0,0 +1,95 @@
+/*
+ * KikiOS Multi-core Support
+ *
+ * Secondary cores are parked by the boot code (or firmware on the Pi) until
+ * smp_init releases them. Each core then runs its own idle loop, timer tick
+ * and scheduler; processes in proc_table run on whichever core picks them.
+ */
+
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include "process.h"
+#include "spinlock.h"
+
+#define MAX_CPUS 4
+
+// Per-core state. TPIDR_EL1 points at this core's entry.
+// vectors.S reads the first three fields - keep their offsets.
+typedef struct cpu {
+    process_t *current;             // 0x00: Running process (NULL = kernel)
+    cpu_context_t *kernel_context;  // 0x08: This core's kernel thread
+    uint64_t irq_stack_top;         // 0x10: Stack for IRQs taken from a process
+    int id;
+    volatile int online;
+    uint64_t ticks;                 // Local timer ticks
+    uint64_t next_tick;             // Counter value of the next tick, 0 = tickless
+    int mutexes_held;               // By the kernel thread (not preemptible then)
+    cpu_context_t *fp_owner;        // Whose FP registers are live here (fpu.c)
+    int in_irq;                     // In handle_irq (FP traps give scratch registers)
+    uint64_t fp_traps;              // Lazy FP restores on this core
+} cpu_t;
+
+extern cpu_t cpus[MAX_CPUS];
+
+static inline cpu_t *this_cpu(void) {
+    cpu_t *cpu;
+    asm volatile("mrs %0, tpidr_el1" : "=r"(cpu));
+    return cpu;
+}
+
+static inline int smp_cpu_id(void) {
+    uint64_t mpidr;
+    asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+    return mpidr & 0xFF;
+}
+
+// Set up the boot core's per-CPU state (first thing in kernel_main)
+void smp_early_init(void);
+
+// Release the secondary cores (after the MMU, IRQs and process table are up)
+void smp_init(void);
+
+// Number of cores running the scheduler
+int smp_cpu_count(void);
+
+/*
+ * Spinlock the owning core may take again - for code that calls back into
+ * itself (malloc from arena_grow, printf from a fault handler). IRQs stay
+ * masked while it is held. Does no atomics until smp_init starts the other
+ * cores, so it is safe long before the MMU is on.
+ */
+typedef struct {
+    spinlock_t lock;
+    volatile int owner;     // Core id, -1 = free
+    int depth;
+    uint64_t flags;         // DAIF from the outermost acquire
+} rlock_t;
+
+#define RLOCK_INIT { SPINLOCK_INIT, -1, 0, 0 }
+
+void rlock_acquire(rlock_t *l);
+void rlock_release(rlock_t *l);
+
+/*
+ * Sleeping lock for long operations (filesystem, disk I/O).
+ * Recursive for the process (or kernel thread) holding it; other callers
+ * yield the CPU until it is released instead of spinning. A process holding
+ * one can't be killed: the kill waits until it has let go of them all, so
+ * nobody ever sees the half-finished update it was protecting.
+ */
+typedef struct {
+    spinlock_t lock;
+    void *owner;        // process_t or cpu_t
+    int owner_pid;      // 0 for a kernel thread
+    int depth;
+} mutex_t;
+
+#define MUTEX_INIT { SPINLOCK_INIT, 0, 0, 0 }
+
+void mutex_lock(mutex_t *m);
+int mutex_trylock(mutex_t *m);   // 1 if taken, 0 if somebody else holds it
+void mutex_unlock(mutex_t *m);
+
+#endif
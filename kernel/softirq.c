@@ -0,0 +1,44 @@
+/*
+ * KikiOS Softirqs
+ *
+ * Pending softirqs are a bitmask any core can set. The first core to get
+ * to softirq_run on its way out of an IRQ takes run_lock and runs handlers
+ * until nothing is pending; a core that finds the lock taken just leaves,
+ * since the owner re-checks the mask before letting go.
+ */
+
+#include "softirq.h"
+#include "spinlock.h"
+
+static softirq_fn_t handlers[SOFTIRQ_MAX];
+static volatile uint32_t pending = 0;
+static spinlock_t run_lock = SPINLOCK_INIT;
+
+void softirq_register(int nr, softirq_fn_t fn) {
+    if (nr >= 0 && nr < SOFTIRQ_MAX) {
+        handlers[nr] = fn;
+    }
+}
+
+void softirq_raise(int nr) {
+    __atomic_or_fetch(&pending, 1u << nr, __ATOMIC_SEQ_CST);
+}
+
+void softirq_run(void) {
+    while (pending) {
+        if (!spin_trylock(&run_lock)) return;
+
+        uint32_t todo;
+        while ((todo = __atomic_exchange_n(&pending, 0, __ATOMIC_SEQ_CST)) != 0) {
+            for (int nr = 0; nr < SOFTIRQ_MAX; nr++) {
+                if ((todo & (1u << nr)) && handlers[nr]) {
+                    handlers[nr]();
+                }
+            }
+        }
+
+        // Raised after the last exchange but before the unlock, while
+        // another core gave up on the lock: go round again for it
+        spin_unlock(&run_lock);
+    }
+}
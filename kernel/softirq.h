@@ -0,0 +1,29 @@
+/*
+ * KikiOS Softirqs
+ *
+ * Deferred work for interrupt handlers. A handler does the minimum (ack the
+ * device), raises a softirq and returns; the work runs at the end of
+ * handle_irq, after EOI. Softirqs run with IRQs still masked, and a given
+ * softirq never runs on two cores at once, so its handler only has to lock
+ * against process context.
+ */
+
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#define SOFTIRQ_NET     0   // Network receive, TCP timers (net.c)
+#define SOFTIRQ_MAX     8
+
+typedef void (*softirq_fn_t)(void);
+
+// Set the handler for softirq nr
+void softirq_register(int nr, softirq_fn_t fn);
+
+// Mark nr pending. Safe from IRQ handlers and ktimer callbacks; from
+// process context it runs at the next interrupt.
+void softirq_raise(int nr);
+
+// Run pending softirqs (handle_irq, on the way out)
+void softirq_run(void);
+
+#endif
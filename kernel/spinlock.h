@@ -0,0 +1,66 @@
+/*
+ * KikiOS Spinlocks
+ *
+ * Short critical sections shared between cores. Exclusive loads/stores only
+ * work on cacheable memory, so these need the MMU on (mmu_init).
+ */
+
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock(spinlock_t *lock) {
+    uint32_t tmp;
+    // Waiters sleep in wfe; the unlocking store clears their exclusive
+    // monitor, which is the event that wakes them
+    asm volatile(
+        "    sevl\n"
+        "1:  wfe\n"
+        "2:  ldaxr   %w0, [%1]\n"
+        "    cbnz    %w0, 1b\n"
+        "    stxr    %w0, %w2, [%1]\n"
+        "    cbnz    %w0, 2b\n"
+        : "=&r"(tmp)
+        : "r"(&lock->locked), "r"(1)
+        : "memory");
+}
+
+static inline int spin_trylock(spinlock_t *lock) {
+    uint32_t tmp;
+    asm volatile(
+        "    ldaxr   %w0, [%1]\n"
+        "    cbnz    %w0, 1f\n"
+        "    stxr    %w0, %w2, [%1]\n"
+        "1:\n"
+        : "=&r"(tmp)
+        : "r"(&lock->locked), "r"(1)
+        : "memory");
+    return tmp == 0;
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    asm volatile("stlr wzr, [%0]" :: "r"(&lock->locked) : "memory");
+}
+
+// Lock with IRQs masked on this core (for data an IRQ handler also touches).
+// Returns the previous DAIF value for spin_unlock_irqrestore.
+static inline uint64_t spin_lock_irqsave(spinlock_t *lock) {
+    uint64_t flags;
+    asm volatile("mrs %0, daif\n msr daifset, #2" : "=r"(flags) :: "memory");
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint64_t flags) {
+    spin_unlock(lock);
+    asm volatile("msr daif, %0" :: "r"(flags) : "memory");
+}
+
+#endif
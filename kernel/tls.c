@@ -73,9 +73,6 @@ static inline unsigned int load_u32_unaligned(const void *ptr) {
 #include "net.h"
 #include "tls.h"
 
-// Forward declaration
-extern void sleep_ms(uint32_t ms);
-
 // Forward declarations for kernel functions
 extern void uart_puts(const char *s);
 extern unsigned long timer_get_ticks(void);
@@ -232,19 +229,16 @@ int tls_connect(uint32_t ip, uint16_t port, const char *hostname) {
         uart_puts("[TLS] No ClientHello generated!\r\n");
     }
 
-    // Handshake loop - increased timeout for slow connections
+    // Handshake loop - generous timeout for slow connections
     unsigned char recv_buf[4096];
-    int max_rounds = 500;  // Increased from 50 to 500 (5 seconds total)
-    int empty_rounds = 0;  // Track consecutive empty receives
+    uint64_t deadline = timer_get_uptime_us() + 5000000;  // 5 seconds total
 
     uart_puts("[TLS] Starting handshake...\r\n");
 
-    while (!tls_established(ctx) && max_rounds-- > 0) {
-        net_poll();
-
-        int recv_len = tcp_recv(tcp, recv_buf, sizeof(recv_buf));
+    while (!tls_established(ctx) && timer_get_uptime_us() < deadline) {
+        // Sleeps until the server sends something
+        int recv_len = tcp_recv_timeout(tcp, recv_buf, sizeof(recv_buf), 2000);
         if (recv_len > 0) {
-            empty_rounds = 0;  // Reset empty counter on data
             // Print received length
             uart_puts("[TLS] Got ");
             char lbuf[16];
@@ -325,18 +319,10 @@ int tls_connect(uint32_t ip, uint16_t port, const char *hostname) {
             tls_sockets[slot].ctx = NULL;
             return -1;
         } else {
-            // No data received
-            empty_rounds++;
-            // If we've had too many empty rounds after sending, the server might not be responding
-            if (empty_rounds > 200) {  // 2 seconds with no data
-                uart_puts("[TLS] No response from server\r\n");
-                break;
-            }
+            // 2 seconds with no data, the server isn't responding
+            uart_puts("[TLS] No response from server\r\n");
+            break;
         }
-
-        // Small delay - poll network more frequently
-        sleep_ms(10);
-        net_poll();  // Additional poll
     }
 
     if (!tls_established(ctx)) {
@@ -371,7 +357,7 @@ int tls_send(int sock, const void *data, uint32_t len) {
     return len;
 }
 
-int tls_recv(int sock, void *buf, uint32_t maxlen) {
+int tls_recv_timeout(int sock, void *buf, uint32_t maxlen, int timeout_ms) {
     if (sock < 0 || sock >= MAX_TLS_SOCKETS) return -1;
     tls_socket_internal_t *s = &tls_sockets[sock];
     if (!s->ctx || s->closed) return -1;
@@ -380,12 +366,24 @@ int tls_recv(int sock, void *buf, uint32_t maxlen) {
     int decrypted = tls_read(s->ctx, buf, maxlen);
     if (decrypted > 0) return decrypted;
 
-    net_poll();
-
     unsigned char recv_buf[4096];
-    int recv_len = tcp_recv(s->tcp_sock, recv_buf, sizeof(recv_buf));
+    uint64_t deadline = timeout_ms < 0 ? 0 : timer_get_uptime_us() + (uint64_t)timeout_ms * 1000;
+
+    // A record can come in several pieces: keep going until one is whole
+    while (1) {
+        int wait = timeout_ms;
+        if (timeout_ms > 0) {
+            uint64_t now = timer_get_uptime_us();
+            wait = now < deadline ? (int)((deadline - now + 999) / 1000) : 0;
+        }
+
+        int recv_len = tcp_recv_timeout(s->tcp_sock, recv_buf, sizeof(recv_buf), wait);
+        if (recv_len < 0) {
+            s->closed = 1;
+            return -1;
+        }
+        if (recv_len == 0) return 0;  // Timed out
 
-    if (recv_len > 0) {
         int consumed = tls_consume_stream(s->ctx, recv_buf, recv_len, NULL);
         if (consumed < 0) { s->closed = 1; return -1; }
 
@@ -398,12 +396,11 @@ int tls_recv(int sock, void *buf, uint32_t maxlen) {
 
         decrypted = tls_read(s->ctx, buf, maxlen);
         if (decrypted > 0) return decrypted;
-    } else if (recv_len < 0) {
-        s->closed = 1;
-        return -1;
     }
+}
 
-    return 0;
+int tls_recv(int sock, void *buf, uint32_t maxlen) {
+    return tls_recv_timeout(sock, buf, maxlen, 0);
 }
 
 void tls_close(int sock) {
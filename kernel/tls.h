@@ -28,6 +28,10 @@ int tls_send(int sock, const void *data, uint32_t len);
 // Returns: bytes received, 0 if no data yet, -1 on error/closed
 int tls_recv(int sock, void *buf, uint32_t maxlen);
 
+// Receive data, waiting up to timeout_ms (< 0: no limit) for a whole record
+// Returns: bytes received, 0 on timeout, -1 on error/closed
+int tls_recv_timeout(int sock, void *buf, uint32_t maxlen, int timeout_ms);
+
 // Close TLS connection
 void tls_close(int sock);
 
@@ -184,12 +184,17 @@ void vfs_init(void) {
     printf("[VFS] %s, cwd=%s\n", use_fat32 ? "FAT32" : "in-memory", cwd_path);
 }
 
+// FAT32 lookups hand out nodes from a small ring, so callers on other cores
+// don't overwrite each other's result before they've used it
+#define LOOKUP_NODES 8
+static vfs_node_t lookup_nodes[LOOKUP_NODES];
+static char lookup_paths[LOOKUP_NODES][VFS_MAX_PATH];
+static uint32_t lookup_next = 0;
+
 // Resolve a path to a node (returns static/cached node - do NOT free)
-// For FAT32, returns a static temp node
+// For FAT32, returns a temp node that stays valid for the next few lookups
 // For in-memory, returns the actual node
 vfs_node_t *vfs_lookup(const char *path) {
-    static vfs_node_t temp_node;
-    static char stored_path[VFS_MAX_PATH];
     char fullpath[VFS_MAX_PATH];
 
     // Build full path
@@ -244,7 +249,9 @@ vfs_node_t *vfs_lookup(const char *path) {
         }
 
         // Use static node for lookup (not for file handles!)
-        memset(&temp_node, 0, sizeof(temp_node));
+        uint32_t slot = __atomic_fetch_add(&lookup_next, 1, __ATOMIC_RELAXED) % LOOKUP_NODES;
+        vfs_node_t *node = &lookup_nodes[slot];
+        memset(node, 0, sizeof(*node));
 
         // Extract name from path
         char *last_slash = NULL;
@@ -252,21 +259,21 @@ vfs_node_t *vfs_lookup(const char *path) {
             if (*p == '/') last_slash = p;
         }
         if (last_slash && last_slash[1]) {
-            strncpy(temp_node.name, last_slash + 1, VFS_MAX_NAME - 1);
+            strncpy(node->name, last_slash + 1, VFS_MAX_NAME - 1);
         } else {
-            strcpy(temp_node.name, "/");
+            strcpy(node->name, "/");
         }
 
-        temp_node.type = is_dir ? VFS_DIRECTORY : VFS_FILE;
+        node->type = is_dir ? VFS_DIRECTORY : VFS_FILE;
         if (!is_dir) {
-            temp_node.size = fat32_file_size(normalized);
+            node->size = fat32_file_size(normalized);
         }
 
         // Store path in static buffer
-        strcpy(stored_path, normalized);
-        temp_node.data = stored_path;
+        strcpy(lookup_paths[slot], normalized);
+        node->data = lookup_paths[slot];
 
-        return &temp_node;
+        return node;
     } else {
         return mem_lookup(normalized);
     }
@@ -294,12 +301,19 @@ vfs_node_t *vfs_open_handle(const char *path) {
         node->data = path_copy;
     }
 
+    // Files get a FAT32 open file, so reads carry on where the last one
+    // ended instead of resolving the path and walking the chain each time
+    if (use_fat32 && node->type == VFS_FILE) {
+        node->fat_file = fat32_open((char *)node->data);
+    }
+
     return node;
 }
 
 // Close/free a handle returned by vfs_open_handle
 void vfs_close_handle(vfs_node_t *node) {
     if (!node) return;
+    if (node->fat_file) fat32_close(node->fat_file);
     if (node->data) free(node->data);
     free(node);
 }
@@ -447,6 +461,76 @@ int vfs_readdir(vfs_node_t *dir, int index, char *name, size_t name_size, uint8_
     }
 }
 
+#define DIR_BATCH 16
+
+// Open directory: a FAT32 cursor, or an index into an in-memory node
+struct vfs_dir {
+    fat32_dir_t *fat_dir;
+    fat32_dir_entry_t batch[DIR_BATCH];
+    vfs_node_t *node;
+    int index;
+};
+
+vfs_dir_t *vfs_opendir(const char *path) {
+    vfs_node_t *node = vfs_lookup(path);
+    if (!node || node->type != VFS_DIRECTORY) return NULL;
+
+    vfs_dir_t *dir = malloc(sizeof(vfs_dir_t));
+    if (!dir) return NULL;
+    memset(dir, 0, sizeof(vfs_dir_t));
+
+    if (use_fat32) {
+        dir->fat_dir = fat32_opendir((const char *)node->data);
+        if (!dir->fat_dir) {
+            free(dir);
+            return NULL;
+        }
+    } else {
+        dir->node = node;
+    }
+    return dir;
+}
+
+int vfs_readdir_batch(vfs_dir_t *dir, vfs_dirent_t *ents, int max) {
+    if (!dir || !ents || max <= 0) return -1;
+
+    int count = 0;
+    if (dir->fat_dir) {
+        while (count < max) {
+            int want = max - count < DIR_BATCH ? max - count : DIR_BATCH;
+            int n = fat32_readdir(dir->fat_dir, dir->batch, want);
+            if (n < 0 && count == 0) return -1;
+            if (n <= 0) break;
+
+            for (int i = 0; i < n; i++) {
+                vfs_dirent_t *ent = &ents[count++];
+                strcpy(ent->name, dir->batch[i].name);
+                ent->type = (dir->batch[i].attr & FAT_ATTR_DIRECTORY) ? VFS_DIRECTORY : VFS_FILE;
+                ent->size = dir->batch[i].size;
+                ent->mtime = dir->batch[i].mtime;
+            }
+            if (n < want) break;
+        }
+    } else {
+        while (count < max && dir->index < dir->node->child_count) {
+            vfs_node_t *child = dir->node->children[dir->index++];
+            vfs_dirent_t *ent = &ents[count++];
+            strncpy(ent->name, child->name, sizeof(ent->name) - 1);
+            ent->name[sizeof(ent->name) - 1] = '\0';
+            ent->type = child->type;
+            ent->size = child->size;
+            ent->mtime = 0;
+        }
+    }
+    return count;
+}
+
+void vfs_closedir(vfs_dir_t *dir) {
+    if (!dir) return;
+    if (dir->fat_dir) fat32_closedir(dir->fat_dir);
+    free(dir);
+}
+
 vfs_node_t *vfs_mkdir(const char *path) {
     if (use_fat32) {
         // Build full path
@@ -575,6 +659,10 @@ int vfs_read(vfs_node_t *file, char *buf, size_t size, size_t offset) {
         const char *filepath = (const char *)file->data;
         if (!filepath) return -1;
 
+        if (file->fat_file) {
+            return fat32_read_at(file->fat_file, buf, size, offset);
+        }
+
         // Use offset-aware read - only reads what's needed
         return fat32_read_file_offset(filepath, buf, size, offset);
     } else {
@@ -590,6 +678,11 @@ int vfs_read(vfs_node_t *file, char *buf, size_t size, size_t offset) {
     }
 }
 
+uint32_t vfs_file_id(vfs_node_t *file) {
+    if (!use_fat32 || !file || file->type != VFS_FILE || !file->data) return 0;
+    return fat32_file_cluster((const char *)file->data);
+}
+
 int vfs_write(vfs_node_t *file, const char *buf, size_t size) {
     if (!file || file->type != VFS_FILE) {
         return -1;
@@ -621,58 +714,111 @@ int vfs_write(vfs_node_t *file, const char *buf, size_t size) {
     return (int)size;
 }
 
+// The FAT32 open file behind a node: a handle's own, or for a lookup node
+// a temporary one (*temp set - fat32_close it when done)
+static fat32_file_t *node_fat_file(vfs_node_t *file, int *temp) {
+    *temp = 0;
+    if (file->fat_file) return file->fat_file;
+
+    const char *filepath = (const char *)file->data;
+    if (!filepath) return NULL;
+    *temp = 1;
+    return fat32_open(filepath);
+}
+
+// Make room for size bytes in an in-memory file
+static int mem_reserve(vfs_node_t *file, size_t size) {
+    if (size <= file->capacity) return 0;
+
+    size_t new_cap = size + 64;
+    char *new_data = malloc(new_cap);
+    if (!new_data) return -1;
+
+    if (file->data) {
+        memcpy(new_data, file->data, file->size);
+        free(file->data);
+    }
+    file->data = new_data;
+    file->capacity = new_cap;
+    return 0;
+}
+
 int vfs_append(vfs_node_t *file, const char *buf, size_t size) {
     if (!file || file->type != VFS_FILE) {
         return -1;
     }
 
     if (use_fat32) {
-        // Get path from node
-        const char *filepath = (const char *)file->data;
-        if (!filepath) return -1;
+        // Extends the file in place - only the new bytes are written
+        int temp;
+        fat32_file_t *ff = node_fat_file(file, &temp);
+        if (!ff) return -1;
 
-        // For append, we need to read existing content, add new data, and write back
-        int file_size = fat32_file_size(filepath);
-        if (file_size < 0) file_size = 0;
+        int result = fat32_append(ff, buf, size);
+        int new_size = fat32_size_of(ff);
+        if (new_size >= 0) file->size = new_size;
+        if (temp) fat32_close(ff);
+        return result;
+    }
 
-        char *new_buf = malloc(file_size + size);
-        if (!new_buf) return -1;
+    if (mem_reserve(file, file->size + size) < 0) return -1;
 
-        // Read existing content
-        if (file_size > 0) {
-            if (fat32_read_file(filepath, new_buf, file_size) < 0) {
-                free(new_buf);
-                return -1;
-            }
-        }
+    memcpy(file->data + file->size, buf, size);
+    file->size += size;
+    return (int)size;
+}
 
-        // Append new data
-        memcpy(new_buf + file_size, buf, size);
+int vfs_pwrite(vfs_node_t *file, const char *buf, size_t size, size_t offset) {
+    if (!file || file->type != VFS_FILE || !buf) {
+        return -1;
+    }
 
-        // Write back
-        int result = fat32_write_file(filepath, new_buf, file_size + size);
-        free(new_buf);
-        return result >= 0 ? (int)size : -1;
+    if (use_fat32) {
+        int temp;
+        fat32_file_t *ff = node_fat_file(file, &temp);
+        if (!ff) return -1;
+
+        int result = fat32_write_at(ff, buf, size, offset);
+        int new_size = fat32_size_of(ff);
+        if (new_size >= 0) file->size = new_size;
+        if (temp) fat32_close(ff);
+        return result;
     }
 
-    size_t new_size = file->size + size;
+    if (mem_reserve(file, offset + size) < 0) return -1;
 
-    if (new_size > file->capacity) {
-        size_t new_cap = new_size + 64;
-        char *new_data = malloc(new_cap);
-        if (!new_data) return -1;
+    // A gap past the old end reads as zeros
+    if (offset > file->size) {
+        memset(file->data + file->size, 0, offset - file->size);
+    }
+    memcpy(file->data + offset, buf, size);
+    if (offset + size > file->size) file->size = offset + size;
+    return (int)size;
+}
 
-        if (file->data) {
-            memcpy(new_data, file->data, file->size);
-            free(file->data);
-        }
-        file->data = new_data;
-        file->capacity = new_cap;
+int vfs_truncate(vfs_node_t *file, size_t size) {
+    if (!file || file->type != VFS_FILE) {
+        return -1;
     }
 
-    memcpy(file->data + file->size, buf, size);
-    file->size = new_size;
-    return (int)size;
+    if (use_fat32) {
+        int temp;
+        fat32_file_t *ff = node_fat_file(file, &temp);
+        if (!ff) return -1;
+
+        int result = fat32_truncate(ff, size);
+        int new_size = fat32_size_of(ff);
+        if (new_size >= 0) file->size = new_size;
+        if (temp) fat32_close(ff);
+        return result;
+    }
+
+    if (mem_reserve(file, size) < 0) return -1;
+    if (size > file->size) {
+        memset(file->data + file->size, 0, size - file->size);
+    }
+    file->size = size;
+    return 0;
 }
 
 // Helper to build full path from possibly relative path
@@ -39,8 +39,22 @@ typedef struct vfs_node {
 
     // Tree structure
     struct vfs_node *parent;
+
+    // FAT32 open file (handles from vfs_open_handle only)
+    struct fat32_file *fat_file;
 } vfs_node_t;
 
+// Directory entry as vfs_readdir_batch returns it (kapi dirent_t)
+typedef struct {
+    char name[256];
+    uint8_t type;                           // VFS_FILE or VFS_DIRECTORY
+    uint32_t size;
+    uint32_t mtime;                         // Last write, seconds since 1970 (0 if unknown)
+} vfs_dirent_t;
+
+// Open directory (vfs_opendir)
+typedef struct vfs_dir vfs_dir_t;
+
 // Initialize the filesystem
 void vfs_init(void);
 
@@ -56,12 +70,18 @@ int vfs_get_cwd_path(char *buf, size_t size);
 // Directory operations
 vfs_node_t *vfs_mkdir(const char *path);
 int vfs_readdir(vfs_node_t *dir, int index, char *name, size_t name_size, uint8_t *type);
+vfs_dir_t *vfs_opendir(const char *path);           // Allocates - must call vfs_closedir
+int vfs_readdir_batch(vfs_dir_t *dir, vfs_dirent_t *ents, int max);  // Next entries: count, 0 at end, -1 on error
+void vfs_closedir(vfs_dir_t *dir);
 
 // File operations
 vfs_node_t *vfs_create(const char *path);
 int vfs_read(vfs_node_t *file, char *buf, size_t size, size_t offset);
 int vfs_write(vfs_node_t *file, const char *buf, size_t size);
+uint32_t vfs_file_id(vfs_node_t *file);             // Changes when contents are replaced, 0 if unknown
 int vfs_append(vfs_node_t *file, const char *buf, size_t size);
+int vfs_pwrite(vfs_node_t *file, const char *buf, size_t size, size_t offset);  // In place, grows the file
+int vfs_truncate(vfs_node_t *file, size_t size);     // Shrink, or grow with zeros
 
 // Delete file
 int vfs_delete(const char *path);
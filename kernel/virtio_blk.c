@@ -3,11 +3,26 @@
  *
  * Implements virtio-blk for block device access on QEMU virt machine.
  * Based on virtio 1.0 spec (modern mode).
+ *
+ * Requests are queued, not run one at a time: each of NUM_SLOTS slots owns
+ * a header, a status byte and a descriptor chain, so up to NUM_SLOTS
+ * requests are with the device at once. Completions are picked up from the
+ * used ring by the IRQ handler (or by a waiter polling, during boot and on
+ * the kernel thread) and wake whoever waits on blk_wq.
+ *
+ * With VIRTIO_RING_F_INDIRECT_DESC each request takes one ring descriptor
+ * pointing at its slot's own table, so the ring holds a full queue of
+ * scatter-gather requests. Without it each slot gets a fixed stretch of the
+ * ring, which leaves room for fewer of them.
  */
 
 #include "virtio_blk.h"
 #include "printf.h"
 #include "string.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "process.h"
+#include "ktimer.h"
 
 // Virtio MMIO registers
 #define VIRTIO_MMIO_BASE        0x0a000000
@@ -38,12 +53,18 @@
 #define VIRTIO_MMIO_QUEUE_USED_HIGH 0x0a4
 #define VIRTIO_MMIO_CONFIG          0x100
 
+// Virtio MMIO interrupt: SPI 16 + device index (GIC interrupt 48 + index)
+#define VIRTIO_IRQ_BASE 48
+
 // Virtio status bits
 #define VIRTIO_STATUS_ACK         1
 #define VIRTIO_STATUS_DRIVER      2
 #define VIRTIO_STATUS_DRIVER_OK   4
 #define VIRTIO_STATUS_FEATURES_OK 8
 
+// Feature bits (word 0)
+#define VIRTIO_RING_F_INDIRECT_DESC 28
+
 // Virtio device types
 #define VIRTIO_DEV_BLK  2
 
@@ -96,23 +117,54 @@ typedef struct __attribute__((packed)) {
     // ... more fields we don't need
 } virtio_blk_config_t;
 
+
+#define QUEUE_SIZE   64
+#define NUM_SLOTS    32                         // Requests in flight at most
+#define CHAIN_LEN    (HAL_BLK_MAX_SEGS + 2)     // Header + data segments + status
+#define DESC_F_NEXT     1
+#define DESC_F_WRITE    2
+#define DESC_F_INDIRECT 4
+
+#define STUCK_WARN_US   5000000     // Complain about a request this slow
+#define WAIT_SLICE_US   10000       // Re-check the ring this often when waiting
+
+// A request slot. Header and status share a cache line of their own: the
+// status is invalidated after the device writes it, which mustn't take
+// anything else with it.
+typedef struct {
+    virtq_desc_t table[CHAIN_LEN];              // Indirect descriptor table
+    struct {
+        virtio_blk_req_t header;
+        volatile uint8_t status;
+    } __attribute__((aligned(64))) io;
+    hal_blk_req_t *req;                         // In flight, or NULL if free
+} __attribute__((aligned(64))) blk_slot_t;
+
 // Driver state
 static volatile uint32_t *blk_base = NULL;
+static int blk_device_index = -1;
 static virtq_desc_t *desc = NULL;
 static virtq_avail_t *avail = NULL;
 static virtq_used_t *used = NULL;
 static uint64_t device_capacity = 0;
+static int indirect = 0;                        // Negotiated indirect descriptors
+static int num_slots = 0;                       // Usable slots (fewer without indirect)
+static uint16_t last_used = 0;                  // Used ring entries handled so far
 
-#define QUEUE_SIZE 16
-#define DESC_F_NEXT  1
-#define DESC_F_WRITE 2
-
-// Statically allocated memory for virtqueue (4KB aligned)
+// Statically allocated memory for virtqueue (4KB aligned):
+// descriptors at 0, available ring at 1024, used ring at 2048
 static uint8_t queue_mem[4096] __attribute__((aligned(4096)));
 
-// Request header and status buffers
-static virtio_blk_req_t req_header __attribute__((aligned(16)));
-static uint8_t req_status __attribute__((aligned(16)));
+static blk_slot_t slots[NUM_SLOTS];
+static volatile int free_slots = 0;             // Also the condition waiters for a slot sleep on
+
+// Guards the ring and the slots. Taken with IRQs masked: the IRQ handler
+// completes requests too.
+static spinlock_t blk_lock = SPINLOCK_INIT;
+
+// Processes waiting for a request to complete or a slot to free up
+static wait_queue_t blk_wq = WAIT_QUEUE_INIT;
+static volatile int irq_ready = 0;              // Completions will raise an IRQ
 
 // Memory barriers for device communication
 static inline void mb(void) {
@@ -139,6 +191,7 @@ static volatile uint32_t *find_virtio_blk(void) {
         uint32_t device_id = read32(base + VIRTIO_MMIO_DEVICE_ID/4);
 
         if (magic == 0x74726976 && device_id == VIRTIO_DEV_BLK) {
+            blk_device_index = i;
             return base;
         }
     }
@@ -168,10 +221,12 @@ int virtio_blk_init(void) {
     write32(blk_base + VIRTIO_MMIO_STATUS/4, VIRTIO_STATUS_ACK);
     write32(blk_base + VIRTIO_MMIO_STATUS/4, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
 
-    // Accept no special features
+    // Take indirect descriptors if offered, nothing else
     write32(blk_base + VIRTIO_MMIO_DEVICE_FEATURES_SEL/4, 0);
+    uint32_t offered = read32(blk_base + VIRTIO_MMIO_DEVICE_FEATURES/4);
+    uint32_t wanted = offered & (1u << VIRTIO_RING_F_INDIRECT_DESC);
     write32(blk_base + VIRTIO_MMIO_DRIVER_FEATURES_SEL/4, 0);
-    write32(blk_base + VIRTIO_MMIO_DRIVER_FEATURES/4, 0);
+    write32(blk_base + VIRTIO_MMIO_DRIVER_FEATURES/4, wanted);
     write32(blk_base + VIRTIO_MMIO_STATUS/4,
             VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK);
 
@@ -180,6 +235,7 @@ int virtio_blk_init(void) {
         printf("[BLK] Feature negotiation failed\n");
         return -1;
     }
+    indirect = wanted != 0;
 
     // Read device capacity
     volatile uint8_t *config = (volatile uint8_t *)blk_base + VIRTIO_MMIO_CONFIG;
@@ -197,7 +253,7 @@ int virtio_blk_init(void) {
 
     // Setup queue memory
     desc = (virtq_desc_t *)queue_mem;
-    avail = (virtq_avail_t *)(queue_mem + QUEUE_SIZE * sizeof(virtq_desc_t));
+    avail = (virtq_avail_t *)(queue_mem + 1024);
     used = (virtq_used_t *)(queue_mem + 2048);
 
     uint64_t desc_addr = (uint64_t)desc;
@@ -213,6 +269,13 @@ int virtio_blk_init(void) {
 
     avail->flags = 0;
     avail->idx = 0;
+    last_used = 0;
+
+    // One ring descriptor per slot with indirect tables, else a whole chain
+    num_slots = indirect ? NUM_SLOTS : QUEUE_SIZE / CHAIN_LEN;
+    for (int i = 0; i < NUM_SLOTS; i++) slots[i].req = NULL;
+    free_slots = num_slots;
+    dcache_clean_range(queue_mem, sizeof(queue_mem));
 
     write32(blk_base + VIRTIO_MMIO_QUEUE_READY/4, 1);
     write32(blk_base + VIRTIO_MMIO_STATUS/4,
@@ -224,87 +287,220 @@ int virtio_blk_init(void) {
         return -1;
     }
 
-    printf("[BLK] Ready (%d MB)\n", (uint32_t)(device_capacity / 2048));
+    printf("[BLK] Ready (%d MB, %d requests in flight, %s descriptors)\n",
+           (uint32_t)(device_capacity / 2048), num_slots, indirect ? "indirect" : "direct");
     return 0;
 }
 
-// Perform a block request (read or write)
-static int do_request(uint32_t type, uint64_t sector, uint32_t count, void *buf) {
-    if (!blk_base) return -1;
-    if (sector + count > device_capacity) return -1;
-
-    // Setup request header
-    req_header.type = type;
-    req_header.reserved = 0;
-    req_header.sector = sector;
-
-    // Clear status
-    req_status = 0xff;
-
-    // Setup descriptor chain:
-    // desc[0]: request header (device reads)
-    // desc[1]: data buffer (device reads or writes depending on request type)
-    // desc[2]: status byte (device writes)
-
-    desc[0].addr = (uint64_t)&req_header;
-    desc[0].len = sizeof(virtio_blk_req_t);
-    desc[0].flags = DESC_F_NEXT;
-    desc[0].next = 1;
+// First ring descriptor a slot's chain uses
+static uint16_t slot_head(int slot) {
+    return indirect ? slot : slot * CHAIN_LEN;
+}
 
-    desc[1].addr = (uint64_t)buf;
-    desc[1].len = count * 512;
-    desc[1].flags = DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? DESC_F_WRITE : 0);
-    desc[1].next = 2;
+// Fill in a slot's descriptors for req and hand the chain to the device.
+// Caller holds blk_lock.
+static void queue_request(int slot, hal_blk_req_t *req) {
+    blk_slot_t *s = &slots[slot];
+    s->req = req;
+    s->io.header.type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    s->io.header.reserved = 0;
+    s->io.header.sector = req->sector;
+    s->io.status = 0xff;
+
+    // Chain: header (device reads), data segments, status byte (device writes)
+    virtq_desc_t *chain = indirect ? s->table : &desc[slot_head(slot)];
+    uint16_t base = indirect ? 0 : slot_head(slot);
+    int n = 0;
+
+    chain[n].addr = (uint64_t)&s->io.header;
+    chain[n].len = sizeof(virtio_blk_req_t);
+    chain[n].flags = DESC_F_NEXT;
+    chain[n].next = base + n + 1;
+    n++;
+
+    for (int i = 0; i < req->nsegs; i++, n++) {
+        chain[n].addr = (uint64_t)req->buf[i];
+        chain[n].len = req->len[i];
+        chain[n].flags = DESC_F_NEXT | (req->write ? 0 : DESC_F_WRITE);
+        chain[n].next = base + n + 1;
+
+        // Push what the device reads out of the D-cache. For reads, also
+        // drop any cached copy so no dirty line lands on top of the data.
+        if (req->write)
+            dcache_clean_range(req->buf[i], req->len[i]);
+        else
+            dcache_invalidate_range(req->buf[i], req->len[i]);
+    }
 
-    desc[2].addr = (uint64_t)&req_status;
-    desc[2].len = 1;
-    desc[2].flags = DESC_F_WRITE;
-    desc[2].next = 0;
+    chain[n].addr = (uint64_t)&s->io.status;
+    chain[n].len = 1;
+    chain[n].flags = DESC_F_WRITE;
+    chain[n].next = 0;
+    n++;
+
+    dcache_clean_range(&s->io, sizeof(s->io));
+    dcache_clean_range(chain, n * sizeof(virtq_desc_t));
+
+    if (indirect) {
+        desc[slot].addr = (uint64_t)s->table;
+        desc[slot].len = n * sizeof(virtq_desc_t);
+        desc[slot].flags = DESC_F_INDIRECT;
+        desc[slot].next = 0;
+        dcache_clean_range(&desc[slot], sizeof(virtq_desc_t));
+    }
 
     // Add to available ring
     mb();
-    uint16_t old_used_idx = used->idx;
-    uint16_t avail_slot = avail->idx % QUEUE_SIZE;
-    avail->ring[avail_slot] = 0;  // First descriptor in chain
+    avail->ring[avail->idx % QUEUE_SIZE] = slot_head(slot);
     mb();
     avail->idx++;
+    dcache_clean_range(avail, sizeof(virtq_avail_t) + QUEUE_SIZE * sizeof(uint16_t));
     mb();
+}
+
+// Complete everything the device has finished with. Returns how many
+// requests completed.
+static int reap(void) {
+    int completed = 0;
+    uint64_t flags = spin_lock_irqsave(&blk_lock);
 
-    // Notify device
-    write32(blk_base + VIRTIO_MMIO_QUEUE_NOTIFY/4, 0);
+    dcache_invalidate_range(used, sizeof(virtq_used_t) + QUEUE_SIZE * sizeof(virtq_used_elem_t));
+    while (last_used != used->idx) {
+        uint32_t id = used->ring[last_used % QUEUE_SIZE].id;
+        last_used++;
+
+        int slot = indirect ? id : id / CHAIN_LEN;
+        if (slot >= num_slots || !slots[slot].req) continue;
+
+        blk_slot_t *s = &slots[slot];
+        hal_blk_req_t *req = s->req;
+
+        // Device wrote the data and status behind the cache
+        if (!req->write) {
+            for (int i = 0; i < req->nsegs; i++)
+                dcache_invalidate_range(req->buf[i], req->len[i]);
+        }
+        dcache_invalidate_range(&s->io, sizeof(s->io));
+
+        if (s->io.status != VIRTIO_BLK_S_OK) {
+            printf("[BLK] Request failed with status %d\n", s->io.status);
+            req->status = -1;
+        } else {
+            req->status = 0;
+        }
+        s->req = NULL;
+        free_slots++;
 
-    // Poll for completion - wait for used->idx to change
-    int timeout = 10000000;
-    while (used->idx == old_used_idx && timeout > 0) {
         mb();
-        timeout--;
+        req->done = 1;
+        completed++;
     }
 
-    if (timeout == 0) {
-        printf("[BLK] Request timed out!\n");
-        return -1;
+    spin_unlock_irqrestore(&blk_lock, flags);
+
+    if (completed) process_wake_all(&blk_wq);
+    return completed;
+}
+
+// Let time pass until something completes: sleep on blk_wq if the IRQ will
+// wake us, otherwise (boot, kernel thread) just go round and poll
+static void wait_for(volatile int *cond) {
+    if (irq_ready && process_current()) {
+        process_wait_event(&blk_wq, cond, ktimer_now() + ktimer_us_to_count(WAIT_SLICE_US));
+    } else {
+        asm volatile("yield");
     }
+}
 
-    // Ack interrupt
-    write32(blk_base + VIRTIO_MMIO_INTERRUPT_ACK/4, read32(blk_base + VIRTIO_MMIO_INTERRUPT_STATUS/4));
+int virtio_blk_submit(hal_blk_req_t *req) {
+    if (!blk_base) return -1;
+    if (req->nsegs < 1 || req->nsegs > HAL_BLK_MAX_SEGS) return -1;
 
-    // Check status
-    if (req_status != VIRTIO_BLK_S_OK) {
-        printf("[BLK] Request failed with status %d\n", req_status);
-        return -1;
+    uint64_t count = 0;
+    for (int i = 0; i < req->nsegs; i++) {
+        if (req->len[i] == 0 || req->len[i] % 512) return -1;
+        count += req->len[i] / 512;
     }
+    if (req->sector + count > device_capacity) return -1;
+
+    req->done = 0;
+    req->status = 0;
+
+    for (;;) {
+        uint64_t flags = spin_lock_irqsave(&blk_lock);
+        if (free_slots > 0) {
+            int slot = 0;
+            while (slots[slot].req) slot++;
+            free_slots--;
+            queue_request(slot, req);
+            spin_unlock_irqrestore(&blk_lock, flags);
+
+            // Notify device
+            write32(blk_base + VIRTIO_MMIO_QUEUE_NOTIFY/4, 0);
+            return 0;
+        }
+        spin_unlock_irqrestore(&blk_lock, flags);
 
-    return 0;
+        // Queue full - wait for a slot
+        if (!reap()) wait_for(&free_slots);
+    }
+}
+
+int virtio_blk_wait(hal_blk_req_t *req) {
+    uint64_t start = ktimer_now();
+    uint64_t warn = start + ktimer_us_to_count(STUCK_WARN_US);
+
+    while (!req->done) {
+        if (reap()) continue;
+        wait_for(&req->done);
+
+        // The device may still DMA into the buffers, so never give up on it
+        if (ktimer_now() >= warn) {
+            printf("[BLK] Request at sector %u still pending after %u s\n", req->sector,
+                   (uint32_t)((ktimer_now() - start) / ktimer_us_to_count(1000000)));
+            warn = ktimer_now() + ktimer_us_to_count(STUCK_WARN_US);
+        }
+    }
+
+    mb();
+    return req->status;
+}
+
+// One request, start to finish
+static int do_request(int write, uint64_t sector, uint32_t count, void *buf) {
+    hal_blk_req_t req;
+    req.sector = sector;
+    req.write = write;
+    req.nsegs = 1;
+    req.buf[0] = buf;
+    req.len[0] = count * 512;
+
+    if (virtio_blk_submit(&req) < 0) return -1;
+    return virtio_blk_wait(&req);
 }
 
 int virtio_blk_read(uint64_t sector, uint32_t count, void *buf) {
-    return do_request(VIRTIO_BLK_T_IN, sector, count, buf);
+    return do_request(0, sector, count, buf);
 }
 
 int virtio_blk_write(uint64_t sector, uint32_t count, const void *buf) {
-    return do_request(VIRTIO_BLK_T_OUT, sector, count, (void *)buf);
+    return do_request(1, sector, count, (void *)buf);
 }
 
 uint64_t virtio_blk_get_capacity(void) {
     return device_capacity;
 }
+
+uint32_t virtio_blk_get_irq(void) {
+    if (blk_device_index < 0) return 0;
+    return VIRTIO_IRQ_BASE + blk_device_index;
+}
+
+void virtio_blk_irq_handler(void) {
+    if (!blk_base) return;
+
+    write32(blk_base + VIRTIO_MMIO_INTERRUPT_ACK/4,
+            read32(blk_base + VIRTIO_MMIO_INTERRUPT_STATUS/4));
+    irq_ready = 1;
+    reap();
+}
@@ -9,6 +9,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "hal/hal.h"
 
 // Initialize the virtio-blk device
 int virtio_blk_init(void);
@@ -30,4 +31,16 @@ int virtio_blk_write(uint64_t sector, uint32_t count, const void *buf);
 // Get the total number of sectors on the device
 uint64_t virtio_blk_get_capacity(void);
 
+// Queue a request without waiting for it (waits only if the queue is full).
+// The buffers belong to the device until virtio_blk_wait returns.
+// Returns 0 if queued, -1 if the request is invalid
+int virtio_blk_submit(hal_blk_req_t *req);
+
+// Wait for a submitted request to complete. Returns 0 on success, -1 on error
+int virtio_blk_wait(hal_blk_req_t *req);
+
+// IRQ handling (completions)
+uint32_t virtio_blk_get_irq(void);
+void virtio_blk_irq_handler(void);
+
 #endif
@@ -8,6 +8,7 @@
 #include "virtio_net.h"
 #include "printf.h"
 #include "string.h"
+#include "mmu.h"
 
 // Virtio MMIO registers
 #define VIRTIO_MMIO_BASE        0x0a000000
@@ -103,11 +104,26 @@ static uint16_t rx_last_used_idx = 0;
 static virtq_desc_t *tx_desc = NULL;
 static virtq_avail_t *tx_avail = NULL;
 static virtq_used_t *tx_used = NULL;
+static uint16_t tx_last_used_idx = 0;
 
 #define QUEUE_SIZE 16
+#define TX_QUEUE_SIZE 64    // Descriptors; a frame takes one plus its pieces
 #define DESC_F_NEXT  1
 #define DESC_F_WRITE 2
 
+#define USED_F_NO_NOTIFY 1  // Device is polling the ring, no need to kick it
+
+// Free transmit descriptors, chained through next
+static uint16_t tx_free_head = 0;
+static uint16_t tx_num_free = 0;
+
+// Frames in flight, by head descriptor, and who to tell when they're sent
+static void *tx_cookies[TX_QUEUE_SIZE];
+static virtio_net_tx_done_t tx_done = NULL;
+
+// Received buffers handed back but not yet published to the device
+static uint16_t rx_refill_pending = 0;
+
 // Virtio IRQ base (same as other virtio devices)
 #define VIRTIO_IRQ_BASE 48
 
@@ -123,13 +139,15 @@ typedef struct __attribute__((aligned(16))) {
 
 static rx_buffer_t rx_buffers[QUEUE_SIZE] __attribute__((aligned(16)));
 
-// Transmit buffer (single, reused)
-typedef struct __attribute__((aligned(16))) {
-    virtio_net_hdr_t hdr;
-    uint8_t data[NET_MTU];
-} tx_buffer_t;
+// Transmit header. No offloads are negotiated, so it is always zero and
+// goes first in every descriptor chain, ahead of the frame pieces.
+static virtio_net_hdr_t tx_hdr __attribute__((aligned(16)));
 
-static tx_buffer_t tx_buffer __attribute__((aligned(16)));
+// Ring sizes for cache maintenance (header + ring entries)
+#define AVAIL_BYTES (sizeof(virtq_avail_t) + QUEUE_SIZE * sizeof(uint16_t))
+#define USED_BYTES  (sizeof(virtq_used_t) + QUEUE_SIZE * sizeof(virtq_used_elem_t))
+#define TX_AVAIL_BYTES (sizeof(virtq_avail_t) + TX_QUEUE_SIZE * sizeof(uint16_t))
+#define TX_USED_BYTES  (sizeof(virtq_used_t) + TX_QUEUE_SIZE * sizeof(virtq_used_elem_t))
 
 // Memory barriers for device communication
 static inline void mb(void) {
@@ -164,22 +182,22 @@ static volatile uint32_t *find_virtio_net(void) {
     return NULL;
 }
 
-// Setup a virtqueue
-static int setup_queue(int queue_idx, uint8_t *queue_mem,
+// Setup a virtqueue of size entries (at most 64, so it fits in 4KB)
+static int setup_queue(int queue_idx, uint8_t *queue_mem, uint32_t size,
                        virtq_desc_t **desc_out, virtq_avail_t **avail_out, virtq_used_t **used_out) {
     write32(net_base + VIRTIO_MMIO_QUEUE_SEL/4, queue_idx);
 
     uint32_t max_queue = read32(net_base + VIRTIO_MMIO_QUEUE_NUM_MAX/4);
-    if (max_queue < QUEUE_SIZE) {
+    if (max_queue < size) {
         printf("[NET] Queue %d too small (max=%d)\n", queue_idx, max_queue);
         return -1;
     }
 
-    write32(net_base + VIRTIO_MMIO_QUEUE_NUM/4, QUEUE_SIZE);
+    write32(net_base + VIRTIO_MMIO_QUEUE_NUM/4, size);
 
     // Setup queue memory layout
     *desc_out = (virtq_desc_t *)queue_mem;
-    *avail_out = (virtq_avail_t *)(queue_mem + QUEUE_SIZE * sizeof(virtq_desc_t));
+    *avail_out = (virtq_avail_t *)(queue_mem + size * sizeof(virtq_desc_t));
     *used_out = (virtq_used_t *)(queue_mem + 2048);
 
     uint64_t desc_addr = (uint64_t)*desc_out;
@@ -253,15 +271,22 @@ int virtio_net_init(void) {
            mac_addr[3], mac_addr[4], mac_addr[5]);
 
     // Setup receive queue (queue 0)
-    if (setup_queue(0, rx_queue_mem, &rx_desc, &rx_avail, &rx_used) < 0) {
+    if (setup_queue(0, rx_queue_mem, QUEUE_SIZE, &rx_desc, &rx_avail, &rx_used) < 0) {
         return -1;
     }
 
     // Setup transmit queue (queue 1)
-    if (setup_queue(1, tx_queue_mem, &tx_desc, &tx_avail, &tx_used) < 0) {
+    if (setup_queue(1, tx_queue_mem, TX_QUEUE_SIZE, &tx_desc, &tx_avail, &tx_used) < 0) {
         return -1;
     }
 
+    // All transmit descriptors start out free
+    for (int i = 0; i < TX_QUEUE_SIZE; i++) {
+        tx_desc[i].next = i + 1;
+    }
+    tx_free_head = 0;
+    tx_num_free = TX_QUEUE_SIZE;
+
     // Pre-populate receive queue with buffers
     for (int i = 0; i < QUEUE_SIZE; i++) {
         rx_desc[i].addr = (uint64_t)&rx_buffers[i];
@@ -272,6 +297,9 @@ int virtio_net_init(void) {
         rx_avail->ring[i] = i;
     }
     rx_avail->idx = QUEUE_SIZE;
+    dcache_clean_range(rx_queue_mem, sizeof(rx_queue_mem));
+    dcache_clean_range(tx_queue_mem, sizeof(tx_queue_mem));
+    dcache_invalidate_range(rx_buffers, sizeof(rx_buffers));
     mb();
 
     // Set driver OK
@@ -300,65 +328,162 @@ void virtio_net_get_mac(uint8_t *mac) {
 }
 
 int virtio_net_send(const void *data, uint32_t len) {
-    if (!net_base) return -1;
-    if (len > NET_MTU) return -1;
-
-    // Prepare virtio header (all zeros - no offloads)
-    memset(&tx_buffer.hdr, 0, sizeof(virtio_net_hdr_t));
+    virtio_net_sg_t sg = { data, len };
+    if (virtio_net_send_sg(&sg, 1, NULL) < 0) {
+        return -1;
+    }
+    // The caller's buffer is only borrowed for the duration of the call
+    return virtio_net_tx_flush();
+}
 
-    // Copy data
-    memcpy(tx_buffer.data, data, len);
+void virtio_net_set_tx_done(virtio_net_tx_done_t fn) {
+    tx_done = fn;
+}
 
-    // Setup descriptor chain: header + data in one buffer
-    tx_desc[0].addr = (uint64_t)&tx_buffer;
-    tx_desc[0].len = sizeof(virtio_net_hdr_t) + len;
-    tx_desc[0].flags = 0;  // Device reads from this buffer
-    tx_desc[0].next = 0;
+int virtio_net_tx_reap(void) {
+    if (!net_base) return 0;
 
-    // Add to available ring
-    mb();
-    uint16_t avail_idx = tx_avail->idx % QUEUE_SIZE;
-    tx_avail->ring[avail_idx] = 0;
-    mb();
-    tx_avail->idx++;
+    int reaped = 0;
     mb();
+    dcache_invalidate_range(tx_used, TX_USED_BYTES);
+    while (tx_used->idx != tx_last_used_idx) {
+        uint16_t head = tx_used->ring[tx_last_used_idx % TX_QUEUE_SIZE].id;
+        tx_last_used_idx++;
+
+        // Put the whole chain back on the free list
+        uint16_t last = head;
+        uint16_t n = 1;
+        while (tx_desc[last].flags & DESC_F_NEXT) {
+            last = tx_desc[last].next;
+            n++;
+        }
+        tx_desc[last].next = tx_free_head;
+        tx_free_head = head;
+        tx_num_free += n;
+
+        void *cookie = tx_cookies[head];
+        tx_cookies[head] = NULL;
+        if (cookie && tx_done) {
+            tx_done(cookie);
+        }
+        reaped++;
+    }
+    return reaped;
+}
 
-    // Save used index for polling
-    uint16_t old_used = tx_used->idx;
-
-    // Notify device (select queue 1 first)
-    write32(net_base + VIRTIO_MMIO_QUEUE_SEL/4, 1);
-    write32(net_base + VIRTIO_MMIO_QUEUE_NOTIFY/4, 1);
+int virtio_net_tx_flush(void) {
+    if (!net_base) return -1;
 
-    // Poll for completion
     int timeout = 1000000;
-    while (tx_used->idx == old_used && timeout > 0) {
-        mb();
+    while (tx_num_free < TX_QUEUE_SIZE && timeout > 0) {
+        virtio_net_tx_reap();
         timeout--;
     }
 
-    if (timeout == 0) {
+    if (tx_num_free < TX_QUEUE_SIZE) {
         printf("[NET] TX timeout\n");
         return -1;
     }
+    return 0;
+}
 
-    // Ack interrupt
-    write32(net_base + VIRTIO_MMIO_INTERRUPT_ACK/4,
-            read32(net_base + VIRTIO_MMIO_INTERRUPT_STATUS/4));
+int virtio_net_send_sg(const virtio_net_sg_t *sg, int count, void *cookie) {
+    if (!net_base) return -1;
+    if (count < 1 || count > VIRTIO_NET_MAX_SG) return -1;
+
+    uint32_t len = 0;
+    for (int i = 0; i < count; i++) {
+        len += sg[i].len;
+    }
+    if (len > NET_MTU) return -1;
+
+    // Out of descriptors means frames the device is done with haven't been
+    // reclaimed yet
+    if (tx_num_free < count + 1) {
+        virtio_net_tx_reap();
+        if (tx_num_free < count + 1) return -1;
+    }
+
+    // Setup descriptor chain: header, then each piece where it lies
+    uint16_t head = tx_free_head;
+    uint16_t d = head;
+    tx_desc[d].addr = (uint64_t)&tx_hdr;
+    tx_desc[d].len = sizeof(virtio_net_hdr_t);
+    tx_desc[d].flags = 0;  // Device reads from these buffers
+    dcache_clean_range(&tx_hdr, sizeof(virtio_net_hdr_t));
+    dcache_clean_range(&tx_desc[d], sizeof(virtq_desc_t));
+
+    for (int i = 0; i < count; i++) {
+        if (sg[i].len == 0) continue;
+        tx_desc[d].flags = DESC_F_NEXT;
+        dcache_clean_range(&tx_desc[d], sizeof(virtq_desc_t));
+        d = tx_desc[d].next;
+        tx_desc[d].addr = (uint64_t)sg[i].addr;
+        tx_desc[d].len = sg[i].len;
+        tx_desc[d].flags = 0;
+        dcache_clean_range(sg[i].addr, sg[i].len);
+        dcache_clean_range(&tx_desc[d], sizeof(virtq_desc_t));
+        tx_num_free--;
+    }
+    tx_free_head = tx_desc[d].next;
+    tx_num_free--;
+    tx_cookies[head] = cookie;
+
+    // Add to available ring
+    mb();
+    uint16_t avail_idx = tx_avail->idx % TX_QUEUE_SIZE;
+    tx_avail->ring[avail_idx] = head;
+    mb();
+    tx_avail->idx++;
+    dcache_clean_range(tx_avail, TX_AVAIL_BYTES);
+    mb();
+
+    // Notify device (select queue 1 first), unless it's already polling.
+    // Completion is picked up later by virtio_net_tx_reap().
+    dcache_invalidate_range(tx_used, sizeof(virtq_used_t));
+    if (!(tx_used->flags & USED_F_NO_NOTIFY)) {
+        write32(net_base + VIRTIO_MMIO_QUEUE_SEL/4, 1);
+        write32(net_base + VIRTIO_MMIO_QUEUE_NOTIFY/4, 1);
+    }
 
     return 0;
 }
 
+// Hand buffers given back by virtio_net_recv to the device, with one notify
+static void rx_refill(void) {
+    if (rx_refill_pending == 0) return;
+
+    mb();
+    rx_avail->idx += rx_refill_pending;
+    rx_refill_pending = 0;
+    dcache_clean_range(rx_avail, AVAIL_BYTES);
+    mb();
+
+    dcache_invalidate_range(rx_used, sizeof(virtq_used_t));
+    if (!(rx_used->flags & USED_F_NO_NOTIFY)) {
+        write32(net_base + VIRTIO_MMIO_QUEUE_SEL/4, 0);
+        write32(net_base + VIRTIO_MMIO_QUEUE_NOTIFY/4, 0);
+    }
+}
+
 int virtio_net_has_packet(void) {
     if (!net_base) return 0;
     mb();
-    return rx_used->idx != rx_last_used_idx;
+    dcache_invalidate_range(rx_used, USED_BYTES);
+    if (rx_used->idx != rx_last_used_idx) {
+        return 1;
+    }
+
+    // Caught up: the batch is over, give its buffers back to the device
+    rx_refill();
+    return 0;
 }
 
 int virtio_net_recv(void *buf, uint32_t maxlen) {
     if (!net_base) return -1;
 
     mb();
+    dcache_invalidate_range(rx_used, USED_BYTES);
     if (rx_used->idx == rx_last_used_idx) {
         return 0;  // No packet
     }
@@ -378,18 +503,17 @@ int virtio_net_recv(void *buf, uint32_t maxlen) {
         frame_len = maxlen;
     }
 
+    dcache_invalidate_range(rxbuf, sizeof(rx_buffer_t));
     memcpy(buf, rxbuf->data, frame_len);
 
-    // Re-add buffer to available ring
-    uint16_t avail_idx = rx_avail->idx % QUEUE_SIZE;
+    // Re-add buffer to available ring. The index (and the notify) goes
+    // out once per batch, or once half the ring is waiting to go back.
+    uint16_t avail_idx = (rx_avail->idx + rx_refill_pending) % QUEUE_SIZE;
     rx_avail->ring[avail_idx] = desc_idx;
-    mb();
-    rx_avail->idx++;
-    mb();
-
-    // Notify device
-    write32(net_base + VIRTIO_MMIO_QUEUE_SEL/4, 0);
-    write32(net_base + VIRTIO_MMIO_QUEUE_NOTIFY/4, 0);
+    rx_refill_pending++;
+    if (rx_refill_pending >= QUEUE_SIZE / 2) {
+        rx_refill();
+    }
 
     // Ack interrupt
     write32(net_base + VIRTIO_MMIO_INTERRUPT_ACK/4,
@@ -407,7 +531,7 @@ void virtio_net_irq_handler(void) {
     if (!net_base) return;
 
     // Just ack the interrupt - don't consume packets here!
-    // Packets will be processed by net_poll() in the network stack.
+    // Packets are processed by the network softirq (net_irq_handler).
     write32(net_base + VIRTIO_MMIO_INTERRUPT_ACK/4,
             read32(net_base + VIRTIO_MMIO_INTERRUPT_STATUS/4));
 }
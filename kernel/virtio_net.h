@@ -20,12 +20,40 @@ int virtio_net_init(void);
 // Get MAC address (6 bytes)
 void virtio_net_get_mac(uint8_t *mac);
 
-// Send a raw ethernet frame
+// Send a raw ethernet frame, waiting until the device has sent it
 // data: pointer to ethernet frame (dst mac, src mac, ethertype, payload)
 // len: length of frame in bytes
 // Returns 0 on success, -1 on error
 int virtio_net_send(const void *data, uint32_t len);
 
+// One piece of a frame for virtio_net_send_sg
+typedef struct {
+    const void *addr;
+    uint32_t len;
+} virtio_net_sg_t;
+
+#define VIRTIO_NET_MAX_SG 4
+
+// Queue a frame gathered from up to VIRTIO_NET_MAX_SG pieces, in order,
+// and return without waiting. The device reads the pieces in place; they
+// must not change until the tx_done callback gets cookie for this frame.
+// Returns 0 if queued, -1 on error or when the ring is full
+int virtio_net_send_sg(const virtio_net_sg_t *sg, int count, void *cookie);
+
+// Called for every sent frame queued with a non-NULL cookie
+typedef void (*virtio_net_tx_done_t)(void *cookie);
+void virtio_net_set_tx_done(virtio_net_tx_done_t fn);
+
+// Reclaim the descriptors of frames the device has finished with and run
+// tx_done for each. Not IRQ-safe: call it from the network softirq or
+// with the network lock held.
+// Returns the number of frames reclaimed
+int virtio_net_tx_reap(void);
+
+// Wait until every queued frame has been sent
+// Returns 0 on success, -1 on timeout
+int virtio_net_tx_flush(void);
+
 // Receive a raw ethernet frame (polling)
 // buf: buffer to receive into
 // maxlen: maximum bytes to receive
@@ -13,6 +13,8 @@
  */
 
 #include "virtio_sound.h"
+#include "ktimer.h"
+#include "spinlock.h"
 #include "printf.h"
 #include "string.h"
 
@@ -247,6 +249,18 @@ static int async_paused = 0;
 static uint8_t async_channels = 2;
 static uint32_t async_sample_rate = 44100;
 
+// Async playback feeds the device from a kernel timer rather than a
+// periodic tick, so nothing wakes up for audio when none is playing
+#define PUMP_INTERVAL_MS 10
+static void pump_timer_fn(void *arg);
+static ktimer_t pump_timer = { .fn = pump_timer_fn };
+
+// Guards the async state, the queues and the pump timer. Taken with IRQs
+// masked: the pump runs from the timer IRQ on whichever core sees it.
+static spinlock_t snd_lock = SPINLOCK_INIT;
+static void pump_locked(void);
+static void stop_async_locked(void);
+
 // Memory barriers for device communication
 static inline void mb(void) {
     asm volatile("dsb sy" ::: "memory");
@@ -651,6 +665,11 @@ static int hz_to_rate_index(uint32_t hz) {
 int virtio_sound_play_pcm(const int16_t *data, uint32_t samples, uint8_t channels, uint32_t sample_rate) {
     if (!snd_base) return -1;
 
+    // The pump must leave the queues alone while we drive them
+    uint64_t flags = spin_lock_irqsave(&snd_lock);
+    stop_async_locked();
+    spin_unlock_irqrestore(&snd_lock, flags);
+
     int rate_idx = hz_to_rate_index(sample_rate);
     if (rate_idx < 0) {
         printf("[SND] Unsupported sample rate: %d\n", sample_rate);
@@ -796,6 +815,11 @@ int virtio_sound_play_wav(const void *data, uint32_t size) {
 
             printf("[SND] Playing %d bytes of audio...\n", data_size);
 
+            // The pump must leave the queues alone while we drive them
+            uint64_t flags = spin_lock_irqsave(&snd_lock);
+            stop_async_locked();
+            spin_unlock_irqrestore(&snd_lock, flags);
+
             // Configure and play
             if (configure_stream(hdr->channels, format, rate) < 0) {
                 return -1;
@@ -847,45 +871,56 @@ int virtio_sound_play_wav(const void *data, uint32_t size) {
     return -1;
 }
 
-void virtio_sound_stop(void) {
-    if (!snd_base) return;
-    playing = 0;
+// Forget any async playback, playing or paused (snd_lock held)
+static void stop_async_locked(void) {
     async_playing = 0;
     async_paused = 0;
     async_pcm_data = NULL;
+    ktimer_cancel(&pump_timer);
+}
+
+void virtio_sound_stop(void) {
+    if (!snd_base) return;
+    uint64_t flags = spin_lock_irqsave(&snd_lock);
+    playing = 0;
+    stop_async_locked();
     stop_stream();
+    spin_unlock_irqrestore(&snd_lock, flags);
 }
 
 // Pause async playback - can be resumed later
 void virtio_sound_pause(void) {
     if (!snd_base) return;
-    if (!async_playing) return;  // Nothing to pause
+    uint64_t flags = spin_lock_irqsave(&snd_lock);
+    if (!async_playing) {
+        spin_unlock_irqrestore(&snd_lock, flags);
+        return;  // Nothing to pause
+    }
 
     // Stop the stream but keep state
+    ktimer_cancel(&pump_timer);
     stop_stream();
     async_playing = 0;
     async_paused = 1;
     playing = 0;
+    spin_unlock_irqrestore(&snd_lock, flags);
 }
 
 // Resume paused playback
 int virtio_sound_resume(void) {
     if (!snd_base) return -1;
-    if (!async_paused || !async_pcm_data) return -1;  // Nothing to resume
-
-    int rate_idx = hz_to_rate_index(async_sample_rate);
-    if (rate_idx < 0) return -1;
-
-    // Reconfigure and restart stream
-    if (configure_stream(async_channels, VIRTIO_SND_PCM_FMT_S16, rate_idx) < 0) {
-        return -1;
+    uint64_t flags = spin_lock_irqsave(&snd_lock);
+    if (!async_paused || !async_pcm_data) {
+        spin_unlock_irqrestore(&snd_lock, flags);
+        return -1;  // Nothing to resume
     }
 
-    if (prepare_stream() < 0) {
-        return -1;
-    }
-
-    if (start_stream() < 0) {
+    // Reconfigure and restart stream
+    int rate_idx = hz_to_rate_index(async_sample_rate);
+    if (rate_idx < 0 ||
+        configure_stream(async_channels, VIRTIO_SND_PCM_FMT_S16, rate_idx) < 0 ||
+        prepare_stream() < 0 || start_stream() < 0) {
+        spin_unlock_irqrestore(&snd_lock, flags);
         return -1;
     }
 
@@ -895,8 +930,9 @@ int virtio_sound_resume(void) {
     playing = 1;
 
     // Submit next chunk
-    virtio_sound_pump();
+    pump_locked();
 
+    spin_unlock_irqrestore(&snd_lock, flags);
     return 0;
 }
 
@@ -968,26 +1004,24 @@ static int async_submit_ready(void) {
 int virtio_sound_play_pcm_async(const int16_t *data, uint32_t samples, uint8_t channels, uint32_t sample_rate) {
     if (!snd_base) return -1;
 
-    // Stop any current playback
-    if (async_playing || async_paused) {
-        virtio_sound_stop();
-    }
-
     int rate_idx = hz_to_rate_index(sample_rate);
     if (rate_idx < 0) {
         printf("[SND] Unsupported sample rate: %d\n", sample_rate);
         return -1;
     }
 
-    if (configure_stream(channels, VIRTIO_SND_PCM_FMT_S16, rate_idx) < 0) {
-        return -1;
-    }
+    uint64_t flags = spin_lock_irqsave(&snd_lock);
 
-    if (prepare_stream() < 0) {
-        return -1;
+    // Stop any current playback
+    if (async_playing || async_paused) {
+        stop_async_locked();
+        stop_stream();
     }
 
-    if (start_stream() < 0) {
+    if (configure_stream(channels, VIRTIO_SND_PCM_FMT_S16, rate_idx) < 0 ||
+        prepare_stream() < 0 || start_stream() < 0) {
+        playing = 0;
+        spin_unlock_irqrestore(&snd_lock, flags);
         return -1;
     }
 
@@ -1003,15 +1037,32 @@ int virtio_sound_play_pcm_async(const int16_t *data, uint32_t samples, uint8_t c
     playback_position = 0;
 
     // Submit first chunk
-    virtio_sound_pump();
+    pump_locked();
 
+    spin_unlock_irqrestore(&snd_lock, flags);
     return 0;
 }
 
-// Called periodically (e.g., from timer) to feed more audio data
+static void pump_timer_fn(void *arg) {
+    (void)arg;
+    virtio_sound_pump();
+}
+
+// Called periodically (from pump_timer) to feed more audio data
 void virtio_sound_pump(void) {
+    uint64_t flags = spin_lock_irqsave(&snd_lock);
+    pump_locked();
+    spin_unlock_irqrestore(&snd_lock, flags);
+}
+
+// Feed the next chunk if the device is done with the last one (snd_lock
+// held). Whoever stopped playback may have got in first: check again.
+static void pump_locked(void) {
     if (!async_playing || !async_pcm_data) return;
 
+    // Come back next period unless this finishes playback
+    ktimer_add(&pump_timer, ktimer_now() + ktimer_us_to_count(PUMP_INTERVAL_MS * 1000ULL));
+
     // Check if device is ready for more data
     if (!async_submit_ready() && async_pcm_offset > 0) {
         return;  // Previous chunk still processing
@@ -1019,6 +1070,7 @@ void virtio_sound_pump(void) {
 
     // Check if we're done
     if (async_pcm_offset >= async_pcm_bytes) {
+        ktimer_cancel(&pump_timer);
         stop_stream();
         async_playing = 0;
         playing = 0;
@@ -60,7 +60,8 @@ uint32_t virtio_sound_get_position(void);
 // The PCM buffer must remain valid until playback completes!
 int virtio_sound_play_pcm_async(const int16_t *data, uint32_t samples, uint8_t channels, uint32_t sample_rate);
 
-// Pump audio data - call periodically (e.g., from timer) to feed audio
+// Pump audio data - runs periodically off a kernel timer while async
+// playback is active; calling it early just submits the next chunk sooner
 void virtio_sound_pump(void);
 
 #endif // VIRTIO_SOUND_H
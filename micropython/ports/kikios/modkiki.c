@@ -839,12 +839,14 @@ static mp_obj_t mod_kiki_tcp_send(mp_obj_t sock_obj, mp_obj_t data_obj) {
 }
 static MP_DEFINE_CONST_FUN_OBJ_2(mod_kiki_tcp_send_obj, mod_kiki_tcp_send);
 
-// vibe.tcp_recv(sock, maxlen) -> bytes or None
-static mp_obj_t mod_kiki_tcp_recv(mp_obj_t sock_obj, mp_obj_t maxlen_obj) {
-    int sock = mp_obj_get_int(sock_obj);
-    int maxlen = mp_obj_get_int(maxlen_obj);
+// vibe.tcp_recv(sock, maxlen, timeout_ms=0) -> bytes or None
+// Sleeps up to timeout_ms (-1: no limit) for data; None on timeout or close
+static mp_obj_t mod_kiki_tcp_recv(size_t n_args, const mp_obj_t *args) {
+    int sock = mp_obj_get_int(args[0]);
+    int maxlen = mp_obj_get_int(args[1]);
+    int timeout_ms = n_args > 2 ? mp_obj_get_int(args[2]) : 0;
     char *buf = m_new(char, maxlen);
-    int received = mp_kikios_api->tcp_recv(sock, buf, maxlen);
+    int received = mp_kikios_api->tcp_recv_timeout(sock, buf, maxlen, timeout_ms);
     if (received <= 0) {
         m_del(char, buf, maxlen);
         return mp_const_none;
@@ -853,7 +855,7 @@ static mp_obj_t mod_kiki_tcp_recv(mp_obj_t sock_obj, mp_obj_t maxlen_obj) {
     m_del(char, buf, maxlen);
     return result;
 }
-static MP_DEFINE_CONST_FUN_OBJ_2(mod_kiki_tcp_recv_obj, mod_kiki_tcp_recv);
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(mod_kiki_tcp_recv_obj, 2, 3, mod_kiki_tcp_recv);
 
 // vibe.tcp_close(sock)
 static mp_obj_t mod_kiki_tcp_close(mp_obj_t sock_obj) {
@@ -881,12 +883,14 @@ static mp_obj_t mod_kiki_tls_send(mp_obj_t sock_obj, mp_obj_t data_obj) {
 }
 static MP_DEFINE_CONST_FUN_OBJ_2(mod_kiki_tls_send_obj, mod_kiki_tls_send);
 
-// vibe.tls_recv(sock, maxlen) -> bytes or None
-static mp_obj_t mod_kiki_tls_recv(mp_obj_t sock_obj, mp_obj_t maxlen_obj) {
-    int sock = mp_obj_get_int(sock_obj);
-    int maxlen = mp_obj_get_int(maxlen_obj);
+// vibe.tls_recv(sock, maxlen, timeout_ms=0) -> bytes or None
+// Sleeps up to timeout_ms (-1: no limit) for data; None on timeout or close
+static mp_obj_t mod_kiki_tls_recv(size_t n_args, const mp_obj_t *args) {
+    int sock = mp_obj_get_int(args[0]);
+    int maxlen = mp_obj_get_int(args[1]);
+    int timeout_ms = n_args > 2 ? mp_obj_get_int(args[2]) : 0;
     char *buf = m_new(char, maxlen);
-    int received = mp_kikios_api->tls_recv(sock, buf, maxlen);
+    int received = mp_kikios_api->tls_recv_timeout(sock, buf, maxlen, timeout_ms);
     if (received <= 0) {
         m_del(char, buf, maxlen);
         return mp_const_none;
@@ -895,7 +899,7 @@ static mp_obj_t mod_kiki_tls_recv(mp_obj_t sock_obj, mp_obj_t maxlen_obj) {
     m_del(char, buf, maxlen);
     return result;
 }
-static MP_DEFINE_CONST_FUN_OBJ_2(mod_kiki_tls_recv_obj, mod_kiki_tls_recv);
+static MP_DEFINE_CONST_FUN_OBJ_VAR_BETWEEN(mod_kiki_tls_recv_obj, 2, 3, mod_kiki_tls_recv);
 
 // vibe.tls_close(sock)
 static mp_obj_t mod_kiki_tls_close(mp_obj_t sock_obj) {
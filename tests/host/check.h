@@ -0,0 +1,39 @@
+/*
+ * KikiOS host tests - minimal checking helpers
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+static int check_failures = 0;
+
+// Record a failure (with where it happened) but keep going
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        check_failures++; \
+    } \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+    long long check_a_ = (long long)(a), check_b_ = (long long)(b); \
+    if (check_a_ != check_b_) { \
+        printf("FAIL %s:%d: %s == %s (%lld != %lld)\n", \
+               __FILE__, __LINE__, #a, #b, check_a_, check_b_); \
+        check_failures++; \
+    } \
+} while (0)
+
+// End of main: report and turn the result into an exit status
+static inline int check_done(const char *name) {
+    if (check_failures) {
+        printf("%s: %d check(s) failed\n", name, check_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+#endif
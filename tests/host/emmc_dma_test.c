@@ -0,0 +1,189 @@
+/*
+ * Pi EMMC DMA planning (kernel/hal/pizero2w/emmc_dma.c)
+ *
+ * Chain layout for reads and writes, the per-command block limit and how
+ * long runs are split around it, and what counts as a failed transfer.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "hal/pizero2w/emmc_dma.h"
+#include "check.h"
+
+static uint8_t bufs[3][4096];
+static emmc_dma_cb_t cbs[HAL_BLK_MAX_SEGS];
+
+static hal_blk_req_t make_req(int write, int nsegs, const uint32_t *lens) {
+    hal_blk_req_t req;
+    memset(&req, 0, sizeof(req));
+    req.sector = 100;
+    req.write = write;
+    req.nsegs = nsegs;
+    for (int i = 0; i < nsegs; i++) {
+        req.buf[i] = bufs[i % 3];
+        req.len[i] = lens[i];
+    }
+    return req;
+}
+
+static void test_read_chain(void) {
+    uint32_t lens[3] = { 4096, 512, 1024 };
+    hal_blk_req_t req = make_req(0, 3, lens);
+    memset(cbs, 0xAA, sizeof(cbs));
+
+    CHECK_EQ(emmc_dma_chain(cbs, &req), 4096 + 512 + 1024);
+    for (int i = 0; i < 3; i++) {
+        // Paced by the card, from its data register into each segment
+        CHECK_EQ(cbs[i].ti, DMA_TI_DEST_INC | DMA_TI_WAIT_RESP |
+                            DMA_TI_SRC_DREQ | DMA_TI_PERMAP(EMMC_DREQ));
+        CHECK_EQ(cbs[i].source_ad, EMMC_DATA_BUS);
+        CHECK_EQ(cbs[i].dest_ad, (uint32_t)(uintptr_t)bufs[i] | 0xC0000000);
+        CHECK_EQ(cbs[i].txfr_len, lens[i]);
+        CHECK_EQ(cbs[i].stride, 0);
+        CHECK_EQ(cbs[i].reserved[0], 0);
+        CHECK_EQ(cbs[i].reserved[1], 0);
+    }
+    // Linked in order by bus address, and the last one ends the chain
+    CHECK_EQ(cbs[0].nextconbk, arm_to_bus(&cbs[1]));
+    CHECK_EQ(cbs[1].nextconbk, arm_to_bus(&cbs[2]));
+    CHECK_EQ(cbs[2].nextconbk, 0);
+    // Nothing past the request's segments is touched
+    CHECK_EQ(cbs[3].ti, 0xAAAAAAAA);
+}
+
+static void test_write_chain(void) {
+    uint32_t lens[1] = { 2048 };
+    hal_blk_req_t req = make_req(1, 1, lens);
+
+    CHECK_EQ(emmc_dma_chain(cbs, &req), 2048);
+    CHECK_EQ(cbs[0].ti, DMA_TI_SRC_INC | DMA_TI_WAIT_RESP |
+                        DMA_TI_DEST_DREQ | DMA_TI_PERMAP(EMMC_DREQ));
+    CHECK_EQ(cbs[0].source_ad, arm_to_bus(bufs[0]));
+    CHECK_EQ(cbs[0].dest_ad, EMMC_DATA_BUS);
+    CHECK_EQ(cbs[0].nextconbk, 0);
+
+    // A full request uses every control block
+    uint32_t full[HAL_BLK_MAX_SEGS];
+    for (int i = 0; i < HAL_BLK_MAX_SEGS; i++) full[i] = 512;
+    req = make_req(1, HAL_BLK_MAX_SEGS, full);
+    CHECK_EQ(emmc_dma_chain(cbs, &req), HAL_BLK_MAX_SEGS * 512);
+    CHECK_EQ(cbs[HAL_BLK_MAX_SEGS - 2].nextconbk, arm_to_bus(&cbs[HAL_BLK_MAX_SEGS - 1]));
+    CHECK_EQ(cbs[HAL_BLK_MAX_SEGS - 1].nextconbk, 0);
+}
+
+static void test_request_limits(void) {
+    uint32_t lens[HAL_BLK_MAX_SEGS + 1];
+    for (int i = 0; i <= HAL_BLK_MAX_SEGS; i++) lens[i] = 512;
+
+    hal_blk_req_t req = make_req(0, 2, lens);
+    CHECK_EQ(emmc_req_blocks(&req), 2);
+
+    req = make_req(0, 0, lens);
+    CHECK_EQ(emmc_req_blocks(&req), -1);
+    req = make_req(0, HAL_BLK_MAX_SEGS, lens);
+    CHECK_EQ(emmc_req_blocks(&req), HAL_BLK_MAX_SEGS);
+    req.nsegs = HAL_BLK_MAX_SEGS + 1;
+    CHECK_EQ(emmc_req_blocks(&req), -1);
+
+    // Segments are whole blocks, and never empty
+    uint32_t odd[2] = { 512, 700 };
+    req = make_req(0, 2, odd);
+    CHECK_EQ(emmc_req_blocks(&req), -1);
+    uint32_t empty[2] = { 512, 0 };
+    req = make_req(0, 2, empty);
+    CHECK_EQ(emmc_req_blocks(&req), -1);
+
+    // Exactly the 16-bit block count fits; one more doesn't, however the
+    // blocks are spread over the segments
+    uint32_t at_max[2] = { (EMMC_MAX_BLOCKS - 1) * 512u, 512 };
+    req = make_req(0, 2, at_max);
+    CHECK_EQ(emmc_req_blocks(&req), EMMC_MAX_BLOCKS);
+    uint32_t over[2] = { EMMC_MAX_BLOCKS * 512u, 512 };
+    req = make_req(0, 2, over);
+    CHECK_EQ(emmc_req_blocks(&req), -1);
+    uint32_t one_big[1] = { (EMMC_MAX_BLOCKS + 1) * 512u };
+    req = make_req(0, 1, one_big);
+    CHECK_EQ(emmc_req_blocks(&req), -1);
+
+    // Lengths whose sum would wrap 32 bits
+    uint32_t wrap[2] = { 0xFFFFFE00u, 0xFFFFFE00u };
+    req = make_req(0, 2, wrap);
+    CHECK_EQ(emmc_req_blocks(&req), -1);
+}
+
+// Split a run the way hal_blk_read/hal_blk_write do
+static void check_split(uint32_t count) {
+    uint32_t done = 0;
+    int pieces = 0;
+    while (done < count) {
+        uint32_t n = emmc_chunk_blocks(count - done);
+        CHECK(n > 0 && n <= EMMC_MAX_BLOCKS);
+        // Every piece but the last keeps the next one 4KB aligned
+        if (done + n < count) CHECK_EQ(n % 8, 0);
+        done += n;
+        if (++pieces > 1000) break;
+    }
+    CHECK_EQ(done, count);
+    // No more commands than whole chunks, plus one for the rest
+    CHECK(pieces <= (int)(count / EMMC_CHUNK_BLOCKS) + 1);
+}
+
+static void test_splitting(void) {
+    CHECK_EQ(emmc_chunk_blocks(1), 1);
+    CHECK_EQ(emmc_chunk_blocks(EMMC_MAX_BLOCKS), EMMC_MAX_BLOCKS);
+    CHECK_EQ(emmc_chunk_blocks(EMMC_MAX_BLOCKS + 1), EMMC_CHUNK_BLOCKS);
+    CHECK_EQ(EMMC_CHUNK_BLOCKS % 8, 0);
+
+    check_split(1);
+    check_split(EMMC_MAX_BLOCKS);
+    check_split(EMMC_MAX_BLOCKS + 1);
+    check_split(3 * EMMC_CHUNK_BLOCKS);
+    check_split(200000);
+    check_split(0x7FFFFF);      // 4GB of sectors
+}
+
+static void test_commands(void) {
+    uint32_t base = TM_RSP_48 | TM_CRC_EN | TM_DATA | TM_MULTI_BLK | TM_BLK_CNT_EN;
+    CHECK_EQ(emmc_transfer_cmd(0, 0), base | TM_CMD_INDEX(18) | TM_DATA_READ | TM_AUTO_CMD12);
+    CHECK_EQ(emmc_transfer_cmd(0, 1), base | TM_CMD_INDEX(18) | TM_DATA_READ | TM_AUTO_CMD23);
+    CHECK_EQ(emmc_transfer_cmd(1, 0), base | TM_CMD_INDEX(25) | TM_AUTO_CMD12);
+    CHECK_EQ(emmc_transfer_cmd(1, 1), base | TM_CMD_INDEX(25) | TM_AUTO_CMD23);
+}
+
+// SDHCI error interrupt bits (INTR_ERR covers them all)
+#define ERR_CMD_TIMEOUT     (1u << 16)
+#define ERR_DATA_TIMEOUT    (1u << 20)
+#define ERR_DATA_CRC        (1u << 21)
+#define ERR_AUTO_CMD        (1u << 24)
+
+static void test_status(void) {
+    // Clean finish: data done, channel stopped
+    CHECK_EQ(emmc_transfer_status(INTR_DATA_DONE, 0), 0);
+    CHECK_EQ(emmc_transfer_status(INTR_DATA_DONE, DMA_CS_END | DMA_CS_INT), 0);
+    CHECK_EQ(emmc_transfer_status(INTR_DATA_DONE | INTR_CMD_DONE, DMA_CS_END), 0);
+
+    // Any error interrupt fails it, with or without data done
+    uint32_t errs[] = { ERR_CMD_TIMEOUT, ERR_DATA_TIMEOUT, ERR_DATA_CRC, ERR_AUTO_CMD, INTR_ERR };
+    for (unsigned i = 0; i < sizeof(errs) / sizeof(errs[0]); i++) {
+        CHECK_EQ(emmc_transfer_status(errs[i], 0), -1);
+        CHECK_EQ(emmc_transfer_status(errs[i] | INTR_DATA_DONE, DMA_CS_END), -1);
+    }
+
+    // The card finished but the DMA engine didn't drain, or hit a bus error
+    CHECK_EQ(emmc_transfer_status(INTR_DATA_DONE, DMA_CS_ACTIVE), -1);
+    CHECK_EQ(emmc_transfer_status(INTR_DATA_DONE, DMA_CS_ERROR | DMA_CS_END), -1);
+
+    // Not finished at all isn't success either
+    CHECK_EQ(emmc_transfer_status(0, 0), -1);
+    CHECK_EQ(emmc_transfer_status(INTR_CMD_DONE, 0), -1);
+}
+
+int main(void) {
+    test_read_chain();
+    test_write_chain();
+    test_request_limits();
+    test_splitting();
+    test_commands();
+    test_status();
+    return check_done("emmc_dma_test");
+}
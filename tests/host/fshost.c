@@ -0,0 +1,256 @@
+/*
+ * KikiOS host tests - filesystem environment (see fshost.h)
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "hal/hal.h"
+#include "smp.h"
+#include "ktimer.h"
+#include "mmu.h"
+#include "imgcache.h"
+#include "pagecache.h"
+#include "fshost.h"
+
+int fshost_verbose = 0;
+
+static int img_fd = -1;
+static fshost_blk_stats_t blk_stats;
+
+uint64_t fshost_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// ============ Image ============
+
+#define PART_START      2048        // Sectors, where partitioning tools put it
+#define RESERVED        32
+#define NUM_FATS        2
+#define FSINFO_SECTOR   1
+
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static int write_sector(int fd, uint32_t sector, const uint8_t *buf) {
+    return pwrite(fd, buf, 512, (off_t)sector * 512) == 512 ? 0 : -1;
+}
+
+int fshost_mkfs(const char *path, uint32_t size_mb) {
+    uint32_t total = size_mb * 2048 - PART_START;
+    // 2KB clusters up to 8GB keeps well past the 65525 FAT32 needs
+    uint32_t spc = 4;
+
+    // Each FAT sector maps 128 clusters; find the size that covers what's left
+    uint32_t fat_size = 1;
+    for (;;) {
+        uint32_t clusters = (total - RESERVED - NUM_FATS * fat_size) / spc;
+        uint32_t need = (clusters + 2 + 127) / 128;
+        if (need <= fat_size) break;
+        fat_size = need;
+    }
+    uint32_t clusters = (total - RESERVED - NUM_FATS * fat_size) / spc;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    // Sparse: everything not written below reads back as zeros
+    if (ftruncate(fd, (off_t)size_mb * 1024 * 1024) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    uint8_t s[512];
+    int ret = 0;
+
+    // MBR, one FAT32 LBA partition
+    memset(s, 0, sizeof(s));
+    s[446 + 4] = 0x0C;
+    put32(s + 446 + 8, PART_START);
+    put32(s + 446 + 12, total);
+    s[510] = 0x55;
+    s[511] = 0xAA;
+    ret |= write_sector(fd, 0, s);
+
+    // Boot sector, and its backup at 6
+    memset(s, 0, sizeof(s));
+    s[0] = 0xEB; s[1] = 0x58; s[2] = 0x90;
+    memcpy(s + 3, "KIKIOS  ", 8);
+    put16(s + 11, 512);
+    s[13] = spc;
+    put16(s + 14, RESERVED);
+    s[16] = NUM_FATS;
+    s[21] = 0xF8;                       // Fixed disk
+    put16(s + 24, 63);                  // Sectors per track
+    put16(s + 26, 255);                 // Heads
+    put32(s + 28, PART_START);          // Hidden sectors
+    put32(s + 32, total);
+    put32(s + 36, fat_size);
+    put32(s + 44, 2);                   // Root directory cluster
+    put16(s + 48, FSINFO_SECTOR);
+    put16(s + 50, 6);                   // Backup boot sector
+    s[64] = 0x80;
+    s[66] = 0x29;
+    put32(s + 67, 0x4B494B49);
+    memcpy(s + 71, "KIKIOS     ", 11);
+    memcpy(s + 82, "FAT32   ", 8);
+    s[510] = 0x55;
+    s[511] = 0xAA;
+    ret |= write_sector(fd, PART_START, s);
+    ret |= write_sector(fd, PART_START + 6, s);
+
+    // FSInfo: every cluster but the root's is free
+    memset(s, 0, sizeof(s));
+    put32(s, 0x41615252);
+    put32(s + 484, 0x61417272);
+    put32(s + 488, clusters - 1);
+    put32(s + 492, 3);
+    put32(s + 508, 0xAA550000);
+    ret |= write_sector(fd, PART_START + FSINFO_SECTOR, s);
+
+    // Both FATs: media, reserved entry, and the root directory's chain
+    memset(s, 0, sizeof(s));
+    put32(s, 0x0FFFFFF8);
+    put32(s + 4, 0x0FFFFFFF);
+    put32(s + 8, 0x0FFFFFFF);
+    for (int i = 0; i < NUM_FATS; i++) {
+        ret |= write_sector(fd, PART_START + RESERVED + i * fat_size, s);
+    }
+
+    close(fd);
+    return ret;
+}
+
+// ============ hal_blk on the image ============
+
+int fshost_blk_open(const char *path) {
+    img_fd = open(path, O_RDWR);
+    memset(&blk_stats, 0, sizeof(blk_stats));
+    return img_fd < 0 ? -1 : 0;
+}
+
+void fshost_blk_close(void) {
+    if (img_fd >= 0) close(img_fd);
+    img_fd = -1;
+}
+
+void fshost_blk_stats(fshost_blk_stats_t *out) {
+    *out = blk_stats;
+}
+
+static int blk_io(int write, uint32_t sector, void *buf, uint32_t len) {
+    off_t off = (off_t)sector * 512;
+    ssize_t n = write ? pwrite(img_fd, buf, len, off) : pread(img_fd, buf, len, off);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+int hal_blk_read(uint32_t sector, void *buf, uint32_t count) {
+    blk_stats.reads++;
+    blk_stats.sectors_read += count;
+    return blk_io(0, sector, buf, count * 512);
+}
+
+int hal_blk_write(uint32_t sector, const void *buf, uint32_t count) {
+    blk_stats.writes++;
+    blk_stats.sectors_written += count;
+    return blk_io(1, sector, (void *)buf, count * 512);
+}
+
+// One request, however many segments - done by the time submit returns
+int hal_blk_submit(hal_blk_req_t *req) {
+    if (req->nsegs < 1 || req->nsegs > HAL_BLK_MAX_SEGS) return -1;
+
+    uint32_t sector = req->sector;
+    req->status = 0;
+    for (int i = 0; i < req->nsegs; i++) {
+        if (req->len[i] == 0 || req->len[i] % 512) return -1;
+    }
+    for (int i = 0; i < req->nsegs; i++) {
+        if (blk_io(req->write, sector, req->buf[i], req->len[i]) < 0) req->status = -1;
+        sector += req->len[i] / 512;
+    }
+
+    uint32_t sectors = sector - req->sector;
+    if (req->write) {
+        blk_stats.writes++;
+        blk_stats.sectors_written += sectors;
+    } else {
+        blk_stats.reads++;
+        blk_stats.sectors_read += sectors;
+    }
+    req->done = 1;
+    return 0;
+}
+
+int hal_blk_wait(hal_blk_req_t *req) {
+    return req->status;
+}
+
+// ============ Kernel stubs ============
+
+// The kernel sources are built with printf renamed to this
+int kernel_printf(const char *fmt, ...) {
+    if (!fshost_verbose) return 0;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+// One thread: locks are always free
+void mutex_lock(mutex_t *m) {
+    m->depth++;
+}
+
+int mutex_trylock(mutex_t *m) {
+    m->depth++;
+    return 1;
+}
+
+void mutex_unlock(mutex_t *m) {
+    m->depth--;
+}
+
+// Time is the host's in microseconds. Nothing runs timers: the bcache
+// writes back when it fills up or is synced, never from bcache_idle.
+uint64_t ktimer_now(void) {
+    return fshost_now_us();
+}
+
+uint64_t ktimer_us_to_count(uint64_t us) {
+    return us;
+}
+
+void ktimer_add(ktimer_t *t, uint64_t deadline) {
+    t->deadline = deadline;
+}
+
+// No shared pages to keep DMA away from
+int mmu_dma_ok(const void *buf, size_t len) {
+    (void)buf;
+    (void)len;
+    return 1;
+}
+
+// No programs run, so no cached images or mapped pages to drop
+void imgcache_invalidate(uint32_t first_cluster) {
+    (void)first_cluster;
+}
+
+void pagecache_invalidate(uint32_t first_cluster) {
+    (void)first_cluster;
+}
@@ -0,0 +1,38 @@
+/*
+ * KikiOS host tests - filesystem environment
+ *
+ * Lets kernel/vfs.c, fat32.c, dcache.c and bcache.c run as an ordinary
+ * program: hal_blk is an image file, the heap is the C library's, and the
+ * scheduler, timers and MMU are stubs for a single thread.
+ */
+
+#ifndef FSHOST_H
+#define FSHOST_H
+
+#include <stdint.h>
+
+// Requests and sectors that reached the image file
+typedef struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+} fshost_blk_stats_t;
+
+// Write a freshly formatted FAT32 image of size_mb megabytes to path: an
+// MBR with one FAT32 (LBA) partition, as on a real disk. Returns 0 or -1.
+int fshost_mkfs(const char *path, uint32_t size_mb);
+
+// Back hal_blk with the image at path. Returns 0 or -1.
+int fshost_blk_open(const char *path);
+void fshost_blk_close(void);
+
+void fshost_blk_stats(fshost_blk_stats_t *out);
+
+// Show the kernel's printf output (off by default)
+extern int fshost_verbose;
+
+// Monotonic microseconds
+uint64_t fshost_now_us(void);
+
+#endif
@@ -0,0 +1,376 @@
+/*
+ * fsstress - FAT32/VFS consistency test and benchmark (kernel/vfs.c,
+ * fat32.c, dcache.c, bcache.c)
+ *
+ * Usage: fsstress [-v] [ops] [seed]
+ *   Formats a FAT32 image next to the binary (fsstress.img), mounts it
+ *   through vfs_init with hal_blk reading and writing the file, and runs
+ *   ops (default 2000) random operations - create, write, append, pwrite,
+ *   truncate, rename, delete, read, list - on files in a scratch
+ *   directory, doing each one to an in-memory model too. Reads and
+ *   listings are checked against the model as it goes, and every file once
+ *   more at the end with the block cache emptied, so what is checked then
+ *   comes from the image. Reports each operation's count, rate, block
+ *   cache hits/misses and the device requests it caused. -v shows the
+ *   kernel's messages. Exits 1 if anything didn't match.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vfs.h"
+#include "bcache.h"
+#include "fshost.h"
+
+#define DIR         "/fsstress.tmp"
+#define IMAGE_MB    256
+#define NFILES      24
+#define MAX_SIZE    (48 * 1024)
+#define MAX_APPEND  (8 * 1024)
+#define BATCH       16
+#define MAX_FAILS   10
+
+enum {
+    OP_CREATE, OP_WRITE, OP_APPEND, OP_PWRITE, OP_TRUNCATE,
+    OP_RENAME, OP_DELETE, OP_READ, OP_LIST, NUM_OPS
+};
+
+static const char *op_names[NUM_OPS] = {
+    "create", "write", "append", "pwrite", "truncate",
+    "rename", "delete", "read", "list"
+};
+
+// How often each operation is picked for a file that exists
+static const int op_weights[NUM_OPS] = { 0, 3, 4, 3, 2, 2, 1, 4, 1 };
+
+typedef struct {
+    int present;
+    char name[48];
+    uint32_t gen;               // Bumped on rename, so names are never reused
+    uint32_t size;
+    uint8_t *data;
+} mfile_t;
+
+typedef struct {
+    unsigned long count;
+    uint64_t us;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t reads;             // Device requests
+    uint64_t writes;
+} op_stats_t;
+
+static mfile_t files[NFILES];
+static op_stats_t stats[NUM_OPS];
+static uint8_t buf[MAX_SIZE];
+static vfs_dirent_t ents[BATCH];
+static uint32_t rng;
+static int fails;
+
+// xorshift32
+static uint32_t rand32(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+static uint32_t rand_below(uint32_t n) {
+    return n ? rand32() % n : 0;
+}
+
+static void fill_random(uint8_t *p, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) p[i] = (uint8_t)rand32();
+}
+
+// A short (8.3) or long name, so both kinds of directory entry get used
+static void make_name(int slot) {
+    mfile_t *f = &files[slot];
+    if (rand32() & 1) {
+        snprintf(f->name, sizeof(f->name), "f%d_%u", slot, f->gen % 100);
+    } else {
+        snprintf(f->name, sizeof(f->name), "stress file %d gen %u.dat", slot, f->gen);
+    }
+}
+
+static void make_path(char *out, const char *name) {
+    snprintf(out, 96, DIR "/%s", name);
+}
+
+static char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
+
+// FAT compares names case-insensitively, and may hand short ones back
+// upper-cased
+static int same_name(const char *a, const char *b) {
+    while (*a && *b) {
+        if (lower(*a++) != lower(*b++)) return 0;
+    }
+    return *a == *b;
+}
+
+static void fail(int op, const char *name, const char *what) {
+    fails++;
+    printf("fsstress: FAIL %s %s: %s\n", op_names[op], name, what);
+}
+
+// Compare a file on the image with the model
+static void check_file(int op, mfile_t *f) {
+    char path[96];
+    make_path(path, f->name);
+    vfs_node_t *file = vfs_open_handle(path);
+    if (!file) {
+        fail(op, f->name, "missing");
+        return;
+    }
+    if (file->size != f->size) {
+        fail(op, f->name, "wrong size");
+    } else if (f->size && vfs_read(file, (char *)buf, f->size, 0) != (int)f->size) {
+        fail(op, f->name, "short read");
+    } else if (memcmp(buf, f->data, f->size) != 0) {
+        fail(op, f->name, "wrong contents");
+    }
+    vfs_close_handle(file);
+}
+
+// Compare the directory listing with the model
+static void check_dir(void) {
+    vfs_dir_t *dir = vfs_opendir(DIR);
+    if (!dir) {
+        fail(OP_LIST, DIR, "cannot open");
+        return;
+    }
+
+    int seen = 0;
+    int expected = 0;
+    for (int i = 0; i < NFILES; i++) expected += files[i].present;
+
+    int n;
+    while ((n = vfs_readdir_batch(dir, ents, BATCH)) > 0) {
+        for (int e = 0; e < n; e++) {
+            int i = 0;
+            while (i < NFILES && !(files[i].present && same_name(files[i].name, ents[e].name))) i++;
+            if (i == NFILES) {
+                fail(OP_LIST, ents[e].name, "not in the model");
+            } else if (ents[e].size != files[i].size) {
+                fail(OP_LIST, ents[e].name, "listed with the wrong size");
+            }
+            seen++;
+        }
+    }
+    if (n < 0) fail(OP_LIST, DIR, "vfs_readdir_batch failed");
+    if (seen != expected) fail(OP_LIST, DIR, "wrong number of entries");
+    vfs_closedir(dir);
+}
+
+// Open a file that should exist, counting a failure if it doesn't
+static vfs_node_t *open_file(int op, mfile_t *f) {
+    char path[96];
+    make_path(path, f->name);
+    vfs_node_t *file = vfs_open_handle(path);
+    if (!file) fail(op, f->name, "cannot open");
+    return file;
+}
+
+static void do_op(int op, int slot) {
+    mfile_t *f = &files[slot];
+    char path[96];
+    char old[96];
+    vfs_node_t *file;
+    uint32_t off, len;
+
+    switch (op) {
+    case OP_CREATE:
+        make_name(slot);
+        make_path(path, f->name);
+        if (!vfs_create(path)) {
+            fail(op, f->name, "cannot create");
+            return;
+        }
+        f->present = 1;
+        f->size = 0;
+        break;
+
+    case OP_WRITE:
+        len = rand_below(MAX_SIZE + 1);
+        fill_random(buf, len);
+        if (!(file = open_file(op, f))) return;
+        if (vfs_write(file, (const char *)buf, len) != (int)len) fail(op, f->name, "short write");
+        vfs_close_handle(file);
+        memcpy(f->data, buf, len);
+        f->size = len;
+        break;
+
+    case OP_APPEND:
+        len = rand_below(MAX_APPEND + 1);
+        if (len > MAX_SIZE - f->size) len = MAX_SIZE - f->size;
+        fill_random(f->data + f->size, len);
+        if (!(file = open_file(op, f))) return;
+        if (vfs_pwrite(file, (const char *)f->data + f->size, len, f->size) != (int)len) {
+            fail(op, f->name, "short write");
+        }
+        vfs_close_handle(file);
+        f->size += len;
+        break;
+
+    case OP_PWRITE:
+        off = rand_below(f->size + 1);
+        len = rand_below(MAX_APPEND + 1);
+        if (len > MAX_SIZE - off) len = MAX_SIZE - off;
+        fill_random(f->data + off, len);
+        if (!(file = open_file(op, f))) return;
+        if (vfs_pwrite(file, (const char *)f->data + off, len, off) != (int)len) {
+            fail(op, f->name, "short write");
+        }
+        vfs_close_handle(file);
+        if (off + len > f->size) f->size = off + len;
+        break;
+
+    case OP_TRUNCATE:
+        len = rand_below(f->size + MAX_APPEND + 1);
+        if (len > MAX_SIZE) len = MAX_SIZE;
+        if (!(file = open_file(op, f))) return;
+        if (vfs_truncate(file, len) != 0) fail(op, f->name, "truncate failed");
+        vfs_close_handle(file);
+        if (len > f->size) memset(f->data + f->size, 0, len - f->size);
+        f->size = len;
+        break;
+
+    case OP_RENAME:
+        make_path(old, f->name);
+        f->gen++;
+        make_name(slot);
+        if (vfs_rename(old, f->name) != 0) fail(op, f->name, "rename failed");
+        break;
+
+    case OP_DELETE:
+        make_path(path, f->name);
+        if (vfs_delete(path) != 0) fail(op, f->name, "delete failed");
+        f->present = 0;
+        f->gen++;
+        break;
+
+    case OP_READ:
+        check_file(op, f);
+        break;
+
+    case OP_LIST:
+        check_dir();
+        break;
+    }
+}
+
+// A missing file gets created; an existing one a weighted pick of the rest
+static int pick_op(int slot) {
+    if (!files[slot].present) return OP_CREATE;
+    int total = 0;
+    for (int i = 0; i < NUM_OPS; i++) total += op_weights[i];
+    int r = (int)rand_below(total);
+    for (int i = 0; i < NUM_OPS; i++) {
+        if (r < op_weights[i]) return i;
+        r -= op_weights[i];
+    }
+    return OP_READ;
+}
+
+static void timed_op(int op, int slot) {
+    bcache_stats_t c0, c1;
+    fshost_blk_stats_t b0, b1;
+    bcache_get_stats(&c0);
+    fshost_blk_stats(&b0);
+    uint64_t t0 = fshost_now_us();
+
+    do_op(op, slot);
+
+    stats[op].us += fshost_now_us() - t0;
+    bcache_get_stats(&c1);
+    fshost_blk_stats(&b1);
+    stats[op].count++;
+    stats[op].hits += c1.hits - c0.hits;
+    stats[op].misses += c1.misses - c0.misses;
+    stats[op].reads += b1.reads - b0.reads;
+    stats[op].writes += b1.writes - b0.writes;
+}
+
+static void report(uint64_t us) {
+    // Write-back happens when the cache fills, so writes land on whichever
+    // operation was running then - the totals are what to compare
+    printf("              ops     ops/s    hits  misses   reads  writes\n");
+    for (int op = 0; op < NUM_OPS; op++) {
+        op_stats_t *s = &stats[op];
+        printf("  %-8s %7lu %9lu %7llu %7llu %7llu %7llu\n", op_names[op], s->count,
+               s->us ? (unsigned long)(s->count * 1000000 / s->us) : 0,
+               (unsigned long long)s->hits, (unsigned long long)s->misses,
+               (unsigned long long)s->reads, (unsigned long long)s->writes);
+    }
+
+    fshost_blk_stats_t b;
+    fshost_blk_stats(&b);
+    unsigned long total = 0;
+    for (int op = 0; op < NUM_OPS; op++) total += stats[op].count;
+    printf("\n  %lu ops in %llu ms, %lu ops/s\n", total, (unsigned long long)(us / 1000),
+           us ? (unsigned long)(total * 1000000 / us) : 0);
+    printf("  device: %llu reads (%llu sectors), %llu writes (%llu sectors)\n",
+           (unsigned long long)b.reads, (unsigned long long)b.sectors_read,
+           (unsigned long long)b.writes, (unsigned long long)b.sectors_written);
+}
+
+int main(int argc, char **argv) {
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "-v") == 0) {
+        fshost_verbose = 1;
+        arg++;
+    }
+    unsigned long ops = arg < argc ? strtoul(argv[arg++], NULL, 10) : 2000;
+    rng = arg < argc ? (uint32_t)strtoul(argv[arg++], NULL, 10) : 1;
+    if (rng == 0) rng = 1;
+
+    char image[4096];
+    snprintf(image, sizeof(image), "%s.img", argv[0]);
+    if (fshost_mkfs(image, IMAGE_MB) < 0 || fshost_blk_open(image) < 0) {
+        printf("fsstress: cannot create %s\n", image);
+        return 1;
+    }
+
+    for (int i = 0; i < NFILES; i++) {
+        files[i].data = malloc(MAX_SIZE);
+        if (!files[i].data) {
+            printf("fsstress: out of memory\n");
+            return 1;
+        }
+    }
+
+    vfs_init();
+    if (!vfs_mkdir(DIR)) {
+        printf("fsstress: cannot create " DIR " on %s\n", image);
+        return 1;
+    }
+
+    printf("fsstress: %lu ops, seed %u, %d MB image\n\n", ops, rng, IMAGE_MB);
+
+    uint64_t t0 = fshost_now_us();
+    for (unsigned long n = 0; n < ops && fails < MAX_FAILS; n++) {
+        int slot = (int)rand_below(NFILES);
+        timed_op(pick_op(slot), slot);
+    }
+    uint64_t us = fshost_now_us() - t0;
+
+    // Everything once more, from the image
+    bcache_drop();
+    for (int i = 0; i < NFILES && fails < MAX_FAILS; i++) {
+        if (files[i].present) check_file(OP_READ, &files[i]);
+    }
+    check_dir();
+
+    report(us);
+    fshost_blk_close();
+
+    printf("\n");
+    if (fails) {
+        printf("fsstress: %d failures\n", fails);
+        return 1;
+    }
+    printf("fsstress: model and image agree\n");
+    return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * blkbench - block cache benchmark
+ *
+ * Usage: blkbench [file]
+ *   Empties the block cache, then reads every file in /bin twice (cold,
+ *   then warm), then does the same for one large file (default /bin/tcc).
+ *   Reports time, throughput and the cache's hit/miss counts for each pass.
+ *   Cold reads show what read-ahead gets out of the disk; warm reads
+ *   should never touch it.
+ */
+
+#include "../lib/kiki.h"
+
+#define READ_BUF_SIZE   (64 * 1024)
+
+static kapi_t *api;
+static char *buf;
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+static void print_padded(unsigned long n, int width) {
+    int digits = 1;
+    for (unsigned long v = n; v >= 10; v /= 10) digits++;
+    while (digits++ < width) out_putc(' ');
+    print_num(n);
+}
+
+// Read a whole file, returns bytes read
+static unsigned long read_file(const char *path) {
+    void *file = api->open(path);
+    if (!file) return 0;
+    if (api->is_dir(file)) {
+        api->close(file);
+        return 0;
+    }
+
+    unsigned long size = api->file_size(file);
+    unsigned long offset = 0;
+    while (offset < size) {
+        unsigned long chunk = size - offset;
+        if (chunk > READ_BUF_SIZE) chunk = READ_BUF_SIZE;
+
+        int rd = api->read(file, buf, chunk, offset);
+        if (rd <= 0) break;
+        offset += rd;
+    }
+    api->close(file);
+    return offset;
+}
+
+// Every regular file in /bin
+static unsigned long read_bin(void) {
+    void *dir = api->open("/bin");
+    if (!dir) return 0;
+
+    unsigned long total = 0;
+    char name[64];
+    char path[80];
+    uint8_t type;
+    for (int i = 0; api->readdir(dir, i, name, sizeof(name), &type) >= 0; i++) {
+        if (type == 2) continue;
+
+        int n = 0;
+        for (const char *s = "/bin/"; *s; s++) path[n++] = *s;
+        for (const char *s = name; *s && n < (int)sizeof(path) - 1; s++) path[n++] = *s;
+        path[n] = '\0';
+        total += read_file(path);
+    }
+    api->close(dir);
+    return total;
+}
+
+// One pass: time it, and count the blocks it found cached or read
+static void pass(const char *label, const char *path) {
+    uint64_t hits0, misses0, hits1, misses1;
+    api->blk_cache_stats(&hits0, &misses0);
+
+    uint64_t t0 = api->get_uptime_us();
+    unsigned long bytes = path ? read_file(path) : read_bin();
+    uint64_t us = api->get_uptime_us() - t0;
+
+    api->blk_cache_stats(&hits1, &misses1);
+
+    out_puts("  ");
+    out_puts(label);
+    print_padded(bytes / 1024, 8);
+    print_padded((unsigned long)(us / 1000), 8);
+    print_padded(us ? (unsigned long)((uint64_t)bytes * 1000000 / 1024 / us) : 0, 10);
+    print_padded((unsigned long)(hits1 - hits0), 8);
+    print_padded((unsigned long)(misses1 - misses0), 8);
+    out_putc('\n');
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    api = k;
+    const char *big = argc > 1 ? argv[1] : "/bin/tcc";
+
+    buf = k->malloc(READ_BUF_SIZE);
+    if (!buf) {
+        out_puts("blkbench: out of memory\n");
+        return 1;
+    }
+
+    out_puts("blkbench: /bin and ");
+    out_puts(big);
+    out_puts("\n\n");
+    out_puts("                  KB      ms      KB/s    hits  misses\n");
+
+    k->blk_cache_drop();
+    pass("/bin cold ", 0);
+    pass("/bin warm ", 0);
+
+    k->blk_cache_drop();
+    pass("file cold ", big);
+    pass("file warm ", big);
+
+    k->free(buf);
+    return 0;
+}
@@ -8,6 +8,8 @@
 
 #include "../lib/kiki.h"
 
+#define COPY_BUF_SIZE (64 * 1024)
+
 static kapi_t *api;
 
 static void out_puts(const char *s) {
@@ -56,48 +58,64 @@ static int copy_file(const char *src, const char *dst) {
         return -1;
     }
 
-    // Create destination file
-    void *dst_file = api->create(dst);
+    // Create destination file, then write it through a handle: each chunk
+    // goes in place after the last instead of rewriting the whole file
+    void *dst_file = api->create(dst) ? api->open(dst) : 0;
     if (!dst_file) {
         out_puts("cp: cannot create '");
         out_puts(dst);
         out_puts("'\n");
+        api->close(src_file);
         return -1;
     }
+    api->truncate(dst_file, 0);  // create() keeps an existing file
 
     // Copy content in chunks
-    char buf[4096];
+    char *buf = api->malloc(COPY_BUF_SIZE);
+    if (!buf) {
+        out_puts("cp: out of memory\n");
+        api->close(src_file);
+        api->close(dst_file);
+        return -1;
+    }
+
     size_t offset = 0;
     int bytes;
+    int status = 0;
 
-    while ((bytes = api->read(src_file, buf, sizeof(buf), offset)) > 0) {
-        // Write to destination (write appends, so no offset needed)
-        // But our write() always appends, so we need to truncate first
-        // Actually, create() makes empty file, so this should work
-        if (offset == 0) {
-            // First write - file is empty from create()
-            api->write(dst_file, buf, bytes);
-        } else {
-            // Subsequent writes - append
-            api->write(dst_file, buf, bytes);
+    while ((bytes = api->read(src_file, buf, COPY_BUF_SIZE, offset)) > 0) {
+        if (api->pwrite(dst_file, buf, bytes, offset) != bytes) {
+            out_puts("cp: write error on '");
+            out_puts(dst);
+            out_puts("'\n");
+            status = -1;
+            break;
         }
         offset += bytes;
     }
 
-    return 0;
+    api->free(buf);
+    api->close(src_file);
+    api->close(dst_file);
+    return status;
 }
 
+// Directory entries read per call
+#define BATCH 16
+
 // Recursive directory copy
 static int copy_recursive(const char *src, const char *dst) {
-    void *src_node = api->open(src);
-    if (!src_node) {
-        out_puts("cp: cannot open '");
-        out_puts(src);
-        out_puts("'\n");
-        return -1;
-    }
+    void *dir = api->opendir(src);
+    if (!dir) {
+        void *src_node = api->open(src);
+        if (!src_node) {
+            out_puts("cp: cannot open '");
+            out_puts(src);
+            out_puts("'\n");
+            return -1;
+        }
+        api->close(src_node);
 
-    if (!api->is_dir(src_node)) {
         // Regular file
         return copy_file(src, dst);
     }
@@ -111,49 +129,60 @@ static int copy_recursive(const char *src, const char *dst) {
             out_puts("cp: cannot create directory '");
             out_puts(dst);
             out_puts("'\n");
+            api->closedir(dir);
             return -1;
         }
     }
+    api->close(dst_node);
+
+    dirent_t *ents = api->malloc(BATCH * sizeof(dirent_t));
+    if (!ents) {
+        out_puts("cp: out of memory\n");
+        api->closedir(dir);
+        return -1;
+    }
 
     // Iterate through source directory
-    char name[256];
-    uint8_t type;
-    int idx = 0;
     int status = 0;
+    int n;
 
-    while (api->readdir(src_node, idx, name, sizeof(name), &type) == 0) {
-        idx++;
+    while ((n = api->readdir_batch(dir, ents, BATCH)) > 0) {
+        for (int i = 0; i < n; i++) {
+            const char *name = ents[i].name;
 
-        // Skip . and ..
-        if (str_cmp(name, ".") == 0 || str_cmp(name, "..") == 0) {
-            continue;
-        }
+            // Skip . and ..
+            if (str_cmp(name, ".") == 0 || str_cmp(name, "..") == 0) {
+                continue;
+            }
 
-        // Build paths
-        char src_path[512], dst_path[512];
+            // Build paths
+            char src_path[512], dst_path[512];
 
-        str_cpy(src_path, src);
-        int slen = str_len(src_path);
-        if (slen > 0 && src_path[slen - 1] != '/') {
-            src_path[slen++] = '/';
-            src_path[slen] = '\0';
-        }
-        str_cpy(src_path + slen, name);
+            str_cpy(src_path, src);
+            int slen = str_len(src_path);
+            if (slen > 0 && src_path[slen - 1] != '/') {
+                src_path[slen++] = '/';
+                src_path[slen] = '\0';
+            }
+            str_cpy(src_path + slen, name);
 
-        str_cpy(dst_path, dst);
-        int dlen = str_len(dst_path);
-        if (dlen > 0 && dst_path[dlen - 1] != '/') {
-            dst_path[dlen++] = '/';
-            dst_path[dlen] = '\0';
-        }
-        str_cpy(dst_path + dlen, name);
+            str_cpy(dst_path, dst);
+            int dlen = str_len(dst_path);
+            if (dlen > 0 && dst_path[dlen - 1] != '/') {
+                dst_path[dlen++] = '/';
+                dst_path[dlen] = '\0';
+            }
+            str_cpy(dst_path + dlen, name);
 
-        // Recursively copy
-        if (copy_recursive(src_path, dst_path) < 0) {
-            status = -1;
+            // Recursively copy
+            if (copy_recursive(src_path, dst_path) < 0) {
+                status = -1;
+            }
         }
     }
 
+    api->free(ents);
+    api->closedir(dir);
     return status;
 }
 
@@ -2146,6 +2146,9 @@ int main(kapi_t *kapi, int argc, char **argv) {
 
     api = kapi;
 
+    // Input and redraw latency matter more than background throughput
+    if (api->set_priority) api->set_priority(PRIORITY_INTERACTIVE);
+
     // Get screen dimensions from kapi
     SCREEN_WIDTH = api->fb_width;
     SCREEN_HEIGHT = api->fb_height;
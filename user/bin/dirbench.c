@@ -0,0 +1,139 @@
+/*
+ * dirbench - directory listing benchmark
+ *
+ * Usage: dirbench [path]
+ *   Walks the tree under path (default /) like find does, first with the
+ *   index-based readdir (each call rescans the directory up to that index),
+ *   then with opendir/readdir_batch (one pass per directory). Reports the
+ *   entries seen and the time each walk took.
+ */
+
+#include "../lib/kiki.h"
+
+#define BATCH 16
+
+static kapi_t *api;
+static unsigned long entries;
+static unsigned long dirs;
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+static void print_padded(unsigned long n, int width) {
+    int digits = 1;
+    for (unsigned long v = n; v >= 10; v /= 10) digits++;
+    while (digits++ < width) out_putc(' ');
+    print_num(n);
+}
+
+// path + "/" + name
+static void join(char *out, const char *path, const char *name) {
+    int n = 0;
+    for (const char *s = path; *s; s++) out[n++] = *s;
+    if (n > 0 && out[n - 1] != '/') out[n++] = '/';
+    for (const char *s = name; *s && n < 511; s++) out[n++] = *s;
+    out[n] = '\0';
+}
+
+static void walk_index(const char *path) {
+    void *dir = api->open(path);
+    if (!dir) return;
+    dirs++;
+
+    char name[256];
+    char child[512];
+    uint8_t type;
+    for (int i = 0; api->readdir(dir, i, name, sizeof(name), &type) == 0; i++) {
+        entries++;
+        if (type == 2) {
+            join(child, path, name);
+            walk_index(child);
+        }
+    }
+    api->close(dir);
+}
+
+static void walk_batch(const char *path) {
+    void *dir = api->opendir(path);
+    if (!dir) return;
+    dirs++;
+
+    dirent_t *ents = api->malloc(BATCH * sizeof(dirent_t));
+    if (!ents) {
+        api->closedir(dir);
+        return;
+    }
+
+    char child[512];
+    int n;
+    while ((n = api->readdir_batch(dir, ents, BATCH)) > 0) {
+        for (int i = 0; i < n; i++) {
+            entries++;
+            if (ents[i].type == 2) {
+                join(child, path, ents[i].name);
+                walk_batch(child);
+            }
+        }
+    }
+    api->free(ents);
+    api->closedir(dir);
+}
+
+static void pass(const char *label, void (*walk)(const char *), const char *path) {
+    entries = 0;
+    dirs = 0;
+
+    uint64_t t0 = api->get_uptime_us();
+    walk(path);
+    uint64_t us = api->get_uptime_us() - t0;
+
+    out_puts("  ");
+    out_puts(label);
+    print_padded(dirs, 8);
+    print_padded(entries, 9);
+    print_padded((unsigned long)(us / 1000), 8);
+    out_putc('\n');
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    api = k;
+    const char *path = argc > 1 ? argv[1] : "/";
+
+    out_puts("dirbench: ");
+    out_puts(path);
+    out_puts("\n\n");
+    out_puts("                    dirs  entries      ms\n");
+
+    // Warm the block cache first so both walks measure the listing itself
+    walk_batch(path);
+
+    pass("readdir       ", walk_index, path);
+    pass("readdir_batch ", walk_batch, path);
+    return 0;
+}
@@ -21,7 +21,15 @@ extern void D_PostEvent(event_t *ev);
 kapi_t *doom_kapi = 0;
 
 /* Start time for DG_GetTicksMs */
-static uint64_t start_ticks = 0;
+static uint64_t start_ms = 0;
+
+/* Millisecond clock if the kernel has one, else 10ms ticks (100Hz) */
+static uint64_t uptime_ms(void) {
+    if (doom_kapi->get_uptime_us) {
+        return doom_kapi->get_uptime_us() / 1000;
+    }
+    return doom_kapi->get_uptime_ticks() * 10;
+}
 
 /* Screen positioning - calculated at runtime to center on any resolution */
 static int screen_offset_x = 0;
@@ -170,7 +178,7 @@ static void poll_mouse(void) {
 
 void DG_Init(void) {
     /* Record start time */
-    start_ticks = doom_kapi->get_uptime_ticks();
+    start_ms = uptime_ms();
 
     /* Calculate scale factor - largest integer scale that fits */
     int fb_w = doom_kapi->fb_width;
@@ -244,9 +252,7 @@ void DG_SleepMs(uint32_t ms) {
 }
 
 uint32_t DG_GetTicksMs(void) {
-    /* KikiOS ticks are 10ms each (100Hz timer) */
-    uint64_t now = doom_kapi->get_uptime_ticks();
-    return (uint32_t)((now - start_ticks) * 10);
+    return (uint32_t)(uptime_ms() - start_ms);
 }
 
 int DG_GetKey(int *pressed, unsigned char *doomKey) {
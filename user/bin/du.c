@@ -64,74 +64,84 @@ static void str_cpy(char *dst, const char *src) {
     while ((*dst++ = *src++));
 }
 
+// Directory entries read per call
+#define BATCH 16
+
+// Print one line: size in 1K blocks (at least 1), then path
+static void print_line(int size, const char *path, int human) {
+    int kb = (size + 1023) / 1024;  // Round up to 1K blocks
+    if (kb == 0) kb = 1;  // Minimum 1K
+
+    if (human) {
+        print_human(kb);
+    } else {
+        print_num(kb);
+    }
+    out_putc('\t');
+    out_puts(path);
+    out_putc('\n');
+}
+
 // Calculate size recursively
 // Returns size in bytes
 static int calc_size(const char *path, int summary, int human) {
-    void *node = api->open(path);
-    if (!node) {
-        return 0;
-    }
-
-    if (!api->is_dir(node)) {
-        // Regular file
+    void *dir = api->opendir(path);
+    if (!dir) {
+        // Regular file (or nothing there)
+        void *node = api->open(path);
+        if (!node) {
+            return 0;
+        }
         int size = api->file_size(node);
-        int kb = (size + 1023) / 1024;  // Round up to 1K blocks
-        if (kb == 0) kb = 1;  // Minimum 1K
+        api->close(node);
 
-        if (!summary) {
-            if (human) {
-                print_human(kb);
-            } else {
-                print_num(kb);
-            }
-            out_putc('\t');
-            out_puts(path);
-            out_putc('\n');
-        }
+        if (!summary) print_line(size, path, human);
         return size;
     }
 
-    // Directory - recurse
-    int total = 0;
-    char name[256];
-    uint8_t type;
-    int idx = 0;
+    dirent_t *ents = api->malloc(BATCH * sizeof(dirent_t));
+    if (!ents) {
+        api->closedir(dir);
+        return 0;
+    }
 
-    while (api->readdir(node, idx, name, sizeof(name), &type) == 0) {
-        idx++;
+    // Directory - sizes of files come with the entries, only
+    // subdirectories need a recursive call
+    int total = 0;
+    int n;
+    while ((n = api->readdir_batch(dir, ents, BATCH)) > 0) {
+        for (int i = 0; i < n; i++) {
+            const char *name = ents[i].name;
+
+            // Skip . and ..
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
 
-        // Skip . and ..
-        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
-            continue;
-        }
+            // Build full path
+            char child_path[512];
+            str_cpy(child_path, path);
+            int plen = str_len(child_path);
+            if (plen > 0 && child_path[plen - 1] != '/') {
+                child_path[plen++] = '/';
+                child_path[plen] = '\0';
+            }
+            str_cpy(child_path + plen, name);
 
-        // Build full path
-        char child_path[512];
-        str_cpy(child_path, path);
-        int plen = str_len(child_path);
-        if (plen > 0 && child_path[plen - 1] != '/') {
-            child_path[plen++] = '/';
-            child_path[plen] = '\0';
+            if (ents[i].type == 2) {
+                total += calc_size(child_path, summary, human);
+            } else {
+                total += ents[i].size;
+                if (!summary) print_line(ents[i].size, child_path, human);
+            }
         }
-        str_cpy(child_path + plen, name);
-
-        total += calc_size(child_path, summary, human);
     }
 
+    api->free(ents);
+    api->closedir(dir);
+
     // Print directory total
-    int kb = (total + 1023) / 1024;
-    if (kb == 0) kb = 1;
-
-    if (!summary) {
-        if (human) {
-            print_human(kb);
-        } else {
-            print_num(kb);
-        }
-        out_putc('\t');
-        out_puts(path);
-        out_putc('\n');
-    }
+    if (!summary) print_line(total, path, human);
 
     return total;
 }
@@ -167,38 +177,14 @@ int main(kapi_t *k, int argc, char **argv) {
 
         int total = calc_size(cwd, summary, human);
 
-        if (summary) {
-            int kb = (total + 1023) / 1024;
-            if (kb == 0) kb = 1;
-
-            if (human) {
-                print_human(kb);
-            } else {
-                print_num(kb);
-            }
-            out_putc('\t');
-            out_puts(cwd);
-            out_putc('\n');
-        }
+        if (summary) print_line(total, cwd, human);
         return 0;
     }
 
     for (int i = 0; i < path_count; i++) {
         int total = calc_size(paths[i], summary, human);
 
-        if (summary) {
-            int kb = (total + 1023) / 1024;
-            if (kb == 0) kb = 1;
-
-            if (human) {
-                print_human(kb);
-            } else {
-                print_num(kb);
-            }
-            out_putc('\t');
-            out_puts(paths[i]);
-            out_putc('\n');
-        }
+        if (summary) print_line(total, paths[i], human);
     }
 
     return 0;
@@ -270,38 +270,31 @@ static int http_get(url_t *url, char *response, int max_response, http_response_
         return -1;
     }
 
-    // Receive response
+    // Receive response, sleeping until data arrives (giving up after
+    // 5 seconds of silence)
     int total = 0;
-    int timeout = 0;
 
-    while (total < max_response - 1 && timeout < 500) {
+    while (total < max_response - 1) {
         int n;
         if (url->use_tls) {
-            n = k->tls_recv(sock, response + total, max_response - 1 - total);
+            n = k->tls_recv_timeout(sock, response + total, max_response - 1 - total, 5000);
         } else {
-            n = k->tcp_recv(sock, response + total, max_response - 1 - total);
+            n = k->tcp_recv_timeout(sock, response + total, max_response - 1 - total, 5000);
         }
 
-        if (n < 0) break;  // Connection closed
-        if (n == 0) {
-            k->net_poll();
-            k->sleep_ms(10);
-            timeout++;
-            continue;
-        }
+        if (n <= 0) break;  // Connection closed or timed out
         total += n;
-        timeout = 0;
 
         // Check if we got headers yet
         if (resp->header_len == 0) {
             response[total] = '\0';
             parse_headers(response, total, resp);
+        }
 
-            // If we have Content-Length and got all content, we're done
-            if (resp->header_len > 0 && resp->content_length >= 0) {
-                int body_received = total - resp->header_len;
-                if (body_received >= resp->content_length) break;
-            }
+        // If we have Content-Length and got all content, we're done
+        if (resp->header_len > 0 && resp->content_length >= 0) {
+            int body_received = total - resp->header_len;
+            if (body_received >= resp->content_length) break;
         }
     }
 
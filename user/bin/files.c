@@ -243,38 +243,40 @@ static int delete_recursive(const char *path) {
 
     // If that failed, it might be a non-empty directory
     // Open directory and iterate
-    void *dir = api->open(path);
+    void *dir = api->opendir(path);
     if (!dir) {
         return -1;
     }
 
-    char name[256];
-    uint8_t type;
+    dirent_t ents[8];
     char child_path[512];
-    int idx = 0;
+    int n;
 
     // Collect all names first, then delete
-    // (Can't delete while iterating - shifts indices)
+    // (Can't delete while iterating - entries may move)
     char all_names[4096];
     int name_offsets[128];
     int name_count = 0;
     int buf_pos = 0;
 
-    while (api->readdir(dir, idx, name, sizeof(name), &type) == 0) {
-        idx++;
+    while ((n = api->readdir_batch(dir, ents, 8)) > 0) {
+        for (int i = 0; i < n; i++) {
+            const char *name = ents[i].name;
 
-        // Skip . and ..
-        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-            continue;
-        }
+            // Skip . and ..
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
 
-        // Store name
-        if (name_count < 128 && buf_pos + (int)strlen(name) + 1 < 4096) {
-            name_offsets[name_count++] = buf_pos;
-            strcpy(all_names + buf_pos, name);
-            buf_pos += strlen(name) + 1;
+            // Store name
+            if (name_count < 128 && buf_pos + (int)strlen(name) + 1 < 4096) {
+                name_offsets[name_count++] = buf_pos;
+                strcpy(all_names + buf_pos, name);
+                buf_pos += strlen(name) + 1;
+            }
         }
     }
+    api->closedir(dir);
 
     // Now delete all collected entries
     for (int i = 0; i < name_count; i++) {
@@ -302,8 +304,8 @@ static void refresh_directory(void) {
     item_count = 0;
     selected_idx = -1;
 
-    void *dir = api->open(current_path);
-    if (!dir || !api->is_dir(dir)) {
+    void *dir = api->opendir(current_path);
+    if (!dir) {
         return;
     }
 
@@ -315,22 +317,24 @@ static void refresh_directory(void) {
     }
 
     // Read directory entries
-    char name[64];
-    uint8_t type;
-    int idx = 0;
-
-    while (item_count < MAX_ITEMS && api->readdir(dir, idx, name, sizeof(name), &type) == 0) {
-        // Skip . and ..
-        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
-            idx++;
-            continue;
-        }
+    dirent_t ents[8];
+    int n;
 
-        strcpy(items[item_count].name, name);
-        items[item_count].is_dir = (type == 2);  // VFS_DIRECTORY = 2
-        item_count++;
-        idx++;
+    while (item_count < MAX_ITEMS && (n = api->readdir_batch(dir, ents, 8)) > 0) {
+        for (int i = 0; i < n && item_count < MAX_ITEMS; i++) {
+            const char *name = ents[i].name;
+
+            // Skip . and ..
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+                continue;
+            }
+
+            strncpy_safe(items[item_count].name, name, sizeof(items[item_count].name));
+            items[item_count].is_dir = (ents[i].type == 2);  // VFS_DIRECTORY = 2
+            item_count++;
+        }
     }
+    api->closedir(dir);
 
     scroll_offset = 0;
 }
@@ -57,61 +57,70 @@ static void str_cpy(char *dst, const char *src) {
     while ((*dst++ = *src++));
 }
 
+// Directory entries read per call
+#define BATCH 16
+
 // Recursive find
 static void find_recursive(const char *path, const char *name_pattern, int type_filter) {
-    void *dir = api->open(path);
-    if (!dir || !api->is_dir(dir)) {
+    void *dir = api->opendir(path);
+    if (!dir) {
         return;
     }
 
-    char name[256];
-    uint8_t type;
-    int idx = 0;
+    dirent_t *ents = api->malloc(BATCH * sizeof(dirent_t));
+    if (!ents) {
+        api->closedir(dir);
+        return;
+    }
 
-    while (api->readdir(dir, idx, name, sizeof(name), &type) == 0) {
-        idx++;
+    int n;
+    while ((n = api->readdir_batch(dir, ents, BATCH)) > 0) {
+        for (int i = 0; i < n; i++) {
+            const char *name = ents[i].name;
 
-        // Skip . and ..
-        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
-            continue;
-        }
+            // Skip . and ..
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
 
-        // Build full path
-        char full_path[512];
-        str_cpy(full_path, path);
-        int plen = str_len(full_path);
-        if (plen > 0 && full_path[plen - 1] != '/') {
-            full_path[plen++] = '/';
-            full_path[plen] = '\0';
-        }
-        str_cpy(full_path + plen, name);
+            // Build full path
+            char full_path[512];
+            str_cpy(full_path, path);
+            int plen = str_len(full_path);
+            if (plen > 0 && full_path[plen - 1] != '/') {
+                full_path[plen++] = '/';
+                full_path[plen] = '\0';
+            }
+            str_cpy(full_path + plen, name);
 
-        // Check if it's a directory
-        void *node = api->open(full_path);
-        int is_dir = node && api->is_dir(node);
+            int is_dir = ents[i].type == 2;
 
-        // Check type filter
-        int type_ok = 1;
-        if (type_filter == 'f' && is_dir) type_ok = 0;
-        if (type_filter == 'd' && !is_dir) type_ok = 0;
+            // Check type filter
+            int type_ok = 1;
+            if (type_filter == 'f' && is_dir) type_ok = 0;
+            if (type_filter == 'd' && !is_dir) type_ok = 0;
 
-        // Check name pattern
-        int name_ok = 1;
-        if (name_pattern && !glob_match(name_pattern, name)) {
-            name_ok = 0;
-        }
+            // Check name pattern
+            int name_ok = 1;
+            if (name_pattern && !glob_match(name_pattern, name)) {
+                name_ok = 0;
+            }
 
-        // Print if both match
-        if (type_ok && name_ok) {
-            out_puts(full_path);
-            out_putc('\n');
-        }
+            // Print if both match
+            if (type_ok && name_ok) {
+                out_puts(full_path);
+                out_putc('\n');
+            }
 
-        // Recurse into directories
-        if (is_dir) {
-            find_recursive(full_path, name_pattern, type_filter);
+            // Recurse into directories
+            if (is_dir) {
+                find_recursive(full_path, name_pattern, type_filter);
+            }
         }
     }
+
+    api->free(ents);
+    api->closedir(dir);
 }
 
 int main(kapi_t *k, int argc, char **argv) {
@@ -178,8 +187,10 @@ int main(kapi_t *k, int argc, char **argv) {
             out_puts(path);
             out_putc('\n');
         }
+        k->close(start);
         return 0;
     }
+    k->close(start);
 
     // Print start directory if it matches
     if (type_filter == 0 || type_filter == 'd') {
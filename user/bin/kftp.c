@@ -116,13 +116,13 @@ int main(kapi_t *k, int argc, char **argv) {
         out_puts("\n");
         out_puts("Server is running. Press Ctrl+C to stop.\n");
         
-        // Keep running and poll FTP server
+        // Keep running and serve clients (ftp_poll sleeps until one needs us)
         while (api->ftp_is_running && api->ftp_is_running()) {
             if (api->ftp_poll) {
                 api->ftp_poll();
+            } else {
+                api->sleep_ms(10);
             }
-            api->net_poll();  // Process network packets
-            api->sleep_ms(10);   // Small delay
         }
         
         return 0;
@@ -346,15 +346,21 @@ static void save_file(void) {
         return;
     }
 
-    // Always use create for writing (create overwrites or makes new)
-    void *file = api->create(current_file);
+    // Create the file if needed, then rewrite it in place
+    void *file = api->create(current_file) ? api->open(current_file) : 0;
     if (!file) {
         output_clear();
         output_append("Error: Could not save file\n");
         return;
     }
 
-    api->write(file, text_buffer, text_len);
+    int ok = api->pwrite(file, text_buffer, text_len, 0) >= 0 && api->truncate(file, text_len) == 0;
+    api->close(file);
+    if (!ok) {
+        output_clear();
+        output_append("Error: Could not save file\n");
+        return;
+    }
     modified = 0;
 
     // Feedback
@@ -404,10 +410,12 @@ static void create_new_file(void) {
     strncpy_safe(current_file, path, sizeof(current_file));
 
     // Create the file with current editor content
-    void *f = api->create(path);
+    void *f = api->create(path) ? api->open(path) : 0;
     if (f) {
         // Write current content (may be empty or may have existing code)
-        api->write(f, text_buffer, text_len);
+        api->pwrite(f, text_buffer, text_len, 0);
+        api->truncate(f, text_len);
+        api->close(f);
         modified = 0;
         output_clear();
         output_append("Created: ");
@@ -1,7 +1,7 @@
 /*
  * ls - list directory contents
  *
- * Uses the proper readdir API instead of accessing VFS internals.
+ * Reads the directory in one pass with opendir/readdir_batch.
  */
 
 #include "../lib/kiki.h"
@@ -13,35 +13,38 @@ int main(kapi_t *k, int argc, char **argv) {
         path = argv[1];
     }
 
-    void *dir = k->open(path);
+    void *dir = k->opendir(path);
     if (!dir) {
-        vibe_puts(k, "ls: ");
-        vibe_puts(k, path);
-        vibe_puts(k, ": No such file or directory\n");
-        return 1;
-    }
+        void *file = k->open(path);
+        if (!file) {
+            vibe_puts(k, "ls: ");
+            vibe_puts(k, path);
+            vibe_puts(k, ": No such file or directory\n");
+            return 1;
+        }
+        k->close(file);
 
-    if (!k->is_dir(dir)) {
         // It's a file, just print the name
         vibe_puts(k, path);
         vibe_putc(k, '\n');
         return 0;
     }
 
-    // List directory contents using readdir
-    char name[256];
-    uint8_t type;
-    int index = 0;
-
-    while (k->readdir(dir, index, name, sizeof(name), &type) >= 0) {
-        vibe_puts(k, name);
-        if (type == 2) {
-            // Directory
-            vibe_putc(k, '/');
+    // List directory contents, a batch of entries per call
+    dirent_t ents[8];
+    int n;
+
+    while ((n = k->readdir_batch(dir, ents, 8)) > 0) {
+        for (int i = 0; i < n; i++) {
+            vibe_puts(k, ents[i].name);
+            if (ents[i].type == 2) {
+                // Directory
+                vibe_putc(k, '/');
+            }
+            vibe_putc(k, '\n');
         }
-        vibe_putc(k, '\n');
-        index++;
     }
 
+    k->closedir(dir);
     return 0;
 }
@@ -0,0 +1,205 @@
+/*
+ * mallocbench - heap allocator latency benchmark
+ *
+ * Usage: mallocbench
+ *   Fills the heap with 10k and then 100k live blocks of mixed sizes, then
+ *   churns (free a random block, allocate a new one) and reports malloc/free
+ *   latency percentiles measured with the ARM generic timer.
+ */
+
+#include "../lib/kiki.h"
+
+static kapi_t *api;
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+static void print_padded(unsigned long n, int width) {
+    char buf[24];
+    int i = 0;
+    do {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    } while (n > 0);
+    while (width-- > i) out_putc(' ');
+    while (i > 0) out_putc(buf[--i]);
+}
+
+static inline uint64_t counter(void) {
+    uint64_t t;
+    asm volatile("isb; mrs %0, cntpct_el0" : "=r"(t) :: "memory");
+    return t;
+}
+
+static uint64_t counter_freq(void) {
+    uint64_t f;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+    return f;
+}
+
+static uint32_t rng_state = 0x2545F491;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// Mostly small objects, with the occasional buffer-sized one
+static size_t random_size(void) {
+    uint32_t r = rng();
+    if ((r & 31) == 0) return 1024 + (r >> 8) % 3072;
+    return 16 + (r >> 8) % 240;
+}
+
+// In-place heapsort (no recursion, no extra memory)
+static void sift_down(uint32_t *a, int start, int end) {
+    int root = start;
+    while (2 * root + 1 <= end) {
+        int child = 2 * root + 1;
+        if (child + 1 <= end && a[child] < a[child + 1]) child++;
+        if (a[root] >= a[child]) return;
+        uint32_t t = a[root]; a[root] = a[child]; a[child] = t;
+        root = child;
+    }
+}
+
+static void sort_samples(uint32_t *a, int n) {
+    for (int start = (n - 2) / 2; start >= 0; start--) {
+        sift_down(a, start, n - 1);
+    }
+    for (int end = n - 1; end > 0; end--) {
+        uint32_t t = a[0]; a[0] = a[end]; a[end] = t;
+        sift_down(a, 0, end - 1);
+    }
+}
+
+static void report(const char *label, uint32_t *samples, int n, uint64_t freq) {
+    sort_samples(samples, n);
+
+    static const int pct[] = { 50, 90, 99 };
+    out_puts(label);
+    for (int i = 0; i < 3; i++) {
+        uint64_t ticks = samples[(long)n * pct[i] / 100];
+        print_padded(ticks * 1000000000ULL / freq, 8);
+    }
+    print_padded((uint64_t)samples[n - 1] * 1000000000ULL / freq, 10);
+    out_putc('\n');
+}
+
+static int run(int live, uint64_t freq) {
+    void **blocks = api->malloc(live * sizeof(void *));
+    uint32_t *t_malloc = api->malloc(live * sizeof(uint32_t));
+    uint32_t *t_free = api->malloc(live * sizeof(uint32_t));
+    if (!blocks || !t_malloc || !t_free) {
+        out_puts("mallocbench: out of memory for sample buffers\n");
+        if (blocks) api->free(blocks);
+        if (t_malloc) api->free(t_malloc);
+        if (t_free) api->free(t_free);
+        return -1;
+    }
+
+    // Fill to the target number of live blocks
+    int filled = 0;
+    for (; filled < live; filled++) {
+        blocks[filled] = api->malloc(random_size());
+        if (!blocks[filled]) break;
+    }
+
+    int ok = (filled == live);
+    if (!ok) {
+        out_puts("mallocbench: heap exhausted after ");
+        print_num(filled);
+        out_puts(" blocks\n");
+    } else {
+        // Churn at a steady live count: free one random block, allocate another
+        for (int i = 0; i < live; i++) {
+            int victim = rng() % live;
+            size_t size = random_size();
+
+            uint64_t t0 = counter();
+            api->free(blocks[victim]);
+            uint64_t t1 = counter();
+            blocks[victim] = api->malloc(size);
+            uint64_t t2 = counter();
+
+            t_free[i] = (uint32_t)(t1 - t0);
+            t_malloc[i] = (uint32_t)(t2 - t1);
+
+            if (!blocks[victim]) {
+                out_puts("mallocbench: malloc failed during churn\n");
+                ok = 0;
+                break;
+            }
+        }
+    }
+
+    if (ok) {
+        out_puts("\n");
+        print_num(live);
+        out_puts(" live blocks (ns)      p50     p90     p99       max\n");
+        report("  malloc            ", t_malloc, live, freq);
+        report("  free              ", t_free, live, freq);
+    }
+
+    for (int i = 0; i < filled; i++) {
+        if (blocks[i]) api->free(blocks[i]);
+    }
+    api->free(t_free);
+    api->free(t_malloc);
+    api->free(blocks);
+    return ok ? 0 : -1;
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    api = k;
+
+    uint64_t freq = counter_freq();
+    if (freq == 0) {
+        out_puts("mallocbench: timer frequency unknown\n");
+        return 1;
+    }
+
+    out_puts("mallocbench: timer ");
+    print_num(freq / 1000);
+    out_puts(" kHz, heap free ");
+    print_num(k->get_mem_free() / 1024);
+    out_puts(" KB\n");
+
+    if (run(10000, freq) < 0) return 1;
+    if (run(100000, freq) < 0) return 1;
+
+    out_puts("\nallocations still live: ");
+    print_num(k->get_alloc_count());
+    out_putc('\n');
+    return 0;
+}
@@ -711,6 +711,12 @@ static void load_tracks(int album_idx) {
 
 // ============ Playback ============
 
+// Release a file loaded by play_track/play_file: a mapping from map_file,
+// or a private copy
+static void release_file_data(uint8_t *data) {
+    if (api->unmap_file(data) != 0) api->free(data);
+}
+
 static int play_track(int track_idx) {
     if (track_idx < 0 || track_idx >= track_count) return -1;
 
@@ -731,36 +737,42 @@ static int play_track(int track_idx) {
     draw_all();
     api->yield();
 
-    // Load file
-    void *file = api->open(tracks[track_idx].path);
-    if (!file) {
-        is_loading = 0;
-        load_state = LOAD_STATE_IDLE;
-        show_error("Cannot open file");
-        return -1;
-    }
+    // Decode straight from the page cache when the file can be mapped,
+    // otherwise load a private copy
+    size_t mapped_size;
+    uint8_t *mp3_data = api->map_file(tracks[track_idx].path, &mapped_size);
+    int size = (int)mapped_size;
+    if (!mp3_data) {
+        void *file = api->open(tracks[track_idx].path);
+        if (!file) {
+            is_loading = 0;
+            load_state = LOAD_STATE_IDLE;
+            show_error("Cannot open file");
+            return -1;
+        }
 
-    int size = api->file_size(file);
-    if (size <= 0) {
-        is_loading = 0;
-        load_state = LOAD_STATE_IDLE;
-        show_error("Empty file");
-        return -1;
-    }
+        size = api->file_size(file);
+        if (size <= 0) {
+            is_loading = 0;
+            load_state = LOAD_STATE_IDLE;
+            show_error("Empty file");
+            return -1;
+        }
 
-    uint8_t *mp3_data = api->malloc(size);
-    if (!mp3_data) {
-        is_loading = 0;
-        load_state = LOAD_STATE_IDLE;
-        show_error("Out of memory (file too large)");
-        return -1;
-    }
+        mp3_data = api->malloc(size);
+        if (!mp3_data) {
+            is_loading = 0;
+            load_state = LOAD_STATE_IDLE;
+            show_error("Out of memory (file too large)");
+            return -1;
+        }
 
-    int offset = 0;
-    while (offset < size) {
-        int n = api->read(file, (char *)mp3_data + offset, size - offset, offset);
-        if (n <= 0) break;
-        offset += n;
+        int offset = 0;
+        while (offset < size) {
+            int n = api->read(file, (char *)mp3_data + offset, size - offset, offset);
+            if (n <= 0) break;
+            offset += n;
+        }
     }
 
     // Switch to decoding state
@@ -774,7 +786,7 @@ static int play_track(int track_idx) {
     uint32_t max_pcm_bytes = (uint32_t)size * 15;
     pcm_buffer = api->malloc(max_pcm_bytes);
     if (!pcm_buffer) {
-        api->free(mp3_data);
+        release_file_data(mp3_data);
         is_loading = 0;
         load_state = LOAD_STATE_IDLE;
         show_error("Out of memory (song too long)");
@@ -816,7 +828,7 @@ static int play_track(int track_idx) {
         remaining -= info.frame_bytes;
     }
 
-    api->free(mp3_data);
+    release_file_data(mp3_data);
 
     if (decoded_samples == 0 || channels == 0) {
         api->free(pcm_buffer);
@@ -877,36 +889,42 @@ static int play_file(const char *path) {
     draw_all();
     api->yield();
 
-    // Load file
-    void *file = api->open(path);
-    if (!file) {
-        is_loading = 0;
-        load_state = LOAD_STATE_IDLE;
-        show_error("Cannot open file");
-        return -1;
-    }
+    // Decode straight from the page cache when the file can be mapped,
+    // otherwise load a private copy
+    size_t mapped_size;
+    uint8_t *file_data = api->map_file(path, &mapped_size);
+    int size = (int)mapped_size;
+    if (!file_data) {
+        void *file = api->open(path);
+        if (!file) {
+            is_loading = 0;
+            load_state = LOAD_STATE_IDLE;
+            show_error("Cannot open file");
+            return -1;
+        }
 
-    int size = api->file_size(file);
-    if (size <= 0) {
-        is_loading = 0;
-        load_state = LOAD_STATE_IDLE;
-        show_error("Empty file");
-        return -1;
-    }
+        size = api->file_size(file);
+        if (size <= 0) {
+            is_loading = 0;
+            load_state = LOAD_STATE_IDLE;
+            show_error("Empty file");
+            return -1;
+        }
 
-    uint8_t *file_data = api->malloc(size);
-    if (!file_data) {
-        is_loading = 0;
-        load_state = LOAD_STATE_IDLE;
-        show_error("Out of memory");
-        return -1;
-    }
+        file_data = api->malloc(size);
+        if (!file_data) {
+            is_loading = 0;
+            load_state = LOAD_STATE_IDLE;
+            show_error("Out of memory");
+            return -1;
+        }
 
-    int offset = 0;
-    while (offset < size) {
-        int n = api->read(file, (char *)file_data + offset, size - offset, offset);
-        if (n <= 0) break;
-        offset += n;
+        int offset = 0;
+        while (offset < size) {
+            int n = api->read(file, (char *)file_data + offset, size - offset, offset);
+            if (n <= 0) break;
+            offset += n;
+        }
     }
 
     // Check file type and decode
@@ -918,7 +936,7 @@ static int play_file(const char *path) {
 
         // Basic WAV header parsing
         if (size < 44) {
-            api->free(file_data);
+            release_file_data(file_data);
             is_loading = 0;
             load_state = LOAD_STATE_IDLE;
             show_error("Invalid WAV file");
@@ -928,7 +946,7 @@ static int play_file(const char *path) {
         // Check RIFF header
         if (file_data[0] != 'R' || file_data[1] != 'I' ||
             file_data[2] != 'F' || file_data[3] != 'F') {
-            api->free(file_data);
+            release_file_data(file_data);
             is_loading = 0;
             load_state = LOAD_STATE_IDLE;
             show_error("Not a WAV file");
@@ -942,7 +960,7 @@ static int play_file(const char *path) {
         int bits_per_sample = file_data[34] | (file_data[35] << 8);
 
         if (bits_per_sample != 16) {
-            api->free(file_data);
+            release_file_data(file_data);
             is_loading = 0;
             load_state = LOAD_STATE_IDLE;
             show_error("Only 16-bit WAV supported");
@@ -970,7 +988,7 @@ static int play_file(const char *path) {
         if (channels == 1) {
             pcm_buffer = api->malloc(num_samples * 4);  // 2 channels * 2 bytes
             if (!pcm_buffer) {
-                api->free(file_data);
+                release_file_data(file_data);
                 is_loading = 0;
                 load_state = LOAD_STATE_IDLE;
                 show_error("Out of memory");
@@ -986,7 +1004,7 @@ static int play_file(const char *path) {
             // Already stereo, just copy
             pcm_buffer = api->malloc(data_size);
             if (!pcm_buffer) {
-                api->free(file_data);
+                release_file_data(file_data);
                 is_loading = 0;
                 load_state = LOAD_STATE_IDLE;
                 show_error("Out of memory");
@@ -1000,7 +1018,7 @@ static int play_file(const char *path) {
             }
         }
 
-        api->free(file_data);
+        release_file_data(file_data);
         pcm_samples = num_samples;
         pcm_sample_rate = sample_rate;
 
@@ -1013,7 +1031,7 @@ static int play_file(const char *path) {
         uint32_t max_pcm_bytes = (uint32_t)size * 15;
         pcm_buffer = api->malloc(max_pcm_bytes);
         if (!pcm_buffer) {
-            api->free(file_data);
+            release_file_data(file_data);
             is_loading = 0;
             load_state = LOAD_STATE_IDLE;
             show_error("Out of memory");
@@ -1055,7 +1073,7 @@ static int play_file(const char *path) {
             remaining -= info.frame_bytes;
         }
 
-        api->free(file_data);
+        release_file_data(file_data);
 
         if (decoded_samples == 0 || channels == 0) {
             api->free(pcm_buffer);
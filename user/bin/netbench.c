@@ -0,0 +1,184 @@
+/*
+ * netbench - TCP throughput benchmark
+ *
+ * Usage: netbench [-r] <ip> [port] [MB]
+ *   Connects to a sink on the host and sends MB megabytes (default 16) as
+ *   fast as the stack allows, then reports the throughput. Under QEMU user
+ *   networking the host is 10.0.2.2; run a sink there first, e.g.
+ *       nc -l 5001 > /dev/null       (or iperf -s, which discards too)
+ *   and then: netbench 10.0.2.2 5001
+ *
+ *   With -r it downloads instead, reading until MB megabytes have arrived
+ *   or the host closes, e.g. with  head -c 64M /dev/zero | nc -l 5001
+ *   Run it next to something that keeps the desktop busy to see how well
+ *   the stack keeps up without the app's help.
+ */
+
+#include "../lib/kiki.h"
+
+#define DEFAULT_PORT 5001
+#define DEFAULT_MB   16
+#define CHUNK        (16 * 1024)
+
+static kapi_t *api;
+
+static uint8_t chunk[CHUNK];
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+// Parse a decimal number, -1 if s isn't one
+static long parse_num(const char *s) {
+    long n = 0;
+    if (!*s) return -1;
+    while (*s) {
+        if (*s < '0' || *s > '9') return -1;
+        n = n * 10 + (*s++ - '0');
+    }
+    return n;
+}
+
+// Parse IP address from string "a.b.c.d"
+static int parse_ip(const char *s, uint32_t *ip) {
+    int parts[4] = {0, 0, 0, 0};
+    int part = 0;
+    int val = 0;
+
+    while (*s) {
+        if (*s >= '0' && *s <= '9') {
+            val = val * 10 + (*s - '0');
+            if (val > 255) return -1;
+        } else if (*s == '.') {
+            if (part >= 3) return -1;
+            parts[part++] = val;
+            val = 0;
+        } else {
+            return -1;
+        }
+        s++;
+    }
+
+    if (part != 3) return -1;
+    parts[3] = val;
+
+    *ip = MAKE_IP(parts[0], parts[1], parts[2], parts[3]);
+    return 0;
+}
+
+// Read until total bytes arrived or the peer closed, returns bytes read
+static uint64_t recv_all(int sock, uint64_t total) {
+    uint64_t got = 0;
+
+    while (got < total) {
+        uint32_t want = total - got < CHUNK ? (uint32_t)(total - got) : CHUNK;
+        int n = api->tcp_recv_timeout(sock, chunk, want, -1);
+        if (n <= 0) break;
+        got += n;
+    }
+
+    return got;
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    api = k;
+
+    int receive = 0;
+    if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+        receive = 1;
+        argc--;
+        argv++;
+    }
+
+    uint32_t ip;
+    if (argc < 2 || parse_ip(argv[1], &ip) < 0) {
+        out_puts("Usage: netbench [-r] <ip> [port] [MB]\n");
+        out_puts("Example: netbench 10.0.2.2 5001 16 (with a sink on the host)\n");
+        out_puts("         netbench -r 10.0.2.2 5001 64 (with a source on the host)\n");
+        return 1;
+    }
+
+    long port = argc > 2 ? parse_num(argv[2]) : DEFAULT_PORT;
+    long mb = argc > 3 ? parse_num(argv[3]) : DEFAULT_MB;
+    if (port <= 0 || port > 65535 || mb <= 0) {
+        out_puts("netbench: bad port or size\n");
+        return 1;
+    }
+
+    // Something other than zeros, so nothing along the way can cheat
+    for (int i = 0; i < CHUNK; i++) {
+        chunk[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+
+    out_puts("netbench: connecting to ");
+    out_puts(argv[1]);
+    out_putc(':');
+    print_num(port);
+    out_puts("\n");
+
+    int sock = k->tcp_connect(ip, (uint16_t)port);
+    if (sock < 0) {
+        out_puts("netbench: connect failed\n");
+        return 1;
+    }
+
+    uint64_t total = (uint64_t)mb * 1024 * 1024;
+    uint64_t sent = 0;
+    uint64_t t0 = k->get_uptime_us();
+
+    if (receive) {
+        sent = recv_all(sock, total);
+    } else {
+        while (sent < total) {
+            uint32_t len = total - sent < CHUNK ? (uint32_t)(total - sent) : CHUNK;
+            int n = k->tcp_send(sock, chunk, len);
+            if (n <= 0) {
+                out_puts("netbench: send failed after ");
+                print_num(sent);
+                out_puts(" bytes\n");
+                break;
+            }
+            sent += n;
+        }
+    }
+
+    // Closing waits for the peer to acknowledge everything we sent
+    k->tcp_close(sock);
+    uint64_t us = k->get_uptime_us() - t0;
+    if (us == 0) us = 1;
+
+    print_num(sent / 1024);
+    out_puts(" KB in ");
+    print_num(us / 1000);
+    out_puts(" ms = ");
+    print_num(sent * 1000000 / us / 1024);
+    out_puts(" KB/s\n");
+
+    // The host closing early is how a download normally ends
+    return sent == total || (receive && sent > 0) ? 0 : 1;
+}
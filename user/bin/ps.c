@@ -61,8 +61,8 @@ int main(kapi_t *k, int argc, char **argv) {
 
     out_puts("  PID  STATE   NAME\n");
 
-    // Iterate through all process slots (MAX_PROCESSES = 16)
-    for (int i = 0; i < 16; i++) {
+    // Iterate through all process slots (MAX_PROCESSES = 64)
+    for (int i = 0; i < 64; i++) {
         char name[32];
         int state;
 
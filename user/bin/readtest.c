@@ -1,8 +1,11 @@
 /*
  * readtest - read a file and discard data (benchmark disk read speed)
  *
- * Usage: readtest <file>
- *   Reads entire file, reports bytes read. No output to screen (no FB bottleneck).
+ * Usage: readtest <file> [chunk_kb]
+ *   Reads entire file in chunk_kb pieces (default 64), reports bytes read,
+ *   time and throughput. No output to screen (no FB bottleneck). Small
+ *   chunks show the per-read cost of the open file handle: with 4 KB
+ *   chunks a 20 MB file is 5120 reads at increasing offsets.
  */
 
 #include "../lib/kiki.h"
@@ -38,11 +41,17 @@ static void print_num(unsigned long n) {
     }
 }
 
+static unsigned long parse_num(const char *s) {
+    unsigned long n = 0;
+    while (*s >= '0' && *s <= '9') n = n * 10 + (*s++ - '0');
+    return n;
+}
+
 int main(kapi_t *k, int argc, char **argv) {
     api = k;
 
     if (argc < 2) {
-        out_puts("usage: readtest <file>\n");
+        out_puts("usage: readtest <file> [chunk_kb]\n");
         return 1;
     }
 
@@ -65,9 +74,10 @@ int main(kapi_t *k, int argc, char **argv) {
         return 0;
     }
 
-    /* Allocate read buffer - 64KB chunks for multi-block reads */
-    #define READ_BUF_SIZE (64 * 1024)
-    char *buf = k->malloc(READ_BUF_SIZE);
+    /* Allocate read buffer - 64KB chunks for multi-block reads by default */
+    unsigned long chunk_size = 64 * 1024;
+    if (argc > 2 && parse_num(argv[2]) > 0) chunk_size = parse_num(argv[2]) * 1024;
+    char *buf = k->malloc(chunk_size);
     if (!buf) {
         out_puts("readtest: out of memory\n");
         return 1;
@@ -75,10 +85,11 @@ int main(kapi_t *k, int argc, char **argv) {
 
     unsigned long total = 0;
     unsigned long offset = 0;
+    uint64_t t0 = k->get_uptime_us();
 
     while (offset < size) {
         unsigned long chunk = size - offset;
-        if (chunk > READ_BUF_SIZE) chunk = READ_BUF_SIZE;
+        if (chunk > chunk_size) chunk = chunk_size;
 
         int rd = k->read(file, buf, chunk, offset);
         if (rd <= 0) break;
@@ -87,11 +98,19 @@ int main(kapi_t *k, int argc, char **argv) {
         offset += rd;
     }
 
+    uint64_t us = k->get_uptime_us() - t0;
     k->free(buf);
+    k->close(file);
 
     out_puts("read ");
     print_num(total);
-    out_puts(" bytes\n");
+    out_puts(" bytes in ");
+    print_num((unsigned long)(us / 1000));
+    out_puts(" ms (");
+    print_num(us ? (unsigned long)((uint64_t)total * 1000000 / 1024 / us) : 0);
+    out_puts(" KB/s, ");
+    print_num(chunk_size / 1024);
+    out_puts(" KB reads)\n");
 
     return 0;
 }
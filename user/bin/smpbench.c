@@ -0,0 +1,155 @@
+/*
+ * smpbench - multi-core scaling benchmark
+ *
+ * Usage: smpbench
+ *   Runs 1, 2 and 4 copies of a fixed CPU-bound loop as separate processes
+ *   and reports wall time and throughput relative to one copy. With one core
+ *   online the times grow linearly; with four, up to 4 copies should take
+ *   about as long as one.
+ *
+ *   smpbench worker  - one copy of the loop (spawned by the above)
+ */
+
+#include "../lib/kiki.h"
+
+#define WORK_ITERS  40000000UL
+#define MAX_WORKERS 4
+#define SELF_PATH   "/bin/smpbench"
+
+static kapi_t *api;
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+static inline uint64_t counter(void) {
+    uint64_t t;
+    asm volatile("isb; mrs %0, cntpct_el0" : "=r"(t) :: "memory");
+    return t;
+}
+
+static uint64_t counter_freq(void) {
+    uint64_t f;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(f));
+    return f;
+}
+
+static int streq(const char *a, const char *b) {
+    while (*a && *a == *b) { a++; b++; }
+    return *a == *b;
+}
+
+// Integer-only on purpose: no memory traffic, so the cores don't slow each
+// other down and the result measures scheduling alone
+static int worker(void) {
+    uint32_t x = 0x2545F491;
+    for (unsigned long i = 0; i < WORK_ITERS; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+    }
+    asm volatile("" :: "r"(x));
+    return 0;
+}
+
+// Live processes running this binary (the workers, plus us if we were
+// started by that path)
+static int count_copies(void) {
+    int n = 0;
+    for (int i = 0; i < 64; i++) {
+        char name[64];
+        int state;
+        if (api->get_process_info(i, name, sizeof(name), &state) && streq(name, SELF_PATH)) {
+            n++;
+        }
+    }
+    return n;
+}
+
+// Run n workers at once, return elapsed counter ticks (0 on failure)
+static uint64_t run(int n) {
+    int before = count_copies();
+    char *args[2] = { SELF_PATH, "worker" };
+
+    uint64_t t0 = counter();
+    for (int i = 0; i < n; i++) {
+        if (api->spawn_args(SELF_PATH, 2, args) < 0) {
+            out_puts("smpbench: spawn failed\n");
+            return 0;
+        }
+    }
+
+    while (count_copies() > before) {
+        api->sleep_ms(1);
+    }
+    return counter() - t0;
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    api = k;
+
+    if (argc > 1 && streq(argv[1], "worker")) {
+        return worker();
+    }
+
+    uint64_t freq = counter_freq();
+    if (freq == 0) {
+        out_puts("smpbench: timer frequency unknown\n");
+        return 1;
+    }
+
+    out_puts("smpbench: ");
+    print_num(k->get_cpu_cores());
+    out_puts(" core(s) online, ");
+    print_num(WORK_ITERS / 1000000);
+    out_puts("M iterations per worker\n\n");
+    out_puts("  workers      ms   throughput\n");
+
+    uint64_t base = 0;
+    for (int n = 1; n <= MAX_WORKERS; n *= 2) {
+        uint64_t ticks = run(n);
+        if (ticks == 0) return 1;
+        if (n == 1) base = ticks;
+
+        // Work done relative to one worker, per unit of time (x100)
+        uint64_t speedup = base * n * 100 / ticks;
+
+        out_puts("  ");
+        print_num(n);
+        out_puts("        ");
+        print_num(ticks * 1000 / freq);
+        out_puts("     ");
+        print_num(speedup / 100);
+        out_putc('.');
+        if (speedup % 100 < 10) out_putc('0');
+        print_num(speedup % 100);
+        out_puts("x\n");
+    }
+
+    return 0;
+}
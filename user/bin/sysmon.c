@@ -25,7 +25,7 @@ static gfx_ctx_t gfx;
 #define PROC_STATE_BLOCKED 3
 #define PROC_STATE_ZOMBIE  4
 
-#define MAX_PROCESSES 16
+#define MAX_PROCESSES 64
 
 // State tracking for dirty-rectangle optimization
 // Only redraw when values actually change
@@ -344,6 +344,10 @@ static void draw_all(void) {
             const char *state_str = (state >= 0 && state <= 4) ? state_names[state] : "?";
             uint32_t state_color = (state == 2) ? COLOR_BAR_FILL : COLOR_LABEL;  // Green if running
             buf_draw_string(140, y, state_str, state_color, COLOR_BG);
+
+            // Heap in use by this process
+            format_size_kb(buf, (int)(api->get_process_mem(i) / 1024));
+            buf_draw_string(200, y, buf, COLOR_TEXT, COLOR_BG);
             y += 16;
             shown++;
         }
@@ -484,6 +488,11 @@ static void print_cli(void) {
             while (pad-- > 0) out(" ");
             const char *state_str = (state >= 0 && state <= 4) ? state_names[state] : "?";
             out(state_str);
+            pad = 8 - strlen(state_str);
+            while (pad-- > 0) out(" ");
+            char mem[16];
+            format_size_kb(mem, (int)(api->get_process_mem(i) / 1024));
+            out(mem);
             out("\n");
         }
     }
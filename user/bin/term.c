@@ -457,6 +457,9 @@ int main(kapi_t *kapi, int argc, char **argv) {
         return 1;
     }
 
+    // Keystrokes should echo promptly even with background jobs running
+    if (api->set_priority) api->set_priority(PRIORITY_INTERACTIVE);
+
     // Create window (add chrome height for title bar, separator, and corner radius)
     window_id = api->window_create(50, 50, WIN_WIDTH, WIN_HEIGHT + WIN_CHROME_HEIGHT, "Terminal");
     if (window_id < 0) {
@@ -264,15 +264,19 @@ static void open_save_as(void) {
 
 static void do_save(const char *path) {
     void *file = api->open(path);
-    if (!file) {
-        file = api->create(path);
+    if (!file && api->create(path)) {
+        file = api->open(path);
     }
     if (!file) {
         save_failed = 1;
         return;
     }
 
-    api->write(file, text_buffer, text_len);
+    // Rewrite in place
+    if (api->pwrite(file, text_buffer, text_len, 0) < 0 || api->truncate(file, text_len) < 0) {
+        save_failed = 1;
+    }
+    api->close(file);
 
     // Update current filename
     int i;
@@ -0,0 +1,94 @@
+/*
+ * timerbench - sleep wakeup latency benchmark
+ *
+ * Usage: timerbench
+ *   Sleeps for a range of durations and reports how late each wakeup was
+ *   (min / average / max microseconds past the requested time). With a
+ *   one-shot timer short sleeps should wake within tens of microseconds
+ *   instead of being rounded up to the next 10ms tick.
+ */
+
+#include "../lib/kiki.h"
+
+#define ROUNDS 50
+
+static kapi_t *api;
+
+static const uint32_t durations_us[] = { 100, 500, 1000, 2500, 5000, 16667 };
+
+static void out_puts(const char *s) {
+    if (api->stdio_puts) api->stdio_puts(s);
+    else api->puts(s);
+}
+
+static void out_putc(char c) {
+    if (api->stdio_putc) api->stdio_putc(c);
+    else api->putc(c);
+}
+
+static void print_num(unsigned long n) {
+    char buf[24];
+    int i = 0;
+
+    if (n == 0) {
+        out_putc('0');
+        return;
+    }
+
+    while (n > 0) {
+        buf[i++] = '0' + (n % 10);
+        n /= 10;
+    }
+
+    while (i > 0) {
+        out_putc(buf[--i]);
+    }
+}
+
+// Right-align n in a field of width characters
+static void print_col(unsigned long n, int width) {
+    int digits = 1;
+    for (unsigned long v = n; v >= 10; v /= 10) digits++;
+    while (digits++ < width) out_putc(' ');
+    print_num(n);
+}
+
+int main(kapi_t *k, int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    api = k;
+
+    if (!k->get_uptime_us || !k->sleep_us) {
+        out_puts("timerbench: kernel has no microsecond timer API\n");
+        return 1;
+    }
+
+    out_puts("timerbench: ");
+    print_num(ROUNDS);
+    out_puts(" sleeps per duration, lateness in us\n\n");
+    out_puts("  sleep us     min     avg     max\n");
+
+    for (unsigned d = 0; d < sizeof(durations_us) / sizeof(durations_us[0]); d++) {
+        uint32_t want = durations_us[d];
+        uint64_t min = ~0ULL, max = 0, total = 0;
+
+        for (int i = 0; i < ROUNDS; i++) {
+            uint64_t t0 = k->get_uptime_us();
+            k->sleep_us(want);
+            uint64_t slept = k->get_uptime_us() - t0;
+
+            uint64_t late = slept > want ? slept - want : 0;
+            if (late < min) min = late;
+            if (late > max) max = late;
+            total += late;
+        }
+
+        print_col(want, 10);
+        print_col(min, 8);
+        print_col(total / ROUNDS, 8);
+        print_col(max, 8);
+        out_putc('\n');
+    }
+
+    return 0;
+}
@@ -146,32 +146,40 @@ static int load_image(const char *path) {
         image_data = NULL;
     }
 
-    // Open file
-    void *file = api->open(path);
-    if (!file) {
-        return -1;
-    }
+    // Decode straight from the page cache when the file can be mapped
+    size_t mapped_size;
+    uint8_t *file_data = api->map_file(path, &mapped_size);
+    int size = (int)mapped_size;
+    int mapped = file_data != NULL;
+
+    if (!mapped) {
+        // Open file
+        void *file = api->open(path);
+        if (!file) {
+            return -1;
+        }
 
-    if (api->is_dir(file)) {
-        return -1;
-    }
+        if (api->is_dir(file)) {
+            return -1;
+        }
 
-    // Get file size
-    int size = api->file_size(file);
-    if (size <= 0) {
-        return -1;
-    }
+        // Get file size
+        size = api->file_size(file);
+        if (size <= 0) {
+            return -1;
+        }
 
-    // Read file into memory
-    uint8_t *file_data = api->malloc(size);
-    if (!file_data) {
-        return -1;
-    }
+        // Read file into memory
+        file_data = api->malloc(size);
+        if (!file_data) {
+            return -1;
+        }
 
-    int bytes_read = api->read(file, (char *)file_data, size, 0);
-    if (bytes_read != size) {
-        api->free(file_data);
-        return -1;
+        int bytes_read = api->read(file, (char *)file_data, size, 0);
+        if (bytes_read != size) {
+            api->free(file_data);
+            return -1;
+        }
     }
 
     // Decode image
@@ -179,7 +187,8 @@ static int load_image(const char *path) {
     image_data = stbi_load_from_memory(file_data, size, &img_width, &img_height, &channels, 3);
 
     // Free file data
-    api->free(file_data);
+    if (mapped) api->unmap_file(file_data);
+    else api->free(file_data);
 
     if (!image_data) {
         return -1;
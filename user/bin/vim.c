@@ -739,8 +739,8 @@ static int save_file(void) {
 
     size_t len = gap_length(&ed.buf);
 
-    // Create/truncate file
-    void *file = ed.api->create(ed.filename);
+    // Create the file if needed, then rewrite it in place
+    void *file = ed.api->create(ed.filename) ? ed.api->open(ed.filename) : 0;
     if (!file) {
         set_status("Error: could not create file");
         return -1;
@@ -749,6 +749,7 @@ static int save_file(void) {
     // Write content
     char *temp = ed.api->malloc(len + 1);
     if (!temp) {
+        ed.api->close(file);
         set_status("Error: out of memory");
         return -1;
     }
@@ -757,8 +758,10 @@ static int save_file(void) {
         temp[i] = gap_get_char(&ed.buf, i);
     }
 
-    int written = ed.api->write(file, temp, len);
+    int written = ed.api->pwrite(file, temp, len, 0);
+    if (written >= 0 && ed.api->truncate(file, len) < 0) written = -1;
     ed.api->free(temp);
+    ed.api->close(file);
 
     if (written < 0 || (size_t)written != len) {
         set_status("Error: write failed");